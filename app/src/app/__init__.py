@@ -56,6 +56,140 @@ class Serial:
 		# 	print(hex(byte), end=" ")
 		return package_data
 
+	def read_exact(self, size):
+		data = bytearray()
+		t1 = time.time()
+		while len(data) < size and (time.time() - t1) < 2:
+			data += self.ser.read(size - len(data))
+		return data
+
+	def download_window(
+		self,
+		camera_id,
+		hour,
+		minute,
+		total_package,
+		package_size,
+		window=fr.MAX_WINDOW,
+		crc_mode=False,
+	):
+		frame_size = 7 + package_size + 3
+		packages = {}
+		first = 1
+		while first <= total_package:
+			count = min(window, total_package - first + 1)
+			self.send_frame(
+				fr.construct_get_window_command(camera_id, hour, minute, first, count)
+			)
+			received, _ = fr.split_window(
+				self.read_exact(frame_size * count), package_size, crc_mode
+			)
+			packages.update(received)
+			# re-request only the corrupt or missing packages of this window
+			bitmap = fr.construct_nack_bitmap(first, count, packages)
+			retries = 3
+			while bitmap:
+				if retries == 0:
+					raise ValueError(f"Packages missing after retransmit: {bitmap:#x}")
+				retries -= 1
+				self.send_frame(
+					fr.construct_retransmit_command(
+						camera_id, hour, minute, first, bitmap
+					)
+				)
+				missing = bin(bitmap).count("1")
+				received, _ = fr.split_window(
+					self.read_exact(frame_size * missing), package_size, crc_mode
+				)
+				packages.update(received)
+				bitmap = fr.construct_nack_bitmap(first, count, packages)
+			first += count
+		return b"".join(packages[i] for i in range(1, total_package + 1))
+
+	# Download a file through a transfer session. Pass the packages and file CRC of
+	# an interrupted attempt to resume, they are updated in place as data arrives.
+	def download_session(
+		self,
+		camera_id,
+		next_file_command,
+		package_size,
+		crc_mode=False,
+		window=fr.MAX_WINDOW,
+		packages=None,
+		file_crc=None,
+	):
+		frame_size = 9 + package_size + 3
+		packages = {} if packages is None else packages
+		session = None
+		reopens = 3
+		while True:
+			if session is None:
+				if reopens == 0:
+					raise ValueError("Session lost too often, giving up")
+				reopens -= 1
+				self.ser.reset_input_buffer()
+				self.send_frame(next_file_command)
+				_, _, _, session, file_size, crc = (
+					fr.parse_nextfile_session_ack_frame(self.read_exact(15))
+				)
+				# the file changed since the interrupted attempt, start over
+				if file_crc is not None and crc != file_crc:
+					packages.clear()
+				file_crc = crc
+				total_package = -(-file_size // package_size)
+			missing = [i for i in range(total_package) if i not in packages]
+			if not missing:
+				break
+			first = missing[0]
+			count = min(window, total_package - first)
+			self.send_frame(
+				fr.construct_get_session_package_command(
+					camera_id, session, first, count
+				)
+			)
+			data = self.read_exact(frame_size * count)
+			if len(data) >= 2 and data[1] == fr.NONE_COMMAND:
+				# evicted or the daemon restarted, reopen and resume at first
+				session = None
+				continue
+			received = fr.split_session_window(data, package_size, crc_mode)
+			if not received:
+				# link dropped mid window, reopen and resume at first
+				session = None
+				continue
+			packages.update(received)
+		data = b"".join(packages[i] for i in range(total_package))[:file_size]
+		if not fr.verify_file_crc(data, file_crc):
+			raise ValueError("File CRC mismatch")
+		return data
+
+	def switch_baudrate(self, camera_id, baud_rate, persist=False):
+		command = fr.construct_baudrate_command(
+			camera_id, baud_rate, fr.BAUD_PERSIST if persist else 0
+		)
+		self.send_frame(command)
+		fr.parse_ack_rtc_frame(self.read_exact(4))
+		# the daemon switches after the ack, confirm at the new rate in time
+		self.ser.flush()
+		self.ser.baudrate = baud_rate.rate
+		self.ser.reset_input_buffer()
+		self.send_frame(command)
+		fr.parse_ack_rtc_frame(self.read_exact(4))
+
+	def poll_status(self, max_camera_id):
+		self.send_frame(fr.construct_status_command(fr.GROUP_ID))
+		# replies arrive back-to-back in per-camera slots
+		time.sleep((max_camera_id + 2) * fr.STATUS_SLOT_MS / 1000)
+		data = self.ser.read_all()
+		status = {}
+		for offset in range(0, len(data) - 4, 5):
+			command, camera_id, result = fr.parse_completion_frame(
+				data[offset : offset + 5]
+			)
+			if command == fr.STATUS_COMMAND[0]:
+				status[camera_id] = result
+		return status
+
 	def flush(self):
 		self.ser.flush()
 
@@ -0,0 +1,477 @@
+import argparse
+import asyncio
+import json
+import os
+import pty
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+import tty
+from datetime import datetime
+
+import client
+import frame as fr
+
+SDCARD = "/mnt/mmcblk0p1"
+BENCH_TIME = datetime(2001, 1, 1, 0, 0)  # Where the benchmark image is planted
+DAEMON_START_S = 1.5
+
+
+def package_size(value):
+	return fr.PackageSize[f"SIZE_{value}"]
+
+
+def parse_time(value):
+	return datetime.strptime(value, "%Y-%m-%d %H:%M") if value else datetime.now()
+
+
+def transfer_options(args):
+	return {
+		"package_size": package_size(args.package_size),
+		"window": args.window,
+		"depth": args.depth,
+		"crc_mode": not args.checksum,
+	}
+
+
+# Function to load the state of an interrupted download: <output>.part holds the
+# packages at their offsets, <output>.part.json which of them are there
+def load_partial(output, size):
+	try:
+		with open(output + ".part.json") as f:
+			state = json.load(f)
+		with open(output + ".part", "rb") as f:
+			data = f.read()
+	except (OSError, ValueError):
+		return {}, None
+	if state["package_size"] != size:
+		return {}, None
+	packages = {i: data[i * size : (i + 1) * size] for i in state["packages"]}
+	return packages, state["file_crc"]
+
+
+def save_partial(output, size, packages, file_crc):
+	with open(output + ".part", "wb") as f:
+		for index in sorted(packages):
+			f.seek(index * size)
+			f.write(packages[index])
+	with open(output + ".part.json", "w") as f:
+		json.dump(
+			{"package_size": size, "file_crc": file_crc, "packages": sorted(packages)},
+			f,
+		)
+
+
+def remove_partial(output):
+	for path in (output + ".part", output + ".part.json"):
+		if os.path.exists(path):
+			os.remove(path)
+
+
+async def download(args):
+	options = transfer_options(args)
+	size = options["package_size"].size
+	packages, file_crc = load_partial(args.output, size) if args.resume else ({}, None)
+	link = client.AsyncSerial.open(args.port, args.baudrate)
+	camera = client.Camera(link, args.camera, args.timeout)
+	stats = client.TransferStats()
+	try:
+		hour, minute, data = await camera.download(
+			parse_time(args.time),
+			packages=packages,
+			file_crc=file_crc,
+			stats=stats,
+			**options,
+		)
+	except (Exception, asyncio.CancelledError):
+		if packages:
+			save_partial(args.output, size, packages, camera.file_crc)
+			print(f"interrupted, {len(packages)} packages kept for --resume")
+		raise
+	finally:
+		link.close()
+	with open(args.output, "wb") as f:
+		f.write(data)
+	remove_partial(args.output)
+	print(
+		f"{hour:02d}:{minute:02d} {len(data)} bytes in {stats.elapsed:.2f}s, "
+		f"{stats.retransmits} packages resent"
+	)
+
+
+async def parallel(args):
+	jobs = []
+	links = {}
+	for target in args.targets:
+		port, camera_id = target.rsplit(":", 1)
+		if port not in links:
+			links[port] = client.AsyncSerial.open(port, args.baudrate)
+		jobs.append((port, int(camera_id), parse_time(args.time)))
+	started = time.monotonic()
+	try:
+		results = await client.download_many(links, jobs, **transfer_options(args))
+	finally:
+		for link in links.values():
+			link.close()
+	total = 0
+	for (port, camera_id, _), result in zip(jobs, results):
+		if isinstance(result, Exception):
+			print(f"{port}:{camera_id} failed: {result}")
+			continue
+		_, _, hour, minute, data, stats = result
+		path = os.path.join(args.output, f"{camera_id}_{hour:02d}-{minute:02d}.jpg")
+		with open(path, "wb") as f:
+			f.write(data)
+		total += len(data)
+		print(f"{port}:{camera_id} {path} {len(data)} bytes in {stats.elapsed:.2f}s")
+	elapsed = time.monotonic() - started
+	print(f"{total} bytes in {elapsed:.2f}s, {total / elapsed / 1e6:.3f} MB/s")
+
+
+# Function to plant a file where findNearestFile looks for BENCH_TIME, returns the
+# paths to remove afterwards
+def plant_image(size):
+	directory = BENCH_TIME.strftime(f"{SDCARD}/%Y-%m-%d/image/%H")
+	path = BENCH_TIME.strftime(f"{directory}/%M-%S.jpg")
+	created = []
+	head = directory
+	while not os.path.exists(head):
+		created.insert(0, head)
+		head = os.path.dirname(head)
+	os.makedirs(directory, exist_ok=True)
+	if not os.path.exists(path):
+		created.append(path)
+	with open(path, "wb") as f:
+		f.write(b"\xff\xd8" + os.urandom(size - 4) + b"\xff\xd9")
+	# stale image index of the hour, see image_index.c
+	created.append(BENCH_TIME.strftime(f"{SDCARD}/.index/%Y-%m-%d_%H.idx"))
+	return created
+
+
+def start_daemon(
+	daemon, port, directory, log, camera_id=None, debug=False, baudrate=115200
+):
+	with open(os.path.join(directory, "serial.yaml"), "w") as f:
+		f.write(
+			f"serial:\n  port: {port}\n  baudrate: {baudrate}\n  package_size: 1024\n"
+			f"  watchdog: 0\n  debug: {'true' if debug else 'false'}\n"
+		)
+		if camera_id is not None:
+			f.write(f"  camera_id: {camera_id}\n")
+	return subprocess.Popen(
+		[daemon], cwd=directory, stdout=log, stderr=subprocess.STDOUT
+	)
+
+
+# Function to time short commands: one at a time for the round trip, then all
+# written back to back for the frame rate. MOSD to the last, unused OSD slot is
+# always answered with a 4 byte ack and has no other effect.
+async def command_rates(link, camera_id, count):
+	command = fr.construct_osd_command(camera_id, fr.POSITION_SLOTS[-1], "")
+	await link.drain(0)
+	latencies = []
+	for _ in range(count):
+		sent = time.monotonic()
+		await link.write(command)
+		await link.read_exact(4)
+		latencies.append(time.monotonic() - sent)
+	started = time.monotonic()
+	writer = asyncio.ensure_future(link.write(command * count))
+	await link.read_exact(4 * count, max(count / 100, client.DEFAULT_TIMEOUT))
+	await writer
+	return latencies, count / (time.monotonic() - started)
+
+
+# Function to drive the daemon over a pty pair: the daemon opens the slave as its
+# UART, the client talks to the master. A pty has no line rate, the results are
+# put against what the UART at --baudrate could carry (10 bits per byte).
+async def bench(args):
+	daemon = os.path.abspath(args.daemon)
+	master, slave = pty.openpty()
+	tty.setraw(slave)
+	directory = tempfile.mkdtemp(prefix="serial-bench-")
+	planted = plant_image(args.file_size)
+	log = open(args.log, "w") if args.log else subprocess.DEVNULL
+	process = start_daemon(
+		daemon,
+		os.ttyname(slave),
+		directory,
+		log,
+		debug=args.debug,
+		baudrate=args.baudrate,
+	)
+	ceiling = args.baudrate / 10
+	link = None
+	try:
+		await asyncio.sleep(DAEMON_START_S)
+		if process.poll() is not None:
+			raise RuntimeError(f"daemon exited with {process.returncode}")
+		link = client.AsyncSerial(master, error_rate=args.error_rate)
+		camera = client.Camera(link, args.camera, args.timeout)
+		print(
+			f"{args.file_size} byte file, {args.runs} runs, window {args.window}, "
+			f"depth {args.depth}, error rate {args.error_rate:g}, "
+			f"UART ceiling {ceiling / 1e6:.4f} MB/s at {args.baudrate} baud"
+		)
+		print(
+			f"{'package':>8} {'MB/s':>8} {'x UART':>8} {'p50 ms':>8} {'p99 ms':>8} "
+			f"{'resent %':>9} {'corrupt':>8} {'timeouts':>9}"
+		)
+		for size in args.sizes:
+			stats = client.TransferStats()
+			for _ in range(args.runs):
+				_, _, data = await camera.download(
+					BENCH_TIME,
+					package_size=package_size(size),
+					window=args.window,
+					depth=args.depth,
+					crc_mode=not args.checksum,
+					stats=stats,
+				)
+				if len(data) != args.file_size:
+					raise ValueError(f"{len(data)} bytes received")
+			print(
+				f"{size:>8} {stats.bytes / stats.elapsed / 1e6:>8.3f} "
+				f"{stats.bytes / stats.elapsed / ceiling:>8.1f} "
+				f"{client.percentile(stats.latencies, 50) * 1e3:>8.2f} "
+				f"{client.percentile(stats.latencies, 99) * 1e3:>8.2f} "
+				f"{stats.retransmits / stats.packages * 100:>9.2f} "
+				f"{stats.corrupt:>8} {stats.timeouts:>9}"
+			)
+		if args.error_rate == 0 and args.frames:
+			latencies, rate = await command_rates(link, args.camera, args.frames)
+			command = len(
+				fr.construct_osd_command(args.camera, fr.POSITION_SLOTS[-1], "")
+			)
+			print(
+				f"{args.frames} commands: {rate:.0f} frames/s back to back "
+				f"(UART ceiling {ceiling / command:.0f}), round trip "
+				f"p50 {client.percentile(latencies, 50) * 1e3:.3f} ms "
+				f"p99 {client.percentile(latencies, 99) * 1e3:.3f} ms"
+			)
+		if args.error_rate == 0:
+			spans = await camera.status_metrics()
+			print("daemon spans (calls, avg us, p99 < us):")
+			for name, (count, avg, _, p99, _) in spans.items():
+				print(f"  {name:>8} {count:>8} {avg:>8} {p99:>8}")
+	finally:
+		if link is not None:
+			link.close()
+		else:
+			os.close(master)
+		process.send_signal(signal.SIGINT)
+		try:
+			process.wait(5)
+		except subprocess.TimeoutExpired:
+			process.kill()
+		os.close(slave)
+		if log is not subprocess.DEVNULL:
+			log.close()
+		for path in reversed(planted):
+			if os.path.isdir(path):
+				shutil.rmtree(path, ignore_errors=True)
+			elif os.path.exists(path):
+				os.remove(path)
+		shutil.rmtree(directory, ignore_errors=True)
+
+
+# Simulated RS-485 bus: every host frame reaches all daemons, whatever they send
+# is merged into one log of (time, camera, bytes) like a shared receive line
+class Bus:
+	def __init__(self, masters):
+		self.masters = masters
+		self.log = []
+		for camera, fd in enumerate(masters, 1):
+			os.set_blocking(fd, False)
+			asyncio.get_running_loop().add_reader(fd, self._readable, camera)
+
+	def _readable(self, camera):
+		try:
+			data = os.read(self.masters[camera - 1], 65536)
+		except OSError:
+			return
+		if data:
+			self.log.append((time.monotonic(), camera, data))
+
+	# Function to send a frame to every camera and return when it was sent and
+	# what the cameras said within listen seconds
+	async def exchange(self, frame, listen):
+		self.log.clear()
+		sent = time.monotonic()
+		for fd in self.masters:
+			os.write(fd, frame)
+		await asyncio.sleep(listen)
+		return sent, list(self.log)
+
+	def close(self):
+		for fd in self.masters:
+			asyncio.get_running_loop().remove_reader(fd)
+			os.close(fd)
+
+
+def speakers(heard):
+	return sorted({camera for _, camera, _ in heard})
+
+
+# Function to check the multi-drop rules with several daemons on one simulated
+# bus: broadcasts get no reply, an addressed frame only one, and a group STATUS
+# one reply per camera in its own slot without two replies on the wire at once
+async def multidrop(args):
+	daemon = os.path.abspath(args.daemon)
+	cameras = range(1, args.cameras + 1)
+	pairs = [pty.openpty() for _ in cameras]
+	directories = [tempfile.mkdtemp(prefix=f"serial-drop{c}-") for c in cameras]
+	logs = [
+		open(f"{args.log}.{c}", "w") if args.log else subprocess.DEVNULL
+		for c in cameras
+	]
+	processes = []
+	for c, (_, slave), directory, log in zip(cameras, pairs, directories, logs):
+		tty.setraw(slave)
+		processes.append(start_daemon(daemon, os.ttyname(slave), directory, log, c))
+	bus = None
+	failures = 0
+	try:
+		await asyncio.sleep(DAEMON_START_S)
+		for c, process in zip(cameras, processes):
+			if process.poll() is not None:
+				raise RuntimeError(f"daemon {c} exited with {process.returncode}")
+		bus = Bus([master for master, _ in pairs])
+
+		# RTC would step the clock of this machine, MOSD and STATUS are harmless
+		for name, frame in [
+			("MOSD", fr.construct_osd_command(fr.BROADCAST_ID, fr.POSITION_TOP, "")),
+			("STATUS", fr.construct_status_command(fr.BROADCAST_ID)),
+		]:
+			_, heard = await bus.exchange(frame, args.listen)
+			failures += bool(heard)
+			print(f"broadcast {name:<6}  replies from {speakers(heard) or 'nobody'}")
+		for c in cameras:
+			_, heard = await bus.exchange(fr.construct_status_command(c), args.listen)
+			failures += speakers(heard) != [c]
+			print(f"STATUS to {c:<6}  replies from {speakers(heard) or 'nobody'}")
+
+		slot = fr.STATUS_SLOT_MS / 1e3
+		airtime = fr.STATUS_GROUP_REPLY * 10 / args.baudrate
+		offsets = {c: [] for c in cameras}
+		late = {c: 0 for c in cameras}
+		overlaps = 0
+		for _ in range(args.polls):
+			sent, heard = await bus.exchange(
+				fr.construct_status_command(fr.GROUP_ID),
+				slot * (args.cameras + 1) + args.listen,
+			)
+			replies = {}
+			for at, c, data in heard:
+				first, received = replies.get(c, (at, b""))
+				replies[c] = (first, received + data)
+			on_air = -1.0
+			for c, (at, data) in sorted(replies.items(), key=lambda r: r[1][0]):
+				if len(data) != fr.STATUS_GROUP_REPLY or data[2] != c:
+					continue
+				offset = at - sent
+				offsets[c].append(offset)
+				late[c] += not c * slot <= offset < (c + 1) * slot
+				overlaps += at < on_air
+				on_air = at + airtime
+		print(f"group STATUS, {args.polls} polls, slot {fr.STATUS_SLOT_MS} ms")
+		print(f"{'camera':>8} {'replies':>8} {'p50 ms':>8} {'max ms':>8} {'late':>6}")
+		for c in cameras:
+			samples = offsets[c]
+			failures += args.polls - len(samples) + late[c]
+			print(
+				f"{c:>8} {len(samples):>8} "
+				f"{client.percentile(samples, 50) * 1e3:>8.2f} "
+				f"{max(samples, default=0) * 1e3:>8.2f} {late[c]:>6}"
+			)
+		failures += overlaps
+		print(f"{overlaps} overlapping replies, {failures} failures")
+	finally:
+		if bus is not None:
+			bus.close()
+		for process in processes:
+			process.send_signal(signal.SIGINT)
+		for process in processes:
+			try:
+				process.wait(5)
+			except subprocess.TimeoutExpired:
+				process.kill()
+		for master, slave in pairs:
+			if bus is None:
+				os.close(master)
+			os.close(slave)
+		for log in logs:
+			if log is not subprocess.DEVNULL:
+				log.close()
+		for directory in directories:
+			shutil.rmtree(directory, ignore_errors=True)
+	if failures:
+		sys.exit(1)
+
+
+def size_list(value):
+	sizes = [int(v) for v in value.split(",")]
+	for size in sizes:
+		package_size(size)
+	return sizes
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Serial camera transfer client")
+	common = argparse.ArgumentParser(add_help=False)
+	common.add_argument("--camera", type=int, default=1)
+	common.add_argument("--window", type=int, default=fr.MAX_WINDOW)
+	common.add_argument("--depth", type=int, default=4, help="windows in flight")
+	common.add_argument("--timeout", type=float, default=client.DEFAULT_TIMEOUT)
+	common.add_argument(
+		"--checksum", action="store_true", help="sum checksum instead of CRC-16"
+	)
+	commands = parser.add_subparsers(dest="command", required=True)
+
+	port = argparse.ArgumentParser(add_help=False)
+	port.add_argument("--baudrate", type=int, default=115200)
+	port.add_argument("--time", help="YYYY-MM-DD HH:MM, now by default")
+	port.add_argument(
+		"--package-size", type=int, default=1024, choices=[256, 512, 1024, 2048]
+	)
+
+	p = commands.add_parser("download", parents=[common, port])
+	p.add_argument("--port", required=True)
+	p.add_argument("-o", "--output", default="image.jpg")
+	p.add_argument("--resume", action="store_true")
+
+	p = commands.add_parser("parallel", parents=[common, port])
+	p.add_argument("targets", nargs="+", metavar="PORT:CAMERA")
+	p.add_argument("-o", "--output", default=".")
+
+	p = commands.add_parser("bench", parents=[common])
+	p.add_argument("--daemon", required=True, help="serial binary, see make host")
+	p.add_argument("--sizes", type=size_list, default=[256, 512, 1024, 2048])
+	p.add_argument("--file-size", type=int, default=256 * 1024)
+	p.add_argument("--runs", type=int, default=5)
+	p.add_argument("--error-rate", type=float, default=0.0, help="per byte")
+	p.add_argument("--log", help="file for the daemon output")
+	p.add_argument("--frames", type=int, default=1000, help="commands to time")
+	p.add_argument("--debug", action="store_true", help="daemon traces every frame")
+	p.add_argument("--baudrate", type=int, default=115200, help="UART to compare with")
+
+	p = commands.add_parser("multidrop")
+	p.add_argument("--daemon", required=True, help="serial binary, see make host")
+	p.add_argument("--cameras", type=int, default=3)
+	p.add_argument("--polls", type=int, default=20, help="group STATUS polls")
+	p.add_argument("--listen", type=float, default=0.2, help="seconds per reply")
+	p.add_argument("--baudrate", type=int, default=115200, help="for the airtime")
+	p.add_argument("--log", help="prefix of the daemon output files")
+
+	args = parser.parse_args()
+	try:
+		asyncio.run(globals()[args.command](args))
+	except KeyboardInterrupt:
+		sys.exit(130)
+
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,363 @@
+import asyncio
+import os
+import random
+import time
+from collections import deque
+from dataclasses import dataclass, field
+
+import frame as fr
+
+SESSION_ACK_SIZE = 15
+NONE_FRAME_SIZE = 4
+DEFAULT_TIMEOUT = 1.0  # Seconds without a package before outstanding windows are resent
+DRAIN_IDLE = 0.1  # Seconds of silence that end a drain
+
+
+class LinkTimeout(Exception):
+	pass
+
+
+# Async transport over a serial port or any tty fd, e.g. the master side of a pty
+class AsyncSerial:
+	def __init__(self, fd, owner=None, error_rate=0.0):
+		self.fd = fd
+		self.owner = owner  # pyserial object keeping the port open, if any
+		self.buffer = bytearray()
+		self.event = asyncio.Event()
+		self.error_rate = error_rate  # Injected byte error rate on receive
+		self.errors = 0
+		self._next_error = self._draw_error()
+		os.set_blocking(fd, False)
+		asyncio.get_running_loop().add_reader(fd, self._readable)
+
+	@classmethod
+	def open(cls, port, baudrate, error_rate=0.0):
+		import serial
+
+		ser = serial.Serial(port, baudrate, bytesize=8, timeout=0)
+		ser.reset_input_buffer()
+		return cls(ser.fileno(), ser, error_rate)
+
+	# Function to draw the number of good bytes before the next injected error
+	def _draw_error(self):
+		if self.error_rate <= 0:
+			return -1
+		return int(random.expovariate(self.error_rate))
+
+	def _readable(self):
+		try:
+			data = os.read(self.fd, 65536)
+		except BlockingIOError:
+			return
+		except OSError:
+			# pty master without a slave yet, or the port went away
+			data = b""
+		if not data:
+			return
+		start = len(self.buffer)
+		self.buffer += data
+		while 0 <= self._next_error < len(self.buffer) - start:
+			self.buffer[start + self._next_error] ^= 1 << random.randrange(8)
+			self.errors += 1
+			start += self._next_error + 1
+			self._next_error = self._draw_error()
+		if self._next_error >= 0:
+			self._next_error -= len(self.buffer) - start
+		self.event.set()
+
+	async def write(self, data):
+		view = memoryview(data)
+		while view:
+			try:
+				view = view[os.write(self.fd, view) :]
+			except BlockingIOError:
+				writable = asyncio.get_running_loop().create_future()
+				asyncio.get_running_loop().add_writer(
+					self.fd, writable.set_result, None
+				)
+				try:
+					await writable
+				finally:
+					asyncio.get_running_loop().remove_writer(self.fd)
+
+	# Function to wait until more bytes arrive, returns False on timeout
+	async def wait(self, timeout):
+		self.event.clear()
+		try:
+			await asyncio.wait_for(self.event.wait(), timeout)
+			return True
+		except asyncio.TimeoutError:
+			return False
+
+	async def read_exact(self, size, timeout=DEFAULT_TIMEOUT):
+		deadline = time.monotonic() + timeout
+		while len(self.buffer) < size:
+			if not await self.wait(max(deadline - time.monotonic(), 0)):
+				raise LinkTimeout(f"{len(self.buffer)} of {size} bytes")
+		data = bytes(self.buffer[:size])
+		del self.buffer[:size]
+		return data
+
+	# Function to discard input until the line stays quiet
+	async def drain(self, idle=DRAIN_IDLE):
+		self.buffer.clear()
+		while await self.wait(idle):
+			self.buffer.clear()
+
+	def close(self):
+		asyncio.get_running_loop().remove_reader(self.fd)
+		if self.owner is not None:
+			self.owner.close()
+		else:
+			os.close(self.fd)
+
+
+@dataclass
+class TransferStats:
+	bytes: int = 0
+	packages: int = 0
+	retransmits: int = 0  # Packages requested again after a loss or a bad checksum
+	corrupt: int = 0  # Frames dropped on a bad checksum
+	timeouts: int = 0
+	reopens: int = 0  # NEXT_FILE after a lost session
+	elapsed: float = 0.0
+	latencies: list = field(default_factory=list)  # Request to last package, per window
+
+	def merge(self, other):
+		for name in ("bytes", "packages", "retransmits", "corrupt", "timeouts"):
+			setattr(self, name, getattr(self, name) + getattr(other, name))
+		self.reopens += other.reopens
+		self.elapsed += other.elapsed
+		self.latencies += other.latencies
+
+
+@dataclass
+class Window:
+	first: int
+	count: int
+	sent: float
+	received: set = field(default_factory=set)
+
+	@property
+	def last(self):
+		return self.first + self.count - 1
+
+
+# Function to compute a percentile of a list of samples
+def percentile(samples, p):
+	if not samples:
+		return 0.0
+	ordered = sorted(samples)
+	return ordered[min(int(p / 100 * len(ordered)), len(ordered) - 1)]
+
+
+# One camera on a transport, several cameras may share it on a bus
+class Camera:
+	def __init__(self, link, camera_id, timeout=DEFAULT_TIMEOUT):
+		self.link = link
+		self.camera_id = camera_id
+		self.timeout = timeout
+		self.file_crc = None  # CRC-32 of the file of the last session opened
+
+	# Function to open a transfer session, returns hour, minute, session, size and CRC
+	async def open_file(self, when, package_size, flags=fr.FLAG_CRC):
+		command = fr.construct_get_next_file_command(
+			self.camera_id,
+			when.year,
+			when.month,
+			when.day,
+			when.hour,
+			when.minute,
+			package_size,
+			flags | fr.FLAG_SESSION,
+		)
+		await self.link.drain(0)
+		await self.link.write(command)
+		_, hour, minute, session, file_size, file_crc = (
+			fr.parse_nextfile_session_ack_frame(
+				await self.link.read_exact(SESSION_ACK_SIZE, self.timeout)
+			)
+		)
+		return hour, minute, session, file_size, file_crc
+
+	# Function to take the next run of pending packages as one window
+	@staticmethod
+	def _next_window(pending, window):
+		first = min(pending)
+		count = 1
+		while count < window and first + count in pending:
+			count += 1
+		for index in range(first, first + count):
+			pending.discard(index)
+		return first, count
+
+	# Download a file with up to depth GET_SESSION_PACKAGE windows in flight. The
+	# daemon serves them in order, so a package of a later window means the earlier
+	# ones are over and whatever they are missing is requested again. Pass packages
+	# and file_crc of an interrupted attempt to resume, packages is updated in place.
+	async def download(
+		self,
+		when,
+		package_size=fr.PackageSize.SIZE_1024,
+		window=fr.MAX_WINDOW,
+		depth=4,
+		crc_mode=True,
+		packages=None,
+		file_crc=None,
+		stats=None,
+		max_reopens=3,
+	):
+		size = package_size.size
+		frame_size = 9 + size + 3
+		packages = {} if packages is None else packages
+		stats = TransferStats() if stats is None else stats
+		started = time.monotonic()
+		link = self.link
+		session = None
+		reopens = 0
+		outstanding = deque()
+		pending = set()
+
+		while True:
+			if session is None:
+				if reopens > max_reopens:
+					raise ValueError("Session lost too often, giving up")
+				hour, minute, session, file_size, crc = await self.open_file(
+					when, package_size, fr.FLAG_CRC if crc_mode else 0
+				)
+				# the file changed since the interrupted attempt, start over
+				if file_crc is not None and crc != file_crc:
+					packages.clear()
+				file_crc = self.file_crc = crc
+				total = -(-file_size // size)
+				pending = set(range(total)) - packages.keys()
+				outstanding.clear()
+
+			while pending and len(outstanding) < depth:
+				first, count = self._next_window(pending, window)
+				outstanding.append(Window(first, count, time.monotonic()))
+				await link.write(
+					fr.construct_get_session_package_command(
+						self.camera_id, session, first, count
+					)
+				)
+			if not outstanding:
+				break
+
+			if not await self._receive(
+				outstanding, pending, packages, session, frame_size, crc_mode, stats
+			):
+				# evicted or the daemon restarted, reopen and resume where we are
+				session = None
+				reopens += 1
+				stats.reopens += 1
+				for w in outstanding:
+					self._requeue(w, pending, stats)
+				await link.drain()
+
+		data = b"".join(packages[i] for i in range(total))[:file_size]
+		if not fr.verify_file_crc(data, file_crc):
+			raise ValueError("File CRC mismatch")
+		stats.bytes += len(data)
+		stats.packages += total
+		stats.elapsed += time.monotonic() - started
+		return hour, minute, data
+
+	@staticmethod
+	def _requeue(w, pending, stats):
+		missing = set(range(w.first, w.first + w.count)) - w.received
+		pending |= missing
+		stats.retransmits += len(missing)
+
+	def _complete(self, outstanding, upto, pending, stats):
+		now = time.monotonic()
+		while outstanding and outstanding[0] is not upto:
+			w = outstanding.popleft()
+			self._requeue(w, pending, stats)
+			if not w.received:
+				continue
+			stats.latencies.append(now - w.sent)
+
+	# Function to consume buffered frames, returns False once the session is lost
+	async def _receive(
+		self, outstanding, pending, packages, session, frame_size, crc_mode, stats
+	):
+		link = self.link
+		buffer = link.buffer
+		progress = False
+		pos = 0  # frames are consumed by offset, the buffer is compacted once per batch
+		while True:
+			pos = buffer.find(fr.DATA_HEADER, pos)
+			if pos < 0:
+				pos = len(buffer)
+			command = buffer[pos + 1] if len(buffer) >= pos + 2 else None
+			if command not in (None, fr.SESSION_DATA_PACKAGE, fr.NONE_COMMAND):
+				pos += 1
+				continue
+			if command == fr.NONE_COMMAND and len(buffer) >= pos + NONE_FRAME_SIZE:
+				if buffer[pos + 3] == fr.END_MARK_BYTE[0]:
+					del buffer[:pos]
+					return False
+				pos += 1
+				continue
+			if len(buffer) < pos + frame_size:
+				del buffer[:pos]
+				pos = 0
+				if progress:
+					return True
+				if await link.wait(self.timeout):
+					continue
+				# no package for a whole timeout, whatever is in flight is lost
+				stats.timeouts += 1
+				while outstanding:
+					self._requeue(outstanding.popleft(), pending, stats)
+				await link.drain()
+				return True
+			package = bytes(buffer[pos : pos + frame_size])
+			if package[3] != session or not fr.verify_data_package(package, crc_mode):
+				# damaged, or a header that was just payload bytes: resync past it
+				stats.corrupt += package[3] == session
+				pos += 1
+				continue
+			pos += frame_size
+			progress = True
+			index = int.from_bytes(package[4:8], byteorder="big")
+			packages[index] = package[9:-3]
+			owner = next((w for w in outstanding if w.first <= index <= w.last), None)
+			if owner is None:
+				# late package of a window given up on, still welcome
+				pending.discard(index)
+				continue
+			self._complete(outstanding, owner, pending, stats)
+			owner.received.add(index)
+			if index == owner.last:
+				outstanding.popleft()
+				self._requeue(owner, pending, stats)
+				stats.latencies.append(time.monotonic() - owner.sent)
+
+	# Function to read the span metrics of the daemon, see stats.c
+	async def status_metrics(self):
+		await self.link.drain(0)
+		await self.link.write(
+			fr.construct_status_command(self.camera_id)[:-1]
+			+ bytes([fr.STATUS_METRICS])
+			+ fr.END_MARK_BYTE
+		)
+		head = await self.link.read_exact(5, self.timeout)
+		body = await self.link.read_exact(head[4] * fr.STATS_SPAN_RECORD + 1)
+		return fr.parse_status_metrics_frame(head + body)
+
+
+# Function to download from several cameras, in parallel across ports and one
+# after the other on a shared port. jobs is a list of (port, camera_id, when).
+async def download_many(links, jobs, **options):
+	locks = {port: asyncio.Lock() for port in links}
+
+	async def one(port, camera_id, when):
+		stats = TransferStats()
+		async with locks[port]:
+			camera = Camera(links[port], camera_id)
+			hour, minute, data = await camera.download(when, stats=stats, **options)
+		return port, camera_id, hour, minute, data, stats
+
+	return await asyncio.gather(*(one(*job) for job in jobs), return_exceptions=True)
@@ -1,3 +1,5 @@
+import binascii
+import zlib
 from enum import Enum
 
 ack = bytearray([0x55, 0x4D, 0x00, 0x83, 0x23])
@@ -10,18 +12,68 @@ LIST_FILES_COMMAND = b"\x4c"
 GET_NEXT_FILE_COMMAND = b"\x4d"
 GET_SPEC_FILE_COMMAND = b"\x45"
 SEND_SPEC_FILE_COMMAND = b"\x46"
+GET_WINDOW_COMMAND = b"\x57"
+RETRANSMIT_COMMAND = b"\x52"
+GET_SESSION_PACKAGE_COMMAND = b"\x47"
+SESSION_DATA_PACKAGE = 0x48
+NONE_COMMAND = 0x63  # Reply of the daemon to a command it could not serve
 BAUDRATE_COMMAND = b"\x49"
 OSD_COMMAND = b"\x4f"
 RTC_COMMAND = b"\x54"
+STATUS_COMMAND = b"\x53"
+BROADCAST_ID = 0xFF  # RTC and OSD for every camera on the bus, no reply
+GROUP_ID = 0xFE  # STATUS poll, camera N replies in time slot N
+STATUS_METRICS = 0x01  # STATUS option: reply with the span metrics of the daemon
+STATS_SPAN_RECORD = 12
+STATS_SPANS = ["parse", "lookup", "read", "write", "render"]
+STATUS_SLOT_MS = 20
+STATUS_GROUP_REPLY = 5  # Bytes of a group STATUS reply
 POSITION_TOP = b"\x54"
 POSITION_BOTTOM = b"\x42"
+POSITION_SLOTS = [b"\x30", b"\x31", b"\x32", b"\x33"]  # Replace the template of slot N
 MAX_PACKAGE_SIZE = 1024
-
-
+MAX_WINDOW = 32  # Packages per window, also the NACK bitmap width
+FLAG_CRC = 0x01  # Next file option: CRC-16 per package, CRC-32 of the file in the ack
+FLAG_SESSION = 0x04  # Next file option: session id and 32-bit file size in the ack
+VARIANT_RAW = 0x00  # Next file option: the original file
+VARIANT_THUMBNAIL = 0x10  # Next file option: the EXIF thumbnail of the JPEG
+VARIANT_LZ4 = 0x20  # Next file option: LZ4 legacy frame of the file
+LZ4_LEGACY_MAGIC = 0x184C2102
+
+
+BAUD_PERSIST = 0x01  # Baud rate option: store the new rate in serial.yaml
+BAUD_CONFIRM_TIMEOUT = 2.0  # Seconds the daemon waits at the new rate
+
+
+class BaudRate(Enum):
+	BAUD_9600 = 0x30
+	BAUD_19200 = 0x31
+	BAUD_38400 = 0x32
+	BAUD_57600 = 0x33
+	BAUD_115200 = 0x34
+	BAUD_230400 = 0x35
+	BAUD_460800 = 0x36
+	BAUD_921600 = 0x37
+	BAUD_1000000 = 0x38
+	BAUD_1500000 = 0x39
+	BAUD_2000000 = 0x3A
+	BAUD_3000000 = 0x3B
+
+	@property
+	def rate(self):
+		return int(self.name.split("_")[1])
+
+
+# Package size codes of NEXT_FILE, as the daemon decodes them
 class PackageSize(Enum):
-	SIZE_512 = 0
-	SIZE_1024 = 1
-	SIZE_2048 = 2
+	SIZE_256 = 0
+	SIZE_512 = 1
+	SIZE_1024 = 2
+	SIZE_2048 = 3
+
+	@property
+	def size(self):
+		return int(self.name.split("_")[1])
 
 
 def calculate_checksum(header, cmd, id, package, length, data):
@@ -32,6 +84,12 @@ def calculate_checksum(header, cmd, id, package, length, data):
 	return result & 0xFFFF
 
 
+# Function to calculate the CRC-16/CCITT-FALSE used by data packages in CRC mode,
+# binascii has it in C as the XMODEM CRC with the initial value left to the caller
+def crc16_ccitt(data, crc=0xFFFF):
+	return binascii.crc_hqx(data, crc)
+
+
 # Function to construct a frame with the new data structure
 def construct_data_frame(command_specifier, camera_id, package_number, package_data):
 	if len(package_data) > MAX_PACKAGE_DATA_SIZE:
@@ -53,10 +111,17 @@ def construct_data_frame(command_specifier, camera_id, package_number, package_d
 	frame += package_number + package_size + package_data
 
 	# Calculate the checksum (excluding checksum itself)
-	checksum = calculate_checksum(frame)
+	checksum = calculate_checksum(
+		frame[0],
+		frame[1],
+		frame[2],
+		sum(package_number),
+		sum(package_size),
+		package_data,
+	)
 
 	# Append checksum to frame
-	frame += checksum
+	frame += checksum.to_bytes(2, byteorder="big")
 
 	return frame
 
@@ -69,11 +134,12 @@ def parse_data_frame(frame):
 		raise ValueError("Frame is too short")
 
 	# Extract the checksum from the frame
-	received_checksum = frame[-2:]  # Last 2 bytes are the checksum
-	frame_without_checksum = frame[:-2]  # Exclude checksum for calculation
+	received_checksum = int.from_bytes(frame[-2:], byteorder="big")
 
 	# Calculate checksum on the frame (excluding the received checksum)
-	calculated_checksum = calculate_checksum(frame_without_checksum)
+	calculated_checksum = calculate_checksum(
+		frame[0], frame[1], frame[2], sum(frame[3:5]), sum(frame[5:7]), frame[7:-2]
+	)
 
 	# Validate checksum
 	if received_checksum != calculated_checksum:
@@ -153,10 +219,10 @@ def parse_list_file_ack_frame(frame):
 
 # Function to construct the "Get Next File by File" command frame
 def construct_get_next_file_command(
-	camera_id, year, month, day, hour, minute, package_size_data
+	camera_id, year, month, day, hour, minute, package_size_data, flags=None
 ):
 	if not isinstance(package_size_data, PackageSize):
-		raise ValueError("Invalid package size data. Must be 00, 01, or 02.")
+		raise ValueError("Invalid package size data. Must be a PackageSize value.")
 
 	# Date is packed into 3 bytes (Year, Month, Day)
 	date = bytes([year - 2000]) + bytes([month]) + bytes([day])  # Year offset for 2000+
@@ -170,6 +236,8 @@ def construct_get_next_file_command(
 	# Start with Data Header, Command Specifier, Camera ID, then Command Content
 	frame = DATA_HEADER + GET_NEXT_FILE_COMMAND + bytes([camera_id])
 	frame += date + time + package_size_data_byte
+	if flags is not None:
+		frame += bytes([flags])  # Transfer options, e.g. FLAG_CRC
 	frame += END_MARK_BYTE  # End mark
 
 	return frame
@@ -192,10 +260,52 @@ def parse_nextfile_ack_frame(frame):
 	return camera_id, total_package
 
 
+# Function to parse the next file ACK frame sent in CRC mode
+def parse_nextfile_crc_ack_frame(frame):
+	if len(frame) != 11:  # Fixed size of 11 bytes for the CRC mode ACK frame
+		raise ValueError("ACK Frame size is incorrect")
+
+	if frame[0] != DATA_HEADER[0] or frame[10] != END_MARK_BYTE[0]:
+		raise ValueError("Invalid frame format")
+
+	camera_id = frame[2]
+	hour = frame[3]
+	minute = frame[4]
+	total_package = frame[5]
+	file_crc = int.from_bytes(frame[6:10], byteorder="big")
+
+	return camera_id, hour, minute, total_package, file_crc
+
+
+# Function to parse the next file ACK frame of a session
+def parse_nextfile_session_ack_frame(frame):
+	if len(frame) != 15:  # Fixed size of 15 bytes for the session ACK frame
+		raise ValueError("ACK Frame size is incorrect")
+
+	if frame[0] != DATA_HEADER[0] or frame[14] != END_MARK_BYTE[0]:
+		raise ValueError("Invalid frame format")
+	if frame[1] == NONE_COMMAND:
+		raise ValueError("No file for the requested time")
+
+	camera_id = frame[2]
+	hour = frame[3]
+	minute = frame[4]
+	session = frame[5]
+	file_size = int.from_bytes(frame[6:10], byteorder="big")
+	file_crc = int.from_bytes(frame[10:14], byteorder="big")
+
+	return camera_id, hour, minute, session, file_size, file_crc
+
+
+# Function to verify a downloaded file against the CRC-32 from the ack
+def verify_file_crc(data, file_crc):
+	return zlib.crc32(data) & 0xFFFFFFFF == file_crc
+
+
 # Function to construct the OSD command frame
 def construct_osd_command(camera_id, position, text_value):
-	if position not in [POSITION_TOP, POSITION_BOTTOM]:
-		raise ValueError("Invalid position. Must be 0x54 or 0x42.")
+	if position not in [POSITION_TOP, POSITION_BOTTOM, *POSITION_SLOTS]:
+		raise ValueError("Invalid position. Must be 0x54, 0x42 or 0x30-0x33.")
 
 	length = len(text_value)  # Length of the text value
 	if length > 255:
@@ -299,6 +409,20 @@ def parse_get_send_data_package(frame):
 	)
 
 
+# Function to construct the baud rate command frame
+def construct_baudrate_command(camera_id, baud_rate, flags=None):
+	if not isinstance(baud_rate, BaudRate):
+		raise ValueError("Invalid baud rate. Must be a BaudRate value.")
+
+	frame = DATA_HEADER + BAUDRATE_COMMAND + bytes([camera_id])
+	frame += bytes([baud_rate.value])
+	if flags is not None:
+		frame += bytes([flags])  # Baud rate options, e.g. BAUD_PERSIST
+	frame += END_MARK_BYTE  # End mark
+
+	return frame
+
+
 # Function to construct the OSD command frame
 def construct_rtc_command(camera_id, byte1, byte2, byte3, byte4):
 	frame = DATA_HEADER + RTC_COMMAND + bytes([camera_id])
@@ -322,3 +446,197 @@ def parse_ack_rtc_frame(frame):
 		raise ValueError("Invalid frame format")
 
 	return command_specifier, camera_id
+
+
+# Function to construct the "Get Package Window" command frame
+def construct_get_window_command(camera_id, hour, minute, first_package, count):
+	if not (1 <= first_package <= 255):
+		raise ValueError("First package must be between 1 and 255")
+	if not (1 <= count <= MAX_WINDOW):
+		raise ValueError(f"Window must be between 1 and {MAX_WINDOW} packages")
+
+	# Command content: HH (hour) + MM (minute) + PK (first package) + N (count)
+	command_content = bytes([hour, minute, first_package, count])
+
+	frame = DATA_HEADER + GET_WINDOW_COMMAND + bytes([camera_id])
+	frame += command_content + END_MARK_BYTE  # End mark
+
+	return frame
+
+
+# Function to construct the "Get Session Package" command frame, index is 0-based
+def construct_get_session_package_command(camera_id, session, index, count=1):
+	if not (1 <= session <= 255):
+		raise ValueError("Session must be between 1 and 255")
+	if not (0 <= index < (1 << 32)):
+		raise ValueError("Package index must fit in 32 bits")
+	if not (1 <= count <= MAX_WINDOW):
+		raise ValueError(f"Window must be between 1 and {MAX_WINDOW} packages")
+
+	# Command content: SID (session) + 32-bit package index (big endian) + N (count)
+	command_content = bytes([session]) + index.to_bytes(4, byteorder="big")
+	command_content += bytes([count])
+
+	frame = DATA_HEADER + GET_SESSION_PACKAGE_COMMAND + bytes([camera_id])
+	frame += command_content + END_MARK_BYTE  # End mark
+
+	return frame
+
+
+# Function to split back-to-back session data frames into packages by index
+def split_session_window(buffer, package_size, crc_mode=False):
+	frame_size = 9 + package_size + 3
+	packages = {}
+	for offset in range(0, len(buffer) - frame_size + 1, frame_size):
+		frame = buffer[offset : offset + frame_size]
+		if frame[0] != DATA_HEADER[0] or frame[1] != SESSION_DATA_PACKAGE:
+			continue
+		if verify_data_package(frame, crc_mode):
+			packages[int.from_bytes(frame[4:8], byteorder="big")] = frame[9:-3]
+	return packages
+
+
+# Function to build the NACK bitmap for the packages missing from a window
+def construct_nack_bitmap(first_package, count, received):
+	bitmap = 0
+	for i in range(count):
+		if first_package + i not in received:
+			bitmap |= 1 << i
+	return bitmap
+
+
+# Function to construct the "Retransmit Packages" command frame
+def construct_retransmit_command(camera_id, hour, minute, first_package, bitmap):
+	if not (0 <= bitmap < (1 << MAX_WINDOW)):
+		raise ValueError(f"NACK bitmap must fit in {MAX_WINDOW} bits")
+
+	# Command content: HH + MM + PK (base package) + 32-bit NACK bitmap (big endian)
+	command_content = bytes([hour, minute, first_package])
+	command_content += bitmap.to_bytes(4, byteorder="big")
+
+	frame = DATA_HEADER + RETRANSMIT_COMMAND + bytes([camera_id])
+	frame += command_content + END_MARK_BYTE  # End mark
+
+	return frame
+
+
+# Function to compute the checksum carried by a "Send Specified Data Package" frame
+def data_package_checksum(frame):
+	# header + cmd + camera_id + hour + minute + package_no + data_size + data
+	return sum(frame[:-3]) & 0xFFFF
+
+
+# Function to verify a "Send Specified Data Package" frame
+def verify_data_package(frame, crc_mode=False):
+	received = int.from_bytes(frame[-3:-1], byteorder="big")
+	if crc_mode:
+		expected = crc16_ccitt(frame[:-3])
+	else:
+		expected = data_package_checksum(frame)
+	return frame[-1] == END_MARK_BYTE[0] and received == expected
+
+
+# Function to split a window of back-to-back data frames into packages
+def split_window(buffer, package_size, crc_mode=False):
+	frame_size = 7 + package_size + 3
+	packages = {}
+	corrupt = set()
+	for offset in range(0, len(buffer) - frame_size + 1, frame_size):
+		frame = buffer[offset : offset + frame_size]
+		package_number = frame[5]
+		if frame[0] == DATA_HEADER[0] and verify_data_package(frame, crc_mode):
+			packages[package_number] = frame[7:-3]
+		else:
+			corrupt.add(package_number)
+	return packages, corrupt
+
+
+# Function to parse the completion frame sent after an asynchronous command (RTC, STATUS)
+def parse_completion_frame(frame):
+	if len(frame) != 5:  # Fixed size of 5 bytes for the completion frame
+		raise ValueError("Completion Frame size is incorrect")
+
+	if frame[0] != DATA_HEADER[0] or frame[4] != END_MARK_BYTE[0]:
+		raise ValueError("Invalid frame format")
+
+	command_specifier = frame[1]
+	camera_id = frame[2]
+	result = int.from_bytes(frame[3:4], byteorder="big", signed=True)
+
+	return command_specifier, camera_id, result
+
+
+# Function to decompress a single LZ4 block
+def lz4_decompress_block(block):
+	out = bytearray()
+	pos = 0
+	while pos < len(block):
+		token = block[pos]
+		pos += 1
+		literals = token >> 4
+		if literals == 15:
+			while True:
+				literals += block[pos]
+				pos += 1
+				if block[pos - 1] != 255:
+					break
+		out += block[pos : pos + literals]
+		pos += literals
+		if pos >= len(block):
+			break
+		offset = block[pos] | block[pos + 1] << 8
+		pos += 2
+		match = token & 0x0F
+		if match == 15:
+			while True:
+				match += block[pos]
+				pos += 1
+				if block[pos - 1] != 255:
+					break
+		start = len(out) - offset
+		for i in range(match + 4):
+			out.append(out[start + i])
+	return bytes(out)
+
+
+# Function to decompress a file downloaded with VARIANT_LZ4
+def lz4_decompress_legacy(data):
+	if int.from_bytes(data[:4], byteorder="little") != LZ4_LEGACY_MAGIC:
+		raise ValueError("Not an LZ4 legacy frame")
+	out = bytearray()
+	pos = 4
+	while pos + 4 <= len(data):
+		length = int.from_bytes(data[pos : pos + 4], byteorder="little")
+		pos += 4
+		out += lz4_decompress_block(data[pos : pos + length])
+		pos += length
+	return bytes(out)
+
+
+# Function to construct the STATUS command frame, GROUP_ID polls every camera
+def construct_status_command(camera_id):
+	return DATA_HEADER + STATUS_COMMAND + bytes([camera_id]) + END_MARK_BYTE
+
+
+# Function to parse the STATUS_METRICS reply into span name -> count, average in
+# microseconds and the p50, p99 and max upper bounds (power of two microseconds)
+def parse_status_metrics_frame(frame):
+	if len(frame) < 6 or frame[0] != DATA_HEADER[0] or frame[-1] != END_MARK_BYTE[0]:
+		raise ValueError("Invalid frame format")
+	if frame[3] != STATUS_METRICS:
+		raise ValueError("Not a metrics frame")
+	if len(frame) != 6 + frame[4] * STATS_SPAN_RECORD:
+		raise ValueError("Metrics Frame size is incorrect")
+
+	spans = {}
+	for offset in range(5, len(frame) - 1, STATS_SPAN_RECORD):
+		record = frame[offset : offset + STATS_SPAN_RECORD]
+		name = STATS_SPANS[record[0]] if record[0] < len(STATS_SPANS) else record[0]
+		spans[name] = (
+			int.from_bytes(record[1:5], byteorder="big"),
+			int.from_bytes(record[5:9], byteorder="big"),
+			1 << record[9],
+			1 << record[10],
+			1 << record[11],
+		)
+	return spans
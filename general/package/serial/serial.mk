@@ -9,7 +9,7 @@ SERIAL_SITE = $(SERIAL_PKGDIR)
 
 SERIAL_LICENSE = MIT
 SERIAL_LICENSE_FILES = LICENSE
-SERIAL_DEPENDENCIES += libcurl-openipc mbedtls-openipc
+SERIAL_DEPENDENCIES += libcurl-openipc mbedtls-openipc zlib
 
 SERIAL_TARGET = serial
 SERIAL_FAMILY = star6b0
@@ -23,6 +23,7 @@ endef
 define SERIAL_INSTALL_TARGET_CMDS
 	$(INSTALL) -m 755 -d $(TARGET_DIR)/etc
 	$(INSTALL) -m 644 -t $(TARGET_DIR)/etc $(@D)/serial.yaml
+	if [ -f $(@D)/serial.pub ]; then $(INSTALL) -m 644 -t $(TARGET_DIR)/etc $(@D)/serial.pub; fi
 
 	$(INSTALL) -m 755 -d $(TARGET_DIR)/usr/bin
 	$(INSTALL) -m 0755 -t $(TARGET_DIR)/usr/bin $(@D)/src/serial
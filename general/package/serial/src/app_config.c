@@ -1,27 +1,63 @@
 #include "app_config.h"
-const char *appconf_paths[] = {"./serial.yaml", "/etc/serial.yaml"};
+#include "data_define.h"
+#include "palette.h"
+#include "region.h"
+#include "stats.h"
+#include "text.h"
+#include <pthread.h>
+const char *appconf_paths[] = {"./serial.yaml", "/etc/serial.yaml", NULL};
 
 struct AppConfig app_config;
 
-static inline void *open_app_config(FILE **file, const char *flags)
+static const char *osd_aligns[] = {"left", "center", "right"};
+
+// Region pixel formats the OSD can render to
+static const struct
 {
-    const char **path = appconf_paths;
-    *file = NULL;
+    const char *name;
+    int format;
+} osd_formats[] = {{"argb1555", PIXEL_FORMAT_1555}, {"i4", PIXEL_FORMAT_4BPP}, {"i2", PIXEL_FORMAT_2BPP}};
 
-    while (*path)
+static const char *osd_format_name(int format)
+{
+    for (size_t i = 0; i < sizeof(osd_formats) / sizeof(*osd_formats); i++)
+        if (osd_formats[i].format == format)
+            return osd_formats[i].name;
+    return osd_formats[0].name;
+}
+
+// ARGB8888 entries separated by '|', parse_array() stops at INT_MAX
+static enum ConfigError parse_palette(struct IniConfig *ini)
+{
+    char value[256];
+    enum ConfigError err = parse_param_value(ini, "osd", "palette", value);
+    if (err != CONFIG_OK)
+        return err;
+
+    app_config.osd_palette_size = 0;
+    for (char *token = strtok(value, "|"); token; token = strtok(NULL, "|"))
     {
-        if (access(*path++, F_OK))
-            continue;
-        if (*flags == 'w')
+        char *end;
+        unsigned long entry = strtoul(token, &end, 16);
+        if (*end || app_config.osd_palette_size == PALETTE_SIZE)
         {
-            char bkPath[32];
-            sprintf(bkPath, "%s.bak", *(path - 1));
-            remove(bkPath);
-            rename(*(path - 1), bkPath);
+            fprintf(stderr, "Can't parse param 'palette' entry '%s'. Expected up to %d hex ARGB8888 values.\n",
+                    token, PALETTE_SIZE);
+            app_config.osd_palette_size = 0;
+            return CONFIG_PARAM_ISNT_NUMBER;
         }
-        *file = fopen(*(path - 1), flags);
-        break;
+        app_config.osd_palette[app_config.osd_palette_size++] = entry;
     }
+    return CONFIG_OK;
+}
+
+// The first config file that exists, NULL when there is none
+static const char *app_config_path(void)
+{
+    for (const char **path = appconf_paths; *path; path++)
+        if (!access(*path, F_OK))
+            return *path;
+    return NULL;
 }
 
 void restore_app_config(void)
@@ -30,35 +66,346 @@ void restore_app_config(void)
 
     while (*path)
     {
-        char bkPath[32];
+        char bkPath[64];
         sprintf(bkPath, "%s.bak", *path);
-        if (!access(bkPath, F_OK))
+        // a rename between two links of one file leaves both
+        if (!access(bkPath, F_OK) && !rename(bkPath, *path))
+            unlink(bkPath);
+        path++;
+    }
+}
+
+// One persisted key, an empty value leaves it out of the file
+struct Setting
+{
+    const char *section, *key;
+    char value[160];
+};
+
+static int app_config_settings(const struct AppConfig *config, struct Setting *out)
+{
+    int n = 0;
+#define SETTING(sec, name, ...)                                                                                        \
+    out[n].section = sec, out[n].key = name, snprintf(out[n++].value, sizeof(out->value), __VA_ARGS__)
+    SETTING("serial", "port", "%s", config->port);
+    SETTING("serial", "baudrate", "%d", config->baudrate);
+    SETTING("serial", "package_size", "%d", config->package_size);
+    SETTING("serial", "watchdog", "%d", config->watchdog);
+    SETTING("serial", "debug", "%s", config->debug ? "true" : "false");
+    SETTING("serial", "camera_id", config->camera_id >= 0 ? "%d" : "", config->camera_id);
+    // the osd section is only written once something differs from the defaults
+    bool osd = config->osd_align != TEXT_LEFT || config->osd_width || config->osd_color != DEF_COLOR ||
+               config->osd_background || config->osd_outline || config->osd_format != PIXEL_FORMAT_1555 ||
+               config->osd_palette_size;
+    SETTING("osd", "align", osd ? "%s" : "", osd_aligns[config->osd_align]);
+    SETTING("osd", "width", osd ? "%d" : "", config->osd_width);
+    SETTING("osd", "color", osd ? "0x%04X" : "", config->osd_color);
+    SETTING("osd", "background", osd ? "0x%04X" : "", config->osd_background);
+    SETTING("osd", "outline", osd ? "0x%04X" : "", config->osd_outline);
+    SETTING("osd", "format", osd ? "%s" : "", osd_format_name(config->osd_format));
+    out[n].section = "osd", out[n].key = "palette", out[n].value[0] = 0;
+    for (int i = 0, len = 0; i < config->osd_palette_size; i++)
+        len += snprintf(out[n].value + len, sizeof(out->value) - len, "%s%08X", i ? "|" : "",
+                        config->osd_palette[i]);
+    n++;
+#undef SETTING
+    return n;
+}
+
+// A span of the old text replaced by new text, insertions have start == end
+struct Edit
+{
+    int start, end, order;
+    char text[256];
+};
+
+static int compare_edit(const void *a, const void *b)
+{
+    const struct Edit *x = a, *y = b;
+    return x->start != y->start ? x->start - y->start : x->order - y->order;
+}
+
+static int line_start(const char *str, int pos)
+{
+    while (pos > 0 && str[pos - 1] != '\n')
+        pos--;
+    return pos;
+}
+
+static int line_end(const char *str, int pos)
+{
+    while (str[pos] && str[pos] != '\n')
+        pos++;
+    return str[pos] ? pos + 1 : pos;
+}
+
+// Where new keys of a section go, after its last key, and the shape of that
+// key's line (indent and separator) to copy
+static int section_tail(struct IniConfig *ini, const char *section, const char **indent, int *indent_len,
+                        const char **separator, int *separator_len)
+{
+    int found = -1;
+    for (int i = 0; i < ini->section_count && found < 0; i++)
+        if (!strcasecmp(ini->sections[i].name, section))
+            found = i;
+    if (found < 0)
+        return -1;
+    const struct Param *last = NULL;
+    for (int i = 0; i < ini->param_count; i++)
+        if (ini->params[i].section == found && (!last || ini->params[i].key > last->key))
+            last = &ini->params[i];
+    *indent = "  ", *indent_len = 2, *separator = ": ", *separator_len = 2;
+    if (!last)
+        return ini->sections[found].pos;
+    int start = line_start(ini->str, last->key);
+    *indent = ini->str + start, *indent_len = last->key - start;
+    *separator = ini->str + last->key + last->key_len, *separator_len = last->value - last->key - last->key_len;
+    return line_end(ini->str, last->value);
+}
+
+// Writes the text of ini with the settings applied in place: known keys get
+// their new value, keys with an empty one are dropped, missing keys are added
+// at the end of their section. Comments and unknown keys stay as they are.
+static char *apply_settings(struct IniConfig *ini, const struct Setting *settings, int count, size_t *length)
+{
+    struct Edit *edits = calloc(count, sizeof(*edits));
+    int n = 0, size = strlen(ini->str);
+    if (!edits)
+        return NULL;
+
+    char appended[1024] = "";
+    const char *appended_section = NULL;
+    for (int i = 0; i < count; i++)
+    {
+        const struct Setting *setting = &settings[i];
+        const struct Param *param = find_param(ini, setting->section, setting->key);
+        struct Edit *edit = &edits[n];
+        edit->order = i;
+        if (param && !setting->value[0])
         {
-            remove(*path);
-            rename(bkPath, *path);
+            edit->start = line_start(ini->str, param->key);
+            edit->end = line_end(ini->str, param->value);
         }
-        path++;
+        else if (param)
+        {
+            edit->start = param->value;
+            edit->end = param->value + param->value_len;
+            snprintf(edit->text, sizeof(edit->text), "%s", setting->value);
+        }
+        else if (setting->value[0])
+        {
+            const char *indent, *separator;
+            int indent_len, separator_len;
+            int at = section_tail(ini, setting->section, &indent, &indent_len, &separator, &separator_len);
+            if (at < 0)
+            {
+                // a whole new section at the end of the file
+                size_t len = strlen(appended);
+                if (setting->section != appended_section)
+                    len += snprintf(appended + len, sizeof(appended) - len, "%s:\n", setting->section);
+                snprintf(appended + len, sizeof(appended) - len, "  %s: %s\n", setting->key, setting->value);
+                appended_section = setting->section;
+                continue;
+            }
+            edit->start = edit->end = at;
+            bool newline = at == size && size && ini->str[size - 1] != '\n';
+            snprintf(edit->text, sizeof(edit->text), "%s%.*s%s%.*s%s\n", newline ? "\n" : "", indent_len, indent,
+                     setting->key, separator_len, separator, setting->value);
+        }
+        else
+            continue;
+        n++;
+    }
+    qsort(edits, n, sizeof(*edits), compare_edit);
+
+    size_t capacity = size + strlen(appended) + 2;
+    for (int i = 0; i < n; i++)
+        capacity += strlen(edits[i].text);
+    char *out = malloc(capacity);
+    if (!out)
+    {
+        free(edits);
+        return NULL;
+    }
+    size_t len = 0;
+    int pos = 0;
+    for (int i = 0; i < n; i++)
+    {
+        // a removed line may swallow an edit inside it
+        if (edits[i].start < pos)
+            continue;
+        memcpy(out + len, ini->str + pos, edits[i].start - pos);
+        len += edits[i].start - pos;
+        len += sprintf(out + len, "%s", edits[i].text);
+        pos = edits[i].end;
     }
+    memcpy(out + len, ini->str + pos, size - pos);
+    len += size - pos;
+    if (appended[0] && len && out[len - 1] != '\n')
+        out[len++] = '\n';
+    memcpy(out + len, appended, strlen(appended));
+    len += strlen(appended);
+    free(edits);
+    *length = len;
+    return out;
 }
 
-int save_app_config(void)
+// Replaces path with data so that it is either the old or the new file at any
+// time: written to a temporary next to it, synced, then renamed over it. The
+// old file is kept as .bak until the rename is durable, restore_app_config()
+// only finds one after a write that did not complete.
+static int write_atomic(const char *path, const char *data, size_t length)
 {
-    FILE *file;
+    char tmpPath[64], bkPath[64];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    snprintf(bkPath, sizeof(bkPath), "%s.bak", path);
 
-    open_app_config(&file, "w");
-    if (!file)
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror(tmpPath);
+        return -1;
+    }
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = write(fd, data + done, length - done);
+        if (n < 0)
+            break;
+        done += n;
+    }
+    if (done < length || fsync(fd))
+    {
+        perror(tmpPath);
+        close(fd);
+        unlink(tmpPath);
+        return -1;
+    }
+    close(fd);
+
+    // a hard link keeps the live file in place until the rename
+    unlink(bkPath);
+    if (link(path, bkPath))
+        perror(bkPath);
+    if (rename(tmpPath, path))
+    {
+        perror(path);
+        unlink(tmpPath);
+        unlink(bkPath);
+        return -1;
+    }
+
+    // the rename itself is durable once the directory is synced
+    char dir[64];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash)
+        *slash = '\0';
+    fd = open(slash ? dir : ".", O_RDONLY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+    unlink(bkPath);
+    return 0;
+}
+
+static int write_app_config(const struct AppConfig *config)
+{
+    const char *path = app_config_path();
+    if (!path)
+    {
         fprintf(stderr, "Can't open config file for writing\n");
+        return EXIT_FAILURE;
+    }
+
+    struct IniConfig ini;
+    memset(&ini, 0, sizeof(ini));
+    FILE *file = fopen(path, "r");
+    if (!open_config(&ini, &file))
+        return EXIT_FAILURE;
+    find_sections(&ini);
+
+    struct Setting settings[16];
+    int count = app_config_settings(config, settings);
+    size_t length;
+    char *data = apply_settings(&ini, settings, count, &length);
+    int ret = EXIT_FAILURE;
+    if (!data)
+        fprintf(stderr, "Cannot allocate memory for config file!\n");
+    // unchanged content is not written again
+    else if (length == strlen(ini.str) && !memcmp(data, ini.str, length))
+        ret = EXIT_SUCCESS;
+    else if (!write_atomic(path, data, length))
+        ret = EXIT_SUCCESS;
+    free(data);
+    close_config(&ini);
+    return ret;
+}
 
-    fprintf(file, "serial:\n");
-    fprintf(file, "  port: %s\n", app_config.port);
-    fprintf(file, "  baudrate: %d\n", app_config.baudrate);
-    fprintf(file, "  package_size: %d\n", app_config.package_size);
-    fprintf(file, "  watchdog: %d\n", app_config.watchdog);
+// Saves are deferred until no new one came in for SAVE_QUIET_MS, so a burst of
+// commands costs one write
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct AppConfig save_pending;
+static struct timespec save_requested;
+static bool save_dirty;
 
-    fclose(file);
+int save_app_config(void)
+{
+    pthread_mutex_lock(&save_lock);
+    save_pending = app_config;
+    save_dirty = true;
+    clock_gettime(CLOCK_MONOTONIC, &save_requested);
+    pthread_mutex_unlock(&save_lock);
     return EXIT_SUCCESS;
 }
 
+int flush_app_config(bool force)
+{
+    struct AppConfig config;
+    pthread_mutex_lock(&save_lock);
+    bool due = save_dirty && (force || stats_since_us(&save_requested) >= SAVE_QUIET_MS * 1000);
+    if (due)
+    {
+        config = save_pending;
+        save_dirty = false;
+    }
+    pthread_mutex_unlock(&save_lock);
+    if (!due)
+        return EXIT_SUCCESS;
+
+    int ret = write_app_config(&config);
+    if (ret != EXIT_SUCCESS)
+        fprintf(stderr, "Can't save config file\n");
+    return ret;
+}
+
+// [osdN] text, x, y and refresh, each key optional
+static enum ConfigError parse_osd_slots(struct IniConfig *ini)
+{
+    for (int i = 0; i < OSD_SLOTS; i++)
+    {
+        char section[8];
+        snprintf(section, sizeof(section), "osd%d", i);
+        const struct Param *text = find_param(ini, section, "text");
+        if (text && text->value_len >= (int)sizeof(app_config.osd_slots[i].text))
+        {
+            fprintf(stderr, "Can't parse param 'text' of %s, longer than %zu characters.\n", section,
+                    sizeof(app_config.osd_slots[i].text) - 1);
+            return CONFIG_PARAM_ISNT_IN_RANGE;
+        }
+        if (text)
+            parse_param_value(ini, section, "text", app_config.osd_slots[i].text);
+        if (parse_int(ini, section, "x", 0, SHRT_MAX, &app_config.osd_slots[i].x) == CONFIG_PARAM_ISNT_IN_RANGE ||
+            parse_int(ini, section, "y", 0, SHRT_MAX, &app_config.osd_slots[i].y) == CONFIG_PARAM_ISNT_IN_RANGE ||
+            parse_int(ini, section, "refresh", 0, 3600000, &app_config.osd_slots[i].refresh) ==
+                CONFIG_PARAM_ISNT_IN_RANGE)
+            return CONFIG_PARAM_ISNT_IN_RANGE;
+    }
+    return CONFIG_OK;
+}
+
 enum ConfigError parse_app_config(void)
 {
     memset(&app_config, 0, sizeof(struct AppConfig));
@@ -67,12 +414,28 @@ enum ConfigError parse_app_config(void)
     app_config.baudrate = 115200;
     app_config.package_size = 1024;
     app_config.watchdog = 0;
+    app_config.debug = false;
+    app_config.camera_id = -1;
+    app_config.osd_align = TEXT_LEFT;
+    app_config.osd_width = 0;
+    app_config.osd_color = DEF_COLOR;
+    app_config.osd_background = 0;
+    app_config.osd_outline = 0;
+    app_config.osd_format = PIXEL_FORMAT_1555;
+    app_config.osd_palette_size = 0;
+    for (int i = 0; i < OSD_SLOTS; i++)
+    {
+        app_config.osd_slots[i].x = DEF_POSX;
+        app_config.osd_slots[i].y = DEF_POSY + (DEF_SIZE * 3 / 2) * i;
+    }
+    strcpy(app_config.osd_slots[0].text, "$t");
+    app_config.osd_slots[0].refresh = DEF_REFRESH;
 
     struct IniConfig ini;
     memset(&ini, 0, sizeof(struct IniConfig));
 
-    FILE *file;
-    open_app_config(&file, "r");
+    const char *path = app_config_path();
+    FILE *file = path ? fopen(path, "r") : NULL;
     if (!open_config(&ini, &file))
     {
         // fprintf(stderr, "Can't find config divinus.yaml in: divinus.yaml, /etc/divinus.yaml\n");
@@ -84,7 +447,7 @@ enum ConfigError parse_app_config(void)
     err = parse_param_value(&ini, "serial", "port", app_config.port);
     if (err != CONFIG_OK)
         goto RET_ERR;
-    err = parse_int(&ini, "serial", "baudrate", 9600, 115200, &app_config.baudrate);
+    err = parse_int(&ini, "serial", "baudrate", 9600, 3000000, &app_config.baudrate);
     if (err != CONFIG_OK)
         goto RET_ERR;
     err = parse_int(&ini, "serial", "package_size", 512, 2048, &app_config.package_size);
@@ -93,9 +456,51 @@ enum ConfigError parse_app_config(void)
     err = parse_int(&ini, "serial", "watchdog", 0, INT_MAX, &app_config.watchdog);
     if (err != CONFIG_OK)
         goto RET_ERR;
-    free(ini.str);
+    parse_bool(&ini, "serial", "debug", &app_config.debug);
+    err = parse_int(&ini, "serial", "camera_id", 0, GROUP_ID - 1, &app_config.camera_id);
+    if (err == CONFIG_PARAM_ISNT_IN_RANGE)
+        goto RET_ERR;
+    // [osd] is optional, white unwrapped text by default
+    err = parse_enum(&ini, "osd", "align", &app_config.osd_align, osd_aligns, 3, TEXT_LEFT);
+    if (err == CONFIG_ENUM_INCORRECT_STRING)
+        goto RET_ERR;
+    if (app_config.osd_align < TEXT_LEFT || app_config.osd_align > TEXT_RIGHT)
+        app_config.osd_align = TEXT_LEFT;
+    err = parse_int(&ini, "osd", "width", 0, SHRT_MAX, &app_config.osd_width);
+    if (err == CONFIG_PARAM_ISNT_IN_RANGE)
+        goto RET_ERR;
+    err = parse_int(&ini, "osd", "color", 0, 0xFFFF, &app_config.osd_color);
+    if (err == CONFIG_PARAM_ISNT_IN_RANGE)
+        goto RET_ERR;
+    err = parse_int(&ini, "osd", "background", 0, 0xFFFF, &app_config.osd_background);
+    if (err == CONFIG_PARAM_ISNT_IN_RANGE)
+        goto RET_ERR;
+    err = parse_int(&ini, "osd", "outline", 0, 0xFFFF, &app_config.osd_outline);
+    if (err == CONFIG_PARAM_ISNT_IN_RANGE)
+        goto RET_ERR;
+    char format[64];
+    if (parse_param_value(&ini, "osd", "format", format) == CONFIG_OK)
+    {
+        size_t i = 0;
+        while (i < sizeof(osd_formats) / sizeof(*osd_formats) && strcasecmp(format, osd_formats[i].name))
+            i++;
+        if (i == sizeof(osd_formats) / sizeof(*osd_formats))
+        {
+            fprintf(stderr, "Can't parse param 'format' value '%s'. Expected argb1555, i4 or i2.\n", format);
+            err = CONFIG_ENUM_INCORRECT_STRING;
+            goto RET_ERR;
+        }
+        app_config.osd_format = osd_formats[i].format;
+    }
+    err = parse_palette(&ini);
+    if (err == CONFIG_PARAM_ISNT_NUMBER)
+        goto RET_ERR;
+    err = parse_osd_slots(&ini);
+    if (err != CONFIG_OK)
+        goto RET_ERR;
+    close_config(&ini);
     return CONFIG_OK;
 RET_ERR:
-    free(ini.str);
+    close_config(&ini);
     return err;
 }
@@ -2,22 +2,50 @@
 #define APP_CONFIG_H_
 #include "config.h"
 #include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#define OSD_SLOTS 4
+
 struct AppConfig
 {
     // [serial]
     char port[128];
     int baudrate;
     int package_size;
-    unsigned int watchdog;
+    int watchdog;
+    bool debug;
+    int camera_id; // -1 answers every frame (single camera link)
+
+    // [osd]
+    int osd_align; // enum TextAlign
+    int osd_width; // wrap width in pixels, 0 never wraps
+    int osd_color; // ARGB1555
+    int osd_background;
+    int osd_outline;
+    int osd_format;            // region pixel format, ARGB1555, I4 or I2
+    uint32_t osd_palette[16];  // ARGB8888 for I2 and I4, ramped from the colours when empty
+    int osd_palette_size;
+
+    // [osd0] .. [osd3], one per OSD slot, the first one is the timestamp
+    struct
+    {
+        char text[80]; // template, MOSD replaces or appends to it
+        int x, y;
+        int refresh; // ms between redraws, 0 redraws on updates only
+    } osd_slots[OSD_SLOTS];
 };
 
 extern struct AppConfig app_config;
 
 enum ConfigError parse_app_config(void);
 void restore_app_config(void);
+// Quiet time after the last save_app_config() before the file is written
+#define SAVE_QUIET_MS 1000
+
 int save_app_config(void);
+int flush_app_config(bool force);
 #endif
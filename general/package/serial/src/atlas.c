@@ -0,0 +1,170 @@
+#include "atlas.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct Atlas
+{
+    char font[PATH_MAX]; // font path the atlas was looked up for, kept when missing too
+    const unsigned char *map;
+    size_t length;
+};
+
+// Mappings stay for the life of the process, glyph caches point into them
+static struct Atlas atlases[MAX_ATLASES];
+
+static size_t stride_of(int bits, int width)
+{
+    return bits == 2 ? (width + 3) / 4 : width;
+}
+
+// Every record and bitmap has to lie inside the mapping, checked once here so
+// lookups can trust the file
+static bool atlas_valid(const unsigned char *map, size_t length)
+{
+    const struct AtlasHeader *header = (const void *)map;
+    if (length < sizeof(*header) || memcmp(header->magic, ATLAS_MAGIC, 4) || header->version != ATLAS_VERSION ||
+        (header->bits != 8 && header->bits != 2) || header->sizes > ATLAS_MAX_SIZES)
+        return false;
+
+    for (int i = 0; i < header->sizes; i++)
+    {
+        size_t offset = header->offsets[i];
+        if (offset % 8 || offset + sizeof(struct AtlasSize) > length)
+            return false;
+        const struct AtlasSize *size = (const void *)(map + offset);
+        size_t records = sizeof(*size) + (size_t)size->glyphs * sizeof(struct AtlasGlyph) +
+                         (size_t)size->kernings * sizeof(struct AtlasKerning);
+        if (size->glyphs > 0x110000 || size->kernings > 0x1000000 || offset + records > length)
+            return false;
+        const struct AtlasGlyph *glyph = (const void *)(size + 1);
+        for (uint32_t k = 0; k < size->glyphs; k++, glyph++)
+        {
+            // bitmap is from the file, offset + bitmap could wrap a 32-bit size_t
+            size_t bytes = stride_of(header->bits, glyph->minWidth) * glyph->minHeight;
+            if (glyph->bitmap > length - offset || bytes > length - offset - glyph->bitmap)
+                return false;
+        }
+    }
+    return true;
+}
+
+static const unsigned char *atlas_open(const char *font, size_t *length)
+{
+    char path[PATH_MAX];
+    const char *dot = strrchr(font, '.');
+    const char *slash = strrchr(font, '/');
+    int stem = dot && (!slash || dot > slash) ? (int)(dot - font) : (int)strlen(font);
+    if (snprintf(path, sizeof(path), "%.*s.atlas", stem, font) >= (int)sizeof(path))
+        return NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    const unsigned char *map = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
+    }
+    close(fd);
+    if (map && !atlas_valid(map, st.st_size))
+    {
+        fprintf(stderr, "Ignoring malformed glyph atlas %s\n", path);
+        munmap((void *)map, st.st_size);
+        map = NULL;
+    }
+    *length = map ? st.st_size : 0;
+    return map;
+}
+
+// Baked glyphs of font at size, NULL when the font has no atlas or the atlas
+// lacks the size. Past MAX_ATLASES distinct fonts the rest render from TTF.
+const struct AtlasSize *atlas_find(const char *font, double size)
+{
+    struct Atlas *atlas = NULL;
+    for (int i = 0; i < MAX_ATLASES && !atlas; i++)
+    {
+        if (!atlases[i].font[0])
+        {
+            atlas = &atlases[i];
+            strncpy(atlas->font, font, sizeof(atlas->font) - 1);
+            atlas->map = atlas_open(font, &atlas->length);
+        }
+        else if (!strcmp(atlases[i].font, font))
+            atlas = &atlases[i];
+    }
+    if (!atlas || !atlas->map)
+        return NULL;
+
+    const struct AtlasHeader *header = (const void *)atlas->map;
+    for (int i = 0; i < header->sizes; i++)
+    {
+        const struct AtlasSize *baked = (const void *)(atlas->map + header->offsets[i]);
+        if (baked->size == size)
+            return baked;
+    }
+    return NULL;
+}
+
+static int compare_glyph(const void *key, const void *element)
+{
+    uint32_t codepoint = *(const uint32_t *)key;
+    const struct AtlasGlyph *glyph = element;
+    return codepoint < glyph->codepoint ? -1 : codepoint > glyph->codepoint;
+}
+
+const struct AtlasGlyph *atlas_glyph(const struct AtlasSize *size, uint32_t codepoint)
+{
+    return bsearch(&codepoint, size + 1, size->glyphs, sizeof(struct AtlasGlyph), compare_glyph);
+}
+
+static int compare_kerning(const void *key, const void *element)
+{
+    const uint32_t *pair = key;
+    const struct AtlasKerning *kerning = element;
+    if (pair[0] != kerning->left)
+        return pair[0] < kerning->left ? -1 : 1;
+    return pair[1] < kerning->right ? -1 : pair[1] > kerning->right;
+}
+
+// Returns -1 when either codepoint was not baked and the font has to answer,
+// pairs without kerning are not stored and read as a zero shift
+int atlas_kerning(const struct AtlasSize *size, uint32_t left, uint32_t right, double *xShift)
+{
+    if (!atlas_glyph(size, left) || !atlas_glyph(size, right))
+        return -1;
+    const uint32_t pair[2] = {left, right};
+    const struct AtlasGlyph *glyphs = (const void *)(size + 1);
+    const struct AtlasKerning *kerning =
+        bsearch(pair, glyphs + size->glyphs, size->kernings, sizeof(struct AtlasKerning), compare_kerning);
+    *xShift = kerning ? kerning->xShift : 0.0;
+    return 0;
+}
+
+int atlas_bits(const struct AtlasSize *size)
+{
+    const unsigned char *p = (const void *)size;
+    for (int i = 0; i < MAX_ATLASES; i++)
+        if (atlases[i].map && p >= atlases[i].map && p < atlases[i].map + atlases[i].length)
+            return ((const struct AtlasHeader *)atlases[i].map)->bits;
+    return 0;
+}
+
+const unsigned char *atlas_bitmap(const struct AtlasSize *size, const struct AtlasGlyph *glyph)
+{
+    return (const unsigned char *)size + glyph->bitmap;
+}
+
+int atlas_stride(const struct AtlasSize *size, const struct AtlasGlyph *glyph)
+{
+    return stride_of(atlas_bits(size), glyph->minWidth);
+}
@@ -0,0 +1,56 @@
+#ifndef ATLAS_H_
+#define ATLAS_H_
+#include <stdint.h>
+
+// Pre-rendered glyphs baked by mkatlas, found next to the font as <font>.atlas
+// (DejaVuSans.ttf -> DejaVuSans.atlas) and mapped read-only. All fields are
+// little-endian, records are 8-byte aligned and offsets are relative to the
+// AtlasSize they belong to, so a glyph costs no parsing or allocation at startup.
+#define ATLAS_MAGIC "GATL"
+#define ATLAS_VERSION 1
+#define ATLAS_MAX_SIZES 8
+#define MAX_ATLASES 4
+
+struct AtlasHeader
+{
+    char magic[4];
+    uint16_t version;
+    uint8_t bits; // 8: one alpha byte per pixel, 2: four pixels per byte (I2 levels 0, 85, 170, 255)
+    uint8_t sizes;
+    uint32_t offsets[ATLAS_MAX_SIZES]; // of each AtlasSize from the file start
+};
+
+// Followed by glyphs AtlasGlyph sorted by codepoint, then kernings AtlasKerning
+// sorted by (left, right), then the bitmaps
+struct AtlasSize
+{
+    double size;
+    double ascender, descender, lineGap;
+    uint32_t glyphs;
+    uint32_t kernings;
+};
+
+struct AtlasGlyph
+{
+    uint32_t codepoint;
+    uint32_t gid; // glyph id in the font, kerning against TTF glyphs stays valid
+    double advanceWidth, leftSideBearing;
+    int32_t yOffset;
+    uint16_t minWidth, minHeight;
+    uint32_t bitmap; // rows are whole bytes, minHeight * stride
+    uint32_t reserved;
+};
+
+struct AtlasKerning
+{
+    uint32_t left, right; // codepoints
+    double xShift;
+};
+
+const struct AtlasSize *atlas_find(const char *font, double size);
+const struct AtlasGlyph *atlas_glyph(const struct AtlasSize *size, uint32_t codepoint);
+int atlas_kerning(const struct AtlasSize *size, uint32_t left, uint32_t right, double *xShift);
+int atlas_bits(const struct AtlasSize *size);
+const unsigned char *atlas_bitmap(const struct AtlasSize *size, const struct AtlasGlyph *glyph);
+int atlas_stride(const struct AtlasSize *size, const struct AtlasGlyph *glyph);
+#endif
@@ -18,6 +18,7 @@
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <sys/types.h>
 
 #ifdef __cplusplus
@@ -35,6 +36,7 @@ extern "C"
 #define PIXEL_FORMAT_4444 E_MI_RGN_PIXEL_FORMAT_ARGB4444
 #define PIXEL_FORMAT_1555 E_MI_RGN_PIXEL_FORMAT_ARGB1555
 #define PIXEL_FORMAT_2BPP E_MI_RGN_PIXEL_FORMAT_I2
+#define PIXEL_FORMAT_4BPP E_MI_RGN_PIXEL_FORMAT_I4
 #define PIXEL_FORMAT_8888 E_MI_RGN_PIXEL_FORMAT_ARGB8888
 
 #ifndef DIV_UP
@@ -59,7 +61,10 @@ extern "C"
     {
         double size;
         int hand, color;
+        int background, outline; // ARGB1555, 0 for none
+        int refresh;             // ms between redraws, 0 redraws on updates only
         short opal, posx, posy;
+        short align, width; // of the lines, wrap width in pixels (0 never wraps)
         char updt;
         char font[32];
         char text[80];
@@ -78,69 +83,12 @@ extern "C"
         short width, height;
     } RECT;
 
-    int sysinfo(struct sysinfo *);
-
-    static void fatal(const char *message)
+    static inline void fatal(const char *message)
     {
         fprintf(stderr, "%s\n", message);
         exit(1);
     }
 
-#ifdef SUPP_UTF32
-    static int utf8_to_utf32(const uint8_t *utf8, uint32_t *utf32, int max)
-    {
-        unsigned int c;
-        int i = 0;
-        --max;
-        while (*utf8)
-        {
-            if (i >= max)
-                return 0;
-            if (!(*utf8 & 0x80U))
-            {
-                utf32[i++] = *utf8++;
-            }
-            else if ((*utf8 & 0xe0U) == 0xc0U)
-            {
-                c = (*utf8++ & 0x1fU) << 6;
-                if ((*utf8 & 0xc0U) != 0x80U)
-                    return 0;
-                utf32[i++] = c + (*utf8++ & 0x3fU);
-            }
-            else if ((*utf8 & 0xf0U) == 0xe0U)
-            {
-                c = (*utf8++ & 0x0fU) << 12;
-                if ((*utf8 & 0xc0U) != 0x80U)
-                    return 0;
-                c += (*utf8++ & 0x3fU) << 6;
-                if ((*utf8 & 0xc0U) != 0x80U)
-                    return 0;
-                utf32[i++] = c + (*utf8++ & 0x3fU);
-            }
-            else if ((*utf8 & 0xf8U) == 0xf0U)
-            {
-                c = (*utf8++ & 0x07U) << 18;
-                if ((*utf8 & 0xc0U) != 0x80U)
-                    return 0;
-                c += (*utf8++ & 0x3fU) << 12;
-                if ((*utf8 & 0xc0U) != 0x80U)
-                    return 0;
-                c += (*utf8++ & 0x3fU) << 6;
-                if ((*utf8 & 0xc0U) != 0x80U)
-                    return 0;
-                c += (*utf8++ & 0x3fU);
-                if ((c & 0xFFFFF800U) == 0xD800U)
-                    return 0;
-                utf32[i++] = c;
-            }
-            else
-                return 0;
-        }
-        utf32[i] = 0;
-        return i;
-    }
-#endif
-
 #ifdef __cplusplus
 #if __cplusplus
 }
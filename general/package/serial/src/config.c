@@ -1,95 +1,228 @@
 #include "config.h"
+#include <ctype.h>
 
-enum ConfigError find_sections(struct IniConfig *ini)
+// Grows one of the tables by half, false when out of memory
+static bool grow(void **table, int count, int *capacity, size_t size)
 {
-    for (unsigned int i = 0; i < MAX_SECTIONS; ++i)
-        ini->sections[i].pos = -1;
+    if (count < *capacity)
+        return true;
+    int more = *capacity ? *capacity * 3 / 2 : 16;
+    void *bigger = realloc(*table, more * size);
+    if (!bigger)
+        return false;
+    *table = bigger;
+    *capacity = more;
+    return true;
+}
 
-    regex_t regex;
-    if (compile_regex(&regex, REG_SECTION) < 0)
-    {
-        fprintf(stderr, "Error compiling regex!\n");
-        return CONFIG_REGEX_ERROR;
-    };
+static int compare_span(const char *str, int a, int a_len, const char *b, int b_len)
+{
+    int res = strncasecmp(str + a, b, a_len < b_len ? a_len : b_len);
+    return res ? res : a_len - b_len;
+}
 
-    size_t n_matches = 4;
-    regmatch_t m[n_matches];
+// FNV-1a over the lowercased key, seeded with its section
+static unsigned int hash_key(int section, const char *key, int key_len)
+{
+    unsigned int hash = 2166136261u ^ (unsigned int)section;
+    for (int i = 0; i < key_len; i++)
+        hash = (hash ^ (unsigned char)tolower((unsigned char)key[i])) * 16777619u;
+    return hash;
+}
 
-    int section_pos = 0;
-    int section_index = 0;
-    while (1)
+// The param of section by key, NULL when missing
+static const struct Param *lookup(const struct IniConfig *ini, int section, const char *key, int key_len)
+{
+    if (!ini->index_size)
+        return NULL;
+    unsigned int mask = ini->index_size - 1;
+    for (unsigned int slot = hash_key(section, key, key_len) & mask; ini->index[slot]; slot = (slot + 1) & mask)
     {
-        if (section_index >= MAX_SECTIONS)
-            break;
-        int match = regexec(&regex, ini->str + section_pos, n_matches, m, 0);
-        if (match != 0)
-            break;
-
-        int i = 2;
-        if (m[i].rm_eo - m[i].rm_so == 0)
-            i++;
-        int len = sprintf(ini->sections[section_index].name, "%.*s", (int)(m[i].rm_eo - m[i].rm_so),
-                          ini->str + section_pos + m[i].rm_so);
-        ini->sections[section_index].name[len] = 0;
-        section_pos = section_pos + (int)m[1].rm_eo;
-        ini->sections[section_index].pos = section_pos;
-        section_index++;
+        const struct Param *p = &ini->params[ini->index[slot] - 1];
+        if (p->section == section && !compare_span(ini->str, p->key, p->key_len, key, key_len))
+            return p;
     }
+    return NULL;
+}
 
-    regfree(&regex);
-    return CONFIG_OK;
+// Indexes the params in file order so the first occurrence of a key wins
+static bool build_index(struct IniConfig *ini)
+{
+    int size = 16;
+    while (size < ini->param_count * 2)
+        size *= 2;
+    ini->index = calloc(size, sizeof(*ini->index));
+    if (!ini->index)
+        return false;
+    ini->index_size = size;
+    for (int i = 0; i < ini->param_count; i++)
+    {
+        const struct Param *p = &ini->params[i];
+        if (lookup(ini, p->section, ini->str + p->key, p->key_len))
+            continue;
+        unsigned int slot = hash_key(p->section, ini->str + p->key, p->key_len) & (size - 1);
+        while (ini->index[slot])
+            slot = (slot + 1) & (size - 1);
+        ini->index[slot] = i + 1;
+    }
+    return true;
 }
 
-enum ConfigError section_pos(struct IniConfig *ini, const char *section, int *start_pos, int *end_pos)
+static bool is_blank(char c)
 {
-    for (unsigned int i = 0; i < MAX_SECTIONS; ++i)
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+enum ConfigError find_sections(struct IniConfig *ini)
+{
+    int section_capacity = 0, param_capacity = 0, current = -1;
+    bool yaml = false; // the current section is a "name:" block
+    const char *str = ini->str;
+    ini->section_count = ini->param_count = 0;
+
+    for (int line = 0; str[line];)
     {
-        if (ini->sections[i].pos > 0 && strcasecmp(ini->sections[i].name, section) == 0)
+        int next = line;
+        while (str[next] && str[next] != '\n')
+            next++;
+        int eol = next;
+        if (str[next])
+            next++;
+
+        int p = line;
+        while (p < eol && is_blank(str[p]))
+            p++;
+        bool indented = p > line;
+        const char *name = NULL;
+        int name_len = 0;
+
+        if (p == eol || str[p] == '#' || str[p] == ';')
+        {
+            line = next;
+            continue;
+        }
+        if (str[p] == '[')
+        {
+            // [section]
+            int close = p + 1;
+            while (close < eol && str[close] != ']')
+                close++;
+            if (close < eol && close > p + 1)
+                name = str + p + 1, name_len = close - p - 1, yaml = false;
+        }
+        else
         {
-            *start_pos = ini->sections[i].pos;
-            if (i + 1 < MAX_SECTIONS && ini->sections[i + i].pos > 0)
-                *end_pos = ini->sections[i + 1].pos;
-            else
+            // key = value or key: value
+            int key = p;
+            while (p < eol && !is_blank(str[p]) && str[p] != ':' && str[p] != '=')
+                p++;
+            int key_len = p - key;
+            while (p < eol && is_blank(str[p]))
+                p++;
+            if (!key_len || p == eol || (str[p] != ':' && str[p] != '='))
             {
-                *end_pos = -1;
+                line = next;
+                continue;
+            }
+            char separator = str[p++];
+            while (p < eol && is_blank(str[p]))
+                p++;
+            int value = p;
+            bool quoted = p < eol && str[p] == '"';
+            if (quoted)
+                // spaces and comment characters are part of a quoted value
+                for (value = ++p; p < eol && str[p] != '"'; p++)
+                    ;
+            else if (p < eol)
+                for (p++; p < eol && !isspace(str[p]) && str[p] != ';' && str[p] != '#'; p++)
+                    ;
+            bool empty = !quoted && (value == eol || str[value] == '#' || str[value] == ';');
+
+            if (!indented && separator == ':' && empty)
+                name = str + key, name_len = key_len, yaml = true;
+            else if (!empty)
+            {
+                // a top-level YAML key closes the block above it
+                if (!indented && separator == ':' && yaml && current >= 0)
+                {
+                    ini->sections[current].end = line;
+                    current = -1;
+                }
+                if (!grow((void **)&ini->params, ini->param_count, &param_capacity, sizeof(*ini->params)))
+                    goto oom;
+                ini->params[ini->param_count++] = (struct Param){
+                    .section = current, .key = key, .key_len = key_len, .value = value, .value_len = p - value};
             }
-            return CONFIG_OK;
         }
+
+        if (name)
+        {
+            if (!grow((void **)&ini->sections, ini->section_count, &section_capacity, sizeof(*ini->sections)))
+                goto oom;
+            if (current >= 0)
+                ini->sections[current].end = line;
+            current = ini->section_count++;
+            struct Section *section = &ini->sections[current];
+            snprintf(section->name, sizeof(section->name), "%.*s", name_len, name);
+            section->pos = next;
+            section->end = -1;
+        }
+        line = next;
     }
 
+    if (!build_index(ini))
+        goto oom;
+    return CONFIG_OK;
+
+oom:
+    fprintf(stderr, "Cannot allocate memory for config file!\n");
+    ini->section_count = ini->param_count = ini->index_size = 0;
     return CONFIG_SECTION_NOT_FOUND;
 }
 
-enum ConfigError parse_param_value(struct IniConfig *ini, const char *section, const char *param_name,
-                                   char *param_value)
+static int find_section(struct IniConfig *ini, const char *section)
+{
+    for (int i = 0; i < ini->section_count; ++i)
+        if (strcasecmp(ini->sections[i].name, section) == 0)
+            return i;
+    return -1;
+}
+
+enum ConfigError section_pos(struct IniConfig *ini, const char *section, int *start_pos, int *end_pos)
 {
-    int start_pos = 0;
-    int end_pos = 0;
+    int found = find_section(ini, section);
+    if (found < 0)
+        return CONFIG_SECTION_NOT_FOUND;
+    *start_pos = ini->sections[found].pos;
+    *end_pos = ini->sections[found].end;
+    return CONFIG_OK;
+}
+
+// The first param_name of section (of the whole file when empty), NULL when missing
+const struct Param *find_param(struct IniConfig *ini, const char *section, const char *param_name)
+{
+    int name_len = strlen(param_name);
     if (strlen(section) > 0)
     {
-        enum ConfigError err = section_pos(ini, section, &start_pos, &end_pos);
-        if (err != CONFIG_OK)
-            return err;
+        int found = find_section(ini, section);
+        return found < 0 ? NULL : lookup(ini, found, param_name, name_len);
     }
+    for (int i = 0; i < ini->param_count; i++)
+        if (!compare_span(ini->str, ini->params[i].key, ini->params[i].key_len, param_name, name_len))
+            return &ini->params[i];
+    return NULL;
+}
 
-    regex_t regex;
-    char reg_buf[128];
-    ssize_t reg_buf_len = sprintf(reg_buf, REG_PARAM, param_name);
-    reg_buf[reg_buf_len] = 0;
-    if (compile_regex(&regex, reg_buf) < 0)
-    {
-        fprintf(stderr, "Error compiling regex!\n");
-        return CONFIG_REGEX_ERROR;
-    };
-
-    size_t n_matches = 2;
-    regmatch_t m[n_matches];
-    int match = regexec(&regex, ini->str + start_pos, n_matches, m, 0);
-    regfree(&regex);
-    if (match > 0 || (end_pos >= 0 && end_pos - start_pos < m[1].rm_so))
+enum ConfigError parse_param_value(struct IniConfig *ini, const char *section, const char *param_name,
+                                   char *param_value)
+{
+    if (strlen(section) > 0 && find_section(ini, section) < 0)
+        return CONFIG_SECTION_NOT_FOUND;
+    const struct Param *param = find_param(ini, section, param_name);
+    if (!param)
         return CONFIG_PARAM_NOT_FOUND;
 
-    int res = sprintf(param_value, "%.*s", (int)(m[1].rm_eo - m[1].rm_so), ini->str + start_pos + m[1].rm_so);
+    int res = sprintf(param_value, "%.*s", param->value_len, ini->str + param->value);
     param_value[res] = 0;
     return CONFIG_OK;
 }
@@ -118,7 +251,7 @@ enum ConfigError parse_enum(struct IniConfig *ini, const char *section, const ch
     }
 
     // try to find value in possible values
-    for (unsigned int i = 0; i < possible_values_count; ++i)
+    for (int i = 0; i < possible_values_count; ++i)
         if (strcasecmp(param_value, possible_values[i]) == 0)
         {
             *(int *)enum_value = possible_values_offset + i;
@@ -130,7 +263,7 @@ enum ConfigError parse_enum(struct IniConfig *ini, const char *section, const ch
             "Can't parse param '%s' value '%s'. Is not a number and is not in "
             "possible values: ",
             param_name, param_value);
-    for (unsigned int i = 0; i < possible_values_count; ++i)
+    for (int i = 0; i < possible_values_count; ++i)
         printf("'%s', ", possible_values[i]);
     return CONFIG_ENUM_INCORRECT_STRING;
 }
@@ -322,3 +455,12 @@ bool open_config(struct IniConfig *ini, FILE **file)
 
     return true;
 }
+
+void close_config(struct IniConfig *ini)
+{
+    free(ini->str);
+    free(ini->sections);
+    free(ini->params);
+    free(ini->index);
+    memset(ini, 0, sizeof(*ini));
+}
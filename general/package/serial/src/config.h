@@ -6,18 +6,25 @@
 
 #include "tools.h"
 
-#define MAX_SECTIONS 3
-#define REG_SECTION "^([[:space:]]*\\[(\\w+)\\][[:space:]]|(\\w+):)"
-#define REG_PARAM "^[[:space:]]*%s[[:space:]]*[=:][[:space:]]*(.[^[:space:];#]*)"
-
+// find_sections() tokenizes the file once into sections ("[name]" or a bare
+// "name:" at the start of a line) and key/value spans, parse_* look keys up in
+// that table. Values end at whitespace, ';' or '#' like they always did, a
+// value in double quotes runs to the closing quote.
 struct IniConfig
 {
     char *str;
     struct Section
     {
         char name[64];
-        int pos;
-    } sections[MAX_SECTIONS];
+        int pos, end; // of the body, end is -1 for the last section
+    } *sections;
+    struct Param
+    {
+        int section; // -1 before the first section or after a top-level key
+        int key, key_len, value, value_len;
+    } *params;
+    int *index; // open addressing over params (slot holds param + 1)
+    int section_count, param_count, index_size;
 };
 
 enum ConfigError
@@ -35,8 +42,10 @@ enum ConfigError
 };
 
 bool open_config(struct IniConfig *ini, FILE **file);
+void close_config(struct IniConfig *ini);
 enum ConfigError find_sections(struct IniConfig *ini);
 enum ConfigError section_pos(struct IniConfig *ini, const char *section, int *start_pos, int *end_pos);
+const struct Param *find_param(struct IniConfig *ini, const char *section, const char *param_name);
 enum ConfigError parse_param_value(struct IniConfig *ini, const char *section, const char *param_name,
                                    char *param_value);
 enum ConfigError parse_enum(struct IniConfig *ini, const char *section, const char *param_name, void *enum_value,
@@ -0,0 +1,68 @@
+#include "crc.h"
+#include <pthread.h>
+
+// Both kernels consume 8 bytes per iteration from 8 derived tables (slicing-by-8),
+// the 16 KiB of tables are built once on first use
+static uint16_t crc16_table[8][256];
+static uint32_t crc32_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint16_t c16 = i << 8;
+        uint32_t c32 = i;
+        for (int k = 0; k < 8; k++)
+        {
+            c16 = (c16 & 0x8000) ? (c16 << 1) ^ 0x1021 : c16 << 1;
+            c32 = (c32 & 1) ? (c32 >> 1) ^ 0xEDB88320 : c32 >> 1;
+        }
+        crc16_table[0][i] = c16;
+        crc32_table[0][i] = c32;
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        for (int t = 1; t < 8; t++)
+        {
+            uint16_t c16 = crc16_table[t - 1][i];
+            uint32_t c32 = crc32_table[t - 1][i];
+            crc16_table[t][i] = (c16 << 8) ^ crc16_table[0][c16 >> 8];
+            crc32_table[t][i] = (c32 >> 8) ^ crc32_table[0][c32 & 0xFF];
+        }
+    }
+}
+
+uint16_t crc16_ccitt(uint16_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    pthread_once(&crc_once, crc_init);
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        crc = crc16_table[7][p[0] ^ (crc >> 8)] ^ crc16_table[6][p[1] ^ (crc & 0xFF)] ^ crc16_table[5][p[2]] ^
+              crc16_table[4][p[3]] ^ crc16_table[3][p[4]] ^ crc16_table[2][p[5]] ^ crc16_table[1][p[6]] ^
+              crc16_table[0][p[7]];
+    }
+    while (len--)
+        crc = (crc << 8) ^ crc16_table[0][(crc >> 8) ^ *p++];
+    return crc;
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    pthread_once(&crc_once, crc_init);
+    crc = ~crc;
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        uint32_t one = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = crc32_table[7][one & 0xFF] ^ crc32_table[6][(one >> 8) & 0xFF] ^ crc32_table[5][(one >> 16) & 0xFF] ^
+              crc32_table[4][one >> 24] ^ crc32_table[3][p[4]] ^ crc32_table[2][p[5]] ^ crc32_table[1][p[6]] ^
+              crc32_table[0][p[7]];
+    }
+    while (len--)
+        crc = (crc >> 8) ^ crc32_table[0][(crc ^ *p++) & 0xFF];
+    return ~crc;
+}
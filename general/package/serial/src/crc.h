@@ -0,0 +1,13 @@
+#ifndef CRC_H_
+#define CRC_H_
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC16_INIT 0xFFFF
+#define CRC32_INIT 0
+
+// CRC-16/CCITT-FALSE (poly 0x1021, MSB first), chain by passing the previous result
+uint16_t crc16_ccitt(uint16_t crc, const void *data, size_t len);
+// CRC-32/ISO-HDLC as used by zlib, chain by passing the previous result
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+#endif
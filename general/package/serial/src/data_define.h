@@ -14,6 +14,17 @@ enum
     ACK_4 = 0x04,
     ACK_5 = 0x05,
     ACK_7 = 0x07,
+    ACK_9 = 0x09,
+    ACK_11 = 0x0B,
+    ACK_15 = 0x0F,
+};
+
+// NEXT_FILE transfer option flags, bit 1 stays clear so the byte never reads as END
+enum TransferFlag
+{
+    FLAG_CRC = 0x01,     // CRC-16/CCITT per package, CRC-32 of the file in the ack
+    FLAG_SESSION = 0x04, // session id, 32-bit file size and CRC-32 in the ack
+    FLAG_VARIANT = 0x30, // enum TransferVariant << 4: raw, EXIF thumbnail or LZ4
 };
 
 enum Mark
@@ -36,13 +47,54 @@ enum CommandSpecifier
     NEXT_FILE = 0x4D,
     GET_SPEC_PACKAGE = 0x45,
     SEND_SPEC_DATA_PACKAGE = 0x46,
+    GET_WINDOW = 0x57,
+    RETRANSMIT = 0x52,
+    GET_SESSION_PACKAGE = 0x47,
+    SESSION_DATA_PACKAGE = 0x48,
     BAUD_RATE = 0x49,
     MOSD = 0x4F,
     STATUS = 0x53,
     RTC = 0x54,
+    UPGRADE_BEGIN = 0x42,
+    UPGRADE_COMMIT = 0x43,
+    UPGRADE_DATA = 0x44,
     NONE = 0x63
 };
 
+// Largest number of packages streamed back-to-back by GET_WINDOW, also the
+// width of the RETRANSMIT NACK bitmap
+#define MAX_WINDOW 32
+
+// Sessions: NEXT_FILE with FLAG_SESSION answers START, cmd, camera, HH, MM, session,
+// file size (4 bytes), CRC-32 (4 bytes), END. GET_SESSION_PACKAGE (START, cmd, camera,
+// session, index (4 bytes, 0-based), count, END) streams SESSION_DATA_PACKAGE frames
+// headed by the session and the 32-bit index. An unknown session answers NONE, the
+// host then repeats NEXT_FILE and, when the CRC-32 still matches, resumes at its index.
+
+// Upgrades: UPGRADE_BEGIN (START, cmd, camera, image size (4 bytes), END) opens an upload,
+// UPGRADE_DATA (START, cmd, camera, offset (4 bytes), length (2 bytes), CRC-16 of the data,
+// data, END) carries up to UPGRADE_CHUNK bytes of it and UPGRADE_COMMIT (START, cmd, camera,
+// END) verifies and installs it. Every ack is START, cmd, camera, enum UpgradeStatus, next
+// offset expected (4 bytes), END: chunks may be pipelined, the host rewinds to that offset
+// after a CRC error or a gap. A committed upgrade restarts the daemon after the ack.
+// They run on the serial thread to keep the chunks in order: each one is hashed, patched
+// and written to flash before its ack and COMMIT checks the signature inline, so frames
+// queued behind an upgrade frame wait for it. Upload while the bus is otherwise quiet.
+#define UPGRADE_CHUNK 2048
+
+// Multi-drop addressing, see serial.camera_id in serial.yaml
+#define BROADCAST_ID 0xFF  // RTC and MOSD for every camera, nobody replies
+#define GROUP_ID 0xFE      // STATUS poll, each camera replies in slot camera_id
+#define STATUS_SLOT_MS 20
+
+enum Addressing
+{
+    ADDRESSED,
+    BROADCAST,
+    GROUP,
+    OTHER,
+};
+
 enum BaudRate
 {
     BAUD_9600 = 0x30,
@@ -50,9 +102,30 @@ enum BaudRate
     BAUD_38400 = 0x32,
     BAUD_57600 = 0x33,
     BAUD_115200 = 0x34,
+    BAUD_230400 = 0x35,
+    BAUD_460800 = 0x36,
+    BAUD_921600 = 0x37,
+    BAUD_1000000 = 0x38,
+    BAUD_1500000 = 0x39,
+    BAUD_2000000 = 0x3A,
+    BAUD_3000000 = 0x3B,
     DEFAULT_BAUD = 0x34
 };
 
+// BAUD_RATE option flags, the legacy frame without flags persists the rate
+enum BaudFlag
+{
+    BAUD_PERSIST = 0x01,
+};
+
+// Time the host gets to send a frame at the new rate before the daemon falls back
+#define BAUD_CONFIRM_MS 2000
+
+// MOSD position byte
+#define POSITION_TOP 'T'    // appended to the template of slot 0, the timestamp
+#define POSITION_BOTTOM 'B' // replaces the text of slot 1
+#define POSITION_SLOT '0'   // '0' + N replaces the template of slot N
+
 struct OsdContent
 {
     char position;
@@ -98,6 +171,9 @@ struct AckFrame
     char optional;
     char end;
     int len;
+    char session;
+    unsigned int size;
+    unsigned int crc;
 };
 
 struct DataFrame
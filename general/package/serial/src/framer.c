@@ -0,0 +1,140 @@
+#include "framer.h"
+#include "data_define.h"
+#include <stdio.h>
+#include <string.h>
+
+static long elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// Length of the frame starting at p: >0 complete length, 0 more bytes needed,
+// -1 unknown command. Lengths are those of START..END without the optional CRLF.
+static int frame_length(const unsigned char *p, size_t available)
+{
+    if (available < 2)
+        return 0;
+    switch (p[1])
+    {
+    case LIST_FILE:
+        return 9;
+    case NEXT_FILE:
+        // legacy 10-byte form or 11 bytes with a trailing flags byte
+        if (available < 10)
+            return 0;
+        return p[9] == END ? 10 : 11;
+    case GET_SPEC_PACKAGE:
+    case SEND_SPEC_DATA_PACKAGE:
+        return 7;
+    case GET_WINDOW:
+        return 8;
+    case RETRANSMIT:
+        return 11;
+    case GET_SESSION_PACKAGE:
+        return 10;
+    case BAUD_RATE:
+        // legacy 5-byte form or 6 bytes with a trailing flags byte
+        if (available < 5)
+            return 0;
+        return p[4] == END ? 5 : 6;
+    case MOSD:
+        if (available < 5)
+            return 0;
+        return 6 + p[4];
+    case RTC:
+        return 8;
+    case STATUS:
+        // legacy 4-byte poll or 5 bytes with a selector such as STATUS_METRICS
+        if (available < 4)
+            return 0;
+        return p[3] == END ? 4 : 5;
+    case UPGRADE_COMMIT:
+        return 4;
+    case UPGRADE_BEGIN:
+        return 8;
+    case UPGRADE_DATA:
+    {
+        if (available < 9)
+            return 0;
+        int length = p[7] << 8 | p[8];
+        return length > UPGRADE_CHUNK ? -1 : 12 + length;
+    }
+    default:
+        return -1;
+    }
+}
+
+void framer_reset(struct Framer *framer)
+{
+    framer->head = framer->tail = 0;
+}
+
+unsigned char *framer_space(struct Framer *framer, size_t *available)
+{
+    // Only a partial frame is ever left behind, move it to the front
+    if (framer->head == framer->tail)
+        framer->head = framer->tail = 0;
+    else if (framer->head > 0 && framer->tail == RX_BUFFER_SIZE)
+    {
+        memmove(framer->buffer, framer->buffer + framer->head, framer->tail - framer->head);
+        framer->tail -= framer->head;
+        framer->head = 0;
+    }
+    *available = RX_BUFFER_SIZE - framer->tail;
+    return framer->buffer + framer->tail;
+}
+
+void framer_commit(struct Framer *framer, size_t length)
+{
+    if (framer->head == framer->tail && length)
+        clock_gettime(CLOCK_MONOTONIC, &framer->started);
+    framer->tail += length;
+}
+
+// Hand every complete frame to the handler in place, returns the number of frames
+int framer_dispatch(struct Framer *framer, frame_handler handler, void *user)
+{
+    int frames = 0;
+
+    while (framer->head < framer->tail)
+    {
+        unsigned char *p = framer->buffer + framer->head;
+        size_t available = framer->tail - framer->head;
+
+        // Skip line terminators and noise between frames
+        if (*p != START)
+        {
+            unsigned char *next = memchr(p, START, available);
+            framer->head = next ? (size_t)(next - framer->buffer) : framer->tail;
+            continue;
+        }
+
+        int length = frame_length(p, available);
+        if (length == 0 || (length > 0 && (size_t)length > available))
+            break;
+        if (length < 0 || p[length - 1] != END)
+        {
+            // Not a frame start after all, resynchronise on the next marker
+            framer->head++;
+            continue;
+        }
+
+        framer->head += length;
+        clock_gettime(CLOCK_MONOTONIC, &framer->started);
+        handler((char *)p, length, user);
+        frames++;
+    }
+    return frames;
+}
+
+// Drop a partial frame that stalled on the line
+void framer_expire(struct Framer *framer)
+{
+    if (framer->head == framer->tail || elapsed_ms(&framer->started) < FRAME_TIMEOUT_MS)
+        return;
+    fprintf(stderr, "Dropping %zu bytes of incomplete frame\n", framer->tail - framer->head);
+    framer->head++;
+    clock_gettime(CLOCK_MONOTONIC, &framer->started);
+}
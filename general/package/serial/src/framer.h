@@ -0,0 +1,23 @@
+#ifndef FRAMER_H_
+#define FRAMER_H_
+#include <stddef.h>
+#include <time.h>
+
+#define RX_BUFFER_SIZE 4096
+#define FRAME_TIMEOUT_MS 500
+
+struct Framer
+{
+    unsigned char buffer[RX_BUFFER_SIZE];
+    size_t head, tail;
+    struct timespec started; // first byte of the pending partial frame
+};
+
+typedef void (*frame_handler)(char *frame, size_t length, void *user);
+
+void framer_reset(struct Framer *framer);
+unsigned char *framer_space(struct Framer *framer, size_t *available);
+void framer_commit(struct Framer *framer, size_t length);
+int framer_dispatch(struct Framer *framer, frame_handler handler, void *user);
+void framer_expire(struct Framer *framer);
+#endif
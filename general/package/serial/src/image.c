@@ -0,0 +1,456 @@
+#include "image.h"
+#include "palette.h"
+#include "region.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <zlib.h>
+
+// Logos are decoded a row at a time into RGBA and converted straight into the
+// region surface, colour key included. Besides the surface only a couple of
+// rows are ever held.
+struct Surface
+{
+    BITMAP *bitmap;
+    int bits;   // palette index depth, 0 for direct colour
+    int stride; // bytes of a surface row
+    bool key;
+    unsigned short key_color; // ARGB1555, the alpha bit is ignored
+    unsigned char *rgba;      // one decoded row
+    unsigned char *levels;    // one row before packing, palette output
+};
+
+static uint32_t le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static int surface_init(struct Surface *s, int width, int height)
+{
+    if (width <= 0 || height <= 0 || width > MAX_LOGO_SIZE || height > MAX_LOGO_SIZE)
+    {
+        fprintf(stderr, "Unsupported logo size %dx%d\n", width, height);
+        return -1;
+    }
+    int bpp = s->bitmap->enPixelFormat == PIXEL_FORMAT_8888 ? 4 : 2;
+    s->stride = s->bits ? PALETTE_STRIDE(width, s->bits) : width * bpp;
+    s->bitmap->u32Width = width;
+    s->bitmap->u32Height = height;
+    s->bitmap->pData = malloc(s->stride * height);
+    s->rgba = malloc(width * 4);
+    s->levels = s->bits ? malloc(width) : NULL;
+    if (!s->bitmap->pData || !s->rgba || (s->bits && !s->levels))
+    {
+        fputs("malloc osd memory err!\n", stderr);
+        return -1;
+    }
+    return 0;
+}
+
+// Convert the decoded row into surface row y
+static void put_row(struct Surface *s, int y)
+{
+    const unsigned char *p = s->rgba;
+    unsigned char *row = (unsigned char *)s->bitmap->pData + y * s->stride;
+    for (unsigned int x = 0; x < s->bitmap->u32Width; x++, p += 4)
+    {
+        unsigned int r = p[0], g = p[1], b = p[2], a = p[3];
+        unsigned short rgb = (r >> 3) << 10 | (g >> 3) << 5 | b >> 3;
+        if (s->key && rgb == (s->key_color & 0x7FFF))
+            a = 0;
+        switch (s->bitmap->enPixelFormat)
+        {
+        case PIXEL_FORMAT_1555:
+            ((unsigned short *)row)[x] = (a >= 128) << 15 | rgb;
+            break;
+        case PIXEL_FORMAT_4444:
+            ((unsigned short *)row)[x] = (a >> 4) << 12 | (r >> 4) << 8 | (g >> 4) << 4 | b >> 4;
+            break;
+        case PIXEL_FORMAT_8888:
+            ((uint32_t *)row)[x] = (uint32_t)a << 24 | r << 16 | g << 8 | b;
+            break;
+        default:
+            // luma walks the palette ramp, transparent pixels take index 0
+            s->levels[x] = a >= 128 ? (r * 299 + g * 587 + b * 114) / 1000 : 0;
+        }
+    }
+    if (s->bits)
+        palette_pack(row, s->stride, s->levels, s->bitmap->u32Width, 0, s->bitmap->u32Width, y, 1, s->bits);
+}
+
+// Position and width of a BI_BITFIELDS channel mask
+struct Channel
+{
+    int shift, bits;
+};
+
+static struct Channel channel(uint32_t mask)
+{
+    struct Channel c = {0, 0};
+    if (!mask)
+        return c;
+    while (!(mask & 1))
+        mask >>= 1, c.shift++;
+    while (mask & 1)
+        mask >>= 1, c.bits++;
+    return c;
+}
+
+static unsigned int extract(uint32_t pixel, struct Channel c)
+{
+    if (!c.bits)
+        return 255;
+    uint32_t v = pixel >> c.shift & ((1u << c.bits) - 1);
+    return c.bits >= 8 ? v >> (c.bits - 8) : v * 255 / ((1u << c.bits) - 1);
+}
+
+static int load_bmp(FILE *file, struct Surface *s)
+{
+    unsigned char header[14 + 124 + 12];
+    if (fread(header, 1, 18, file) != 18)
+        return -1;
+    uint32_t offset = le32(header + 10), size = le32(header + 14);
+    if (size < 40 || size > 124 || fread(header + 18, 1, size - 4, file) != size - 4)
+    {
+        fprintf(stderr, "bitmap format not supported!\n");
+        return -1;
+    }
+    int width = (int32_t)le32(header + 18), height = (int32_t)le32(header + 22);
+    int depth = header[28] | header[29] << 8;
+    uint32_t compression = le32(header + 30), colors = le32(header + 46);
+    bool topdown = height < 0;
+    if (topdown)
+        height = height < -MAX_LOGO_SIZE ? 0 : -height;
+
+    // masks follow a plain BITMAPINFOHEADER, later headers carry them (and alpha)
+    uint32_t masks[4] = {0, 0, 0, 0};
+    if (compression == 3 && size == 40 && fread(header + 54, 1, 12, file) != 12)
+        return -1;
+    if (compression == 3)
+        for (int i = 0; i < (size >= 56 ? 4 : 3); i++)
+            masks[i] = le32(header + 54 + 4 * i);
+    else if (compression == 0 && depth == 16)
+        masks[0] = 0x7C00, masks[1] = 0x3E0, masks[2] = 0x1F;
+    else if (compression == 0 && depth == 32)
+        masks[0] = 0xFF0000, masks[1] = 0xFF00, masks[2] = 0xFF;
+    if ((compression != 0 && compression != 3) || (depth != 1 && depth != 4 && depth != 8 && depth != 16 &&
+                                                    depth != 24 && depth != 32))
+    {
+        fprintf(stderr, "not support compressed bitmap file!\n");
+        return -1;
+    }
+    struct Channel r = channel(masks[0]), g = channel(masks[1]), b = channel(masks[2]), a = channel(masks[3]);
+    // extract() needs a bit to spare above each channel
+    if (r.bits > 16 || g.bits > 16 || b.bits > 16 || a.bits > 16)
+    {
+        fprintf(stderr, "bitmap channel masks not supported!\n");
+        return -1;
+    }
+
+    unsigned char palette[256][4];
+    if (depth <= 8)
+    {
+        colors = colors && colors <= 256 ? colors : 1u << depth;
+        memset(palette, 0, sizeof(palette));
+        if (fread(palette, 4, colors, file) != colors)
+            return -1;
+    }
+
+    if (surface_init(s, width, height) || fseek(file, offset, SEEK_SET))
+        return -1;
+    size_t stride = ((size_t)width * depth + 31) / 32 * 4;
+    unsigned char *line = malloc(stride);
+    if (!line)
+        return -1;
+
+    int ret = 0;
+    for (int i = 0; i < height && !ret; i++)
+    {
+        if (fread(line, 1, stride, file) != stride)
+        {
+            fprintf(stderr, "fread (%d*%zu)error!line:%d\n", height, stride, __LINE__);
+            ret = -1;
+            break;
+        }
+        unsigned char *out = s->rgba;
+        for (int x = 0; x < width; x++, out += 4)
+        {
+            if (depth <= 8)
+            {
+                int index = line[x * depth / 8] >> (8 - depth - x * depth % 8) & ((1 << depth) - 1);
+                out[0] = palette[index][2], out[1] = palette[index][1], out[2] = palette[index][0], out[3] = 255;
+                continue;
+            }
+            if (depth == 24)
+            {
+                out[0] = line[x * 3 + 2], out[1] = line[x * 3 + 1], out[2] = line[x * 3], out[3] = 255;
+                continue;
+            }
+            uint32_t pixel = depth == 16 ? (uint32_t)(line[x * 2] | line[x * 2 + 1] << 8) : le32(line + x * 4);
+            out[0] = extract(pixel, r), out[1] = extract(pixel, g), out[2] = extract(pixel, b);
+            out[3] = extract(pixel, a);
+        }
+        put_row(s, topdown ? i : height - 1 - i);
+    }
+    free(line);
+    return ret;
+}
+
+// Minimal PNG: every colour type at bit depths 1 to 16, tRNS, no interlace.
+// IDAT data is inflated straight into a row and unfiltered against the last.
+static const unsigned char png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+struct Png
+{
+    int width, height, depth, type, channels;
+    unsigned char palette[256][4];
+    bool trns;
+    uint16_t key[3]; // tRNS colour of grey and truecolour images
+};
+
+static void unfilter(unsigned char *row, const unsigned char *prev, size_t length, size_t bpp)
+{
+    int filter = row[0];
+    row++, prev++;
+    for (size_t i = 0; i < length; i++)
+    {
+        int left = i >= bpp ? row[i - bpp] : 0, up = prev[i], corner = i >= bpp ? prev[i - bpp] : 0;
+        switch (filter)
+        {
+        case 1:
+            row[i] += left;
+            break;
+        case 2:
+            row[i] += up;
+            break;
+        case 3:
+            row[i] += (left + up) / 2;
+            break;
+        case 4:
+        {
+            int p = left + up - corner, pa = abs(p - left), pb = abs(p - up), pc = abs(p - corner);
+            row[i] += pa <= pb && pa <= pc ? left : pb <= pc ? up : corner;
+            break;
+        }
+        }
+    }
+}
+
+static unsigned int sample(const unsigned char *row, int index, int depth)
+{
+    if (depth == 16)
+        return row[index * 2] << 8 | row[index * 2 + 1];
+    if (depth == 8)
+        return row[index];
+    return row[index * depth / 8] >> (8 - depth - index * depth % 8) & ((1 << depth) - 1);
+}
+
+static void png_row(const struct Png *png, const unsigned char *row, unsigned char *out)
+{
+    int top = (1 << png->depth) - 1;
+    for (int x = 0; x < png->width; x++, out += 4)
+    {
+        unsigned int v[4];
+        for (int c = 0; c < png->channels; c++)
+            v[c] = sample(row, x * png->channels + c, png->depth);
+        if (png->type == 3)
+        {
+            memcpy(out, png->palette[v[0] & 0xFF], 4);
+            continue;
+        }
+        unsigned int scale[4];
+        for (int c = 0; c < png->channels; c++)
+            scale[c] = png->depth == 16 ? v[c] >> 8 : png->depth == 8 ? v[c] : v[c] * 255 / top;
+        if (png->type == 0 || png->type == 4)
+        {
+            out[0] = out[1] = out[2] = scale[0];
+            out[3] = png->type == 4 ? scale[1] : png->trns && v[0] == png->key[0] ? 0 : 255;
+        }
+        else
+        {
+            out[0] = scale[0], out[1] = scale[1], out[2] = scale[2];
+            if (png->type == 6)
+                out[3] = scale[3];
+            else
+                out[3] = png->trns && v[0] == png->key[0] && v[1] == png->key[1] && v[2] == png->key[2] ? 0 : 255;
+        }
+    }
+}
+
+static int load_png(FILE *file, struct Surface *s)
+{
+    struct Png png = {0};
+    unsigned char head[13], in[4096];
+    unsigned char *rows = NULL;
+    size_t length = 0; // bytes of a row without its filter byte
+    size_t filled = 0; // of the current row, filter byte included
+    int bpp = 1, y = 0, ret = -1;
+    bool ended = false;
+    z_stream z = {0};
+
+    if (fseek(file, sizeof(png_signature), SEEK_SET) || inflateInit(&z) != Z_OK)
+        return -1;
+    for (;;)
+    {
+        unsigned char chunk[8];
+        if (fread(chunk, 1, 8, file) != 8)
+            break;
+        uint32_t size = be32(chunk), crc = crc32(crc32(0, Z_NULL, 0), chunk + 4, 4);
+        const unsigned char *type = chunk + 4;
+        if (size > 0x7FFFFFFF)
+            break;
+
+        if (!memcmp(type, "IHDR", 4))
+        {
+            // a second header would resize the surface under the rows already drawn
+            if (rows || size != 13 || fread(head, 1, 13, file) != 13)
+                break;
+            crc = crc32(crc, head, 13);
+            png.width = be32(head), png.height = be32(head + 4), png.depth = head[8], png.type = head[9];
+            png.channels = png.type == 0 || png.type == 3 ? 1 : png.type == 2 ? 3 : png.type == 4 ? 2 : 4;
+            if ((png.type == 1 || png.type == 5 || png.type > 6) || head[12] ||
+                (png.depth != 1 && png.depth != 2 && png.depth != 4 && png.depth != 8 && png.depth != 16) ||
+                (png.type != 0 && png.type != 3 && png.depth < 8) || (png.type == 3 && png.depth > 8))
+            {
+                fprintf(stderr, "Unsupported PNG (type %d, depth %d, interlace %d)\n", png.type, png.depth,
+                        head[12]);
+                break;
+            }
+            if (surface_init(s, png.width, png.height))
+                break;
+            length = ((size_t)png.width * png.channels * png.depth + 7) / 8;
+            bpp = MAX(png.channels * png.depth / 8, 1);
+            rows = calloc(2, length + 1);
+            if (!rows)
+                break;
+        }
+        else if (!memcmp(type, "PLTE", 4) || !memcmp(type, "tRNS", 4))
+        {
+            unsigned char data[768];
+            if (size > sizeof(data) || fread(data, 1, size, file) != size)
+                break;
+            crc = crc32(crc, data, size);
+            if (type[0] == 'P')
+                for (uint32_t i = 0; i < size / 3; i++)
+                    png.palette[i][0] = data[3 * i], png.palette[i][1] = data[3 * i + 1],
+                    png.palette[i][2] = data[3 * i + 2], png.palette[i][3] = 255;
+            else if (png.type == 3)
+                for (uint32_t i = 0; i < size && i < 256; i++)
+                    png.palette[i][3] = data[i];
+            else
+            {
+                for (uint32_t c = 0; c < 3 && 2 * c + 1 < size; c++)
+                    png.key[c] = data[2 * c] << 8 | data[2 * c + 1];
+                png.trns = true;
+            }
+        }
+        else if (!memcmp(type, "IDAT", 4))
+        {
+            if (!rows)
+                break;
+            for (uint32_t left = size; left > 0;)
+            {
+                z.next_in = in;
+                z.avail_in = fread(in, 1, MIN(left, sizeof(in)), file);
+                if (!z.avail_in)
+                    goto done;
+                crc = crc32(crc, in, z.avail_in);
+                left -= z.avail_in;
+                while (z.avail_in && y < png.height && !ended)
+                {
+                    unsigned char *row = rows + (y & 1) * (length + 1);
+                    unsigned char *prev = rows + !(y & 1) * (length + 1);
+                    z.next_out = row + filled;
+                    z.avail_out = length + 1 - filled;
+                    int status = inflate(&z, Z_NO_FLUSH);
+                    if (status != Z_OK && status != Z_STREAM_END)
+                        goto done;
+                    ended = status == Z_STREAM_END;
+                    filled = length + 1 - z.avail_out;
+                    if (filled < length + 1)
+                        continue;
+                    unfilter(row, prev, length, bpp);
+                    png_row(&png, row + 1, s->rgba);
+                    put_row(s, y++);
+                    filled = 0;
+                }
+            }
+        }
+        else if (!memcmp(type, "IEND", 4))
+        {
+            ret = y == png.height ? 0 : -1;
+            break;
+        }
+        else if (!(type[0] & 0x20))
+        {
+            fprintf(stderr, "Unsupported critical PNG chunk %.4s\n", type);
+            break;
+        }
+        else
+        {
+            // ancillary chunk, skipped together with its CRC
+            if (fseek(file, size + 4, SEEK_CUR))
+                break;
+            continue;
+        }
+
+        unsigned char check[4];
+        if (fread(check, 1, 4, file) != 4 || be32(check) != crc)
+        {
+            fprintf(stderr, "PNG chunk %.4s fails its CRC\n", type);
+            break;
+        }
+    }
+done:
+    if (ret)
+        fprintf(stderr, "PNG decoding stopped after %d of %d rows\n", y, png.height);
+    inflateEnd(&z);
+    free(rows);
+    return ret;
+}
+
+// Decode a BMP or PNG logo into a surface of the region pixel format (ARGB1555,
+// ARGB4444, ARGB8888, I4 or I2). With key set, pixels of key_color (ARGB1555)
+// turn transparent. The caller frees bitmap->pData.
+int load_logo(const char *filename, BITMAP *bitmap, int format, int key, unsigned int key_color)
+{
+    unsigned char magic[8];
+    struct Surface s = {.bitmap = bitmap, .bits = palette_bits(format), .key = key, .key_color = key_color};
+    int ret = -1;
+
+    memset(bitmap, 0, sizeof(*bitmap));
+    bitmap->enPixelFormat = format;
+    if (format != PIXEL_FORMAT_1555 && format != PIXEL_FORMAT_4444 && format != PIXEL_FORMAT_8888 && !s.bits)
+    {
+        fprintf(stderr, "enPixelFormat err %d \n", format);
+        return -1;
+    }
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Open file failed:%s!\n", filename);
+        return -1;
+    }
+    if (fread(magic, 1, sizeof(magic), file) == sizeof(magic) && !fseek(file, 0, SEEK_SET))
+    {
+        if (!memcmp(magic, png_signature, sizeof(png_signature)))
+            ret = load_png(file, &s);
+        else if (magic[0] == 'B' && magic[1] == 'M')
+            ret = load_bmp(file, &s);
+        else
+            fprintf(stderr, "not supported image file!\n");
+    }
+    fclose(file);
+    free(s.rgba);
+    free(s.levels);
+    if (ret)
+    {
+        free(bitmap->pData);
+        bitmap->pData = NULL;
+    }
+    return ret;
+}
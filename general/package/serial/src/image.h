@@ -0,0 +1,9 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+#include "common.h"
+
+// Largest logo side accepted, keeps a corrupt header from sizing the surface
+#define MAX_LOGO_SIZE 4096
+
+int load_logo(const char *filename, BITMAP *bitmap, int format, int key, unsigned int key_color);
+#endif
@@ -0,0 +1,248 @@
+#include "image_index.h"
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The most recently used hour directory stays in memory, every other one is
+// served from its index file and only rescanned once the directory changes
+static struct ImageIndex cache;
+
+static int64_t mtime_ns(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// Only an index built a whole granule after the last change of its directory
+// can be trusted on the mtime alone
+static bool settled(int64_t dir_mtime, int64_t built)
+{
+    return built - dir_mtime >= INDEX_GRANULE_NS;
+}
+
+static int by_mtime(const void *a, const void *b)
+{
+    const struct IndexEntry *x = a, *y = b;
+    if (x->mtime != y->mtime)
+        return x->mtime < y->mtime ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+static int by_name(const void *a, const void *b)
+{
+    return strcmp(((const struct IndexEntry *)a)->name, ((const struct IndexEntry *)b)->name);
+}
+
+// INDEX_ROOT/YYYY-MM-DD/image/HH -> INDEX_ROOT/.index/YYYY-MM-DD_HH.idx
+static void index_file(const char *directory, char *file, size_t size)
+{
+    char day[16] = "", hour[8] = "";
+    sscanf(directory, INDEX_ROOT "/%15[^/]/image/%7s", day, hour);
+    snprintf(file, size, "%s/%s_%s.idx", INDEX_PATH, day, hour);
+}
+
+static void release(struct ImageIndex *index)
+{
+    free(index->entries);
+    memset(index, 0, sizeof(*index));
+}
+
+static int load(struct ImageIndex *index, const char *directory, int64_t dir_mtime)
+{
+    char file[PATH_MAX];
+    struct IndexHeader header;
+
+    index_file(directory, file, sizeof(file));
+    struct stat st;
+    FILE *fp = fopen(file, "rb");
+    if (!fp)
+        return -1;
+    // count comes from disk: it has to account for the file size exactly (a torn or
+    // corrupt file is rebuilt) before it sizes an allocation
+    if (fstat(fileno(fp), &st) || fread(&header, sizeof(header), 1, fp) != 1 || header.magic != INDEX_MAGIC ||
+        header.dir_mtime != dir_mtime ||
+        (uint64_t)st.st_size != sizeof(header) + (uint64_t)header.count * sizeof(struct IndexEntry))
+    {
+        fclose(fp);
+        return -1;
+    }
+    index->entries = malloc((size_t)header.count * sizeof(struct IndexEntry) + 1);
+    if (!index->entries || fread(index->entries, sizeof(struct IndexEntry), header.count, fp) != header.count)
+    {
+        fclose(fp);
+        release(index);
+        return -1;
+    }
+    fclose(fp);
+    for (uint32_t i = 0; i < header.count; i++)
+        index->entries[i].name[INDEX_NAME_LEN - 1] = '\0';
+    strncpy(index->directory, directory, sizeof(index->directory) - 1);
+    index->dir_mtime = dir_mtime;
+    index->built = header.built;
+    index->count = header.count;
+    return 0;
+}
+
+static void store(const struct ImageIndex *index)
+{
+    char file[PATH_MAX], tmp[PATH_MAX + 4];
+    struct IndexHeader header = {
+        .magic = INDEX_MAGIC, .count = index->count, .dir_mtime = index->dir_mtime, .built = index->built};
+
+    if (mkdir(INDEX_PATH, 0755) && errno != EEXIST)
+        return;
+    index_file(index->directory, file, sizeof(file));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp)
+        return;
+    // on disk before the rename publishes it, or a power cut can leave an empty index behind
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+             fwrite(index->entries, sizeof(struct IndexEntry), index->count, fp) == (size_t)index->count && !fflush(fp) &&
+             !fsync(fileno(fp));
+    if (fclose(fp) || !ok || rename(tmp, file))
+    {
+        fprintf(stderr, "Failed to store image index %s\n", file);
+        remove(tmp);
+    }
+}
+
+// Rescan a directory, only files missing from the previous index are stat()ed
+static int scan(struct ImageIndex *index, const char *directory, int64_t dir_mtime, struct ImageIndex *previous)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    DIR *dir;
+    struct dirent *entry;
+    struct stat file_stat;
+    char filepath[PATH_MAX];
+    int capacity = 64;
+
+    if ((dir = opendir(directory)) == NULL)
+    {
+        perror("Failed to open directory");
+        return -1;
+    }
+    if (previous->count)
+        qsort(previous->entries, previous->count, sizeof(struct IndexEntry), by_name);
+
+    index->count = 0;
+    index->entries = malloc(capacity * sizeof(struct IndexEntry));
+    while (index->entries && (entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_type != DT_REG || strlen(entry->d_name) >= INDEX_NAME_LEN)
+            continue;
+        if (index->count == capacity)
+        {
+            struct IndexEntry *grown = realloc(index->entries, (capacity *= 2) * sizeof(struct IndexEntry));
+            if (!grown)
+                break;
+            index->entries = grown;
+        }
+        struct IndexEntry *item = &index->entries[index->count];
+        strcpy(item->name, entry->d_name);
+
+        struct IndexEntry *known =
+            previous->count ? bsearch(item, previous->entries, previous->count, sizeof(struct IndexEntry), by_name)
+                            : NULL;
+        if (known)
+            item->mtime = known->mtime;
+        else
+        {
+            snprintf(filepath, sizeof(filepath), "%s/%s", directory, entry->d_name);
+            if (stat(filepath, &file_stat) != 0)
+            {
+                perror("Failed to get file stats");
+                continue;
+            }
+            item->mtime = file_stat.st_mtime;
+        }
+        index->count++;
+    }
+    closedir(dir);
+    if (!index->entries)
+        return -1;
+
+    qsort(index->entries, index->count, sizeof(struct IndexEntry), by_mtime);
+    strncpy(index->directory, directory, sizeof(index->directory) - 1);
+    index->dir_mtime = dir_mtime;
+    index->built = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    return 0;
+}
+
+const struct ImageIndex *image_index_get(const char *directory)
+{
+    struct stat st;
+    struct ImageIndex fresh;
+
+    if (stat(directory, &st) != 0)
+    {
+        perror("Failed to open directory");
+        return NULL;
+    }
+    int64_t dir_mtime = mtime_ns(&st);
+    if (cache.entries && !strcmp(cache.directory, directory) && cache.dir_mtime == dir_mtime &&
+        settled(cache.dir_mtime, cache.built))
+        return &cache;
+
+    memset(&fresh, 0, sizeof(fresh));
+    if (load(&fresh, directory, dir_mtime) == 0 && settled(fresh.dir_mtime, fresh.built))
+    {
+        release(&cache);
+        cache = fresh;
+        return &cache;
+    }
+    release(&fresh);
+
+    // Reuse the stale index of this directory (memory or disk) to avoid stat()ing known files
+    struct ImageIndex previous;
+    memset(&previous, 0, sizeof(previous));
+    if (cache.entries && !strcmp(cache.directory, directory))
+    {
+        previous = cache;
+        memset(&cache, 0, sizeof(cache));
+    }
+    else
+    {
+        char file[PATH_MAX];
+        struct IndexHeader header;
+        index_file(directory, file, sizeof(file));
+        FILE *fp = fopen(file, "rb");
+        if (fp && fread(&header, sizeof(header), 1, fp) == 1 && header.magic == INDEX_MAGIC)
+            load(&previous, directory, header.dir_mtime);
+        if (fp)
+            fclose(fp);
+    }
+
+    int ret = scan(&fresh, directory, dir_mtime, &previous);
+    release(&previous);
+    if (ret != 0)
+    {
+        release(&fresh);
+        return NULL;
+    }
+    store(&fresh);
+    release(&cache);
+    cache = fresh;
+    return &cache;
+}
+
+// First entry not older than target, NULL when every file is older
+const struct IndexEntry *image_index_find(const struct ImageIndex *index, time_t target)
+{
+    int lo = 0, hi = index->count;
+
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (index->entries[mid].mtime < target)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < index->count ? &index->entries[lo] : NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef IMAGE_INDEX_H_
+#define IMAGE_INDEX_H_
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+
+// Card the hour directories live on, overridden by the host tests
+#ifndef INDEX_ROOT
+#define INDEX_ROOT "/mnt/mmcblk0p1"
+#endif
+#define INDEX_PATH INDEX_ROOT "/.index"
+#define INDEX_MAGIC 0x32444953 // "SID2"
+#define INDEX_NAME_LEN 48
+// FAT keeps mtimes to 2 s, a directory changed that close to a scan can change
+// again without its mtime moving
+#define INDEX_GRANULE_NS 2000000000LL
+
+struct IndexEntry
+{
+    int64_t mtime;
+    char name[INDEX_NAME_LEN];
+};
+
+struct IndexHeader
+{
+    uint32_t magic;
+    uint32_t count;
+    int64_t dir_mtime; // ns
+    int64_t built;     // ns, wall clock of the scan
+};
+
+struct ImageIndex
+{
+    char directory[PATH_MAX];
+    int64_t dir_mtime, built; // ns
+    int count;
+    struct IndexEntry *entries; // sorted by mtime
+};
+
+const struct ImageIndex *image_index_get(const char *directory);
+const struct IndexEntry *image_index_find(const struct ImageIndex *index, time_t target);
+#endif
@@ -3,7 +3,9 @@
 #include "data_define.h"
 #include "region.h"
 #include "serial.h"
+#include "stats.h"
 #include "text.h"
+#include "upgrade.h"
 #include "utils.h"
 #include "watchdog.h"
 #include <errno.h>
@@ -23,6 +25,7 @@ void *io_map;
 
 void handle_error(int signo)
 {
+    (void)signo;
     write(STDERR_FILENO, "Error occurred! Quitting...\n", 28);
     keep_running = 0;
     exit(EXIT_FAILURE);
@@ -30,13 +33,15 @@ void handle_error(int signo)
 
 void handle_exit(int signo)
 {
+    (void)signo;
     write(STDERR_FILENO, "Graceful shutdown...\n", 21);
     keep_running = 0;
     graceful = 1;
 }
 
-int main(int argc, char *argv[])
+int main(void)
 {
+    upgrade_boot();
     upgrade_application_from_sdcard();
 
     {
@@ -61,10 +66,12 @@ int main(int argc, char *argv[])
     printf("app config port: %s baudrate: %d package_size: %d watchdog: %d\n", app_config.port, app_config.baudrate,
            app_config.package_size, app_config.watchdog);
 
+    // absent off-target (make host)
     int fd_mem = open("/dev/mem", O_RDWR);
-    io_map = mmap(NULL, IO_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd_mem, IO_BASE);
+    io_map = fd_mem < 0 ? MAP_FAILED : mmap(NULL, IO_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd_mem, IO_BASE);
 
-    static MI_RGN_PaletteTable_t g_stPaletteTable = {{{0, 0, 0, 0}}};
+    static MI_RGN_PaletteTable_t g_stPaletteTable;
+    region_palette(&g_stPaletteTable);
     int s32Ret = MI_RGN_Init(&g_stPaletteTable);
     if (s32Ret)
         fprintf(stderr, "[%s:%d]RGN_Init failed with %#x!\n", __func__, __LINE__, s32Ret);
@@ -72,13 +79,17 @@ int main(int argc, char *argv[])
     toggleLed();
     start_region_handler();
     start_serial_handler();
+    stats_serve_start(STATS_SOCKET);
 
     while (keep_running)
     {
         watchdog_reset();
+        flush_app_config(false);
+        upgrade_health();
         sleep(1);
     }
 
+    stats_serve_stop();
     stop_serial_handler();
     stop_region_handler();
 
@@ -86,14 +97,20 @@ int main(int argc, char *argv[])
     if (s32Ret)
         printf("[%s:%d]RGN_DeInit failed with %#x!\n", __func__, __LINE__, s32Ret);
 
-    munmap(io_map, IO_SIZE);
-    close(fd_mem);
+    if (io_map != MAP_FAILED)
+        munmap(io_map, IO_SIZE);
+    if (fd_mem >= 0)
+        close(fd_mem);
 
     if (app_config.watchdog)
         watchdog_stop();
 
+    // an interrupted write is rolled back before the pending settings go out
     if (!graceful)
         restore_app_config();
+    flush_app_config(true);
+    if (upgrade_installed())
+        restart_application();
 
     return graceful ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,235 @@
+// Host tool, bakes a font into the glyph atlas text.c maps at startup:
+//   mkatlas [-2] [-r FIRST-LAST]... -o DejaVuSans.atlas DejaVuSans.ttf 32 48
+// -2 stores 2-bit alpha (I2) instead of 8-bit, -r adds a codepoint range
+// (default 0x20-0x7E). Install the atlas next to the font it was baked from.
+#include "atlas.h"
+#include "schrift.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_RANGES 16
+
+struct Range
+{
+    uint32_t first, last;
+};
+
+static struct Range ranges[MAX_RANGES];
+static int range_count;
+
+static void fail(const char *message)
+{
+    fprintf(stderr, "mkatlas: %s\n", message);
+    exit(1);
+}
+
+static void emit(FILE *out, const void *data, size_t length)
+{
+    if (fwrite(data, 1, length, out) != length)
+        fail("write failed");
+}
+
+static void pad(FILE *out, long *offset, int align)
+{
+    static const unsigned char zero[8];
+    int n = (align - *offset % align) % align;
+    emit(out, zero, n);
+    *offset += n;
+}
+
+// Collapse 8-bit alpha to four levels, four pixels per byte with the leftmost
+// pixel in the high bits
+static void pack2(unsigned char *dest, const unsigned char *alpha, int width, int height)
+{
+    int stride = (width + 3) / 4;
+    memset(dest, 0, stride * height);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            dest[y * stride + x / 4] |= ((alpha[y * width + x] + 42) / 85) << (6 - 2 * (x % 4));
+}
+
+static void bake(FILE *out, long *offset, SFT_Font *font, double size, int bits)
+{
+    SFT sft = {.font = font, .xScale = size, .yScale = size, .flags = SFT_DOWNWARD_Y};
+    SFT_LMetrics lmtx;
+    if (sft_lmetrics(&sft, &lmtx) < 0)
+        fail("sft_lmetrics failed");
+
+    uint32_t capacity = 0;
+    for (int r = 0; r < range_count; r++)
+        capacity += ranges[r].last - ranges[r].first + 1;
+    struct AtlasGlyph *glyphs = calloc(capacity, sizeof(*glyphs));
+    unsigned char **bitmaps = calloc(capacity, sizeof(*bitmaps));
+    if (!glyphs || !bitmaps)
+        fail("out of memory");
+
+    // Ranges are sorted and merged by main(), glyphs come out in codepoint order
+    uint32_t count = 0, bitmap = 0;
+    for (int r = 0; r < range_count; r++)
+    {
+        for (uint32_t cp = ranges[r].first; cp <= ranges[r].last; cp++)
+        {
+            SFT_Glyph gid;
+            SFT_GMetrics mtx;
+            if (sft_lookup(&sft, cp, &gid) < 0 || sft_gmetrics(&sft, gid, &mtx) < 0)
+                fail("glyph lookup failed");
+            if (gid == 0 && cp != 0)
+                continue; // not in the font, the runtime falls back the same way
+            unsigned char *alpha = calloc(mtx.minWidth * mtx.minHeight + 1, 1);
+            SFT_Image image = {.pixels = alpha, .width = mtx.minWidth, .height = mtx.minHeight};
+            if (!alpha || sft_render(&sft, gid, image) < 0)
+                fail("sft_render failed");
+            if (bits == 2)
+            {
+                unsigned char *packed = calloc((mtx.minWidth + 3) / 4 * mtx.minHeight + 1, 1);
+                pack2(packed, alpha, mtx.minWidth, mtx.minHeight);
+                free(alpha);
+                alpha = packed;
+            }
+            struct AtlasGlyph *glyph = &glyphs[count];
+            glyph->codepoint = cp;
+            glyph->gid = gid;
+            glyph->advanceWidth = mtx.advanceWidth;
+            glyph->leftSideBearing = mtx.leftSideBearing;
+            glyph->yOffset = mtx.yOffset;
+            glyph->minWidth = mtx.minWidth;
+            glyph->minHeight = mtx.minHeight;
+            glyph->bitmap = bitmap; // relative to the bitmap area for now
+            bitmap += (bits == 2 ? (mtx.minWidth + 3) / 4 : mtx.minWidth) * mtx.minHeight;
+            bitmaps[count++] = alpha;
+        }
+    }
+
+    // Only pairs with a shift are stored, the loader reads absent pairs as zero
+    struct AtlasKerning *kernings = NULL;
+    uint32_t kerning_count = 0, kerning_capacity = 0;
+    for (uint32_t l = 0; l < count; l++)
+    {
+        for (uint32_t r = 0; r < count; r++)
+        {
+            SFT_Kerning kerning;
+            if (sft_kerning(&sft, glyphs[l].gid, glyphs[r].gid, &kerning) < 0 || kerning.xShift == 0.0)
+                continue;
+            if (kerning_count == kerning_capacity)
+            {
+                kerning_capacity = kerning_capacity ? kerning_capacity * 2 : 256;
+                kernings = realloc(kernings, kerning_capacity * sizeof(*kernings));
+                if (!kernings)
+                    fail("out of memory");
+            }
+            kernings[kerning_count++] =
+                (struct AtlasKerning){.left = glyphs[l].codepoint, .right = glyphs[r].codepoint, .xShift = kerning.xShift};
+        }
+    }
+
+    struct AtlasSize header = {.size = size,
+                               .ascender = lmtx.ascender,
+                               .descender = lmtx.descender,
+                               .lineGap = lmtx.lineGap,
+                               .glyphs = count,
+                               .kernings = kerning_count};
+    uint32_t base = sizeof(header) + count * sizeof(*glyphs) + kerning_count * sizeof(*kernings);
+    for (uint32_t k = 0; k < count; k++)
+        glyphs[k].bitmap += base;
+
+    emit(out, &header, sizeof(header));
+    emit(out, glyphs, count * sizeof(*glyphs));
+    emit(out, kernings, kerning_count * sizeof(*kernings));
+    for (uint32_t k = 0; k < count; k++)
+    {
+        emit(out, bitmaps[k], (bits == 2 ? (glyphs[k].minWidth + 3) / 4 : glyphs[k].minWidth) * glyphs[k].minHeight);
+        free(bitmaps[k]);
+    }
+    *offset += base + bitmap;
+    printf("%g: %u glyphs, %u kerning pairs, %u bitmap bytes\n", size, count, kerning_count, bitmap);
+
+    free(glyphs);
+    free(bitmaps);
+    free(kernings);
+}
+
+static int compare_range(const void *a, const void *b)
+{
+    const struct Range *x = a, *y = b;
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *output = NULL;
+    int bits = 8, opt;
+    while ((opt = getopt(argc, argv, "2r:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case '2':
+            bits = 2;
+            break;
+        case 'r':
+        {
+            char *end;
+            if (range_count == MAX_RANGES)
+                fail("too many ranges");
+            ranges[range_count].first = strtoul(optarg, &end, 0);
+            ranges[range_count].last = *end == '-' ? strtoul(end + 1, &end, 0) : ranges[range_count].first;
+            if (*end || ranges[range_count].last < ranges[range_count].first || ranges[range_count].last > 0x10FFFF)
+                fail("bad range, expected FIRST-LAST");
+            range_count++;
+            break;
+        }
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            output = NULL;
+            optind = argc + 1;
+        }
+    }
+    if (!output || argc - optind < 2 || argc - optind - 1 > ATLAS_MAX_SIZES)
+    {
+        fprintf(stderr, "usage: %s [-2] [-r FIRST-LAST]... -o OUTPUT FONT SIZE...\n", argv[0]);
+        return 1;
+    }
+    if (!range_count)
+        ranges[range_count++] = (struct Range){0x20, 0x7E};
+
+    qsort(ranges, range_count, sizeof(*ranges), compare_range);
+    int merged = 0;
+    for (int r = 1; r < range_count; r++)
+    {
+        if (ranges[r].first <= ranges[merged].last + 1)
+            ranges[merged].last = ranges[r].last > ranges[merged].last ? ranges[r].last : ranges[merged].last;
+        else
+            ranges[++merged] = ranges[r];
+    }
+    range_count = merged + 1;
+
+    SFT_Font *font = sft_loadfile(argv[optind]);
+    if (!font)
+        fail("sft_loadfile failed");
+    FILE *out = fopen(output, "wb");
+    if (!out)
+    {
+        perror(output);
+        return 1;
+    }
+
+    struct AtlasHeader header = {.magic = ATLAS_MAGIC, .version = ATLAS_VERSION, .bits = bits};
+    header.sizes = argc - optind - 1;
+    long offset = sizeof(header);
+    emit(out, &header, sizeof(header));
+    for (int i = 0; i < header.sizes; i++)
+    {
+        pad(out, &offset, 8);
+        header.offsets[i] = offset;
+        bake(out, &offset, font, atof(argv[optind + 1 + i]), bits);
+    }
+    rewind(out);
+    emit(out, &header, sizeof(header));
+    if (fclose(out) != 0)
+        fail("write failed");
+    sft_freefont(font);
+    return 0;
+}
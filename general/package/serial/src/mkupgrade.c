@@ -0,0 +1,272 @@
+// Host tool, packs a binary into an upgrade image for upgrade.c:
+//   mkupgrade [-b BASE] -o serial.upg serial
+// -b makes a bsdiff style delta against BASE, the binary running on the camera,
+// falling back to a full image when that is not smaller. Either payload is deflated. The image still has to be
+// signed, the signature is appended as is:
+//   openssl dgst -sha256 -sign key.pem -out serial.sig serial.upg && cat serial.sig >> serial.upg
+#include "upgrade.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Base positions are indexed by their first KEY bytes, shorter matches are not worth
+// a control record
+#define KEY 8
+#define MIN_MATCH 32
+#define HASH_BITS 20
+#define MAX_CHAIN 64
+
+struct Buffer
+{
+    unsigned char *data;
+    size_t length, capacity;
+};
+
+static void fail(const char *message)
+{
+    fprintf(stderr, "mkupgrade: %s\n", message);
+    exit(1);
+}
+
+static unsigned char *load(const char *path, size_t *length)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        fail("can't open input");
+    fseek(file, 0, SEEK_END);
+    *length = ftell(file);
+    rewind(file);
+    unsigned char *data = malloc(*length + 1);
+    if (!data || fread(data, 1, *length, file) != *length)
+        fail("can't read input");
+    fclose(file);
+    return data;
+}
+
+static void append(struct Buffer *buffer, const void *data, size_t length)
+{
+    if (buffer->length + length > buffer->capacity)
+    {
+        buffer->capacity = (buffer->length + length) * 2;
+        if (!(buffer->data = realloc(buffer->data, buffer->capacity)))
+            fail("out of memory");
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+static void offset_out(struct Buffer *buffer, int64_t value)
+{
+    unsigned char p[8];
+    uint64_t magnitude = value < 0 ? -value : value;
+    for (int i = 0; i < 8; i++)
+        p[i] = magnitude >> (8 * i);
+    if (value < 0)
+        p[7] |= 0x80;
+    append(buffer, p, sizeof(p));
+}
+
+static void deflate_buffer(struct Buffer *out, const unsigned char *data, size_t length)
+{
+    uLongf size = compressBound(length);
+    out->data = malloc(size);
+    if (!out->data || compress2(out->data, &size, data, length, Z_BEST_COMPRESSION) != Z_OK)
+        fail("deflate failed");
+    out->length = out->capacity = size;
+}
+
+static uint32_t hash_key(const unsigned char *p)
+{
+    uint64_t key;
+    memcpy(&key, p, KEY);
+    return (key * 0x9E3779B97F4A7C15ULL) >> (64 - HASH_BITS);
+}
+
+static void record(struct Buffer *patch, const unsigned char *base, const unsigned char *target, size_t diff,
+                   size_t extra, int64_t seek, size_t target_pos, size_t base_pos)
+{
+    offset_out(patch, diff);
+    offset_out(patch, extra);
+    offset_out(patch, seek);
+    for (size_t i = 0; i < diff; i++)
+    {
+        unsigned char d = target[target_pos + i] - base[base_pos + i];
+        append(patch, &d, 1);
+    }
+    append(patch, target + target_pos + diff, extra);
+}
+
+// bsdiff with a hash chain in place of the suffix array: exact matches anchor the
+// alignment, the stretch in front of them is covered by extending the previous
+// alignment forward and the new one backward as long as most bytes agree
+static void delta(struct Buffer *patch, const unsigned char *base, size_t base_size, const unsigned char *target,
+                  size_t target_size)
+{
+    int32_t *head = malloc(sizeof(int32_t) << HASH_BITS);
+    int32_t *chain = malloc(sizeof(int32_t) * (base_size + 1));
+    if (!head || !chain)
+        fail("out of memory");
+    memset(head, 0xFF, sizeof(int32_t) << HASH_BITS);
+    for (size_t i = 0; i + KEY <= base_size; i++)
+    {
+        uint32_t h = hash_key(base + i);
+        chain[i] = head[h];
+        head[h] = i;
+    }
+
+    size_t scan = 0, last_scan = 0, last_pos = 0;
+    int64_t last_offset = 0;
+    while (scan + KEY <= target_size)
+    {
+        size_t pos = 0, length = 0;
+        int32_t candidate = head[hash_key(target + scan)];
+        for (int steps = 0; candidate >= 0 && steps < MAX_CHAIN; candidate = chain[candidate], steps++)
+        {
+            size_t n = 0;
+            while (candidate + n < base_size && scan + n < target_size && base[candidate + n] == target[scan + n])
+                n++;
+            if (n > length)
+            {
+                pos = candidate;
+                length = n;
+            }
+        }
+        // Matches on the current alignment are picked up by its forward extension
+        if (length < MIN_MATCH || (int64_t)pos - (int64_t)scan == last_offset)
+        {
+            scan += length >= MIN_MATCH ? length : 1;
+            continue;
+        }
+
+        size_t lenf = 0, lenb = 0;
+        int64_t s = 0, best = 0;
+        for (size_t i = 0; last_scan + i < scan && last_pos + i < base_size; i++)
+        {
+            s += target[last_scan + i] == base[last_pos + i];
+            if (s * 2 - (int64_t)(i + 1) > best * 2 - (int64_t)lenf)
+            {
+                best = s;
+                lenf = i + 1;
+            }
+        }
+        s = best = 0;
+        for (size_t i = 1; scan >= last_scan + i && pos >= i; i++)
+        {
+            s += target[scan - i] == base[pos - i];
+            if (s * 2 - (int64_t)i > best * 2 - (int64_t)lenb)
+            {
+                best = s;
+                lenb = i;
+            }
+        }
+        if (last_scan + lenf > scan - lenb)
+        {
+            // Split the overlap where the two alignments trade places best
+            size_t overlap = last_scan + lenf - (scan - lenb), lens = 0;
+            s = best = 0;
+            for (size_t i = 0; i < overlap; i++)
+            {
+                s += target[last_scan + lenf - overlap + i] == base[last_pos + lenf - overlap + i];
+                s -= target[scan - lenb + i] == base[pos - lenb + i];
+                if (s > best)
+                {
+                    best = s;
+                    lens = i + 1;
+                }
+            }
+            lenf += lens - overlap;
+            lenb -= lens;
+        }
+
+        record(patch, base, target, lenf, scan - lenb - (last_scan + lenf),
+               (int64_t)(pos - lenb) - (int64_t)(last_pos + lenf), last_scan, last_pos);
+        last_scan = scan - lenb;
+        last_pos = pos - lenb;
+        last_offset = (int64_t)pos - (int64_t)scan;
+        scan += length;
+    }
+
+    // Whatever is left: the current alignment as far as it goes, then literal bytes
+    size_t lenf = 0;
+    int64_t s = 0, best = 0;
+    for (size_t i = 0; last_scan + i < target_size && last_pos + i < base_size; i++)
+    {
+        s += target[last_scan + i] == base[last_pos + i];
+        if (s * 2 - (int64_t)(i + 1) > best * 2 - (int64_t)lenf)
+        {
+            best = s;
+            lenf = i + 1;
+        }
+    }
+    record(patch, base, target, lenf, target_size - last_scan - lenf, 0, last_scan, last_pos);
+    free(head);
+    free(chain);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *base_path = NULL, *output = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            base_path = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            output = NULL;
+            optind = argc + 1;
+        }
+    }
+    if (!output || argc - optind != 1)
+    {
+        fprintf(stderr, "usage: %s [-b BASE] -o OUTPUT BINARY\n", argv[0]);
+        return 1;
+    }
+
+    size_t target_size, base_size;
+    unsigned char *target = load(argv[optind], &target_size);
+    if (target_size > UPGRADE_MAX_TARGET)
+        fail("binary larger than UPGRADE_MAX_TARGET");
+    struct UpgradeHeader header = {.magic = UPGRADE_MAGIC,
+                                   .version = UPGRADE_VERSION,
+                                   .type = UPGRADE_FULL,
+                                   .flags = UPGRADE_DEFLATE,
+                                   .target_size = target_size};
+    struct Buffer full = {0}, patch = {0};
+    mbedtls_sha256_ret(target, target_size, header.target_sha256, 0);
+    deflate_buffer(&full, target, target_size);
+    if (base_path)
+    {
+        struct Buffer raw = {0};
+        unsigned char *base = load(base_path, &base_size);
+        delta(&raw, base, base_size, target, target_size);
+        deflate_buffer(&patch, raw.data, raw.length);
+        printf("delta: %zu bytes, %zu deflated, full image %zu deflated\n", raw.length, patch.length, full.length);
+        if (patch.length < full.length)
+        {
+            header.type = UPGRADE_DELTA;
+            mbedtls_sha256_ret(base, base_size, header.base_sha256, 0);
+        }
+        free(base);
+        free(raw.data);
+    }
+    const struct Buffer *payload = header.type == UPGRADE_DELTA ? &patch : &full;
+    header.payload = payload->length;
+
+    FILE *out = fopen(output, "wb");
+    if (!out || fwrite(&header, sizeof(header), 1, out) != 1 ||
+        fwrite(payload->data, 1, payload->length, out) != payload->length || fclose(out))
+        fail("write failed");
+    printf("%s image: %u byte payload for a %zu byte binary\n", header.type == UPGRADE_DELTA ? "delta" : "full",
+           header.payload, target_size);
+    free(target);
+    free(full.data);
+    free(patch.data);
+    return 0;
+}
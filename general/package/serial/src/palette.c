@@ -0,0 +1,71 @@
+#include "palette.h"
+
+// 4x4 ordered dither thresholds, spread over 0..255 when scaled by 16
+static const unsigned char bayer[4][4] = {{0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}};
+
+uint32_t argb1555_to_8888(int color)
+{
+    uint32_t r = (color >> 10) & 0x1F, g = (color >> 5) & 0x1F, b = color & 0x1F;
+    uint32_t alpha = color & 0x8000 ? 0xFF000000u : 0;
+    return alpha | ((r << 3 | r >> 2) << 16) | ((g << 3 | g >> 2) << 8) | (b << 3 | b >> 2);
+}
+
+// A transparent end takes the colour of the other one, only alpha ramps
+static uint32_t lerp(uint32_t from, uint32_t to, int t, int range)
+{
+    if (!(from >> 24))
+        from = to & 0x00FFFFFF;
+    if (!(to >> 24))
+        to = from & 0x00FFFFFF;
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8)
+    {
+        int a = from >> shift & 0xFF, b = to >> shift & 0xFF;
+        out |= (uint32_t)((a * (range - t) + b * t + range / 2) / range) << shift;
+    }
+    return out;
+}
+
+// Colours of the levels an index stands for, background through outline to
+// the glyph colour (all ARGB1555)
+void palette_ramp(uint32_t *palette, int bits, int background, int outline, int color)
+{
+    int entries = 1 << bits;
+    uint32_t bg = argb1555_to_8888(background), ol = argb1555_to_8888(outline), fg = argb1555_to_8888(color);
+    for (int i = 0; i < entries; i++)
+    {
+        int level = i * 255 / (entries - 1);
+        if (!outline)
+            palette[i] = lerp(bg, fg, level, 255);
+        else if (level <= PALETTE_OUTLINE)
+            palette[i] = lerp(bg, ol, level, PALETTE_OUTLINE);
+        else
+            palette[i] = lerp(ol, fg, level - PALETTE_OUTLINE, 255 - PALETTE_OUTLINE);
+    }
+}
+
+// Dither and pack columns x0..x1-1 of height rows starting at surface row y0
+// (dest points at that row), x0 is a multiple of the pixels per byte and
+// levels holds the columns from x0 on. Levels 0 and 255 always land on the
+// first and last index.
+void palette_pack(unsigned char *dest, int stride, const unsigned char *levels, int lstride, int x0, int x1,
+                  int y0, int height, int bits)
+{
+    int ppb = PALETTE_PPB(bits), top = (1 << bits) - 1;
+    for (int y = y0; y < y0 + height; y++, dest += stride, levels += lstride)
+    {
+        const unsigned char *threshold = bayer[y & 3];
+        unsigned char *out = dest + x0 / ppb;
+        for (int x = x0; x < x1; out++)
+        {
+            unsigned char byte = 0;
+            for (int k = 0; k < ppb; k++, x++)
+            {
+                byte <<= bits;
+                if (x < x1)
+                    byte |= (levels[x - x0] * top + threshold[x & 3] * 16 + 8) / 255;
+            }
+            *out = byte;
+        }
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef PALETTE_H_
+#define PALETTE_H_
+#include <stdint.h>
+
+// Palette (I2, I4) surfaces are drawn as 8-bit levels along one ramp, 0 the
+// background and 255 the glyph colour with outlines at PALETTE_OUTLINE, and
+// dithered down to the index depth when packed. Index 0 doubles as the
+// background (transparent without one), the leftmost pixel of a byte sits in
+// its high bits.
+#define PALETTE_SIZE 16
+#define PALETTE_OUTLINE 85
+
+// Pixels of a packed row in one byte
+#define PALETTE_PPB(bits) (8 / (bits))
+// Bytes of a packed row
+#define PALETTE_STRIDE(width, bits) (((width) * (bits) + 7) / 8)
+
+uint32_t argb1555_to_8888(int color);
+void palette_ramp(uint32_t *palette, int bits, int background, int outline, int color);
+void palette_pack(unsigned char *dest, int stride, const unsigned char *levels, int lstride, int x0, int x1,
+                  int y0, int height, int bits);
+#endif
@@ -0,0 +1,83 @@
+#include "pool.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// First-fit allocator over a single static block, freed neighbours are merged
+// so the same few bitmap sizes keep fitting without fragmenting the heap.
+// Requests that do not fit fall back to malloc().
+struct Chunk
+{
+    size_t size; // payload bytes following the header
+    bool used;
+};
+
+#define ALIGN(n) (((n) + sizeof(uintptr_t) * 2 - 1) & ~(sizeof(uintptr_t) * 2 - 1))
+#define HEADER ALIGN(sizeof(struct Chunk))
+
+static union
+{
+    unsigned char bytes[POOL_SIZE];
+    uintptr_t align;
+} pool;
+static bool ready;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct Chunk *next_chunk(struct Chunk *chunk)
+{
+    unsigned char *next = (unsigned char *)chunk + HEADER + chunk->size;
+    return next < pool.bytes + POOL_SIZE ? (struct Chunk *)next : NULL;
+}
+
+void *pool_alloc(size_t size)
+{
+    size = ALIGN(size ? size : 1);
+    pthread_mutex_lock(&lock);
+    if (!ready)
+    {
+        struct Chunk *first = (struct Chunk *)pool.bytes;
+        first->size = POOL_SIZE - HEADER;
+        first->used = false;
+        ready = true;
+    }
+    for (struct Chunk *chunk = (struct Chunk *)pool.bytes; chunk; chunk = next_chunk(chunk))
+    {
+        if (chunk->used || chunk->size < size)
+            continue;
+        // split when the rest can hold another header and some payload
+        if (chunk->size >= size + HEADER + ALIGN(1))
+        {
+            struct Chunk *rest = (struct Chunk *)((unsigned char *)chunk + HEADER + size);
+            rest->size = chunk->size - size - HEADER;
+            rest->used = false;
+            chunk->size = size;
+        }
+        chunk->used = true;
+        pthread_mutex_unlock(&lock);
+        return (unsigned char *)chunk + HEADER;
+    }
+    pthread_mutex_unlock(&lock);
+    return malloc(size);
+}
+
+void pool_free(void *ptr)
+{
+    unsigned char *p = ptr;
+    if (p < pool.bytes || p >= pool.bytes + POOL_SIZE)
+    {
+        free(ptr);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    ((struct Chunk *)(p - HEADER))->used = false;
+    // merge runs of free chunks in one sweep
+    for (struct Chunk *chunk = (struct Chunk *)pool.bytes; chunk; chunk = next_chunk(chunk))
+    {
+        struct Chunk *next;
+        while (!chunk->used && (next = next_chunk(chunk)) && !next->used)
+            chunk->size += HEADER + next->size;
+    }
+    pthread_mutex_unlock(&lock);
+}
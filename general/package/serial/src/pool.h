@@ -0,0 +1,10 @@
+#ifndef POOL_H_
+#define POOL_H_
+#include <stddef.h>
+
+// One block shared by every region bitmap, enough for MAX_OSD full-width lines
+#define POOL_SIZE (512 * 1024)
+
+void *pool_alloc(size_t size);
+void pool_free(void *ptr);
+#endif
@@ -1,7 +1,14 @@
 #include "region.h"
+#include "app_config.h"
 #include "common.h"
+#include "image.h"
+#include "palette.h"
+#include "pool.h"
 #include "pthread.h"
+#include "stats.h"
 #include "text.h"
+#include <stdbool.h>
+#include <strings.h>
 
 const double inv16 = 1.0 / 16.0;
 char timefmt[32] = DEF_TIMEFMT;
@@ -32,7 +39,7 @@ int create_region(int *handle, int x, int y, int width, int height)
     stRegion.eType = E_MI_RGN_TYPE_OSD;
     stRegion.stOsdInitParam.stSize.u32Height = height;
     stRegion.stOsdInitParam.stSize.u32Width = width;
-    stRegion.stOsdInitParam.ePixelFmt = PIXEL_FORMAT_1555;
+    stRegion.stOsdInitParam.ePixelFmt = app_config.osd_format;
 
     s32Ret = MI_RGN_GetAttr(*handle, &stRegionCurrent);
 
@@ -73,16 +80,18 @@ int create_region(int *handle, int x, int y, int width, int height)
     if (s32Ret)
         fprintf(stderr, "[%s:%d]RGN_GetDisplayAttr failed with %#x %d, attaching...\n", __func__, __LINE__, s32Ret,
                 *handle);
-    else if (stChnAttrCurrent.stPoint.u32X != x || stChnAttrCurrent.stPoint.u32Y != y)
+    else if (stChnAttrCurrent.stPoint.u32X != (MI_U32)x || stChnAttrCurrent.stPoint.u32Y != (MI_U32)y)
 
     {
         fprintf(stderr, "[%s:%d] Position has changed, detaching handle %d from channel %d...\n", __func__, __LINE__,
-                *handle, &stChn.s32ChnId);
+                *handle, stChn.s32ChnId);
         stChn.s32OutputPortId = 1;
         MI_RGN_DetachFromChn(*handle, &stChn);
         stChn.s32OutputPortId = 0;
         MI_RGN_DetachFromChn(*handle, &stChn);
     }
+    else
+        return 0; // attached where it belongs
 
     memset(&stChnAttr, 0, sizeof(MI_RGN_ChnPortParam_t));
     stChnAttr.bShow = 1;
@@ -94,7 +103,7 @@ int create_region(int *handle, int x, int y, int width, int height)
     stChnAttr.unPara.stOsdChnPort.stOsdAlphaAttr.stAlphaPara.stArgb1555Alpha.u8FgAlpha = 255;
 
     stChn.s32OutputPortId = 0;
-    MI_RGN_AttachToChn(*handle, &stChn, &stChnAttr);
+    s32Ret = MI_RGN_AttachToChn(*handle, &stChn, &stChnAttr);
     stChn.s32OutputPortId = 1;
     MI_RGN_AttachToChn(*handle, &stChn, &stChnAttr);
     return s32Ret;
@@ -102,129 +111,31 @@ int create_region(int *handle, int x, int y, int width, int height)
 
 int prepare_bitmap(const char *filename, BITMAP *bitmap, int bFil, unsigned int u16FilColor, int enPixelFmt)
 {
-    OSD_SURFACE_S Surface;
-    OSD_BITMAPFILEHEADER bmpFileHeader;
-    OSD_BITMAPINFO bmpInfo;
-    int s32BytesPerPix = 2;
-    unsigned char *pu8Data;
-    int R_Value;
-    int G_Value;
-    int B_Value;
-    int Gr_Value;
-    unsigned char Value_tmp;
-    unsigned char Value;
-    int s32Width;
-
-    if (parse_bitmap(filename, &bmpFileHeader, &bmpInfo) < 0)
-    {
-        fprintf(stderr, "GetBmpInfo err!\n");
-        return -1;
-    }
-
-    switch (enPixelFmt)
-    {
-    case PIXEL_FORMAT_4444:
-        Surface.enColorFmt = OSD_COLOR_FMT_RGB4444;
-        break;
-    case PIXEL_FORMAT_1555:
-        Surface.enColorFmt = OSD_COLOR_FMT_RGB1555;
-        break;
-    case PIXEL_FORMAT_2BPP:
-        Surface.enColorFmt = OSD_COLOR_FMT_RGB1555;
-        break;
-    case PIXEL_FORMAT_8888:
-        Surface.enColorFmt = OSD_COLOR_FMT_RGB8888;
-        s32BytesPerPix = 4;
-        break;
-    default:
-        fprintf(stderr, "enPixelFormat err %d \n", enPixelFmt);
-        return -1;
-    }
+    return load_logo(filename, bitmap, enPixelFmt, bFil, u16FilColor);
+}
 
-    if (!(bitmap->pData = malloc(s32BytesPerPix * bmpInfo.bmiHeader.biWidth * bmpInfo.bmiHeader.biHeight)))
+// Palette of I2 and I4 regions, given as osd.palette or ramped from the OSD colours
+void region_palette(MI_RGN_PaletteTable_t *table)
+{
+    uint32_t palette[PALETTE_SIZE] = {0};
+    int entries = app_config.osd_palette_size;
+    if (entries)
+        memcpy(palette, app_config.osd_palette, entries * sizeof(*palette));
+    else
     {
-        fputs("malloc osd memory err!\n", stderr);
-        return -1;
+        int bits = palette_bits(app_config.osd_format) == 2 ? 2 : 4;
+        palette_ramp(palette, bits, app_config.osd_background, app_config.osd_outline, app_config.osd_color);
+        entries = 1 << bits;
     }
-
-    CreateSurfaceByBitMap(filename, &Surface, (unsigned char *)(bitmap->pData));
-
-    bitmap->u32Width = Surface.u16Width;
-    bitmap->u32Height = Surface.u16Height;
-    bitmap->enPixelFormat = enPixelFmt;
-
-    int i, j, k;
-    unsigned char *pu8Temp;
-
-#ifndef __16CV300__
-    if (enPixelFmt == PIXEL_FORMAT_2BPP)
+    memset(table, 0, sizeof(*table));
+    for (int i = 0; i < entries; i++)
     {
-        s32Width = DIV_UP(bmpInfo.bmiHeader.biWidth, 4);
-        pu8Data = malloc(s32Width * bmpInfo.bmiHeader.biHeight);
-        if (!pu8Data)
-        {
-            fputs("malloc osd memory err!\n", stderr);
-            return -1;
-        }
+        MI_RGN_PaletteElement_t *element = &table->astElement[i];
+        element->u8Alpha = palette[i] >> 24;
+        element->u8Red = palette[i] >> 16;
+        element->u8Green = palette[i] >> 8;
+        element->u8Blue = palette[i];
     }
-
-#endif
-    if (enPixelFmt != PIXEL_FORMAT_2BPP)
-    {
-        unsigned short *pu16Temp;
-        pu16Temp = (unsigned short *)bitmap->pData;
-        if (bFil)
-        {
-            for (i = 0; i < bitmap->u32Height; i++)
-            {
-                for (j = 0; j < bitmap->u32Width; j++)
-                {
-                    if (u16FilColor == *pu16Temp)
-                    {
-                        *pu16Temp &= 0x7FFF;
-                    }
-
-                    pu16Temp++;
-                }
-            }
-        }
-    }
-    else
-    {
-        unsigned short *pu16Temp;
-
-        pu16Temp = (unsigned short *)bitmap->pData;
-        pu8Temp = (unsigned char *)pu8Data;
-
-        for (i = 0; i < bitmap->u32Height; i++)
-        {
-            for (j = 0; j < bitmap->u32Width / 4; j++)
-            {
-                Value = 0;
-
-                for (k = j; k < j + 4; k++)
-                {
-                    B_Value = *pu16Temp & 0x001F;
-                    G_Value = *pu16Temp >> 5 & 0x001F;
-                    R_Value = *pu16Temp >> 10 & 0x001F;
-                    pu16Temp++;
-
-                    Gr_Value = (R_Value * 299 + G_Value * 587 + B_Value * 144 + 500) / 1000;
-                    if (Gr_Value > 16)
-                        Value_tmp = 0x01;
-                    else
-                        Value_tmp = 0x00;
-                    Value = (Value << 2) + Value_tmp;
-                }
-                *pu8Temp = Value;
-                pu8Temp++;
-            }
-        }
-        free(bitmap->pData);
-        bitmap->pData = pu8Data;
-    }
-
-    return 0;
 }
 
 int set_bitmap(int handle, BITMAP *bitmap)
@@ -256,140 +167,369 @@ void unload_region(int *handle)
         fprintf(stderr, "[%s:%d]RGN_Destroy failed with %#x %d!\n", __func__, __LINE__, s32Ret, *handle);
 }
 
-static void fill(char *str)
+// /proc files stay open and are read again only once the cached sample is
+// older than PROC_MAX_AGE_MS, so every region of a tick shares one read
+#define PROC_MAX_AGE_MS 500
+
+struct ProcReader
 {
-    unsigned int rxb_l, txb_l, cpu_l[6];
-    char out[DATA_SIZE] = "";
-    char param = 0;
-    int ipos = 0, opos = 0;
+    const char *path;
+    int fd;
+    long long stamp;
+    char data[2048];
+};
+
+static struct ProcReader proc_stat = {.path = "/proc/stat", .fd = -1};
+static struct ProcReader proc_net = {.path = "/proc/net/dev", .fd = -1};
+
+static long long now_ms(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static const char *proc_read(struct ProcReader *reader)
+{
+    long long now = now_ms(CLOCK_MONOTONIC);
+    if (reader->stamp && now - reader->stamp < PROC_MAX_AGE_MS)
+        return reader->data;
+    if (reader->fd < 0 && (reader->fd = open(reader->path, O_RDONLY | O_CLOEXEC)) < 0)
+        return NULL;
+    ssize_t n = pread(reader->fd, reader->data, sizeof(reader->data) - 1, 0);
+    if (n < 0)
+        return NULL;
+    reader->data[n] = '\0';
+    reader->stamp = now;
+    return reader->data;
+}
+
+// $C: share of CPU time not spent idle since the previous sample
+static int cpu_usage(void)
+{
+    static unsigned long long last_total, last_idle;
+    static long long sampled;
+    static int usage;
+
+    const char *stat = proc_read(&proc_stat);
+    if (!stat || proc_stat.stamp == sampled)
+        return usage;
+    unsigned long long v[8] = {0};
+    if (sscanf(stat, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6],
+               &v[7]) < 4)
+        return usage;
+    unsigned long long total = 0, idle = v[3] + v[4];
+    for (int i = 0; i < 8; i++)
+        total += v[i];
+    if (sampled && total > last_total)
+        usage = 100 - (idle - last_idle) * 100 / (total - last_total);
+    last_total = total;
+    last_idle = idle;
+    sampled = proc_stat.stamp;
+    return usage;
+}
 
-    while (str[ipos] != 0)
+// $B: receive and send rate of the first interface other than lo, in Kbps
+static void net_rates(int *rx_kbps, int *tx_kbps)
+{
+    static unsigned long long last_rx, last_tx;
+    static long long sampled;
+    static int rx_rate, tx_rate;
+
+    const char *dev = proc_read(&proc_net);
+    if (dev && proc_net.stamp != sampled)
     {
-        if (str[ipos] != '$')
-        {
-            strncat(out, str + ipos, 1);
-            opos++;
-        }
-        else if (str[ipos + 1] == 'B')
+        const char *line = dev;
+        // two header lines, then "name: rx_bytes 7 more rx fields tx_bytes ..."
+        for (int skip = 2; skip && line; skip--)
+            if ((line = strchr(line, '\n')))
+                line++;
+        for (; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL)
         {
-            ipos++;
-            struct ifaddrs *ifaddr, *ifa;
-            if (getifaddrs(&ifaddr) == -1)
+            char name[32];
+            unsigned long long rx, tx, skipped;
+            if (sscanf(line, " %31[^:]: %llu %llu %llu %llu %llu %llu %llu %llu %llu", name, &rx, &skipped, &skipped,
+                       &skipped, &skipped, &skipped, &skipped, &skipped, &tx) != 10 ||
+                equals(name, "lo"))
                 continue;
-
-            for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
+            long long elapsed = proc_net.stamp - sampled;
+            if (sampled && elapsed > 0)
             {
-                if (equals(ifa->ifa_name, "lo"))
-                    continue;
-                if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_PACKET)
-                    continue;
-                if (!ifa->ifa_data)
-                    continue;
-
-                struct rtnl_link_stats *stats = ifa->ifa_data;
-                char b[32];
-                sprintf(b, "R:%dKbps S:%dKbps", (stats->rx_bytes - rxb_l) / 1024, (stats->tx_bytes - txb_l) / 1024);
-                strcat(out, b);
-                opos += strlen(b);
-                rxb_l = stats->rx_bytes;
-                txb_l = stats->tx_bytes;
-                break;
+                rx_rate = (rx - last_rx) * 8 / elapsed;
+                tx_rate = (tx - last_tx) * 8 / elapsed;
             }
+            last_rx = rx;
+            last_tx = tx;
+            break;
+        }
+        sampled = proc_net.stamp;
+    }
+    *rx_kbps = rx_rate;
+    *tx_kbps = tx_rate;
+}
+
+// Function to expand the $B (network), $C (CPU), $M (memory), $t (time) and
+// $$ macros of an OSD template
+static void fill(const char *str, char *out, size_t size)
+{
+    size_t opos = 0;
+    out[0] = '\0';
 
-            freeifaddrs(ifaddr);
+    for (int ipos = 0; str[ipos] && opos < size - 1; ipos++)
+    {
+        int n = 0;
+        if (str[ipos] != '$' || !str[ipos + 1])
+        {
+            out[opos++] = str[ipos];
+            out[opos] = '\0';
+            continue;
         }
-        else if (str[ipos + 1] == 'C')
+        switch (str[++ipos])
+        {
+        case 'B':
         {
-            ipos++;
-            char tmp[6];
-            unsigned int cpu[6];
-            FILE *stat = fopen("/proc/stat", "r");
-            fscanf(stat, "%s %u %u %u %u %u %u", tmp, &cpu[0], &cpu[1], &cpu[2], &cpu[3], &cpu[4], &cpu[5]);
-            fclose(stat);
-
-            char c[5];
-            char avg = 100 - (cpu[3] - cpu_l[3]) / sysconf(_SC_NPROCESSORS_ONLN);
-            sprintf(c, "%d%%", avg);
-            strcat(out, c);
-            opos += strlen(c);
-            for (int i = 0; i < sizeof(cpu) / sizeof(cpu[0]); i++)
-                cpu_l[i] = cpu[i];
+            int rx, tx;
+            net_rates(&rx, &tx);
+            n = snprintf(out + opos, size - opos, "R:%dKbps S:%dKbps", rx, tx);
+            break;
         }
-        else if (str[ipos + 1] == 'M')
+        case 'C':
+            n = snprintf(out + opos, size - opos, "%d%%", cpu_usage());
+            break;
+        case 'M':
         {
-            ipos++;
             struct sysinfo si;
             sysinfo(&si);
-
-            char m[16];
-            short used = (si.freeram + si.bufferram) / 1024 / 1024;
-            short total = si.totalram / 1024 / 1024;
-            sprintf(m, "%d/%dMB", used, total);
-            strcat(out, m);
-            opos += strlen(m);
+            unsigned long long unit = si.mem_unit ? si.mem_unit : 1;
+            n = snprintf(out + opos, size - opos, "%llu/%lluMB",
+                         (si.totalram - si.freeram - si.bufferram) * unit / 1024 / 1024,
+                         si.totalram * unit / 1024 / 1024);
+            break;
         }
-        else if (str[ipos + 1] == 't')
+        case 't':
         {
-            ipos++;
-            char s[64];
             time_t t = time(NULL);
-            struct tm *tm = gmtime(&t);
-            strftime(s, 64, timefmt, tm);
-            strcat(out, s);
-            opos += strlen(s);
+            struct tm tm;
+            n = strftime(out + opos, size - opos, timefmt, localtime_r(&t, &tm));
+            break;
         }
-        else if (str[ipos + 1] == '$')
+        case '$':
+            n = snprintf(out + opos, size - opos, "$");
+            break;
+        }
+        opos = MIN(opos + MAX(n, 0), size - 1);
+    }
+}
+
+// What is on screen for each OSD, regions only ever grow
+static struct OsdCanvas
+{
+    RECT area;
+    char font[32];
+    double size;
+    char text[DATA_SIZE];
+    TEXTSTATE state;
+} canvases[MAX_OSD];
+
+// Function to bring an OSD up to date, only the glyphs that changed are
+// redrawn in place on the region canvas
+static void draw_osd(int id, const char *font, const char *text)
+{
+    struct OsdCanvas *c = &canvases[id];
+    if (c->state.serial && c->size == osds[id].size && equals(c->font, osds[id].font) && equals(c->text, text))
+    {
+        stats_osd(OSD_SKIPPED);
+        return;
+    }
+
+    TEXTSTYLE style = {.color = osds[id].color,
+                       .background = osds[id].background,
+                       .outline = osds[id].outline,
+                       .align = osds[id].align,
+                       .width = osds[id].width,
+                       .padding = osds[id].background ? 2 : 0,
+                       .bits = palette_bits(app_config.osd_format)};
+    RECT need = measure_text(font, osds[id].size, text, &style);
+    if (need.width > c->area.width || need.height > c->area.height)
+    {
+        c->area.width = MAX(need.width, c->area.width);
+        c->area.height = MAX(need.height, c->area.height);
+        memset(&c->state, 0, sizeof(c->state));
+        if (create_region(&osds[id].hand, osds[id].posx, osds[id].posy, c->area.width, c->area.height))
         {
-            ipos++;
-            strcat(out, "$");
-            opos++;
+            memset(&c->area, 0, sizeof(c->area));
+            return;
         }
-        ipos++;
+        stats_osd(OSD_RECREATED);
+    }
+
+    MI_RGN_CanvasInfo_t info;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (MI_RGN_GetCanvasInfo(osds[id].hand, &info))
+    {
+        // no canvas access, upload the whole bitmap
+        BITMAP bitmap = raster_text(font, osds[id].size, text, &style);
+        stats_span(SPAN_RENDER, &start);
+        set_bitmap(osds[id].hand, &bitmap);
+        pool_free(bitmap.pData);
+        memset(&c->state, 0, sizeof(c->state));
+        stats_osd(OSD_FULL);
     }
-    strncpy(str, out, DATA_SIZE);
+    else
+    {
+        SFT_Image dest = {.pixels = (void *)(uintptr_t)info.virtAddr,
+                          .width = style.bits ? info.u32Stride : info.u32Stride / 2,
+                          .height = info.stSize.u32Height};
+        RECT area = {.width = MIN(c->area.width, (int)info.stSize.u32Width),
+                     .height = MIN(c->area.height, (int)info.stSize.u32Height)};
+        int ret = update_text(font, osds[id].size, text, &style, &c->state, &dest, area);
+        stats_span(SPAN_RENDER, &start);
+        MI_RGN_UpdateCanvas(osds[id].hand);
+        stats_osd(ret == TEXT_FULL ? OSD_FULL : ret == TEXT_PARTIAL ? OSD_PARTIAL : OSD_SKIPPED);
+    }
+    strncpy(c->font, osds[id].font, sizeof(c->font) - 1);
+    c->size = osds[id].size;
+    strncpy(c->text, text, sizeof(c->text) - 1);
+}
+
+// A template naming a .bmp or .png file shows that image instead of text
+static bool is_logo(const char *text)
+{
+    const char *dot = strrchr(text, '.');
+    return dot && (!strcasecmp(dot, ".bmp") || !strcasecmp(dot, ".png"));
+}
+
+// Function to show a logo on an OSD, the file is read again on every redraw so
+// a refresh interval picks up a rewritten image
+static void draw_logo(int id, const char *path)
+{
+    struct OsdCanvas *c = &canvases[id];
+    BITMAP bitmap;
+    if (prepare_bitmap(path, &bitmap, 0, 0, app_config.osd_format))
+        return;
+    if (!create_region(&osds[id].hand, osds[id].posx, osds[id].posy, bitmap.u32Width, bitmap.u32Height) &&
+        !set_bitmap(osds[id].hand, &bitmap))
+    {
+        // the region has the size of the logo, text drawn next starts from scratch
+        c->area = (RECT){.width = bitmap.u32Width, .height = bitmap.u32Height};
+        memset(&c->state, 0, sizeof(c->state));
+        strncpy(c->text, path, sizeof(c->text) - 1);
+        stats_osd(OSD_FULL);
+    }
+    else
+        memset(&c->area, 0, sizeof(c->area));
+    free(bitmap.pData);
 }
 
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER;
+// Waits run on CLOCK_MONOTONIC (set up in start_region_handler), an RTC step must not stretch them
+static pthread_cond_t region_wake;
+
+// Function to replace the template of an OSD, it is redrawn right away
+void region_set_text(int id, const char *text)
+{
+    pthread_mutex_lock(&region_lock);
+    strncpy(osds[id].text, text, sizeof(osds[id].text) - 1);
+    osds[id].text[sizeof(osds[id].text) - 1] = '\0';
+    osds[id].updt = 1;
+    pthread_cond_signal(&region_wake);
+    pthread_mutex_unlock(&region_lock);
+}
+
+// Each OSD is redrawn when its refresh interval is due (aligned to the wall
+// clock, so a 1 s clock flips right after the second) or when it was updated,
+// the thread sleeps until the earliest deadline in between
 void *region_thread()
 {
-    for (char id = 0; id < MAX_OSD; id++)
+    long long due[MAX_OSD] = {0};
+    long long started = now_ms(CLOCK_MONOTONIC);
+    bool shown = false;
+
+    for (int id = 0; id < MAX_OSD; id++)
     {
         osds[id].hand = id;
-        osds[id].color = DEF_COLOR;
+        osds[id].color = app_config.osd_color;
+        osds[id].background = app_config.osd_background;
+        osds[id].outline = app_config.osd_outline;
+        osds[id].align = app_config.osd_align;
+        osds[id].width = app_config.osd_width;
         osds[id].opal = DEF_OPAL;
         osds[id].size = DEF_SIZE;
-        osds[id].posx = DEF_POSX;
-        osds[id].posy = DEF_POSY + (DEF_SIZE * 3 / 2) * id;
-        osds[id].updt = 0;
+        osds[id].posx = app_config.osd_slots[id].x;
+        osds[id].posy = app_config.osd_slots[id].y;
+        osds[id].refresh = app_config.osd_slots[id].refresh;
+        osds[id].updt = 1;
         strcpy(osds[id].font, DEF_FONT);
-        osds[id].text[0] = '\0';
+        strcpy(osds[id].text, app_config.osd_slots[id].text);
     }
+
     while (keep_running)
     {
+        long long now = now_ms(CLOCK_REALTIME);
+        long long next = now + 1000;
         for (int id = 0; id < MAX_OSD; id++)
         {
-            char out[DATA_SIZE];
-            time_t t = time(NULL);
-            struct tm *tm = localtime(&t);
-            strftime(out, sizeof(out), timefmt, tm);
-            strcat(out, osds[id].text);
-            char *font;
-            asprintf(&font, "/usr/share/fonts/truetype/%s.ttf", osds[id].font);
-            if (!access(font, F_OK))
+            char template[sizeof(osds[id].text)];
+            pthread_mutex_lock(&region_lock);
+            bool forced = osds[id].updt;
+            osds[id].updt = 0;
+            strcpy(template, osds[id].text);
+            pthread_mutex_unlock(&region_lock);
+
+            int refresh = osds[id].refresh;
+            // a clock step (RTC command) invalidates the deadline
+            if (refresh && due[id] > now + refresh)
+                due[id] = 0;
+            if (forced || (refresh && now >= due[id]))
             {
-                RECT rect = measure_text(font, osds[id].size, out);
-                create_region(&osds[id].hand, osds[id].posx, osds[id].posy, rect.width, rect.height);
-                BITMAP bitmap = raster_text(font, osds[id].size, out);
-                set_bitmap(osds[id].hand, &bitmap);
-                free(bitmap.pData);
+                char out[DATA_SIZE];
+                char font[80];
+                fill(template, out, sizeof(out));
+                snprintf(font, sizeof(font), "/usr/share/fonts/truetype/%s.ttf", osds[id].font);
+                // unused slots never get a region
+                if (is_logo(out))
+                    draw_logo(id, out);
+                else if ((out[0] || canvases[id].area.width) && !access(font, F_OK))
+                {
+                    draw_osd(id, font, out);
+                    // startup cost of font loading, with or without a glyph atlas
+                    if (!shown)
+                        printf("[region] first OSD drawn after %lld ms\n", now_ms(CLOCK_MONOTONIC) - started);
+                    shown = true;
+                }
+                if (refresh)
+                    due[id] = (now / refresh + 1) * refresh;
             }
+            if (refresh)
+                next = MIN(next, due[id]);
         }
-        sleep(1);
+
+        pthread_mutex_lock(&region_lock);
+        bool pending = false;
+        for (int id = 0; id < MAX_OSD; id++)
+            pending |= osds[id].updt;
+        if (!pending && keep_running)
+        {
+            // deadlines are on the wall clock, the wait is not
+            long long until_ms = now_ms(CLOCK_MONOTONIC) + MAX(next - now_ms(CLOCK_REALTIME), 0);
+            struct timespec until = {.tv_sec = until_ms / 1000, .tv_nsec = until_ms % 1000 * 1000000};
+            pthread_cond_timedwait(&region_wake, &region_lock, &until);
+        }
+        pthread_mutex_unlock(&region_lock);
     }
+    return NULL;
 }
 
 int start_region_handler()
 {
     printf("start_region_handler\n");
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&region_wake, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
     pthread_attr_t thread_attr;
     pthread_attr_init(&thread_attr);
     size_t stacksize;
@@ -405,6 +545,7 @@ int start_region_handler()
         printf("[region] Error:  Can't set stack size %zu\n", stacksize);
     }
     pthread_attr_destroy(&thread_attr);
+    return 0;
 }
 
 void stop_region_handler()
@@ -8,6 +8,7 @@ extern "C"
 #endif
 #endif
 
+#include "app_config.h"
 #include "bitmap.h"
 #include "common.h"
 #define DATA_SIZE (256)
@@ -19,16 +20,24 @@ extern "C"
 #define DEF_POSY 16
 #define DEF_SIZE 32.0f
 #define DEF_TIMEFMT "%Y/%m/%d %H:%M:%S"
+#define DEF_REFRESH 1000 // ms, the timestamp OSD
 #define MAX_CONN 16
-#define MAX_OSD 1
+#define MAX_OSD OSD_SLOTS
 #define PORT "9000"
 #define QUEUE_SIZE 1000000
-#define SUPP_UTF32
+
+    // Index depth of a palette pixel format, 0 for direct colour
+    static inline int palette_bits(int format)
+    {
+        return format == PIXEL_FORMAT_2BPP ? 2 : format == PIXEL_FORMAT_4BPP ? 4 : 0;
+    }
 
     int create_region(int *handle, int x, int y, int width, int height);
     int prepare_bitmap(const char *filename, BITMAP *bitmap, int bFil, unsigned int u16FilColor, int enPixelFmt);
+    void region_palette(MI_RGN_PaletteTable_t *table);
     int set_bitmap(int handle, BITMAP *bitmap);
     void unload_region(int *handle);
+    void region_set_text(int id, const char *text);
     int start_region_handler();
     void stop_region_handler();
     extern OSD osds[MAX_OSD];
@@ -0,0 +1,341 @@
+// Host stand-in for the MI_RGN calls of region.c and main.c (make host). Regions
+// live in memory with the driver's stride alignment, attached ones are
+// composited onto a frame of RGN_FRAME pixels (WxH, 1920x1080 by default) that
+// is written to the PNG named by RGN_DUMP at most once a second and on exit.
+// Counters for region churn and canvas memory are printed by MI_RGN_DeInit.
+#include "mi_rgn.h"
+#include "palette.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#define HOST_REGIONS 64
+#define HOST_PORTS 2
+// Canvas rows are aligned like the driver's, catches code ignoring the stride
+#define HOST_ALIGN 16
+
+struct HostRegion
+{
+    MI_BOOL created;
+    MI_RGN_Attr_t attr;
+    MI_U32 stride;
+    unsigned char *canvas;
+    MI_BOOL attached[HOST_PORTS];
+    MI_RGN_ChnPortParam_t param[HOST_PORTS];
+};
+
+static struct HostRegion regions[HOST_REGIONS];
+static MI_RGN_PaletteTable_t palette;
+static MI_BOOL initialized;
+static struct
+{
+    unsigned long created, destroyed, bitmaps, updates, dumps;
+    size_t bytes, peak;
+} counters;
+static long long dumped;
+
+// Handles are unsigned, a negative int from the caller fails the upper bound
+static struct HostRegion *lookup(MI_RGN_HANDLE handle)
+{
+    if (!initialized || handle >= HOST_REGIONS || !regions[handle].created)
+        return NULL;
+    return &regions[handle];
+}
+
+static MI_U32 row_bytes(MI_RGN_PixelFormat_e format, MI_U32 width)
+{
+    switch (format)
+    {
+    case E_MI_RGN_PIXEL_FORMAT_I2:
+        return PALETTE_STRIDE(width, 2);
+    case E_MI_RGN_PIXEL_FORMAT_I4:
+        return PALETTE_STRIDE(width, 4);
+    case E_MI_RGN_PIXEL_FORMAT_ARGB8888:
+        return width * 4;
+    default:
+        return width * 2;
+    }
+}
+
+// Pixel x of a canvas row as ARGB8888
+static uint32_t fetch(const struct HostRegion *region, const unsigned char *row, MI_U32 x)
+{
+    const MI_RGN_OsdAlphaAttr_t *attr = &region->param[0].unPara.stOsdChnPort.stOsdAlphaAttr;
+    const MI_RGN_OsdArgb1555Alpha_t *alpha = &attr->stAlphaPara.stArgb1555Alpha;
+    uint32_t p;
+    int index;
+    switch (region->attr.stOsdInitParam.ePixelFmt)
+    {
+    case E_MI_RGN_PIXEL_FORMAT_ARGB1555:
+        p = ((const uint16_t *)row)[x];
+        return (uint32_t)(p & 0x8000 ? alpha->u8FgAlpha : alpha->u8BgAlpha) << 24 | (p >> 10 & 0x1F) << 19 |
+               (p >> 5 & 0x1F) << 11 | (p & 0x1F) << 3;
+    case E_MI_RGN_PIXEL_FORMAT_ARGB4444:
+        p = ((const uint16_t *)row)[x];
+        return (p >> 12) * 0x11u << 24 | (p >> 8 & 0xF) * 0x11 << 16 | (p >> 4 & 0xF) * 0x11 << 8 | (p & 0xF) * 0x11;
+    case E_MI_RGN_PIXEL_FORMAT_ARGB8888:
+        return ((const uint32_t *)row)[x];
+    case E_MI_RGN_PIXEL_FORMAT_I2:
+        index = row[x / 4] >> (6 - 2 * (x % 4)) & 3;
+        break;
+    case E_MI_RGN_PIXEL_FORMAT_I4:
+        index = row[x / 2] >> (x % 2 ? 0 : 4) & 0xF;
+        break;
+    default:
+        return 0;
+    }
+    const MI_RGN_PaletteElement_t *e = &palette.astElement[index];
+    return (uint32_t)e->u8Alpha << 24 | e->u8Red << 16 | e->u8Green << 8 | e->u8Blue;
+}
+
+static void chunk(FILE *file, const char *type, const unsigned char *data, uint32_t size)
+{
+    unsigned char head[8] = {size >> 24, size >> 16, size >> 8, size, type[0], type[1], type[2], type[3]};
+    uint32_t crc = crc32(crc32(0, Z_NULL, 0), head + 4, 4);
+    crc = crc32(crc, data, size);
+    unsigned char tail[4] = {crc >> 24, crc >> 16, crc >> 8, crc};
+    fwrite(head, 1, 8, file);
+    fwrite(data, 1, size, file);
+    fwrite(tail, 1, 4, file);
+}
+
+// Composite the regions attached to output port 0 over a grey frame and write
+// it as an 8-bit RGB PNG
+static void dump(void)
+{
+    const char *path = getenv("RGN_DUMP");
+    unsigned int width = 1920, height = 1080;
+    if (!path)
+        return;
+    if (getenv("RGN_FRAME"))
+        sscanf(getenv("RGN_FRAME"), "%ux%u", &width, &height);
+
+    size_t pitch = 1 + width * 3;
+    uLongf packed = compressBound(pitch * height);
+    unsigned char *frame = malloc(pitch * height), *out = malloc(packed);
+    if (!frame || !out)
+    {
+        free(frame);
+        free(out);
+        return;
+    }
+    memset(frame, 0x80, pitch * height);
+    for (unsigned int y = 0; y < height; y++)
+        frame[y * pitch] = 0; // filter type None
+
+    for (int h = 0; h < HOST_REGIONS; h++)
+    {
+        const struct HostRegion *region = &regions[h];
+        if (!region->created || !region->attached[0] || !region->param[0].bShow)
+            continue;
+        const MI_RGN_Size_t *size = &region->attr.stOsdInitParam.stSize;
+        const MI_RGN_Point_t *at = &region->param[0].stPoint;
+        for (MI_U32 y = 0; y < size->u32Height && at->u32Y + y < height; y++)
+        {
+            unsigned char *dest = frame + (at->u32Y + y) * pitch + 1 + at->u32X * 3;
+            for (MI_U32 x = 0; x < size->u32Width && at->u32X + x < width; x++, dest += 3)
+            {
+                uint32_t p = fetch(region, region->canvas + y * region->stride, x), a = p >> 24;
+                for (int c = 0; c < 3; c++)
+                    dest[c] = (dest[c] * (255 - a) + (p >> (16 - 8 * c) & 0xFF) * a + 127) / 255;
+            }
+        }
+    }
+
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *file = fopen(tmp, "wb");
+    if (file && compress2(out, &packed, frame, pitch * height, 1) == Z_OK)
+    {
+        unsigned char header[13] = {width >> 24, width >> 16, width >> 8, width, height >> 24, height >> 16,
+                                    height >> 8, height, 8, 2, 0, 0, 0};
+        fwrite("\x89PNG\r\n\x1A\n", 1, 8, file);
+        chunk(file, "IHDR", header, sizeof(header));
+        chunk(file, "IDAT", out, packed);
+        chunk(file, "IEND", NULL, 0);
+        if (!fclose(file) && !rename(tmp, path))
+            counters.dumps++;
+    }
+    else if (file)
+        fclose(file);
+    free(frame);
+    free(out);
+}
+
+static void dump_due(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+    if (ms - dumped >= 1000)
+    {
+        dump();
+        dumped = ms;
+    }
+}
+
+MI_S32 MI_RGN_Init(MI_RGN_PaletteTable_t *pstPaletteTable)
+{
+    if (initialized)
+        return MI_ERR_RGN_BUSY;
+    if (pstPaletteTable)
+        palette = *pstPaletteTable;
+    initialized = 1;
+    return MI_RGN_OK;
+}
+
+MI_S32 MI_RGN_DeInit(void)
+{
+    if (!initialized)
+        return MI_ERR_RGN_NOTREADY;
+    dump();
+    for (int h = 0; h < HOST_REGIONS; h++)
+        if (regions[h].created)
+            MI_RGN_Destroy(h);
+    printf("[rgn] %lu regions created, %lu destroyed, %lu bitmaps, %lu canvas updates, %lu dumps, peak canvas %zu "
+           "bytes\n",
+           counters.created, counters.destroyed, counters.bitmaps, counters.updates, counters.dumps, counters.peak);
+    initialized = 0;
+    return MI_RGN_OK;
+}
+
+MI_S32 MI_RGN_Create(MI_RGN_HANDLE hHandle, MI_RGN_Attr_t *pstRegion)
+{
+    if (!initialized || hHandle >= HOST_REGIONS)
+        return MI_ERR_RGN_INVALID_HANDLE;
+    if (!pstRegion)
+        return MI_ERR_RGN_NULL_PTR;
+    struct HostRegion *region = &regions[hHandle];
+    if (region->created)
+        return MI_ERR_RGN_EXIST;
+    const MI_RGN_OsdInitParam_t *init = &pstRegion->stOsdInitParam;
+    if (pstRegion->eType != E_MI_RGN_TYPE_OSD || !init->stSize.u32Width || !init->stSize.u32Height ||
+        init->ePixelFmt >= E_MI_RGN_PIXEL_FORMAT_MAX || init->ePixelFmt == E_MI_RGN_PIXEL_FORMAT_I8 ||
+        init->ePixelFmt == E_MI_RGN_PIXEL_FORMAT_RGB565)
+        return MI_ERR_RGN_NOT_SUPPORT;
+
+    MI_U32 stride = (row_bytes(init->ePixelFmt, init->stSize.u32Width) + HOST_ALIGN - 1) / HOST_ALIGN * HOST_ALIGN;
+    size_t bytes = (size_t)stride * init->stSize.u32Height;
+    unsigned char *canvas = calloc(1, bytes);
+    if (!canvas)
+        return MI_ERR_RGN_NOMEM;
+    memset(region, 0, sizeof(*region));
+    region->created = 1;
+    region->attr = *pstRegion;
+    region->stride = stride;
+    region->canvas = canvas;
+    counters.created++;
+    counters.bytes += bytes;
+    if (counters.bytes > counters.peak)
+        counters.peak = counters.bytes;
+    return MI_RGN_OK;
+}
+
+MI_S32 MI_RGN_Destroy(MI_RGN_HANDLE hHandle)
+{
+    struct HostRegion *region = lookup(hHandle);
+    if (!region)
+        return MI_ERR_RGN_UNEXIST;
+    counters.destroyed++;
+    counters.bytes -= (size_t)region->stride * region->attr.stOsdInitParam.stSize.u32Height;
+    free(region->canvas);
+    memset(region, 0, sizeof(*region));
+    return MI_RGN_OK;
+}
+
+MI_S32 MI_RGN_GetAttr(MI_RGN_HANDLE hHandle, MI_RGN_Attr_t *pstRegion)
+{
+    struct HostRegion *region = lookup(hHandle);
+    if (!region)
+        return MI_ERR_RGN_UNEXIST;
+    *pstRegion = region->attr;
+    return MI_RGN_OK;
+}
+
+// The bitmap replaces the canvas from its top left corner, rows of the bitmap
+// are packed
+MI_S32 MI_RGN_SetBitMap(MI_RGN_HANDLE hHandle, MI_RGN_Bitmap_t *pstBitmap)
+{
+    struct HostRegion *region = lookup(hHandle);
+    if (!region)
+        return MI_ERR_RGN_UNEXIST;
+    const MI_RGN_Size_t *size = &region->attr.stOsdInitParam.stSize;
+    if (!pstBitmap || !pstBitmap->pData)
+        return MI_ERR_RGN_NULL_PTR;
+    if (pstBitmap->ePixelFormat != region->attr.stOsdInitParam.ePixelFmt ||
+        pstBitmap->stSize.u32Width > size->u32Width || pstBitmap->stSize.u32Height > size->u32Height)
+        return MI_ERR_RGN_ILLEGAL_PARAM;
+
+    MI_U32 pitch = row_bytes(pstBitmap->ePixelFormat, pstBitmap->stSize.u32Width);
+    memset(region->canvas, 0, (size_t)region->stride * size->u32Height);
+    for (MI_U32 y = 0; y < pstBitmap->stSize.u32Height; y++)
+        memcpy(region->canvas + y * region->stride, (const unsigned char *)pstBitmap->pData + y * pitch, pitch);
+    counters.bitmaps++;
+    dump_due();
+    return MI_RGN_OK;
+}
+
+MI_S32 MI_RGN_AttachToChn(MI_RGN_HANDLE hHandle, MI_RGN_ChnPort_t *pstChnPort, MI_RGN_ChnPortParam_t *pstChnAttr)
+{
+    struct HostRegion *region = lookup(hHandle);
+    if (!region)
+        return MI_ERR_RGN_UNEXIST;
+    int port = pstChnPort->s32OutputPortId;
+    if (port < 0 || port >= HOST_PORTS)
+        return MI_ERR_RGN_INVALID_CHNID;
+    if (region->attached[port])
+        return MI_ERR_RGN_EXIST;
+    region->attached[port] = 1;
+    region->param[port] = *pstChnAttr;
+    return MI_RGN_OK;
+}
+
+MI_S32 MI_RGN_DetachFromChn(MI_RGN_HANDLE hHandle, MI_RGN_ChnPort_t *pstChnPort)
+{
+    struct HostRegion *region = lookup(hHandle);
+    if (!region)
+        return MI_ERR_RGN_UNEXIST;
+    int port = pstChnPort->s32OutputPortId;
+    if (port < 0 || port >= HOST_PORTS || !region->attached[port])
+        return MI_ERR_RGN_UNEXIST;
+    region->attached[port] = 0;
+    return MI_RGN_OK;
+}
+
+MI_S32 MI_RGN_GetDisplayAttr(MI_RGN_HANDLE hHandle, MI_RGN_ChnPort_t *pstChnPort,
+                             MI_RGN_ChnPortParam_t *pstChnPortAttr)
+{
+    struct HostRegion *region = lookup(hHandle);
+    if (!region)
+        return MI_ERR_RGN_UNEXIST;
+    int port = pstChnPort->s32OutputPortId;
+    if (port < 0 || port >= HOST_PORTS || !region->attached[port])
+        return MI_ERR_RGN_UNEXIST;
+    *pstChnPortAttr = region->param[port];
+    return MI_RGN_OK;
+}
+
+MI_S32 MI_RGN_GetCanvasInfo(MI_RGN_HANDLE hHandle, MI_RGN_CanvasInfo_t *pstCanvasInfo)
+{
+    struct HostRegion *region = lookup(hHandle);
+    if (!region)
+        return MI_ERR_RGN_UNEXIST;
+    memset(pstCanvasInfo, 0, sizeof(*pstCanvasInfo));
+    pstCanvasInfo->virtAddr = (MI_VIRT)(uintptr_t)region->canvas;
+    pstCanvasInfo->stSize = region->attr.stOsdInitParam.stSize;
+    pstCanvasInfo->u32Stride = region->stride;
+    pstCanvasInfo->ePixelFmt = region->attr.stOsdInitParam.ePixelFmt;
+    return MI_RGN_OK;
+}
+
+MI_S32 MI_RGN_UpdateCanvas(MI_RGN_HANDLE hHandle)
+{
+    if (!lookup(hHandle))
+        return MI_ERR_RGN_UNEXIST;
+    counters.updates++;
+    dump_due();
+    return MI_RGN_OK;
+}
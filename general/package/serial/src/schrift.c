@@ -38,6 +38,10 @@
 # include <unistd.h>
 #endif
 
+#if defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
 #include "schrift.h"
 
 #define SCHRIFT_VERSION "0.10.2"
@@ -76,6 +80,12 @@
 #define STACK_FREE(var) \
 	if (var != var##_stack_) free(var);
 
+#if defined(_MSC_VER)
+# define THREAD_LOCAL __declspec(thread)
+#else
+# define THREAD_LOCAL __thread
+#endif
+
 enum { SrcMapping, SrcUser };
 
 /* structs */
@@ -89,7 +99,7 @@ typedef struct Raster  Raster;
 struct Point { double x, y; };
 struct Line  { uint_least16_t beg, end; };
 struct Curve { uint_least16_t beg, end, ctrl; };
-struct Cell  { double area, cover; };
+struct Cell  { float area, cover; };
 
 struct Outline
 {
@@ -141,6 +151,8 @@ static void clip_points(unsigned int numPts, Point *points, int width, int heigh
 /* 'outline' data structure management */
 static int  init_outline(Outline *outl);
 static void free_outline(Outline *outl);
+static int  acquire_outline(Outline *outl);
+static void release_outline(Outline *outl);
 static int  grow_points (Outline *outl);
 static int  grow_curves (Outline *outl);
 static int  grow_lines  (Outline *outl);
@@ -388,7 +400,7 @@ sft_render(const SFT *sft, SFT_Glyph glyph, SFT_Image image)
 	}
 
 	memset(&outl, 0, sizeof outl);
-	if (init_outline(&outl) < 0)
+	if (acquire_outline(&outl) < 0)
 		goto failure;
 
 	if (decode_outline(sft->font, outline, 0, &outl) < 0)
@@ -396,11 +408,11 @@ sft_render(const SFT *sft, SFT_Glyph glyph, SFT_Image image)
 	if (render_outline(&outl, transform, image) < 0)
 		goto failure;
 
-	free_outline(&outl);
+	release_outline(&outl);
 	return 0;
 
 failure:
-	free_outline(&outl);
+	release_outline(&outl);
 	return -1;
 }
 
@@ -628,6 +640,52 @@ free_outline(Outline *outl)
 	free(outl->lines);
 }
 
+/* Buffers kept by each thread between sft_render() calls, so that rendering
+ * the same glyphs over and over does not go through malloc. */
+static THREAD_LOCAL struct {
+	Outline outline;
+	Cell *cells;
+	unsigned int capCells;
+} scratch;
+
+static int
+acquire_outline(Outline *outl)
+{
+	Outline *kept = &scratch.outline;
+	if (kept->points && kept->curves && kept->lines) {
+		*outl = *kept;
+		outl->numPoints = 0;
+		outl->numCurves = 0;
+		outl->numLines  = 0;
+		memset(kept, 0, sizeof *kept);
+		return 0;
+	}
+	free_outline(kept);
+	memset(kept, 0, sizeof *kept);
+	return init_outline(outl);
+}
+
+static void
+release_outline(Outline *outl)
+{
+	free_outline(&scratch.outline);
+	scratch.outline = *outl;
+}
+
+static Cell *
+acquire_cells(unsigned int count)
+{
+	if (count > scratch.capCells || !scratch.cells) {
+		Cell *cells = realloc(scratch.cells, (count ? count : 1) * sizeof *cells);
+		if (!cells)
+			return NULL;
+		scratch.cells    = cells;
+		scratch.capCells = count;
+	}
+	memset(scratch.cells, 0, count * sizeof *scratch.cells);
+	return scratch.cells;
+}
+
 static int
 grow_points(Outline *outl)
 {
@@ -1481,9 +1539,9 @@ draw_line(Raster buf, Point origin, Point goal)
 		yDifference = (nextDistance - prevDistance) * delta.y;
 		cptr = &buf.cells[pixel.y * buf.width + pixel.x];
 		cell = *cptr;
-		cell.cover += yDifference;
+		cell.cover += (float) yDifference;
 		xAverage -= (double) pixel.x;
-		cell.area += (1.0 - xAverage) * yDifference;
+		cell.area += (float) ((1.0 - xAverage) * yDifference);
 		*cptr = cell;
 		prevDistance = nextDistance;
 		int alongX = nextCrossing.x < nextCrossing.y;
@@ -1498,9 +1556,9 @@ draw_line(Raster buf, Point origin, Point goal)
 	yDifference = (1.0 - prevDistance) * delta.y;
 	cptr = &buf.cells[pixel.y * buf.width + pixel.x];
 	cell = *cptr;
-	cell.cover += yDifference;
+	cell.cover += (float) yDifference;
 	xAverage -= (double) pixel.x;
-	cell.area += (1.0 - xAverage) * yDifference;
+	cell.area += (float) ((1.0 - xAverage) * yDifference);
 	*cptr = cell;
 }
 
@@ -1516,19 +1574,41 @@ draw_lines(Outline *outl, Raster buf)
 	}
 }
 
-/* Integrate the values in the buffer to arrive at the final grayscale image. */
+/* Integrate the values in the buffer to arrive at the final grayscale image.
+ * The running coverage is a prefix sum over the cells, vectorised 8 pixels at
+ * a time where NEON is available. */
 static void
 post_process(Raster buf, uint8_t *image)
 {
 	Cell cell;
-	double accum = 0.0, value;
-	unsigned int i, num;
+	float accum = 0.0f, value;
+	unsigned int i = 0, num;
 	num = (unsigned int) buf.width * (unsigned int) buf.height;
-	for (i = 0; i < num; ++i) {
+#if defined(__ARM_NEON)
+	const float32x4_t zero = vdupq_n_f32(0.0f), one = vdupq_n_f32(1.0f);
+	const float32x4_t half = vdupq_n_f32(0.5f), scale = vdupq_n_f32(255.0f);
+	for (; i + 8 <= num; i += 8) {
+		uint16x4_t half_values[2];
+		for (int h = 0; h < 2; ++h) {
+			/* val[0] holds the areas, val[1] the covers */
+			float32x4x2_t c = vld2q_f32((const float *) &buf.cells[i + 4 * h]);
+			/* exclusive prefix sum of the covers, plus what came before */
+			float32x4_t sum = vextq_f32(zero, c.val[1], 3);
+			sum = vaddq_f32(sum, vextq_f32(zero, sum, 3));
+			sum = vaddq_f32(sum, vextq_f32(zero, sum, 2));
+			sum = vaddq_f32(sum, vdupq_n_f32(accum));
+			accum = vgetq_lane_f32(sum, 3) + vgetq_lane_f32(c.val[1], 3);
+			float32x4_t v = vminq_f32(vabsq_f32(vaddq_f32(sum, c.val[0])), one);
+			half_values[h] = vmovn_u32(vcvtq_u32_f32(vmlaq_f32(half, v, scale)));
+		}
+		vst1_u8(image + i, vmovn_u16(vcombine_u16(half_values[0], half_values[1])));
+	}
+#endif
+	for (; i < num; ++i) {
 		cell     = buf.cells[i];
-		value    = fabs(accum + cell.area);
-		value    = MIN(value, 1.0);
-		value    = value * 255.0 + 0.5;
+		value    = fabsf(accum + cell.area);
+		value    = MIN(value, 1.0f);
+		value    = value * 255.0f + 0.5f;
 		image[i] = (uint8_t) value;
 		accum   += cell.cover;
 	}
@@ -1543,11 +1623,10 @@ render_outline(Outline *outl, double transform[6], SFT_Image image)
 
 	numPixels = (unsigned int) image.width * (unsigned int) image.height;
 
-	STACK_ALLOC(cells, Cell, 128 * 128, numPixels);
+	cells = acquire_cells(numPixels);
 	if (!cells) {
 		return -1;
 	}
-	memset(cells, 0, numPixels * sizeof *cells);
 	buf.cells  = cells;
 	buf.width  = image.width;
 	buf.height = image.height;
@@ -1557,7 +1636,6 @@ render_outline(Outline *outl, double transform[6], SFT_Image image)
 	clip_points(outl->numPoints, outl->points, image.width, image.height);
 
 	if (tesselate_curves(outl) < 0) {
-		STACK_FREE(cells);
 		return -1;
 	}
 
@@ -1565,6 +1643,5 @@ render_outline(Outline *outl, double transform[6], SFT_Image image)
 
 	post_process(buf, image.pixels);
 
-	STACK_FREE(cells);
 	return 0;
 }
@@ -1,22 +1,233 @@
 #include "serial.h"
 #include "app_config.h"
+#include "crc.h"
+#include "framer.h"
 #include "data_define.h"
 #include "region.h"
+#include "stats.h"
+#include "transfer.h"
+#include "upgrade.h"
 #include "utils.h"
+#include "variant.h"
+#include "worker.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
+
+// Trace of every frame and reply, with debug: true only: at high baud rates
+// the console costs more than the frame
+#define DEBUG_PRINT(...)                                                                                               \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (app_config.debug)                                                                                          \
+            printf(__VA_ARGS__);                                                                                       \
+    } while (0)
+
 pthread_t serialPid = 0;
 static int uart_out_fd;
-static char path[PATH_MAX];
-static bool need_restart = false;
+static pthread_mutex_t uart_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Framer framer;
+static struct Upgrade upgrade = {.out = -1, .base = -1}; // UART upload, see UPGRADE_BEGIN
+
+// Live baud rate renegotiation: the ack goes out at the old rate, then the
+// UART switches and the host has BAUD_CONFIRM_MS to talk at the new rate
+static struct
+{
+    int current;
+    int pending;
+    int fallback;
+    bool persist;
+    bool awaiting;
+    struct timespec switched;
+} baud;
+
+struct BaudEntry
+{
+    char code;
+    int rate;
+    speed_t speed;
+};
+
+static const struct BaudEntry baud_rates[] = {
+    {BAUD_9600, 9600, B9600},          {BAUD_19200, 19200, B19200},       {BAUD_38400, 38400, B38400},
+    {BAUD_57600, 57600, B57600},       {BAUD_115200, 115200, B115200},    {BAUD_230400, 230400, B230400},
+    {BAUD_460800, 460800, B460800},    {BAUD_921600, 921600, B921600},    {BAUD_1000000, 1000000, B1000000},
+    {BAUD_1500000, 1500000, B1500000}, {BAUD_2000000, 2000000, B2000000}, {BAUD_3000000, 3000000, B3000000},
+};
+
+static const struct BaudEntry *baud_by_code(char code)
+{
+    for (size_t i = 0; i < sizeof(baud_rates) / sizeof(baud_rates[0]); i++)
+        if (baud_rates[i].code == code)
+            return &baud_rates[i];
+    return NULL;
+}
+
+static const struct BaudEntry *baud_by_rate(int rate)
+{
+    for (size_t i = 0; i < sizeof(baud_rates) / sizeof(baud_rates[0]); i++)
+        if (baud_rates[i].rate == rate)
+            return &baud_rates[i];
+    return NULL;
+}
+
+static int set_uart_speed(int fd, int rate)
+{
+    struct termios options;
+    const struct BaudEntry *entry = baud_by_rate(rate);
 
-static int write_data_frame(int fd, struct DataFrame *data_frame);
+    // Let the ack and any queued frame leave at the old rate first, worker replies
+    // wait on the lock so none of them straddles the switch
+    pthread_mutex_lock(&uart_lock);
+    tcdrain(fd);
+    int ret = !entry || tcgetattr(fd, &options) || cfsetispeed(&options, entry->speed) ||
+              cfsetospeed(&options, entry->speed) || tcsetattr(fd, TCSANOW, &options);
+    pthread_mutex_unlock(&uart_lock);
+    if (ret)
+    {
+        fprintf(stderr, "UART does not support %d baud\n", rate);
+        return -1;
+    }
+    // Anything still buffered was received at the old rate
+    tcflush(fd, TCIFLUSH);
+    framer_reset(&framer);
+    baud.current = rate;
+    printf("Baud rate set to %d\n", rate);
+    return 0;
+}
+
+static void switch_baud_rate(int fd)
+{
+    int old = baud.current;
+
+    if (set_uart_speed(fd, baud.pending) != 0)
+    {
+        baud.pending = 0;
+        return;
+    }
+    baud.pending = 0;
+    baud.fallback = old;
+    baud.awaiting = true;
+    clock_gettime(CLOCK_MONOTONIC, &baud.switched);
+}
+
+// The first valid frame at the new rate completes the handshake
+static void confirm_baud_rate(void)
+{
+    baud.awaiting = false;
+    printf("Baud rate %d confirmed\n", baud.current);
+    if (baud.persist && app_config.baudrate != baud.current)
+    {
+        app_config.baudrate = baud.current;
+        if (save_app_config() != EXIT_SUCCESS)
+            fprintf(stderr, "Can't persist baud rate %d\n", baud.current);
+    }
+}
+
+static void check_baud_fallback(int fd)
+{
+    if (!baud.awaiting || stats_since_us(&baud.switched) < BAUD_CONFIRM_MS * 1000)
+        return;
+    fprintf(stderr, "Host did not follow to %d baud, falling back to %d\n", baud.current, baud.fallback);
+    baud.awaiting = false;
+    set_uart_speed(fd, baud.fallback);
+}
+static const unsigned char padding[MAX_PACKAGE_SIZE];
+
+static int write_data_frame(int fd, struct DataFrame *data_frame, int length);
+static int write_package(int fd, const unsigned char *head, size_t head_length, const unsigned char *payload,
+                         int length, int package_size, long checksum);
+
+// Function to write a gathered buffer completely, the UART is non-blocking so
+// wait for room in the driver whenever it fills up
+static int write_all(int fd, struct iovec *v, int count)
+{
+    while (count > 0)
+    {
+        ssize_t n = writev(fd, v, count);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            {
+                struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+                poll(&pfd, 1, 1000);
+                continue;
+            }
+            perror("Error writing to UART");
+            return -1;
+        }
+        while (count > 0 && n >= (ssize_t)v->iov_len)
+        {
+            n -= v->iov_len;
+            v++;
+            count--;
+        }
+        if (count > 0)
+        {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static int write_frame(int fd, char *frame, size_t length)
+{
+    struct iovec iov = {.iov_base = frame, .iov_len = length};
+    pthread_mutex_lock(&uart_lock);
+    int ret = write_all(fd, &iov, 1);
+    pthread_mutex_unlock(&uart_lock);
+    stats_bus_tx((unsigned char)frame[2], length);
+    return ret ? -1 : (int)length;
+}
+
+static int sync_rtc(struct Job *job)
+{
+    (void)job;
+    return system("hwclock -w -u") == 0 ? 0 : -1;
+}
+
+static int mount_sdcard_job(struct Job *job)
+{
+    (void)job;
+    return mount_sdcard();
+}
+
+// Completion frame of an asynchronous command: START, command, camera, result, END
+static void job_done(struct Job *job)
+{
+    char frame[5] = {START, job->command, job->camera_id, job->result, END};
+    DEBUG_PRINT("Job 0x%02X done with %d\n", job->command, job->result);
+    if ((unsigned char)job->camera_id != BROADCAST_ID)
+        write_frame(uart_out_fd, frame, sizeof(frame));
+    stats_record(STATS_JOB, job->command, stats_since_us(&job->queued));
+}
+
+static int package_size_code(int package_size)
+{
+    switch (package_size)
+    {
+    case 256:
+        return SIZE_256;
+    case 512:
+        return SIZE_512;
+    case 2048:
+        return SIZE_2048;
+    default:
+        return SIZE_1024;
+    }
+}
 
 // Function to configure the serial port
 void configure_serial_port(int fd, int baud_rate)
@@ -50,55 +261,120 @@ void configure_serial_port(int fd, int baud_rate)
     tcsetattr(fd, TCSANOW, &options);
 }
 
-// Function to read a line from UART
-ssize_t readline(int fd, char *buffer, size_t size)
+// Function to flush the UART buffers
+void flush_uart(int fd)
 {
-    ssize_t total_bytes_read = 0;
-    ssize_t bytes_read;
-    char ch;
-
-    while (total_bytes_read < size - 1)
+    // Flush both input and output buffers
+    if (tcflush(fd, TCIOFLUSH) == -1)
     {
-        bytes_read = read(fd, &ch, 1);
-        if (bytes_read < 0)
-        {
-            perror("Error reading from UART");
-            return -1;
-        }
-        else if (bytes_read == 0)
-        {
-            // End of file or no more data
-            break;
-        }
+        perror("Unable to flush UART");
+    }
+}
+
+// Package of the transfer at offset, the file read is timed as SPAN_READ
+static int read_package(struct Transfer *transfer, long offset, const unsigned char **payload)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int length = transfer_package(transfer, offset, transfer->package_size, payload);
+    stats_span(SPAN_READ, &start);
+    return length;
+}
 
-        buffer[total_bytes_read++] = ch;
+static int send_data_package(int fd, char camera_id, char hour, char minute, int package_no)
+{
+    struct Transfer *transfer = transfer_current();
+    if (!transfer)
+        return -1;
+    struct DataFrame data_frame;
+    data_frame.header = START;
+    data_frame.command = SEND_SPEC_DATA_PACKAGE;
+    data_frame.camera_id = camera_id;
+
+    struct Data data;
+    data.id[0] = hour;
+    data.id[1] = minute;
+    data.id[2] = package_no; // Index package
+    const unsigned char *payload;
+    int length = read_package(transfer, (long)(package_no - 1) * transfer->package_size, &payload);
+    if (length < 0)
+        return -1;
+    data.data = (char *)payload;
+    data.size = package_size_code(transfer->package_size);
 
-        if (ch == '\n' && buffer[total_bytes_read - 2] == '\r')
+    long checksum;
+    if (transfer->crc_mode)
+    {
+        // CRC-16/CCITT over everything in front of the checksum field, padding included
+        unsigned char head[7] = {data_frame.header, data_frame.command, data_frame.camera_id, hour, minute,
+                                 data.id[2],        data.size};
+        checksum = crc16_ccitt(CRC16_INIT, head, sizeof(head));
+        checksum = crc16_ccitt(checksum, payload, length);
+        checksum = crc16_ccitt(checksum, padding, transfer->package_size - length);
+    }
+    else
+    {
+        // checksum = header + cmd + camera_id + (hour+minute+package_no) + data_size + data and get the last 2 bytes
+        checksum = data_frame.header + data_frame.command + data_frame.camera_id + hour + minute +
+                   (unsigned char)data.id[2] + data.size;
+        for (int i = 0; i < length; i++)
         {
-            // End of line
-            break;
+            checksum += payload[i];
         }
     }
-
-    buffer[total_bytes_read] = '\0'; // Null-terminate the string
-    return total_bytes_read;
+    data.checksum[0] = (checksum >> 8) & 0xFF;
+    data.checksum[1] = checksum & 0xFF;
+    data_frame.data = data;
+    data_frame.end = END;
+    // send package data
+    return write_data_frame(fd, &data_frame, length);
 }
 
-// Function to flush the UART buffers
-void flush_uart(int fd)
+// Function to send package index (0-based, 32-bit) of a session: START, SESSION_DATA_PACKAGE,
+// camera_id, session, index, size code, data, checksum, END
+static int send_session_package(int fd, char camera_id, struct Transfer *transfer, unsigned int index)
 {
-    // Flush both input and output buffers
-    if (tcflush(fd, TCIOFLUSH) == -1)
+    const unsigned char *payload;
+    int length = read_package(transfer, (long)index * transfer->package_size, &payload);
+    if (length < 0)
+        return -1;
+
+    unsigned char head[9] = {START,        SESSION_DATA_PACKAGE, camera_id,
+                             transfer->id, index >> 24,          index >> 16,
+                             index >> 8,   index,                package_size_code(transfer->package_size)};
+    long checksum;
+    if (transfer->crc_mode)
     {
-        perror("Unable to flush UART");
+        checksum = crc16_ccitt(CRC16_INIT, head, sizeof(head));
+        checksum = crc16_ccitt(checksum, payload, length);
+        checksum = crc16_ccitt(checksum, padding, transfer->package_size - length);
+    }
+    else
+    {
+        checksum = 0;
+        for (size_t i = 0; i < sizeof(head); i++)
+            checksum += head[i];
+        for (int i = 0; i < length; i++)
+            checksum += payload[i];
     }
+    return write_package(fd, head, sizeof(head), payload, length, transfer->package_size, checksum);
 }
 
-// Function to parse data from UART buffer into Command structure
+// STATUS_METRICS reply: START, STATUS, camera, STATUS_METRICS, span count, spans, END
+static int write_status_metrics(int fd, char camera_id)
+{
+    unsigned char frame[6 + SPANS * STATS_SPAN_RECORD] = {START, STATUS, camera_id, STATUS_METRICS};
+    size_t length = stats_span_pack(frame + 5, SPANS * STATS_SPAN_RECORD);
+    frame[4] = length / STATS_SPAN_RECORD;
+    frame[5 + length] = END;
+    return write_frame(fd, (char *)frame, 6 + length);
+}
+
+// Function to parse a complete START..END frame into Command structure
 
 void parse_command(char *buffer, size_t buffer_length, struct AckFrame *ack_frame)
 {
-    if (buffer_length < 6)
+    if (buffer_length < 4)
     {
         ack_frame->len = ACK_0;
         ack_frame->command_specifier = NONE;
@@ -110,12 +386,12 @@ void parse_command(char *buffer, size_t buffer_length, struct AckFrame *ack_fram
     cmd.command_specifier = buffer[1];
     cmd.camera_id = buffer[2];
     cmd.command_content = &buffer[3];
-    cmd.end = buffer[buffer_length - 3]; // ignore the last byte
+    cmd.end = buffer[buffer_length - 1];
 
-    printf("Header: %02X\n", cmd.header);
-    printf("Command specifier: %02X\n", cmd.command_specifier);
-    printf("Camera ID: %02X\n", cmd.camera_id);
-    printf("End: %02X\n", cmd.end);
+    DEBUG_PRINT("Header: %02X\n", cmd.header);
+    DEBUG_PRINT("Command specifier: %02X\n", cmd.command_specifier);
+    DEBUG_PRINT("Camera ID: %02X\n", cmd.camera_id);
+    DEBUG_PRINT("End: %02X\n", cmd.end);
 
     ack_frame->header = START;
     ack_frame->camera_id = cmd.camera_id;
@@ -125,8 +401,8 @@ void parse_command(char *buffer, size_t buffer_length, struct AckFrame *ack_fram
     switch (cmd.command_specifier)
     {
     case LIST_FILE:
-        printf("List file in folder command\n");
-        if (buffer_length != 11)
+        DEBUG_PRINT("List file in folder command\n");
+        if (buffer_length != 9)
         {
             ack_frame->len = ACK_0;
             ack_frame->command_specifier = NONE;
@@ -142,19 +418,24 @@ void parse_command(char *buffer, size_t buffer_length, struct AckFrame *ack_fram
         tm_if.tm_min = 0;
         tm_if.tm_sec = 0;
         int files = listFile(&tm_if);
-        printf("Number of files: %d\n", files);
+        DEBUG_PRINT("Number of files: %d\n", files);
         ack_frame->optional = files;
         break;
 
     case NEXT_FILE:
-        printf("Get next file command\n");
-        if (buffer_length != 12)
+        DEBUG_PRINT("Get next file command\n");
+        // An optional trailing flags byte negotiates the transfer options
+        if (buffer_length != 10 && buffer_length != 11)
         {
             ack_frame->len = ACK_0;
             ack_frame->command_specifier = NONE;
             return;
         }
-        ack_frame->len = ACK_7;
+        int flags = buffer_length == 11 ? cmd.command_content[6] : 0;
+        if (flags & FLAG_SESSION)
+            ack_frame->len = ACK_15;
+        else
+            ack_frame->len = flags & FLAG_CRC ? ACK_11 : ACK_7;
         struct tm tm_info;
         memset(&tm_info, 0, sizeof(struct tm));
         // Assuming year 2000+ for simplicity, adjust if needed
@@ -164,18 +445,33 @@ void parse_command(char *buffer, size_t buffer_length, struct AckFrame *ack_fram
         tm_info.tm_hour = cmd.command_content[3];
         tm_info.tm_min = cmd.command_content[4];
 
-        printf("tm: %d-%d-%d %d:%d\n", tm_info.tm_year, tm_info.tm_mon, tm_info.tm_mday, tm_info.tm_hour,
-               tm_info.tm_min);
-        printf("Requested time: %s\n", asctime(&tm_info));
+        DEBUG_PRINT("tm: %d-%d-%d %d:%d\n", tm_info.tm_year, tm_info.tm_mon, tm_info.tm_mday, tm_info.tm_hour,
+                    tm_info.tm_min);
+        DEBUG_PRINT("Requested time: %s\n", asctime(&tm_info));
 
-        memset(path, 0, PATH_MAX);
-        if (findNearestFile(&tm_info, path))
+        char path[PATH_MAX] = {0};
+        struct timespec lookup;
+        clock_gettime(CLOCK_MONOTONIC, &lookup);
+        bool found = findNearestFile(&tm_info, path);
+        stats_span(SPAN_LOOKUP, &lookup);
+        if (found)
         {
             parseDatetimeFromFile(path, &tm_info);
             ack_frame->hour = tm_info.tm_hour;
             ack_frame->minute = tm_info.tm_min;
-            printf("Path: %s\n", path);
-            int size_file = findSize(path);
+            DEBUG_PRINT("Path: %s\n", path);
+            char variant[PATH_MAX];
+            struct Transfer *transfer = NULL;
+            if (variant_prepare(path, (flags & FLAG_VARIANT) >> 4, variant, sizeof(variant)) != 0 ||
+                !(transfer = transfer_open(variant)))
+            {
+                ack_frame->command_specifier = NONE;
+                break;
+            }
+            transfer->crc_mode = flags & FLAG_CRC;
+            ack_frame->session = transfer->id;
+            if (ack_frame->len != ACK_7)
+                ack_frame->crc = transfer_crc32(transfer);
             int package_size = SIZE_1024;
             switch (cmd.command_content[5])
             {
@@ -194,17 +490,13 @@ void parse_command(char *buffer, size_t buffer_length, struct AckFrame *ack_fram
             default:
                 package_size = 1024;
             }
-            app_config.package_size = package_size;
-            int remaining = size_file / package_size;
-            if (remaining == 0)
-            {
-                ack_frame->optional = size_file / package_size;
-            }
-            else
-            {
-                ack_frame->optional = size_file / package_size + 1;
-            }
-            printf("Number of packages: %d\n", ack_frame->optional);
+            // per session, app_config keeps the configured size that gets saved
+            transfer->package_size = package_size;
+            // counted on the selected variant, a partial last package included
+            ack_frame->optional = transfer_packages(transfer, package_size);
+            ack_frame->size = transfer->size;
+            DEBUG_PRINT("Session %d, number of packages: %ld\n", transfer->id,
+                        transfer_packages(transfer, package_size));
         }
         // else
         // {
@@ -213,125 +505,132 @@ void parse_command(char *buffer, size_t buffer_length, struct AckFrame *ack_fram
         break;
 
     case GET_SPEC_PACKAGE:
-        printf("Get Specified package command\n");
-        if (buffer_length != 9)
+    case SEND_SPEC_DATA_PACKAGE:
+        DEBUG_PRINT("Get Specified package command\n");
+        ack_frame->len = ACK_0;
+        if (buffer_length != 7)
         {
-            ack_frame->len = ACK_0;
             ack_frame->command_specifier = NONE;
             return;
         }
-        ack_frame->len = ACK_4;
-        int hour = cmd.command_content[0];
-        int minute = cmd.command_content[1];
-        int package_no = cmd.command_content[2];
-        cmd.command_specifier = SEND_SPEC_DATA_PACKAGE;
-        // send ack
+        if (send_data_package(uart_out_fd, cmd.camera_id, cmd.command_content[0], cmd.command_content[1],
+                              (unsigned char)cmd.command_content[2]) != 0)
+            ack_frame->command_specifier = NONE;
+        break;
 
-    case SEND_SPEC_DATA_PACKAGE:
-        printf("Send specified data package command\n");
+    case GET_WINDOW:
+        DEBUG_PRINT("Get package window command\n");
         ack_frame->len = ACK_0;
-        struct DataFrame data_frame;
-        data_frame.header = cmd.header;
-        data_frame.command = cmd.command_specifier;
-        data_frame.camera_id = cmd.camera_id;
-
-        struct Data data;
-        data.id[0] = cmd.command_content[0];
-        data.id[1] = cmd.command_content[1];
-        data.id[2] = cmd.command_content[2]; // Index package
-        data.data = readBytesFromFile(path, app_config.package_size, (package_no - 1) * app_config.package_size);
-        // memset(path, 0, PATH_MAX);
-        if (data.data == NULL)
+        if (buffer_length != 8)
         {
             ack_frame->command_specifier = NONE;
-            free(data.data);
-            break;
+            return;
         }
-        switch (app_config.package_size)
+        int first = (unsigned char)cmd.command_content[2];
+        int count = MIN((unsigned char)cmd.command_content[3], MAX_WINDOW);
+        long total = transfer_current() ? transfer_packages(transfer_current(), transfer_current()->package_size) : 0;
+        int last = MIN(MIN(first + count - 1, total), 0xFF);
+        DEBUG_PRINT("Window: packages %d..%d\n", first, last);
+        for (int no = first; no <= last; no++)
         {
-        case 256:
-            data.size = SIZE_256;
-            break;
-        case 512:
-            data.size = SIZE_512;
-            break;
-        case 1024:
-            data.size = SIZE_1024;
-            break;
-        case 2048:
-            data.size = SIZE_2048;
-            break;
-        default:
-            data.size = SIZE_1024;
+            if (send_data_package(uart_out_fd, cmd.camera_id, cmd.command_content[0], cmd.command_content[1], no) != 0)
+            {
+                ack_frame->command_specifier = NONE;
+                break;
+            }
         }
+        break;
 
-        // checksum = header + cmd + camera_id + (hour+minute+package_no) + data_size + data and get the last 2 bytes
-        long checksum =
-            data_frame.header + data_frame.command + data_frame.camera_id + hour + minute + package_no + data.size;
-
-        printf("value of checksum: %d %d %d %d %d %d %d\n", data_frame.header, data_frame.command, data_frame.camera_id,
-               hour, minute, package_no, data.size);
-
-        printf("value of checksum as hex: %02X %02X %02X %02X %02X %02X %02X\n", data_frame.header, data_frame.command,
-               data_frame.camera_id, hour, minute, package_no, data.size);
-        for (int i = 0; i < app_config.package_size; i++)
+    case RETRANSMIT:
+        DEBUG_PRINT("Retransmit packages command\n");
+        ack_frame->len = ACK_0;
+        if (buffer_length != 11)
         {
-            checksum += data.data[i];
+            ack_frame->command_specifier = NONE;
+            return;
+        }
+        int base = (unsigned char)cmd.command_content[2];
+        // NACK bitmap, bit i of the big-endian 32-bit mask selects package base + i
+        unsigned int mask = (unsigned char)cmd.command_content[3] << 24 | (unsigned char)cmd.command_content[4] << 16 |
+                            (unsigned char)cmd.command_content[5] << 8 | (unsigned char)cmd.command_content[6];
+        // bounded like GET_WINDOW, the package number is a single byte on the wire
+        struct Transfer *current = transfer_current();
+        long packages = current ? transfer_packages(current, current->package_size) : 0;
+        int highest = MIN(packages, 0xFF);
+        for (int i = 0; i < MAX_WINDOW && mask && base + i <= highest; i++, mask >>= 1)
+        {
+            if (!(mask & 1))
+                continue;
+            if (send_data_package(uart_out_fd, cmd.camera_id, cmd.command_content[0], cmd.command_content[1],
+                                  base + i) != 0)
+            {
+                ack_frame->command_specifier = NONE;
+                break;
+            }
         }
-        data.checksum[0] = (checksum >> 8) & 0xFF;
-        data.checksum[1] = checksum & 0xFF;
-        data_frame.data = data;
-        data_frame.end = END;
-        // send package data
-        write_data_frame(uart_out_fd, &data_frame);
-        free(data.data);
         break;
 
-    case BAUD_RATE:
-        printf("Baud rate command\n");
-        ack_frame->len = ACK_4;
-        if (buffer_length != 7)
+    case GET_SESSION_PACKAGE:
+        DEBUG_PRINT("Get session package command\n");
+        ack_frame->len = ACK_0;
+        if (buffer_length != 10)
         {
             ack_frame->command_specifier = NONE;
             return;
         }
-        int baud_rate = cmd.command_content[0];
-        switch (baud_rate)
+        struct Transfer *session = transfer_session((unsigned char)cmd.command_content[0]);
+        if (!session)
         {
-        case BAUD_9600:
-            baud_rate = 9600;
-            break;
-        case BAUD_19200:
-            baud_rate = 19200;
-            break;
-        case BAUD_38400:
-            baud_rate = 38400;
-            break;
-        case BAUD_57600:
-            baud_rate = 57600;
-            break;
-        case BAUD_115200:
-            baud_rate = 115200;
-            break;
-        default:
+            // Evicted or lost with a restart, the host reopens the file with NEXT_FILE and resumes
+            DEBUG_PRINT("Unknown session %d\n", (unsigned char)cmd.command_content[0]);
+            ack_frame->len = ACK_4;
             ack_frame->command_specifier = NONE;
             return;
         }
-        if (app_config.baudrate != baud_rate)
+        unsigned int index = (unsigned char)cmd.command_content[1] << 24 | (unsigned char)cmd.command_content[2] << 16 |
+                             (unsigned char)cmd.command_content[3] << 8 | (unsigned char)cmd.command_content[4];
+        // up to MAX_WINDOW packages back-to-back, a count of 0 reads as 1
+        int window = MIN(MAX((unsigned char)cmd.command_content[5], 1), MAX_WINDOW);
+        long end = MIN((long)index + window, transfer_packages(session, session->package_size));
+        DEBUG_PRINT("Session %d: packages %u..%ld\n", session->id, index, end - 1);
+        for (long no = index; no < end; no++)
         {
-            app_config.baudrate = baud_rate;
-            if (save_app_config() != EXIT_SUCCESS)
+            if (send_session_package(uart_out_fd, cmd.camera_id, session, no) != 0)
             {
                 ack_frame->command_specifier = NONE;
-                return;
+                break;
             }
-            need_restart = true;
+        }
+        break;
+
+    case BAUD_RATE:
+        DEBUG_PRINT("Baud rate command\n");
+        ack_frame->len = ACK_4;
+        // An optional trailing flags byte selects whether the new rate is persisted
+        if (buffer_length != 5 && buffer_length != 6)
+        {
+            ack_frame->command_specifier = NONE;
+            return;
+        }
+        const struct BaudEntry *entry = baud_by_code(cmd.command_content[0]);
+        if (!entry)
+        {
+            ack_frame->command_specifier = NONE;
+            return;
+        }
+        baud.persist = buffer_length == 6 ? cmd.command_content[1] & BAUD_PERSIST : true;
+        if (entry->rate != baud.current)
+            baud.pending = entry->rate;
+        else if (baud.persist && app_config.baudrate != entry->rate)
+        {
+            app_config.baudrate = entry->rate;
+            save_app_config();
         }
         break;
 
     case MOSD:
-        printf("OSD command\n");
-        if (buffer_length < 8)
+        DEBUG_PRINT("OSD command\n");
+        if (buffer_length < 6)
         {
             ack_frame->len = ACK_0;
             ack_frame->command_specifier = NONE;
@@ -341,21 +640,36 @@ void parse_command(char *buffer, size_t buffer_length, struct AckFrame *ack_fram
         struct OsdContent osd;
         osd.position = cmd.command_content[0];
         osd.text_length = cmd.command_content[1];
-        osd.text = malloc(osd.text_length + 1);
-        memcpy(osd.text, &cmd.command_content[2], osd.text_length);
-        osd.text[osd.text_length] = '\0';
-        printf("OSD position: %c\n", osd.position);
-        printf("OSD text length: %d\n", osd.text_length);
-        printf("OSD text: %s\n", osd.text);
-        // set osd text and update
+        osd.text = malloc((unsigned char)osd.text_length + 1);
+        memcpy(osd.text, &cmd.command_content[2], (unsigned char)osd.text_length);
+        osd.text[(unsigned char)osd.text_length] = '\0';
+        DEBUG_PRINT("OSD position: %c\n", osd.position);
+        DEBUG_PRINT("OSD text length: %d\n", (unsigned char)osd.text_length);
+        DEBUG_PRINT("OSD text: %s\n", osd.text);
+        // macros such as $C are expanded, the slots are placed by [osdN] of the config
+        int slot = -1;
+        if (osd.position == POSITION_TOP)
+            slot = 0;
+        else if (osd.position == POSITION_BOTTOM)
+            slot = 1;
+        else if (osd.position >= POSITION_SLOT && osd.position < POSITION_SLOT + MAX_OSD)
+            slot = osd.position - POSITION_SLOT;
+        if (slot < 0)
+        {
+            ack_frame->len = ACK_0;
+            ack_frame->command_specifier = NONE;
+            free(osd.text);
+            return;
+        }
         char s[DATA_SIZE];
-        strcpy(osds[0].text, osd.text);
+        snprintf(s, sizeof(s), "%s%s", osd.position == POSITION_TOP ? app_config.osd_slots[0].text : "", osd.text);
+        region_set_text(slot, s);
         free(osd.text);
         break;
 
     case RTC:
-        printf("RTC command\n");
-        if (buffer_length != 10)
+        DEBUG_PRINT("RTC command\n");
+        if (buffer_length != 8)
         {
             ack_frame->len = ACK_0;
             ack_frame->command_specifier = NONE;
@@ -367,7 +681,7 @@ void parse_command(char *buffer, size_t buffer_length, struct AckFrame *ack_fram
         int t3 = cmd.command_content[2];
         int t4 = cmd.command_content[3];
         int unix_time = t1 << 24 | t2 << 16 | t3 << 8 | t4;
-        printf("Unix time: %d\n", unix_time);
+        DEBUG_PRINT("Unix time: %d\n", unix_time);
 
         struct timeval tv;
         tv.tv_sec = unix_time;
@@ -375,8 +689,8 @@ void parse_command(char *buffer, size_t buffer_length, struct AckFrame *ack_fram
         // Set the system time
         if (settimeofday(&tv, NULL) == 0)
         {
-            // sync to rtc
-            system("hwclock -w -u");
+            // sync to rtc in the background, a completion frame follows the ack
+            worker_submit(sync_rtc, RTC, cmd.camera_id);
             printf("System time updated successfully.\n");
         }
         else
@@ -385,15 +699,77 @@ void parse_command(char *buffer, size_t buffer_length, struct AckFrame *ack_fram
         }
         break;
     case STATUS:
-        printf("Status command\n");
-        ack_frame->len = ACK_5;
+        DEBUG_PRINT("Status command\n");
         ack_frame->command_specifier = STATUS;
-        // check sdcard status
-        ack_frame->optional = mount_sdcard();
+        // the span summary is sent in place of the ack
+        if (buffer_length == 5 && cmd.command_content[0] == STATUS_METRICS)
+        {
+            ack_frame->len = ACK_0;
+            write_status_metrics(uart_out_fd, cmd.camera_id);
+            break;
+        }
+        // check sdcard status, mounting it is left to a worker
+        if (sdcard_mounted())
+        {
+            ack_frame->len = ACK_5;
+            ack_frame->optional = 0;
+        }
+        else
+        {
+            ack_frame->len = ACK_4;
+            if (worker_submit(mount_sdcard_job, STATUS, cmd.camera_id) != 0)
+            {
+                ack_frame->len = ACK_5;
+                ack_frame->optional = -1;
+            }
+        }
+        break;
+
+    case UPGRADE_BEGIN:
+        DEBUG_PRINT("Upgrade begin command\n");
+        if (buffer_length != 8)
+        {
+            ack_frame->command_specifier = NONE;
+            ack_frame->len = ACK_4;
+            return;
+        }
+        ack_frame->len = ACK_9;
+        ack_frame->optional = upgrade_begin(&upgrade, (unsigned char)cmd.command_content[0] << 24 |
+                                                          (unsigned char)cmd.command_content[1] << 16 |
+                                                          (unsigned char)cmd.command_content[2] << 8 |
+                                                          (unsigned char)cmd.command_content[3]);
+        ack_frame->size = upgrade.received;
+        break;
+
+    case UPGRADE_DATA:
+    {
+        const unsigned char *content = (unsigned char *)cmd.command_content;
+        unsigned int offset = content[0] << 24 | content[1] << 16 | content[2] << 8 | content[3];
+        unsigned int length = content[4] << 8 | content[5];
+        ack_frame->len = ACK_9;
+        if (buffer_length != 12 + length)
+            ack_frame->optional = UPGRADE_ERR_LENGTH;
+        else if (crc16_ccitt(CRC16_INIT, content + 8, length) != (content[6] << 8 | content[7]))
+            ack_frame->optional = UPGRADE_ERR_CRC;
+        else if (offset == upgrade.received)
+            ack_frame->optional = upgrade_write(&upgrade, content + 8, length);
+        else
+            ack_frame->optional = upgrade_write(&upgrade, NULL, 0); // resent or past a gap, just the state
+        ack_frame->size = upgrade.received;
+        break;
+    }
+
+    case UPGRADE_COMMIT:
+        DEBUG_PRINT("Upgrade commit command\n");
+        ack_frame->len = ACK_9;
+        ack_frame->optional = upgrade_finish(&upgrade);
+        ack_frame->size = upgrade.received;
+        if (ack_frame->optional)
+            fprintf(stderr, "Upgrade failed: %s\n", upgrade_error(ack_frame->optional));
         break;
 
     default:
-        printf("Invalid command\n");
+        DEBUG_PRINT("Invalid command\n");
         ack_frame->len = ACK_4;
         ack_frame->command_specifier = NONE;
         break;
@@ -409,16 +785,17 @@ int write_ack_frame(int fd, struct AckFrame *ack_frame)
     else if (ack_frame->len == ACK_4)
     {
         char frame[4] = {START, ack_frame->command_specifier, ack_frame->camera_id, END};
-        printf("\nframe to send: 0x%02X 0x%02X 0x%02X 0x%02X\n", frame[0], frame[1], frame[2], frame[3]);
-        return write(fd, frame, sizeof(frame));
+        DEBUG_PRINT("\nframe to send: 0x%02X 0x%02X 0x%02X 0x%02X\n", frame[0], frame[1], frame[2], frame[3]);
+        return write_frame(fd, frame, sizeof(frame));
     }
     else if (ack_frame->len == ACK_5)
     {
         char frame[5] = {START, ack_frame->command_specifier, ack_frame->camera_id, ack_frame->optional, END};
-        printf("frame to send: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n", frame[0], frame[1], frame[2], frame[3], frame[4]);
-        return write(fd, frame, sizeof(frame));
+        DEBUG_PRINT("frame to send: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n", frame[0], frame[1], frame[2], frame[3],
+                    frame[4]);
+        return write_frame(fd, frame, sizeof(frame));
     }
-    else
+    else if (ack_frame->len == ACK_7)
     {
         char frame[7] = {START,
                          ack_frame->command_specifier,
@@ -427,175 +804,274 @@ int write_ack_frame(int fd, struct AckFrame *ack_frame)
                          ack_frame->minute,
                          ack_frame->optional,
                          END};
-        printf("\nframe to send: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n", frame[0], frame[1], frame[2],
-               frame[3], frame[4], frame[5], frame[6]);
-        return write(fd, frame, sizeof(frame));
+        DEBUG_PRINT("\nframe to send: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n", frame[0], frame[1],
+                    frame[2], frame[3], frame[4], frame[5], frame[6]);
+        return write_frame(fd, frame, sizeof(frame));
+    }
+    else if (ack_frame->len == ACK_9)
+    {
+        // upgrade ack: status and the next image offset expected
+        char frame[9] = {START,
+                         ack_frame->command_specifier,
+                         ack_frame->camera_id,
+                         ack_frame->optional,
+                         ack_frame->size >> 24,
+                         ack_frame->size >> 16,
+                         ack_frame->size >> 8,
+                         ack_frame->size,
+                         END};
+        return write_frame(fd, frame, sizeof(frame));
+    }
+    else if (ack_frame->len == ACK_15)
+    {
+        // NEXT_FILE ack of a session: session id, 32-bit file size and CRC-32 of the file
+        char frame[15] = {START,
+                          ack_frame->command_specifier,
+                          ack_frame->camera_id,
+                          ack_frame->hour,
+                          ack_frame->minute,
+                          ack_frame->session,
+                          ack_frame->size >> 24,
+                          ack_frame->size >> 16,
+                          ack_frame->size >> 8,
+                          ack_frame->size,
+                          ack_frame->crc >> 24,
+                          ack_frame->crc >> 16,
+                          ack_frame->crc >> 8,
+                          ack_frame->crc,
+                          END};
+        DEBUG_PRINT("\nframe to send: session %d size %u crc 0x%08X\n", (unsigned char)ack_frame->session,
+                    ack_frame->size, ack_frame->crc);
+        return write_frame(fd, frame, sizeof(frame));
+    }
+    else
+    {
+        // NEXT_FILE ack in CRC mode carries the CRC-32 of the whole file
+        char frame[11] = {START,
+                          ack_frame->command_specifier,
+                          ack_frame->camera_id,
+                          ack_frame->hour,
+                          ack_frame->minute,
+                          ack_frame->optional,
+                          ack_frame->crc >> 24,
+                          ack_frame->crc >> 16,
+                          ack_frame->crc >> 8,
+                          ack_frame->crc,
+                          END};
+        DEBUG_PRINT("\nframe to send: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X crc 0x%08X 0x%02X\n", frame[0],
+                    frame[1], frame[2], frame[3], frame[4], frame[5], ack_frame->crc, frame[10]);
+        return write_frame(fd, frame, sizeof(frame));
     }
 }
 
-// Function to serialize a DataFrame into a byte array
-void serialize_data_frame(struct DataFrame *data_frame, char *buffer, int *buffer_size)
+// Function to write a DataFrame with a single gathered write, the payload is
+// taken in place and zero padded up to the announced package size
+static int write_data_frame(int fd, struct DataFrame *data_frame, int length)
 {
-    int index = 0;
-
-    // Copy header, command, camera_id directly
-    buffer[index++] = data_frame->header;
-    buffer[index++] = data_frame->command;
-    buffer[index++] = data_frame->camera_id;
-
-    // Copy struct Data fields
-    memcpy(&buffer[index], data_frame->data.id, sizeof(data_frame->data.id));
-    index += sizeof(data_frame->data.id);
-
-    memcpy(&buffer[index], (const char *)&data_frame->data.size, sizeof(data_frame->data.size));
-    index += sizeof(data_frame->data.size);
+    unsigned char head[7] = {data_frame->header,     data_frame->command,    data_frame->camera_id,
+                             data_frame->data.id[0], data_frame->data.id[1], data_frame->data.id[2],
+                             data_frame->data.size};
+    long checksum = (unsigned char)data_frame->data.checksum[0] << 8 | (unsigned char)data_frame->data.checksum[1];
+    return write_package(fd, head, sizeof(head), (unsigned char *)data_frame->data.data, length,
+                         256 << data_frame->data.size, checksum);
+}
 
-    // Copy data
+// Function to write head, payload, zero padding up to package_size and the
+// checksum tail of a data package with a single gathered write
+static int write_package(int fd, const unsigned char *head, size_t head_length, const unsigned char *payload,
+                         int length, int package_size, long checksum)
+{
+    unsigned char tail[3] = {(checksum >> 8) & 0xFF, checksum & 0xFF, END};
+    struct iovec iov[4] = {
+        {.iov_base = (void *)head, .iov_len = head_length},
+        {.iov_base = (void *)payload, .iov_len = length},
+        {.iov_base = (void *)padding, .iov_len = package_size - length},
+        {.iov_base = tail, .iov_len = sizeof(tail)},
+    };
+    struct timespec start;
+    stats_bus_tx(head[2], head_length + package_size + sizeof(tail));
+    pthread_mutex_lock(&uart_lock);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = write_all(fd, iov, 4);
+    // Pace the next frame on the line rather than with per-byte sleeps
+    if (!ret)
+        tcdrain(fd);
+    stats_span(SPAN_WRITE, &start);
+    pthread_mutex_unlock(&uart_lock);
+    return ret;
+}
 
-    // memcpy(&buffer[index], data_frame->data.data, data_frame->data.size);
-    // index += data_frame->data.size;
-    switch (data_frame->data.size)
+// Function to free the allocated text in Command structure
+void free_command(struct CommandFrame *cmd)
+{
+    if (cmd->command_content)
     {
-    case SIZE_256:
-        memcpy(&buffer[index], data_frame->data.data, 256);
-        index += 256;
-        break;
-    case SIZE_512:
-        memcpy(&buffer[index], data_frame->data.data, 512);
-        index += 512;
-        break;
-    case SIZE_1024:
-        memcpy(&buffer[index], data_frame->data.data, 1024);
-        index += 1024;
-        break;
-    case SIZE_2048:
-        memcpy(&buffer[index], data_frame->data.data, 2048);
-        index += 2048;
-        break;
-    default:
-        memcpy(&buffer[index], data_frame->data.data, 1024);
-        index += 1024;
-        break;
+        free(cmd->command_content);
+        cmd->command_content = NULL;
     }
+}
+
+// Group STATUS poll: every camera answers in its own time slot, the slot is a
+// deadline of the serial loop so no worker sleeps through it
+static struct
+{
+    bool pending;
+    struct timespec polled;
+} group_status;
 
-    // memcpy(&buffer[index], data_frame->data.data, UART_BUFFER_SIZE);
-    // index += UART_BUFFER_SIZE;
+// Milliseconds the loop may wait before the reply is due, at most limit
+static int group_status_wait(int limit)
+{
+    if (!group_status.pending)
+        return limit;
+    long long left = app_config.camera_id * STATUS_SLOT_MS - (long long)stats_since_us(&group_status.polled) / 1000;
+    return left <= 0 ? 0 : MIN(left, limit);
+}
 
-    memcpy(&buffer[index], data_frame->data.checksum, sizeof(data_frame->data.checksum));
-    index += sizeof(data_frame->data.checksum);
+static void check_group_status(int fd)
+{
+    if (!group_status.pending || group_status_wait(1))
+        return;
+    group_status.pending = false;
+    char frame[5] = {START, STATUS, app_config.camera_id, sdcard_mounted() ? 0 : -1, END};
+    write_frame(fd, frame, sizeof(frame));
+    stats_record(STATS_JOB, STATUS, stats_since_us(&group_status.polled));
+}
 
-    // Copy end marker
-    buffer[index++] = data_frame->end;
+// Bus addressing: frames for other cameras are dropped, broadcasts are only
+// honoured for commands that need no reply
+static enum Addressing addressing(const char *frame)
+{
+    unsigned char id = frame[2];
 
-    *buffer_size = index; // Set the buffer size
+    if (app_config.camera_id < 0 || id == app_config.camera_id)
+        return ADDRESSED;
+    if (id == BROADCAST_ID && (frame[1] == RTC || frame[1] == MOSD))
+        return BROADCAST;
+    if (id == GROUP_ID && frame[1] == STATUS)
+        return GROUP;
+    return OTHER;
 }
 
-static int write_data_frame(int fd, struct DataFrame *data_frame)
+static void handle_frame(char *frame, size_t length, void *user)
 {
-    flush_uart(fd);
-    char buffer[2057]; // Assuming a reasonable buffer size
-    int buffer_size = 0;
-    serialize_data_frame(data_frame, buffer, &buffer_size);
-    printf("buffer size: %d\n", buffer_size);
-    for (int i = 0; i < buffer_size; i++)
+    struct AckFrame ack_frame;
+    struct timespec start;
+
+    (void)user;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stats_bus_rx((unsigned char)frame[2], length);
+    enum Addressing to = addressing(frame);
+    if (to == OTHER)
+        return;
+    if (to == GROUP)
     {
-        // printf("0x%02X ", buffer[i]);
-        write(fd, &buffer[i], 1);
-        usleep(100);
+        group_status.pending = true;
+        clock_gettime(CLOCK_MONOTONIC, &group_status.polled);
+        return;
     }
-    // int result = write(fd, &buffer, sizeof(buffer));
-    return 0;
-}
 
-// Function to free the allocated text in Command structure
-void free_command(struct CommandFrame *cmd)
-{
-    if (cmd->command_content)
+    if (baud.awaiting)
+        confirm_baud_rate();
+    toggleLed();
+    memset(&ack_frame, 0, sizeof(struct AckFrame));
+    struct timespec parse;
+    clock_gettime(CLOCK_MONOTONIC, &parse);
+    parse_command(frame, length, &ack_frame);
+    stats_span(SPAN_PARSE, &parse);
+    if (to == ADDRESSED)
+        write_ack_frame(uart_out_fd, &ack_frame);
+    stats_record(STATS_HANDLER, frame[1], stats_since_us(&start));
+    if (baud.pending)
+        switch_baud_rate(uart_out_fd);
+    // main() restarts into the new binary once everything is shut down
+    if (frame[1] == UPGRADE_COMMIT && upgrade_installed())
     {
-        free(cmd->command_content);
-        cmd->command_content = NULL;
+        tcdrain(uart_out_fd);
+        keep_running = 0;
     }
 }
 
-void *serial_thread(void)
+void *serial_thread(void *arg)
 {
-    // Open the output serial port
-    uart_out_fd = open(app_config.port, O_RDWR | O_NOCTTY | O_NDELAY | O_SYNC);
+    (void)arg;
+    // Open the output serial port, reads are driven by epoll so it stays non-blocking
+    uart_out_fd = open(app_config.port, O_RDWR | O_NOCTTY | O_NONBLOCK);
 
     if (uart_out_fd == -1)
     {
         perror("Unable to open UART_OUT");
     }
-    int baud_rate = app_config.baudrate;
-    switch (baud_rate)
-    {
-    case 9600:
-        baud_rate = B9600;
-        break;
-    case 19200:
-        baud_rate = B19200;
-        break;
-    case 38400:
-        baud_rate = B38400;
-        break;
-    case 57600:
-        baud_rate = B57600;
-        break;
-    case 115200:
-        baud_rate = B115200;
-        break;
-    default:
-        baud_rate = B115200;
-        break;
-    }
-
     // Flush the UART buffers before starting communication
     flush_uart(uart_out_fd);
 
     // Set up both serial ports
-    configure_serial_port(uart_out_fd, baud_rate);
+    if (!baud_by_rate(app_config.baudrate))
+        app_config.baudrate = 115200;
+    configure_serial_port(uart_out_fd, baud_by_rate(app_config.baudrate)->speed);
+    baud.current = app_config.baudrate;
+    stats_bus_start();
 
-    // Ensure the file descriptors are blocking
-    fcntl(uart_out_fd, F_SETFL, 0);
-    while (keep_running)
+    int epfd = epoll_create1(0);
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = uart_out_fd};
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, uart_out_fd, &event))
     {
-        struct AckFrame ack_frame;
-        char buffer[256];
+        perror("Unable to watch UART_OUT");
+        keep_running = 0;
+    }
+
+    worker_start(WORKER_THREADS, job_done);
 
-        memset(buffer, 0, sizeof(buffer));
-        // Read data from UART
-        ssize_t num_bytes = readline(uart_out_fd, buffer, sizeof(buffer));
-        if (num_bytes < 0)
+    framer_reset(&framer);
+    while (keep_running)
+    {
+        int ready = epoll_wait(epfd, &event, 1, group_status_wait(100));
+        if (ready < 0 && errno != EINTR)
         {
-            perror("Read error");
-            close(uart_out_fd);
+            perror("Wait error");
+            break;
         }
-        else if (num_bytes == 0)
+        // Deadlines are checked on every pass: a host still talking at the old baud
+        // rate keeps the line busy with garbage and epoll never times out
+        check_baud_fallback(uart_out_fd);
+        check_group_status(uart_out_fd);
+        framer_expire(&framer);
+        if (ready <= 0)
         {
+            framer_dispatch(&framer, handle_frame, NULL);
             continue;
         }
-        // check end buffer is newline character
-        else
+
+        // Drain everything the driver has buffered, then cut it into frames
+        while (1)
         {
-            toggleLed();
-            memset(&ack_frame, 0, sizeof(struct AckFrame));
-            buffer[num_bytes] = '\0'; // Null-terminate the string
-            printf("Received length: %ld\n", num_bytes);
-            for (int i = 0; i < num_bytes; i++)
-            {
-                printf("0x%02X ", buffer[i]);
-            }
-            parse_command(buffer, num_bytes, &ack_frame);
-            write_ack_frame(uart_out_fd, &ack_frame);
-            // restart application after save baudrate
-            if (need_restart)
+            size_t available;
+            unsigned char *space = framer_space(&framer, &available);
+            ssize_t num_bytes = read(uart_out_fd, space, available);
+            if (num_bytes < 0 && errno == EINTR)
+                continue;
+            if (num_bytes < 0 && errno != EAGAIN)
+                perror("Read error");
+            if (num_bytes <= 0)
+                break;
+            if (app_config.debug)
             {
-                need_restart = false;
-                restart_application();
+                printf("Received length: %zd\n", num_bytes);
+                for (int i = 0; i < num_bytes; i++)
+                    printf("0x%02X ", space[i]);
+                printf("\n");
             }
+            framer_commit(&framer, num_bytes);
+            framer_dispatch(&framer, handle_frame, NULL);
+            if ((size_t)num_bytes < available)
+                break;
         }
-        flush_uart(uart_out_fd);
     }
+    if (epfd >= 0)
+        close(epfd);
+    worker_stop();
+    transfer_close_all();
+    stats_dump(stdout, baud.current);
     flush_uart(uart_out_fd);
     close(uart_out_fd);
     printf("close serial port\n");
@@ -614,12 +1090,13 @@ int start_serial_handler()
     {
         printf("[serial] Can't set stack size %zu\n", new_stacksize);
     }
-    pthread_create(&serialPid, &thread_attr, (void *(*)(void *))serial_thread, NULL);
+    pthread_create(&serialPid, &thread_attr, serial_thread, NULL);
     if (pthread_attr_setstacksize(&thread_attr, stacksize))
     {
         printf("[serial] Error:  Can't set stack size %zu\n", stacksize);
     }
     pthread_attr_destroy(&thread_attr);
+    return 0;
 }
 
 void stop_serial_handler()
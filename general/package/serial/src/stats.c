@@ -0,0 +1,323 @@
+#include "stats.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// One histogram per command specifier and kind, updated with relaxed atomics
+// from the serial thread and the workers alike
+static struct Histogram histograms[STATS_KINDS][256];
+
+static const char *kind_names[STATS_KINDS] = {"handler", "job"};
+
+// Hot path spans, always on: two clock reads and three relaxed adds each
+static struct Histogram spans[SPANS];
+static const char *span_names[SPANS] = {"parse", "lookup", "read", "write", "render"};
+
+// Metrics socket, the thread sleeps in accept() until somebody asks
+static int serve_fd = -1;
+static pthread_t serve_thread;
+static struct sockaddr_un serve_addr;
+
+// Traffic seen on the shared bus per camera id: frames addressed to it and
+// bytes this daemon sent on its behalf
+static struct BusPeer peers[256];
+static struct timespec bus_start;
+
+// OSD refresh outcomes, bumped by the region thread
+static uint32_t osd_updates[OSD_UPDATES];
+static const char *osd_names[OSD_UPDATES] = {"skipped", "partial", "full", "recreated"};
+
+static void histogram_add(struct Histogram *h, uint64_t us)
+{
+    int bucket = 0;
+
+    while (bucket < STATS_BUCKETS - 1 && us >= (1ULL << bucket))
+        bucket++;
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total_us, us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+}
+
+// Readers get a copy, the writers never wait for them
+static void histogram_load(const struct Histogram *h, struct Histogram *copy)
+{
+    copy->count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    copy->total_us = __atomic_load_n(&h->total_us, __ATOMIC_RELAXED);
+    for (int b = 0; b < STATS_BUCKETS; b++)
+        copy->buckets[b] = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+}
+
+// Bucket holding the call at fraction q of the count, 1.0 gives the highest one in use
+static int histogram_quantile(const struct Histogram *h, double q)
+{
+    uint32_t seen = 0, rank = q * h->count;
+    int last = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++)
+    {
+        if (!h->buckets[b])
+            continue;
+        seen += h->buckets[b];
+        last = b;
+        if (seen > rank)
+            return b;
+    }
+    return last;
+}
+
+void stats_record(int kind, unsigned char command, uint64_t us)
+{
+    histogram_add(&histograms[kind][command], us);
+}
+
+void stats_span(int span, const struct timespec *start)
+{
+    histogram_add(&spans[span], stats_since_us(start));
+}
+
+uint64_t stats_since_us(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+void stats_bus_start(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &bus_start);
+}
+
+void stats_bus_rx(unsigned char camera_id, size_t bytes)
+{
+    __atomic_fetch_add(&peers[camera_id].rx_frames, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&peers[camera_id].rx_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void stats_bus_tx(unsigned char camera_id, size_t bytes)
+{
+    __atomic_fetch_add(&peers[camera_id].tx_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void stats_osd(int update)
+{
+    __atomic_fetch_add(&osd_updates[update], 1, __ATOMIC_RELAXED);
+}
+
+static void dump_histogram(FILE *out, const char *label, const struct Histogram *histogram)
+{
+    struct Histogram h;
+    histogram_load(histogram, &h);
+    if (!h.count)
+        return;
+    fprintf(out, "[stats] %s: %u calls, avg %llu us |", label, h.count, (unsigned long long)(h.total_us / h.count));
+    for (int b = 0; b < STATS_BUCKETS; b++)
+    {
+        if (h.buckets[b])
+            fprintf(out, " <%lluus:%u", 1ULL << b, h.buckets[b]);
+    }
+    fprintf(out, "\n");
+}
+
+void stats_dump(FILE *out, int baudrate)
+{
+    // 10 bits on the wire per byte with 8N1 framing
+    double elapsed = stats_since_us(&bus_start) / 1e6;
+    for (int id = 0; id < 256; id++)
+    {
+        struct BusPeer *p = &peers[id];
+        uint64_t rx = __atomic_load_n(&p->rx_bytes, __ATOMIC_RELAXED);
+        uint64_t tx = __atomic_load_n(&p->tx_bytes, __ATOMIC_RELAXED);
+        if (!rx && !tx)
+            continue;
+        fprintf(out, "[stats] bus 0x%02X: %u frames, rx %llu B, tx %llu B, %.2f%% utilisation\n", id,
+                __atomic_load_n(&p->rx_frames, __ATOMIC_RELAXED), (unsigned long long)rx, (unsigned long long)tx,
+                elapsed > 0 && baudrate > 0 ? (rx + tx) * 10 * 100.0 / (baudrate * elapsed) : 0.0);
+    }
+
+    char label[32];
+    for (int kind = 0; kind < STATS_KINDS; kind++)
+    {
+        for (int command = 0; command < 256; command++)
+        {
+            snprintf(label, sizeof(label), "%s 0x%02X", kind_names[kind], command);
+            dump_histogram(out, label, &histograms[kind][command]);
+        }
+    }
+    for (int span = 0; span < SPANS; span++)
+    {
+        snprintf(label, sizeof(label), "span %s", span_names[span]);
+        dump_histogram(out, label, &spans[span]);
+    }
+
+    fprintf(out, "[stats] osd:");
+    for (int update = 0; update < OSD_UPDATES; update++)
+        fprintf(out, " %s %u", osd_names[update], __atomic_load_n(&osd_updates[update], __ATOMIC_RELAXED));
+    fprintf(out, "\n");
+}
+
+// Span summary for the STATUS_METRICS reply, STATS_SPAN_RECORD bytes per span
+size_t stats_span_pack(unsigned char *out, size_t size)
+{
+    size_t n = 0;
+    for (int span = 0; span < SPANS && n + STATS_SPAN_RECORD <= size; span++)
+    {
+        struct Histogram h;
+        histogram_load(&spans[span], &h);
+        uint64_t avg = h.count ? h.total_us / h.count : 0;
+        if (avg > UINT32_MAX)
+            avg = UINT32_MAX;
+        unsigned char record[STATS_SPAN_RECORD] = {span,
+                                                   h.count >> 24,
+                                                   h.count >> 16,
+                                                   h.count >> 8,
+                                                   h.count,
+                                                   avg >> 24,
+                                                   avg >> 16,
+                                                   avg >> 8,
+                                                   avg,
+                                                   histogram_quantile(&h, 0.5),
+                                                   histogram_quantile(&h, 0.99),
+                                                   histogram_quantile(&h, 1.0)};
+        memcpy(out + n, record, sizeof(record));
+        n += sizeof(record);
+    }
+    return n;
+}
+
+// Cumulative buckets as Prometheus wants them, the last log2 bucket is the +Inf one
+static void prometheus_histogram(FILE *out, const char *name, const char *labels, const struct Histogram *histogram)
+{
+    struct Histogram h;
+    uint32_t cumulative = 0;
+    histogram_load(histogram, &h);
+    for (int b = 0; b < STATS_BUCKETS - 1; b++)
+    {
+        cumulative += h.buckets[b];
+        fprintf(out, "%s_bucket{%s,le=\"%g\"} %u\n", name, labels, (1ULL << b) / 1e6, cumulative);
+    }
+    fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %u\n", name, labels, cumulative + h.buckets[STATS_BUCKETS - 1]);
+    fprintf(out, "%s_sum{%s} %.6f\n", name, labels, h.total_us / 1e6);
+    fprintf(out, "%s_count{%s} %u\n", name, labels, h.count);
+}
+
+void stats_prometheus(FILE *out)
+{
+    char labels[64];
+
+    fprintf(out, "# HELP serial_span_seconds Time spent in the hot paths of the daemon.\n"
+                 "# TYPE serial_span_seconds histogram\n");
+    for (int span = 0; span < SPANS; span++)
+    {
+        snprintf(labels, sizeof(labels), "span=\"%s\"", span_names[span]);
+        prometheus_histogram(out, "serial_span_seconds", labels, &spans[span]);
+    }
+
+    for (int kind = 0; kind < STATS_KINDS; kind++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "serial_%s_seconds", kind_names[kind]);
+        fprintf(out, "# HELP %s %s time per command.\n# TYPE %s histogram\n", name,
+                kind == STATS_HANDLER ? "Serial thread" : "Queue and run", name);
+        for (int command = 0; command < 256; command++)
+        {
+            if (!__atomic_load_n(&histograms[kind][command].count, __ATOMIC_RELAXED))
+                continue;
+            snprintf(labels, sizeof(labels), "command=\"0x%02X\"", command);
+            prometheus_histogram(out, name, labels, &histograms[kind][command]);
+        }
+    }
+
+    fprintf(out, "# HELP serial_bus_frames_total Frames received per camera id.\n"
+                 "# TYPE serial_bus_frames_total counter\n");
+    for (int id = 0; id < 256; id++)
+    {
+        uint32_t frames = __atomic_load_n(&peers[id].rx_frames, __ATOMIC_RELAXED);
+        if (frames)
+            fprintf(out, "serial_bus_frames_total{camera=\"0x%02X\"} %u\n", id, frames);
+    }
+    fprintf(out, "# HELP serial_bus_bytes_total Bytes on the bus per camera id.\n"
+                 "# TYPE serial_bus_bytes_total counter\n");
+    for (int id = 0; id < 256; id++)
+    {
+        uint64_t rx = __atomic_load_n(&peers[id].rx_bytes, __ATOMIC_RELAXED);
+        uint64_t tx = __atomic_load_n(&peers[id].tx_bytes, __ATOMIC_RELAXED);
+        if (rx || tx)
+            fprintf(out, "serial_bus_bytes_total{camera=\"0x%02X\",direction=\"rx\"} %llu\n"
+                         "serial_bus_bytes_total{camera=\"0x%02X\",direction=\"tx\"} %llu\n",
+                    id, (unsigned long long)rx, id, (unsigned long long)tx);
+    }
+
+    fprintf(out, "# HELP serial_osd_updates_total OSD refresh ticks by outcome.\n"
+                 "# TYPE serial_osd_updates_total counter\n");
+    for (int update = 0; update < OSD_UPDATES; update++)
+        fprintf(out, "serial_osd_updates_total{result=\"%s\"} %u\n", osd_names[update],
+                __atomic_load_n(&osd_updates[update], __ATOMIC_RELAXED));
+}
+
+static void *serve(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        int client = accept(serve_fd, NULL, NULL);
+        if (client < 0 && (errno == EINTR || errno == ECONNABORTED))
+            continue;
+        if (client < 0)
+            break; // stats_serve_stop() shut the socket down
+
+        // Rendered up front, a stalled reader only holds up the next one
+        char *text = NULL;
+        size_t length = 0;
+        FILE *out = open_memstream(&text, &length);
+        if (out)
+        {
+            stats_prometheus(out);
+            fclose(out);
+            struct timeval timeout = {.tv_sec = 1};
+            setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            for (size_t sent = 0; sent < length;)
+            {
+                ssize_t n = send(client, text + sent, length - sent, MSG_NOSIGNAL);
+                if (n <= 0 && errno != EINTR)
+                    break;
+                sent += n > 0 ? n : 0;
+            }
+        }
+        free(text);
+        close(client);
+    }
+    return NULL;
+}
+
+int stats_serve_start(const char *path)
+{
+    serve_addr.sun_family = AF_UNIX;
+    strncpy(serve_addr.sun_path, path, sizeof(serve_addr.sun_path) - 1);
+    unlink(serve_addr.sun_path);
+    serve_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (serve_fd < 0 || bind(serve_fd, (struct sockaddr *)&serve_addr, sizeof(serve_addr)) ||
+        listen(serve_fd, 4) || pthread_create(&serve_thread, NULL, serve, NULL))
+    {
+        perror("Unable to serve metrics");
+        if (serve_fd >= 0)
+            close(serve_fd);
+        serve_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void stats_serve_stop(void)
+{
+    if (serve_fd < 0)
+        return;
+    shutdown(serve_fd, SHUT_RDWR);
+    pthread_join(serve_thread, NULL);
+    close(serve_fd);
+    unlink(serve_addr.sun_path);
+    serve_fd = -1;
+}
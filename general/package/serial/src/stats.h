@@ -0,0 +1,73 @@
+#ifndef STATS_H_
+#define STATS_H_
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// log2 buckets of microseconds: <1us, <2us, <4us ... >=2^(STATS_BUCKETS-2)us
+#define STATS_BUCKETS 24
+
+enum StatsKind
+{
+    STATS_HANDLER, // time spent in the serial thread for a frame
+    STATS_JOB,     // queue + run time of an asynchronous job
+    STATS_KINDS
+};
+
+// Hot paths timed with stats_span(), one histogram each
+enum StatsSpan
+{
+    SPAN_PARSE,  // parse_command of a frame
+    SPAN_LOOKUP, // findNearestFile in the image index
+    SPAN_READ,   // a package read from the file being transferred
+    SPAN_WRITE,  // a data package written to the UART, drain included
+    SPAN_RENDER, // an OSD text rendered into its bitmap or canvas
+    SPANS
+};
+
+// STATUS with this selector byte after the camera id answers the span summary:
+// START, STATUS, camera, STATUS_METRICS, span count, per span: id, calls (4 bytes),
+// average us (4 bytes), p50, p99 and max as log2 bucket index (< 2^n us), END
+#define STATUS_METRICS 0x01
+#define STATS_SPAN_RECORD 12
+
+// Prometheus text exposition, served to each client that connects
+#define STATS_SOCKET "/var/run/serial.metrics"
+
+// Outcome of an OSD refresh tick
+enum OsdUpdate
+{
+    OSD_SKIPPED,   // text unchanged, canvas untouched
+    OSD_PARTIAL,   // only the changed glyph cells redrawn
+    OSD_FULL,      // whole canvas redrawn or bitmap uploaded
+    OSD_RECREATED, // region grown, counted in addition to the redraw
+    OSD_UPDATES
+};
+
+struct Histogram
+{
+    uint32_t count;
+    uint64_t total_us;
+    uint32_t buckets[STATS_BUCKETS];
+};
+
+struct BusPeer
+{
+    uint32_t rx_frames;
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+};
+
+void stats_record(int kind, unsigned char command, uint64_t us);
+void stats_span(int span, const struct timespec *start);
+uint64_t stats_since_us(const struct timespec *start);
+void stats_bus_start(void);
+void stats_bus_rx(unsigned char camera_id, size_t bytes);
+void stats_bus_tx(unsigned char camera_id, size_t bytes);
+void stats_osd(int update);
+void stats_dump(FILE *out, int baudrate);
+size_t stats_span_pack(unsigned char *out, size_t size);
+void stats_prometheus(FILE *out);
+int stats_serve_start(const char *path);
+void stats_serve_stop(void);
+#endif
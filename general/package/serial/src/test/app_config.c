@@ -0,0 +1,119 @@
+// app_config.c: a save interrupted at any step leaves the old or the new file
+// once restore_app_config() ran, and a burst of saves is written once
+#include <fcntl.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// Every file operation of a save is a point where the power can go
+static int steps, crash_at, renames;
+static jmp_buf crashed;
+#define CRASH_POINT() (++steps == crash_at ? longjmp(crashed, 1) : (void)0)
+#define open(...) (CRASH_POINT(), open(__VA_ARGS__))
+#define write(fd, data, size) (CRASH_POINT(), write(fd, data, size))
+#define fsync(fd) (CRASH_POINT(), fsync(fd))
+#define close(fd) (CRASH_POINT(), close(fd))
+#define link(from, to) (CRASH_POINT(), link(from, to))
+#define unlink(path) (CRASH_POINT(), unlink(path))
+#define rename(from, to) (CRASH_POINT(), renames++, rename(from, to))
+// the statics are what is tested
+#include "../app_config.c"
+#include "test.h"
+
+static const char *old_file = "# camera 1\n"
+                              "serial:\n"
+                              "  port: /dev/ttyS1\n"
+                              "  baudrate: 115200\n"
+                              "  package_size: 1024\n"
+                              "  watchdog: 30\n"
+                              "  debug: false\n"
+                              "osd2:\n"
+                              "  text: \"CPU $C\"\n";
+
+static void put(const char *text)
+{
+    FILE *fp = fopen("serial.yaml", "w");
+    if (!fp || fputs(text, fp) < 0 || fclose(fp))
+        exit(2);
+}
+
+static char *get(const char *path)
+{
+    static char text[4096];
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return NULL;
+    text[fread(text, 1, sizeof(text) - 1, fp)] = '\0';
+    fclose(fp);
+    return text;
+}
+
+int main(void)
+{
+    char *dir = test_tmpdir();
+    if (chdir(dir))
+        return 2;
+
+    // A save to compare the interrupted ones with
+    put(old_file);
+    CHECK_EQ(parse_app_config(), CONFIG_OK);
+    struct AppConfig config = app_config;
+    config.baudrate = 921600;
+    config.osd_width = 480;
+    CHECK_EQ(write_app_config(&config), EXIT_SUCCESS);
+    char new_file[4096];
+    snprintf(new_file, sizeof(new_file), "%s", get("serial.yaml"));
+    CHECK(strstr(new_file, "baudrate: 921600") && strstr(new_file, "width: 480"));
+    CHECK(strstr(new_file, "# camera 1\n") && strstr(new_file, "text: \"CPU $C\""));
+    int total = steps;
+    CHECK(total >= 8);
+
+    // A crash before each step, then the restore of the next boot. The .bak
+    // brings the old file back until the last step, past it the save completes
+    int olds = 0, news = 0;
+    for (crash_at = 1; crash_at <= total + 1; crash_at++)
+    {
+        put(old_file);
+        steps = 0;
+        if (!setjmp(crashed))
+            write_app_config(&config);
+        int at = crash_at;
+        crash_at = 0;
+        restore_app_config();
+        crash_at = at;
+        const char *after = get("serial.yaml");
+        CHECK(after && (!strcmp(after, old_file) || !strcmp(after, new_file)));
+        olds += after && !strcmp(after, old_file);
+        news += after && !strcmp(after, new_file);
+        CHECK(access("serial.yaml.bak", F_OK));
+    }
+    CHECK_EQ(olds, total);
+    CHECK_EQ(news, 1);
+    crash_at = 0;
+
+    // Saves inside the quiet time are coalesced into one write of the last one
+    put(old_file);
+    CHECK_EQ(parse_app_config(), CONFIG_OK);
+    renames = 0;
+    for (int baudrate = 9600; baudrate <= 115200 * 4; baudrate *= 2)
+    {
+        app_config.baudrate = baudrate;
+        CHECK_EQ(save_app_config(), EXIT_SUCCESS);
+        CHECK_EQ(flush_app_config(false), EXIT_SUCCESS);
+    }
+    CHECK_EQ(renames, 0);
+    CHECK(!strcmp(get("serial.yaml"), old_file));
+    save_requested.tv_sec -= SAVE_QUIET_MS / 1000 + 1;
+    CHECK_EQ(flush_app_config(false), EXIT_SUCCESS);
+    CHECK_EQ(renames, 1);
+    CHECK(strstr(get("serial.yaml"), "baudrate: 307200") != NULL);
+
+    // Nothing pending, or nothing that differs from the file, writes nothing
+    CHECK_EQ(flush_app_config(true), EXIT_SUCCESS);
+    CHECK_EQ(save_app_config(), EXIT_SUCCESS);
+    CHECK_EQ(flush_app_config(true), EXIT_SUCCESS);
+    CHECK_EQ(renames, 1);
+
+    test_rmdir(dir);
+    return test_done("app_config");
+}
@@ -0,0 +1,168 @@
+// atlas.c: fonts baked by mkatlas read back glyph for glyph against the rasteriser
+#include "../atlas.h"
+#include "../schrift.h"
+#include "test.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define FONT "../../majestic-fonts/files/UbuntuMono-Regular.ttf"
+
+static SFT_Font *font;
+
+static void bake(const char *dir, const char *name, const char *options, char *path, size_t size)
+{
+    char command[512];
+    snprintf(path, size, "%s/%s.ttf", dir, name);
+    snprintf(command, sizeof(command), "cp %s %s && ./mkatlas %s -o %s/%s.atlas %s 16 32", FONT, path, options, dir,
+             name, path);
+    CHECK(!system(command));
+}
+
+// Every glyph of the range as the rasteriser draws it, levels quantised like mkatlas -2
+static void check_size(const struct AtlasSize *size, double px, int bits, uint32_t first, uint32_t last)
+{
+    SFT sft = {.font = font, .xScale = px, .yScale = px, .flags = SFT_DOWNWARD_Y};
+    SFT_LMetrics lmtx;
+    unsigned char alpha[128 * 128];
+    int glyphs = 0, pixels = 0, wrong = 0;
+
+    CHECK(size && size->size == px);
+    if (!size)
+        return;
+    CHECK(!sft_lmetrics(&sft, &lmtx) && size->ascender == lmtx.ascender && size->descender == lmtx.descender);
+    CHECK_EQ(atlas_bits(size), bits);
+    for (uint32_t cp = first; cp <= last; cp++)
+    {
+        SFT_Glyph gid;
+        SFT_GMetrics mtx;
+        const struct AtlasGlyph *glyph = atlas_glyph(size, cp);
+        if (sft_lookup(&sft, cp, &gid) || !gid)
+        {
+            CHECK(glyph == NULL);
+            continue;
+        }
+        CHECK(glyph && !sft_gmetrics(&sft, gid, &mtx));
+        if (!glyph)
+            continue;
+        glyphs++;
+        CHECK(glyph->gid == gid && glyph->advanceWidth == mtx.advanceWidth && glyph->yOffset == mtx.yOffset &&
+              glyph->minWidth == mtx.minWidth && glyph->minHeight == mtx.minHeight);
+        CHECK(mtx.minWidth * mtx.minHeight <= (int)sizeof(alpha));
+        CHECK(!sft_render(&sft, gid, (SFT_Image){alpha, mtx.minWidth, mtx.minHeight}));
+
+        const unsigned char *bitmap = atlas_bitmap(size, glyph);
+        int stride = atlas_stride(size, glyph);
+        for (int y = 0; y < mtx.minHeight; y++)
+        {
+            for (int x = 0; x < mtx.minWidth; x++, pixels++)
+            {
+                int want = alpha[y * mtx.minWidth + x], got = bitmap[y * stride + x];
+                if (bits == 2)
+                    want = (want + 42) / 85, got = bitmap[y * stride + x / 4] >> (6 - 2 * (x % 4)) & 3;
+                wrong += want != got;
+            }
+        }
+    }
+    CHECK(glyphs > 0 && pixels > 0);
+    CHECK_EQ(wrong, 0);
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Glyphs of a range ready to draw: every bitmap read from the atlas, or loaded
+// and rendered from the TTF when there is none, the way text.c fills its cache
+static int glyphs_ready(const char *path, double px, uint32_t first, uint32_t last, bool atlas)
+{
+    static unsigned char alpha[128 * 128];
+    int sum = 0;
+    const struct AtlasSize *size = atlas ? atlas_find(path, px) : NULL;
+    SFT sft = {.font = font, .xScale = px, .yScale = px, .flags = SFT_DOWNWARD_Y};
+    for (uint32_t cp = first; cp <= last; cp++)
+    {
+        if (atlas)
+        {
+            const struct AtlasGlyph *glyph = size ? atlas_glyph(size, cp) : NULL;
+            if (glyph)
+                sum += atlas_bitmap(size, glyph)[glyph->minHeight * atlas_stride(size, glyph) / 2];
+            continue;
+        }
+        SFT_Glyph gid;
+        SFT_GMetrics mtx;
+        if (!sft_lookup(&sft, cp, &gid) && gid && !sft_gmetrics(&sft, gid, &mtx) &&
+            !sft_render(&sft, gid, (SFT_Image){alpha, mtx.minWidth, mtx.minHeight}))
+            sum += alpha[mtx.minWidth * mtx.minHeight / 2];
+    }
+    return sum;
+}
+
+// The first text drawn after startup, from a freshly mapped atlas and from the TTF
+static void bench(const char *path)
+{
+    double start = now_us();
+    int from_atlas = glyphs_ready(path, 16, 0x20, 0x7E, true) + glyphs_ready(path, 32, 0x20, 0x7E, true);
+    double atlas = now_us() - start;
+
+    start = now_us();
+    SFT_Font *loaded = font;
+    font = sft_loadfile(path);
+    int from_ttf = glyphs_ready(path, 16, 0x20, 0x7E, false) + glyphs_ready(path, 32, 0x20, 0x7E, false);
+    sft_freefont(font);
+    font = loaded;
+    double ttf = now_us() - start;
+
+    CHECK(from_atlas > 0 && from_ttf > 0);
+    printf("%-12s %.0f us to map 16 and 32 px ASCII, %.0f us to load and render it from the TTF\n", "atlas", atlas,
+           ttf);
+}
+
+int main(void)
+{
+    char *dir = test_tmpdir(), full[256], packed[256], broken[256], path[300];
+    font = sft_loadfile(FONT);
+    CHECK(font != NULL);
+    if (!font)
+        return test_done("atlas");
+
+    bake(dir, "full", "-r 0x20-0x7E -r 0x410-0x451", full, sizeof(full));
+    bake(dir, "packed", "-2", packed, sizeof(packed));
+    bench(full);
+
+    check_size(atlas_find(full, 16), 16, 8, 0x20, 0x7E);
+    check_size(atlas_find(full, 16), 16, 8, 0x410, 0x451);
+    check_size(atlas_find(full, 32), 32, 8, 0x20, 0x7E);
+    check_size(atlas_find(full, 32), 32, 8, 0x410, 0x451);
+    check_size(atlas_find(packed, 32), 32, 2, 0x20, 0x7E);
+    CHECK(atlas_find(full, 24) == NULL);
+    CHECK(atlas_glyph(atlas_find(packed, 16), 0x416) == NULL); // outside the default range
+    CHECK(atlas_glyph(atlas_find(full, 16), 0x416) != NULL);
+    CHECK(atlas_glyph(atlas_find(full, 16), 0xA8) == NULL); // in the font, not in the ranges
+    double shift = 1;
+    CHECK(atlas_kerning(atlas_find(full, 16), 'A', 'V', &shift) == 0 && shift == 0); // monospaced
+    CHECK_EQ(atlas_kerning(atlas_find(packed, 16), 'A', 0x416, &shift), -1);
+
+    // A bitmap offset past the end of the file makes the whole atlas unusable
+    bake(dir, "broken", "", broken, sizeof(broken));
+    snprintf(path, sizeof(path), "%s/broken.atlas", dir);
+    FILE *fp = fopen(path, "r+b");
+    struct AtlasHeader header;
+    CHECK(fp && fread(&header, sizeof(header), 1, fp) == 1);
+    if (fp)
+    {
+        long glyph = header.offsets[1] + sizeof(struct AtlasSize) + offsetof(struct AtlasGlyph, bitmap);
+        uint32_t bitmap = 0xFFFFFFF0;
+        CHECK(!fseek(fp, glyph, SEEK_SET) && fwrite(&bitmap, sizeof(bitmap), 1, fp) == 1);
+        fclose(fp);
+    }
+    CHECK(atlas_find(broken, 16) == NULL);
+    CHECK(atlas_find(dir, 16) == NULL); // no atlas at all
+
+    sft_freefont(font);
+    test_rmdir(dir);
+    return test_done("atlas");
+}
@@ -0,0 +1,91 @@
+// text.c blendrow(): every (alpha, dest, color) combination against the exact
+// integer result, then a timing against the double arithmetic it replaced
+#include "../text.c"
+#include "test.h"
+
+#define BENCH_WIDTH 1920
+#define BENCH_ROWS 2000
+
+// The blend before the integer kernel, for the timing only
+static void blendrow_double(unsigned short *d, const unsigned char *s, int count, int color)
+{
+    unsigned short maskr = (color & 0x7C00) >> 10, maskg = (color & 0x3E0) >> 5, maskb = color & 0x1F;
+    for (int x = 0; x < count; x++)
+    {
+        double t = s[x] * (1.0 / 255.0);
+        unsigned short r = (1.0 - t) * ((d[x] & 0x7C00) >> 10) + t * maskr;
+        unsigned short g = (1.0 - t) * ((d[x] & 0x3E0) >> 5) + t * maskg;
+        unsigned short b = (1.0 - t) * (d[x] & 0x1F) + t * maskb;
+        d[x] = ((t > 0.0) << 15) | (r << 10) | (g << 5) | b;
+    }
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(void)
+{
+    static unsigned short dest[256], row[BENCH_WIDTH];
+    static unsigned char alpha[BENCH_WIDTH];
+
+    // One row per (dest, color) channel pair, every alpha along it; the three
+    // channels get different values so a swapped shift shows
+    int wrong = 0;
+    for (int i = 0; i < 256; i++)
+        alpha[i] = i;
+    for (int dc = 0; dc < 32; dc++)
+    {
+        for (int cc = 0; cc < 32; cc++)
+        {
+            int color = cc << 10 | (31 - cc) << 5 | (cc ^ 21);
+            for (int a = 0; a < 256; a++)
+                dest[a] = dc << 10 | (31 - dc) << 5 | (dc ^ 10);
+            blendrow(dest, alpha, 256, color);
+            for (int a = 0; a < 256; a++)
+            {
+                int r = (dc * (255 - a) + cc * a) / 255;
+                int g = ((31 - dc) * (255 - a) + (31 - cc) * a) / 255;
+                int b = ((dc ^ 10) * (255 - a) + (cc ^ 21) * a) / 255;
+                wrong += dest[a] != ((a > 0) << 15 | r << 10 | g << 5 | b);
+            }
+        }
+    }
+    CHECK_EQ(wrong, 0);
+
+    // Every length and offset around the 8-pixel vector loop; a transparent mask
+    // keeps opaque pixels opaque and clear ones clear
+    for (int count = 0; count < 20; count++)
+    {
+        for (int offset = 0; offset < 8; offset++)
+        {
+            for (int i = 0; i < 32; i++)
+                row[i] = 0x5555 | (i & 1) << 15, alpha[i] = i == offset + count ? 255 : (i * 37) & 0xFF;
+            memset(alpha + offset, 0, count);
+            blendrow(row + offset, alpha + offset, count, 0x7FFF);
+            int changed = 0;
+            for (int i = 0; i < 32; i++)
+                changed += row[i] != (0x5555 | (i & 1) << 15);
+            CHECK_EQ(changed, 0);
+        }
+    }
+
+    // Not checked, a slower kernel still draws the right pixels
+    for (int i = 0; i < BENCH_WIDTH; i++)
+        alpha[i] = i * 7, row[i] = i * 2654435761u;
+    double start = now_us();
+    for (int y = 0; y < BENCH_ROWS; y++)
+        blendrow(row, alpha, BENCH_WIDTH, 0x7FFF ^ y);
+    double integer = now_us() - start;
+    start = now_us();
+    for (int y = 0; y < BENCH_ROWS; y++)
+        blendrow_double(row, alpha, BENCH_WIDTH, 0x7FFF ^ y);
+    double fp = now_us() - start;
+    printf("blend        %.2f ns/pixel, %.2f with doubles\n", integer * 1e3 / (BENCH_WIDTH * BENCH_ROWS),
+           fp * 1e3 / (BENCH_WIDTH * BENCH_ROWS));
+
+    return test_done("blend");
+}
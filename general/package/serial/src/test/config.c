@@ -0,0 +1,262 @@
+// config.c: sections and keys of the single-pass tokenizer, YAML and INI style
+#include "../config.h"
+#include "test.h"
+#include <regex.h>
+#include <time.h>
+
+#define BENCH_PARSES 2000
+
+static void parse(struct IniConfig *ini, const char *text)
+{
+    ini->str = strdup(text);
+    CHECK_EQ(find_sections(ini), CONFIG_OK);
+}
+
+static const char *value(struct IniConfig *ini, const char *section, const char *key)
+{
+    static char buffer[256];
+    return parse_param_value(ini, section, key, buffer) == CONFIG_OK ? buffer : NULL;
+}
+
+#define CHECK_VALUE(ini, section, key, expected)                                                                       \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        const char *v_ = value(ini, section, key);                                                                     \
+        CHECK(v_ && !strcmp(v_, expected));                                                                            \
+    } while (0)
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// The keys app_config.c reads, in a file laid out like the shipped serial.yaml
+static const char *bench_keys[][2] = {
+    {"serial", "port"},     {"serial", "baudrate"}, {"serial", "package_size"}, {"serial", "watchdog"},
+    {"serial", "debug"},    {"serial", "camera_id"}, {"osd", "align"},          {"osd", "width"},
+    {"osd", "color"},       {"osd", "background"},   {"osd", "outline"},        {"osd", "format"},
+    {"osd", "palette"},     {"osd0", "text"},        {"osd0", "x"},             {"osd0", "y"},
+    {"osd0", "refresh"},    {"osd1", "text"},        {"osd1", "x"},             {"osd1", "y"},
+    {"osd2", "refresh"},    {"osd3", "text"},        {"osd3", "y"},             {"osd3", "refresh"},
+};
+#define BENCH_KEYS (int)(sizeof(bench_keys) / sizeof(bench_keys[0]))
+
+static const char *bench_file = "# serial.yaml\n"
+                                "serial:\n"
+                                "  port: /dev/ttyS1\n"
+                                "  baudrate: 115200\n"
+                                "  package_size: 1024\n"
+                                "  watchdog: 30\n"
+                                "  debug: false\n"
+                                "  camera_id: 3\n"
+                                "osd:\n"
+                                "  align: left\n"
+                                "  width: 480\n"
+                                "  color: 0xFFFF\n"
+                                "  background: 0x7C00\n"
+                                "  outline: 0x8000\n"
+                                "  format: 1555\n"
+                                "  palette: 0xFF000000|0xFFFFFFFF|0xFFFF0000\n"
+                                "osd0:\n"
+                                "  text: $t\n"
+                                "  x: 16\n"
+                                "  y: 16\n"
+                                "  refresh: 1000\n"
+                                "osd1:\n"
+                                "  text: CPU:$C\n"
+                                "  x: 16\n"
+                                "  y: 64\n"
+                                "osd2:\n"
+                                "  refresh: 0\n"
+                                "osd3:\n"
+                                "  text: /etc/logo.png\n"
+                                "  y: 400\n"
+                                "  refresh: 0\n";
+
+// The parser config.c had before the tokenizer: a section scan with one regex,
+// then a regex compiled for every key and matched from its section
+struct RegexSection
+{
+    char name[64];
+    int pos;
+};
+
+static int regex_sections(const char *str, struct RegexSection *sections, int max)
+{
+    regex_t regex;
+    if (regcomp(&regex, "^([[:space:]]*\\[(\\w+)\\][[:space:]]|(\\w+):)", REG_EXTENDED | REG_NEWLINE | REG_ICASE))
+        return -1;
+    regmatch_t m[4];
+    int count = 0, pos = 0;
+    while (count < max && !regexec(&regex, str + pos, 4, m, 0))
+    {
+        int i = m[2].rm_eo - m[2].rm_so ? 2 : 3;
+        snprintf(sections[count].name, sizeof(sections[count].name), "%.*s", (int)(m[i].rm_eo - m[i].rm_so),
+                 str + pos + m[i].rm_so);
+        pos += m[1].rm_eo;
+        sections[count++].pos = pos;
+    }
+    regfree(&regex);
+    return count;
+}
+
+static bool regex_value(const char *str, const struct RegexSection *sections, int count, const char *section,
+                        const char *key, char *value)
+{
+    int i = 0;
+    while (i < count && strcasecmp(sections[i].name, section))
+        i++;
+    if (i == count)
+        return false;
+    int start = sections[i].pos, end = i + 1 < count ? sections[i + 1].pos : -1;
+
+    char pattern[128];
+    snprintf(pattern, sizeof(pattern), "^[[:space:]]*%s[[:space:]]*[=:][[:space:]]*(.[^[:space:];#]*)", key);
+    regex_t regex;
+    if (regcomp(&regex, pattern, REG_EXTENDED | REG_NEWLINE | REG_ICASE))
+        return false;
+    regmatch_t m[2];
+    int match = regexec(&regex, str + start, 2, m, 0);
+    regfree(&regex);
+    if (match || (end >= 0 && end - start < m[1].rm_so))
+        return false;
+    sprintf(value, "%.*s", (int)(m[1].rm_eo - m[1].rm_so), str + start + m[1].rm_so);
+    return true;
+}
+
+// Both parsers over the same file: same values, and the time of a whole load
+static void bench(void)
+{
+    char expected[BENCH_KEYS][256], buffer[256];
+    struct RegexSection sections[16];
+    int count = regex_sections(bench_file, sections, 16), agree = 0;
+    CHECK_EQ(count, 6);
+    struct IniConfig ini = {0};
+    parse(&ini, bench_file);
+    for (int k = 0; k < BENCH_KEYS; k++)
+    {
+        bool found = regex_value(bench_file, sections, count, bench_keys[k][0], bench_keys[k][1], expected[k]);
+        const char *v = value(&ini, bench_keys[k][0], bench_keys[k][1]);
+        agree += found && v && !strcmp(v, expected[k]);
+    }
+    CHECK_EQ(agree, BENCH_KEYS);
+    close_config(&ini);
+
+    int sink = 0;
+    double start = now_us();
+    for (int i = 0; i < BENCH_PARSES; i++)
+    {
+        ini.str = strdup(bench_file);
+        find_sections(&ini);
+        for (int k = 0; k < BENCH_KEYS; k++)
+            sink += parse_param_value(&ini, bench_keys[k][0], bench_keys[k][1], buffer) == CONFIG_OK;
+        close_config(&ini);
+    }
+    double tokenizer = now_us() - start;
+
+    start = now_us();
+    for (int i = 0; i < BENCH_PARSES; i++)
+    {
+        count = regex_sections(bench_file, sections, 16);
+        for (int k = 0; k < BENCH_KEYS; k++)
+            sink += regex_value(bench_file, sections, count, bench_keys[k][0], bench_keys[k][1], buffer);
+    }
+    double regex = now_us() - start;
+    CHECK_EQ(sink, 2 * BENCH_PARSES * BENCH_KEYS);
+
+    printf("%-12s %.1f us per serial.yaml load, %.1f with regexes (%d keys)\n", "config", tokenizer / BENCH_PARSES,
+           regex / BENCH_PARSES, BENCH_KEYS);
+}
+
+int main(void)
+{
+    struct IniConfig ini = {0};
+    parse(&ini, "# serial.yaml\n"
+                "top: level\n"
+                "serial:\n"
+                "  port: /dev/ttyS2   # trailing comment\n"
+                "  baudrate: 115200;x\n"
+                "  Package_Size: 1024\n"
+                "  debug: yes\n"
+                "  port: /dev/ttyS9\n"
+                "\n"
+                "osd:\n"
+                "  palette: 0xFF000000|0xFFFFFFFF|16\n"
+                "  empty:\n"
+                "  text: \"CPU $C # load\"  # quoted\n"
+                "  blank: \"\"\n"
+                "  open: \"to the end\n"
+                "after: closes osd\n"
+                "[ini]\r\n"
+                "key = value\r\n"
+                "spaced   :   out\n"
+                "noseparator\n"
+                "; comment = no\n"
+                "[]\n"
+                "last=1");
+
+    CHECK_EQ(ini.section_count, 3);
+    CHECK_VALUE(&ini, "", "top", "level");
+    CHECK_VALUE(&ini, "serial", "port", "/dev/ttyS2"); // first occurrence wins
+    CHECK_VALUE(&ini, "serial", "baudrate", "115200");
+    CHECK_VALUE(&ini, "SERIAL", "package_size", "1024");
+    CHECK_VALUE(&ini, "ini", "key", "value");
+    CHECK_VALUE(&ini, "ini", "spaced", "out");
+    CHECK_VALUE(&ini, "ini", "last", "1");
+    CHECK_VALUE(&ini, "", "after", "closes");
+    CHECK(value(&ini, "osd", "after") == NULL);
+    CHECK(value(&ini, "osd", "empty") == NULL);
+    CHECK_VALUE(&ini, "osd", "text", "CPU $C # load");
+    CHECK_VALUE(&ini, "osd", "blank", "");
+    CHECK_VALUE(&ini, "osd", "open", "to the end");
+    CHECK(value(&ini, "ini", "noseparator") == NULL);
+    CHECK(value(&ini, "ini", "comment") == NULL);
+    CHECK(value(&ini, "serial", "palette") == NULL);
+    CHECK(value(&ini, "serial", "por") == NULL);
+    CHECK(value(&ini, "serial", "ports") == NULL);
+
+    char buffer[64];
+    CHECK_EQ(parse_param_value(&ini, "missing", "port", buffer), CONFIG_SECTION_NOT_FOUND);
+    CHECK_EQ(parse_param_value(&ini, "serial", "missing", buffer), CONFIG_PARAM_NOT_FOUND);
+
+    int number = 0, array[4] = {0};
+    bool flag = false;
+    CHECK_EQ(parse_int(&ini, "serial", "baudrate", 0, 1000000, &number), CONFIG_OK);
+    CHECK_EQ(number, 115200);
+    CHECK_EQ(parse_int(&ini, "serial", "package_size", 512, 1023, &number), CONFIG_PARAM_ISNT_IN_RANGE);
+    CHECK_EQ(parse_int(&ini, "serial", "port", 0, 1, &number), CONFIG_PARAM_ISNT_NUMBER);
+    CHECK_EQ(parse_bool(&ini, "serial", "debug", &flag), CONFIG_OK);
+    CHECK(flag);
+    CHECK_EQ(parse_array(&ini, "osd", "palette", array, 4), CONFIG_OK);
+    CHECK(array[0] == (int)0xFF000000 && array[1] == -1 && array[2] == 16 && array[3] == 0);
+
+    int start, end;
+    CHECK_EQ(section_pos(&ini, "osd", &start, &end), CONFIG_OK);
+    CHECK(!strncmp(ini.str + start, "  palette", 9) && !strncmp(ini.str + end, "after:", 6));
+    CHECK_EQ(section_pos(&ini, "ini", &start, &end), CONFIG_OK);
+    CHECK_EQ(end, -1);
+    close_config(&ini);
+
+    // Enough keys to grow the tables and the index, every one still found
+    char *text = malloc(1000 * 32), name[16];
+    size_t length = sprintf(text, "many:\n");
+    for (int i = 0; i < 1000; i++)
+        length += sprintf(text + length, "  key%d: %d\n", i, i * 7);
+    struct IniConfig big = {0};
+    parse(&big, text);
+    CHECK_EQ(big.param_count, 1000);
+    int found = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        snprintf(name, sizeof(name), "KEY%d", i);
+        found += parse_int(&big, "many", name, 0, 7000, &number) == CONFIG_OK && number == i * 7;
+    }
+    CHECK_EQ(found, 1000);
+    close_config(&big);
+    free(text);
+
+    bench();
+    return test_done("config");
+}
@@ -0,0 +1,95 @@
+// crc.c: slicing-by-8 kernels against the catalogue check values and a bitwise reference
+#include "../crc.h"
+#include "test.h"
+#include <time.h>
+#include <zlib.h>
+
+#define BENCH_PACKAGE 1024
+#define BENCH_PACKAGES 20000
+
+static uint16_t crc16_bitwise(uint16_t crc, const unsigned char *p, size_t len)
+{
+    while (len--)
+    {
+        crc ^= *p++ << 8;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 0x8000 ? crc << 1 ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+// The additive checksum packages carried before CRC mode
+static long sum_bytes(long sum, const unsigned char *p, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        sum += p[i];
+    return sum;
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(void)
+{
+    unsigned char data[4099];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = i * 7 + (i >> 5);
+
+    CHECK_EQ(crc16_ccitt(CRC16_INIT, "123456789", 9), 0x29B1);
+    CHECK_EQ(crc32_update(CRC32_INIT, "123456789", 9), 0xCBF43926);
+    CHECK_EQ(crc16_ccitt(CRC16_INIT, "", 0), CRC16_INIT);
+    CHECK_EQ(crc32_update(CRC32_INIT, "", 0), 0);
+
+    // Every tail length and alignment of the 8 byte loop
+    for (size_t offset = 0; offset < 8; offset++)
+    {
+        for (size_t len = 0; len < 40; len++)
+        {
+            CHECK_EQ(crc16_ccitt(CRC16_INIT, data + offset, len), crc16_bitwise(CRC16_INIT, data + offset, len));
+            CHECK_EQ(crc32_update(CRC32_INIT, data + offset, len), crc32(0, data + offset, len));
+        }
+    }
+
+    // Chaining over uneven pieces gives the CRC of the whole
+    uint16_t crc16 = CRC16_INIT;
+    uint32_t crc32_ = CRC32_INIT;
+    for (size_t pos = 0, step = 1; pos < sizeof(data); pos += step, step = step * 3 % 1021)
+    {
+        size_t len = sizeof(data) - pos < step ? sizeof(data) - pos : step;
+        crc16 = crc16_ccitt(crc16, data + pos, len);
+        crc32_ = crc32_update(crc32_, data + pos, len);
+    }
+    CHECK_EQ(crc16, crc16_bitwise(CRC16_INIT, data, sizeof(data)));
+    CHECK_EQ(crc32_, crc32(0, data, sizeof(data)));
+
+    // Not checked, only what a package costs with each integrity check
+    static unsigned char package[BENCH_PACKAGE];
+    for (size_t i = 0; i < sizeof(package); i++)
+        package[i] = i * 13 + (i >> 3);
+    volatile long sink = 0;
+    double start = now_us();
+    for (int i = 0; i < BENCH_PACKAGES; i++)
+        sink += sum_bytes(i, package, sizeof(package));
+    double sum = now_us() - start;
+    start = now_us();
+    for (int i = 0; i < BENCH_PACKAGES; i++)
+        sink += crc16_ccitt(i, package, sizeof(package));
+    double slicing16 = now_us() - start;
+    start = now_us();
+    for (int i = 0; i < BENCH_PACKAGES; i++)
+        sink += crc32_update(i, package, sizeof(package));
+    double slicing32 = now_us() - start;
+    start = now_us();
+    for (int i = 0; i < BENCH_PACKAGES / 10; i++)
+        sink += crc16_bitwise(i, package, sizeof(package));
+    double bitwise = (now_us() - start) * 10;
+    double bytes = (double)BENCH_PACKAGE * BENCH_PACKAGES;
+    printf("crc          %.2f ns/byte CRC-16, %.2f CRC-32, %.2f additive sum, %.2f bitwise CRC-16\n",
+           slicing16 * 1e3 / bytes, slicing32 * 1e3 / bytes, sum * 1e3 / bytes, bitwise * 1e3 / bytes);
+
+    return test_done("crc");
+}
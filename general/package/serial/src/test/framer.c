@@ -0,0 +1,134 @@
+// framer.c: frame lengths of every command, split reads, resync and the partial frame timeout
+#include "../data_define.h"
+#include "../framer.h"
+#include "test.h"
+
+static unsigned char seen[64][UPGRADE_CHUNK + 12];
+static size_t seen_length[64];
+static int frames;
+
+static void handler(char *frame, size_t length, void *user)
+{
+    (void)user;
+    if (frames < 64)
+    {
+        memcpy(seen[frames], frame, length);
+        seen_length[frames] = length;
+    }
+    frames++;
+}
+
+// Feed bytes in pieces of step, dispatching after each like the serial loop
+static void feed(struct Framer *framer, const unsigned char *data, size_t length, size_t step)
+{
+    for (size_t pos = 0; pos < length;)
+    {
+        size_t available, n = length - pos < step ? length - pos : step;
+        unsigned char *space = framer_space(framer, &available);
+        if (n > available)
+            n = available;
+        memcpy(space, data + pos, n);
+        framer_commit(framer, n);
+        framer_dispatch(framer, handler, NULL);
+        pos += n;
+    }
+}
+
+// START cmd camera, payload of total - 4 bytes, END
+static size_t make(unsigned char *p, int command, size_t total)
+{
+    memset(p, 0x11, total);
+    p[0] = START, p[1] = command, p[2] = 1, p[total - 1] = END;
+    return total;
+}
+
+int main(void)
+{
+    static struct Framer framer;
+    static unsigned char stream[16384];
+    size_t lengths[32], count = 0, size = 0;
+
+    size += lengths[count++] = make(stream + size, LIST_FILE, 9);
+    size += lengths[count++] = make(stream + size, NEXT_FILE, 10);
+    size += lengths[count++] = make(stream + size, NEXT_FILE, 11);
+    size += lengths[count++] = make(stream + size, GET_SPEC_PACKAGE, 7);
+    size += lengths[count++] = make(stream + size, SEND_SPEC_DATA_PACKAGE, 7);
+    size += lengths[count++] = make(stream + size, GET_WINDOW, 8);
+    size += lengths[count++] = make(stream + size, RETRANSMIT, 11);
+    size += lengths[count++] = make(stream + size, GET_SESSION_PACKAGE, 10);
+    size += lengths[count++] = make(stream + size, BAUD_RATE, 5);
+    size += lengths[count++] = make(stream + size, BAUD_RATE, 6);
+    stream[size] = '\r', stream[size + 1] = '\n', size += 2; // line terminator between frames
+    size += lengths[count++] = make(stream + size, MOSD, 6 + 7);
+    stream[size - 7 - 2] = 7;
+    size += lengths[count++] = make(stream + size, RTC, 8);
+    size += lengths[count++] = make(stream + size, STATUS, 4);
+    size += lengths[count++] = make(stream + size, STATUS, 5);
+    size += lengths[count++] = make(stream + size, UPGRADE_BEGIN, 8);
+    size += lengths[count++] = make(stream + size, UPGRADE_COMMIT, 4);
+    size += lengths[count++] = make(stream + size, UPGRADE_DATA, 12 + UPGRADE_CHUNK);
+    stream[size - 12 - UPGRADE_CHUNK + 7] = UPGRADE_CHUNK >> 8;
+    stream[size - 12 - UPGRADE_CHUNK + 8] = UPGRADE_CHUNK & 0xFF;
+
+    // Whole, byte by byte and in odd pieces: the same frames every time
+    size_t steps[] = {sizeof(stream), 1, 7, 1000};
+    for (size_t s = 0; s < sizeof(steps) / sizeof(steps[0]); s++)
+    {
+        framer_reset(&framer);
+        frames = 0;
+        feed(&framer, stream, size, steps[s]);
+        CHECK_EQ(frames, count);
+        size_t pos = 0;
+        for (int i = 0; i < frames && i < (int)count; i++)
+        {
+            CHECK_EQ(seen_length[i], lengths[i]);
+            if (seen[i][0] == START && seen[i][1] == MOSD)
+                pos += 2;
+            CHECK(!memcmp(seen[i], stream + pos, lengths[i]));
+            pos += lengths[i];
+        }
+        CHECK_EQ(framer.head, framer.tail);
+    }
+
+    // Unknown commands, a wrong END and oversized upgrade chunks are skipped
+    unsigned char noise[64];
+    size = 0;
+    noise[size++] = START, noise[size++] = 0x7F;
+    size += make(noise + size, STATUS, 4) - 1; // no END
+    noise[size++] = 0x00;
+    size_t bad = size;
+    size += make(noise + size, UPGRADE_DATA, 12);
+    noise[bad + 7] = 0xFF;
+    size_t good = size;
+    size += make(noise + size, RTC, 8);
+    framer_reset(&framer);
+    frames = 0;
+    feed(&framer, noise, size, 3);
+    CHECK_EQ(frames, 1);
+    CHECK(seen_length[0] == 8 && !memcmp(seen[0], noise + good, 8));
+
+    // A partial frame with nothing after it is given FRAME_TIMEOUT_MS, then its
+    // START is dropped and the line is free again
+    framer_reset(&framer);
+    frames = 0;
+    size = make(stream, GET_WINDOW, 8) - 3;
+    feed(&framer, stream, size, size);
+    framer_expire(&framer);
+    CHECK_EQ(framer.tail - framer.head, size);
+    framer.started.tv_sec -= 1;
+    framer_expire(&framer);
+    framer_dispatch(&framer, handler, NULL);
+    CHECK_EQ(framer.head, framer.tail);
+    feed(&framer, stream + 16, make(stream + 16, STATUS, 4), 4);
+    CHECK_EQ(frames, 1);
+    CHECK(seen_length[0] == 4 && seen[0][1] == STATUS);
+
+    // The timeout runs from the first byte of the partial frame, not from the
+    // frame dispatched before it
+    framer.started.tv_sec -= 10;
+    feed(&framer, stream, 3, 3);
+    framer_expire(&framer);
+    CHECK_EQ(framer.tail - framer.head, 3);
+
+    return test_done("framer");
+}
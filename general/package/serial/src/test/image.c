@@ -0,0 +1,273 @@
+// image.c: BMP and PNG logos decoded into every region format, and the files
+// that must be rejected without leaking or writing past the surface
+#include "../image.h"
+#include "../palette.h"
+#include "../region.h"
+#include "test.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#define W 5
+#define H 3
+
+static char *dir;
+static unsigned char rgba[H][W][4]; // the reference image, row 0 on top
+
+static void put16(unsigned char *p, uint16_t v)
+{
+    p[0] = v, p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    put16(p, v), put16(p + 2, v >> 16);
+}
+
+static void put32be(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24, p[1] = v >> 16, p[2] = v >> 8, p[3] = v;
+}
+
+static const char *save(const char *name, const unsigned char *data, size_t size)
+{
+    static char path[128];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE *fp = fopen(path, "wb");
+    if (!fp || fwrite(data, 1, size, fp) != size || fclose(fp))
+        exit(2);
+    return path;
+}
+
+// ARGB8888 decode of the file, 0 on success
+static int load(const char *path, BITMAP *bitmap, int format)
+{
+    return load_logo(path, bitmap, format, 0, 0);
+}
+
+static uint32_t pixel8888(const BITMAP *bitmap, int x, int y)
+{
+    return ((const uint32_t *)bitmap->pData)[y * bitmap->u32Width + x];
+}
+
+static uint32_t reference(int x, int y)
+{
+    const unsigned char *p = rgba[y][x];
+    return (uint32_t)p[3] << 24 | p[0] << 16 | p[1] << 8 | p[2];
+}
+
+static void check_exact(const char *path, bool alpha)
+{
+    BITMAP bitmap;
+    CHECK_EQ(load(path, &bitmap, PIXEL_FORMAT_8888), 0);
+    CHECK_EQ(bitmap.u32Width, W);
+    CHECK_EQ(bitmap.u32Height, H);
+    int mismatches = 0;
+    for (int y = 0; bitmap.pData && y < H; y++)
+        for (int x = 0; x < W; x++)
+            mismatches += pixel8888(&bitmap, x, y) != (alpha ? reference(x, y) : reference(x, y) | 0xFF000000);
+    CHECK_EQ(mismatches, 0);
+    free(bitmap.pData);
+}
+
+static void check_rejected(const char *path)
+{
+    BITMAP bitmap;
+    CHECK(load(path, &bitmap, PIXEL_FORMAT_1555) != 0);
+    CHECK(bitmap.pData == NULL);
+}
+
+// Bottom-up BMP with a BITMAPINFOHEADER, optional masks and palette
+static size_t make_bmp(unsigned char *out, int depth, int compression, const uint32_t *masks, int colors)
+{
+    size_t stride = ((size_t)W * depth + 31) / 32 * 4;
+    size_t offset = 14 + 40 + (masks ? 12 : 0) + colors * 4;
+    memset(out, 0, offset + stride * H);
+    out[0] = 'B', out[1] = 'M';
+    put32(out + 2, offset + stride * H);
+    put32(out + 10, offset);
+    put32(out + 14, 40);
+    put32(out + 18, W);
+    put32(out + 22, H);
+    put16(out + 26, 1);
+    put16(out + 28, depth);
+    put32(out + 30, compression);
+    put32(out + 46, colors);
+    for (int i = 0; masks && i < 3; i++)
+        put32(out + 54 + 4 * i, masks[i]);
+    unsigned char *palette = out + 54 + (masks ? 12 : 0);
+    for (int i = 0; i < colors; i++)
+        palette[i * 4] = i * 40, palette[i * 4 + 1] = i * 20, palette[i * 4 + 2] = 255 - i * 30;
+
+    for (int y = 0; y < H; y++)
+    {
+        unsigned char *row = out + offset + (H - 1 - y) * stride;
+        for (int x = 0; x < W; x++)
+        {
+            unsigned char *p = rgba[y][x];
+            if (depth == 24)
+                row[x * 3] = p[2], row[x * 3 + 1] = p[1], row[x * 3 + 2] = p[0];
+            else if (depth == 32)
+                put32(row + x * 4, p[2] | p[1] << 8 | p[0] << 16);
+            else if (depth == 16)
+                put16(row + x * 2, (p[0] >> 3) << 11 | (p[1] >> 2) << 5 | p[2] >> 3);
+            else if (depth == 8)
+            {
+                int index = (x + y) % colors;
+                row[x] = index;
+                p[0] = 255 - index * 30, p[1] = index * 20, p[2] = index * 40, p[3] = 255;
+            }
+        }
+    }
+    return offset + stride * H;
+}
+
+static size_t chunk(unsigned char *out, const char *type, const unsigned char *data, uint32_t size)
+{
+    put32be(out, size);
+    memcpy(out + 4, type, 4);
+    if (size)
+        memcpy(out + 8, data, size);
+    put32be(out + 8 + size, crc32(0, out + 4, size + 4));
+    return 12 + size;
+}
+
+static int paeth(int a, int b, int c)
+{
+    int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// RGBA8 PNG with every row on another filter, IDAT split in two chunks
+static size_t make_png(unsigned char *out, const unsigned char *extra, size_t extra_size)
+{
+    enum
+    {
+        STRIDE = W * 4
+    };
+    unsigned char raw[H][1 + STRIDE], prev[STRIDE] = {0};
+    for (int y = 0; y < H; y++)
+    {
+        const unsigned char *cur = rgba[y][0];
+        int filter = (y + 1) % 5;
+        raw[y][0] = filter;
+        for (int i = 0; i < STRIDE; i++)
+        {
+            int left = i >= 4 ? cur[i - 4] : 0, up = prev[i], corner = i >= 4 ? prev[i - 4] : 0;
+            int predict = filter == 1 ? left : filter == 2 ? up : filter == 3 ? (left + up) / 2
+                        : filter == 4 ? paeth(left, up, corner) : 0;
+            raw[y][1 + i] = cur[i] - predict;
+        }
+        memcpy(prev, cur, STRIDE);
+    }
+    unsigned char packed[256];
+    uLongf packed_size = sizeof(packed);
+    compress(packed, &packed_size, &raw[0][0], sizeof(raw));
+
+    unsigned char head[13] = {0};
+    put32be(head, W);
+    put32be(head + 4, H);
+    head[8] = 8, head[9] = 6;
+    size_t size = 8;
+    memcpy(out, "\x89PNG\r\n\x1A\n", 8);
+    size += chunk(out + size, "IHDR", head, 13);
+    if (extra)
+        memcpy(out + size, extra, extra_size), size += extra_size;
+    size += chunk(out + size, "tEXt", (const unsigned char *)"Comment\0test", 12);
+    size += chunk(out + size, "IDAT", packed, packed_size / 2);
+    size += chunk(out + size, "IDAT", packed + packed_size / 2, packed_size - packed_size / 2);
+    size += chunk(out + size, "IEND", NULL, 0);
+    return size;
+}
+
+// Gradient with a transparent first column, palette BMPs replace it with their colours
+static void reset_reference(void)
+{
+    for (int y = 0; y < H; y++)
+        for (int x = 0; x < W; x++)
+            rgba[y][x][0] = x * 60, rgba[y][x][1] = y * 100, rgba[y][x][2] = 255 - x * 50,
+            rgba[y][x][3] = x == 0 ? 0 : 255 - y * 20;
+}
+
+int main(void)
+{
+    dir = test_tmpdir();
+    unsigned char file[2048];
+    size_t size;
+
+    reset_reference();
+    // BMP at 24 and 32 bits is exact, without alpha
+    check_exact(save("24.bmp", file, make_bmp(file, 24, 0, NULL, 0)), false);
+    check_exact(save("32.bmp", file, make_bmp(file, 32, 0, NULL, 0)), false);
+
+    // RGB565 bitfields come back expanded from their channel widths
+    const uint32_t rgb565[3] = {0xF800, 0x07E0, 0x001F};
+    BITMAP bitmap;
+    CHECK_EQ(load(save("565.bmp", file, make_bmp(file, 16, 3, rgb565, 0)), &bitmap, PIXEL_FORMAT_8888), 0);
+    CHECK_EQ(pixel8888(&bitmap, 4, 2), 0xFFF6CA31);
+    free(bitmap.pData);
+
+    // An 8-bit palette image, and a colour key turning one palette entry transparent
+    size = make_bmp(file, 8, 0, NULL, 4);
+    check_exact(save("8.bmp", file, size), false);
+    CHECK_EQ(load_logo(save("8.bmp", file, size), &bitmap, PIXEL_FORMAT_1555, 1, 0x7C00), 0);
+    CHECK_EQ(((uint16_t *)bitmap.pData)[0], 0x7C00);                  // index 0, pure red, keyed out
+    CHECK_EQ(((uint16_t *)bitmap.pData)[1], 0x8000 | 28 << 10 | 2 << 5 | 5); // index 1
+    free(bitmap.pData);
+    reset_reference();
+
+    // PNG with all five filters, an ancillary chunk and a split IDAT
+    check_exact(save("rgba.png", file, make_png(file, NULL, 0)), true);
+
+    // ARGB1555 and ARGB4444 keep the alpha, I4 packs the luma with transparency at index 0
+    CHECK_EQ(load(save("rgba.png", file, make_png(file, NULL, 0)), &bitmap, PIXEL_FORMAT_1555), 0);
+    CHECK_EQ(((uint16_t *)bitmap.pData)[0] & 0x8000, 0);
+    CHECK_EQ(((uint16_t *)bitmap.pData)[1], 0x8000 | (60 >> 3) << 10 | 0 << 5 | 205 >> 3);
+    free(bitmap.pData);
+    CHECK_EQ(load(save("rgba.png", file, make_png(file, NULL, 0)), &bitmap, PIXEL_FORMAT_4444), 0);
+    CHECK_EQ(((uint16_t *)bitmap.pData)[W + 1], (235 >> 4) << 12 | (60 >> 4) << 8 | (100 >> 4) << 4 | 205 >> 4);
+    free(bitmap.pData);
+    CHECK_EQ(load(save("rgba.png", file, make_png(file, NULL, 0)), &bitmap, PIXEL_FORMAT_4BPP), 0);
+    CHECK_EQ(((unsigned char *)bitmap.pData)[0] >> 4, 0);
+    CHECK(((unsigned char *)bitmap.pData)[0] & 0x0F);
+    free(bitmap.pData);
+
+    // Truncated in the middle of the image data
+    size = make_png(file, NULL, 0);
+    check_rejected(save("short.png", file, size - 30));
+    size = make_bmp(file, 24, 0, NULL, 0);
+    check_rejected(save("short.bmp", file, size - 4));
+
+    // One flipped bit in the image data fails its chunk CRC
+    size = make_png(file, NULL, 0);
+    file[size - 20] ^= 0x01;
+    check_rejected(save("crc.png", file, size));
+
+    // Sizes beyond MAX_LOGO_SIZE, an upside-down INT_MIN height
+    size = make_png(file, NULL, 0);
+    put32be(file + 16, MAX_LOGO_SIZE + 1);
+    put32be(file + 29, crc32(0, file + 12, 17));
+    check_rejected(save("wide.png", file, size));
+    size = make_bmp(file, 24, 0, NULL, 0);
+    put32(file + 18, MAX_LOGO_SIZE + 1);
+    check_rejected(save("wide.bmp", file, size));
+    put32(file + 18, W);
+    put32(file + 22, 0x80000000);
+    check_rejected(save("tall.bmp", file, size));
+
+    // A second IHDR that would resize the surface under the rows
+    unsigned char head[13] = {0}, second[32];
+    put32be(head, 64), put32be(head + 4, 64);
+    head[8] = 8, head[9] = 6;
+    size = chunk(second, "IHDR", head, 13);
+    check_rejected(save("ihdr.png", file, make_png(file, second, size)));
+
+    // An all-ones bitfield mask has no bit left above it
+    const uint32_t wide_masks[3] = {0xFFFFFFFF, 0, 0};
+    check_rejected(save("mask.bmp", file, make_bmp(file, 32, 3, wide_masks, 0)));
+
+    check_rejected(save("text.png", (const unsigned char *)"not an image", 12));
+
+    test_rmdir(dir);
+    return test_done("image");
+}
@@ -0,0 +1,202 @@
+// image_index.c: index files written and read back, and rebuilt when stale or corrupt
+#include "../image_index.h"
+#include "test.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#define HOUR INDEX_ROOT "/2024-01-02/image/13"
+#define OTHER INDEX_ROOT "/2024-01-02/image/14"
+#define INDEX_FILE INDEX_PATH "/2024-01-02_13.idx"
+#define BENCH INDEX_ROOT "/2024-01-02/image/15"
+#define T0 1704200400 // 2024-01-02 13:00 UTC
+#define BENCH_FILES 10000
+
+static void touch(const char *path, time_t mtime)
+{
+    struct utimbuf times = {mtime, mtime};
+    CHECK(!utime(path, &times));
+}
+
+static void touch_ns(const char *path, struct timespec mtime)
+{
+    struct timespec times[2] = {mtime, mtime};
+    CHECK(!utimensat(AT_FDCWD, path, times, 0));
+}
+
+static void create_in(const char *directory, const char *name, time_t mtime)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    FILE *fp = fopen(path, "wb");
+    CHECK(fp != NULL);
+    if (fp)
+        fclose(fp);
+    touch(path, mtime);
+}
+
+static void create(const char *name, time_t mtime)
+{
+    create_in(HOUR, name, mtime);
+}
+
+static double ms_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Cold scan, load from the index file, a cache hit and a rescan after one new
+// file, over an hour of BENCH_FILES images
+static void bench(void)
+{
+    char path[PATH_MAX];
+    struct timespec start;
+    int failed = system("mkdir -p " BENCH);
+    for (int i = 0; i < BENCH_FILES && !failed; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%05d.jpg", BENCH, i);
+        struct utimbuf times = {T0 + 7200 + i / 3, T0 + 7200 + i / 3};
+        FILE *fp = fopen(path, "wb");
+        failed = !fp || fclose(fp) || utime(path, &times);
+    }
+    CHECK(!failed);
+    touch(BENCH, T0 + 9000);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    CHECK_EQ(image_index_get(BENCH)->count, BENCH_FILES);
+    double cold = ms_since(&start);
+    CHECK(image_index_get(HOUR) != NULL);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    CHECK_EQ(image_index_get(BENCH)->count, BENCH_FILES);
+    double stored = ms_since(&start);
+    // 1000 lookups, the milliseconds are microseconds per lookup
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < 1000; i++)
+        image_index_find(image_index_get(BENCH), T0 + 7200 + i);
+    double hit = ms_since(&start);
+    create_in(BENCH, "new.jpg", T0 + 9000);
+    touch(BENCH, T0 + 9001);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    CHECK_EQ(image_index_get(BENCH)->count, BENCH_FILES + 1);
+    double rescan = ms_since(&start);
+    printf("%-12s %d files: %.1f ms cold, %.1f ms from the index file, %.1f us cached, %.1f ms rescan\n",
+           "image_index", BENCH_FILES, cold, stored, hit, rescan);
+}
+
+static time_t mtime_of(const struct ImageIndex *index, const char *name)
+{
+    for (int i = 0; index && i < index->count; i++)
+        if (!strcmp(index->entries[i].name, name))
+            return index->entries[i].mtime;
+    return -1;
+}
+
+// Force the next image_index_get(HOUR) to go to disk
+static const struct ImageIndex *reload(void)
+{
+    CHECK(image_index_get(OTHER) != NULL);
+    return image_index_get(HOUR);
+}
+
+static void patch(long offset, const void *data, size_t size)
+{
+    FILE *fp = fopen(INDEX_FILE, "r+b");
+    CHECK(fp && !fseek(fp, offset, SEEK_SET) && fwrite(data, 1, size, fp) == size);
+    if (fp)
+        fclose(fp);
+}
+
+int main(void)
+{
+    test_rmdir(INDEX_ROOT);
+    CHECK(!system("mkdir -p " HOUR " " OTHER));
+    create("00-30.jpg", T0 + 30);
+    create("00-10.jpg", T0 + 10);
+    create("00-20.jpg", T0 + 20);
+    touch(HOUR, T0 + 100);
+
+    const struct ImageIndex *index = image_index_get(HOUR);
+    CHECK(index && index->count == 3);
+    if (!index)
+        return test_done("image_index");
+    CHECK(!strcmp(index->entries[0].name, "00-10.jpg") && !strcmp(index->entries[2].name, "00-30.jpg"));
+    CHECK(!strcmp(image_index_find(index, T0 + 11)->name, "00-20.jpg"));
+    CHECK(!strcmp(image_index_find(index, T0)->name, "00-10.jpg"));
+    CHECK(image_index_find(index, T0 + 31) == NULL);
+
+    struct stat st;
+    CHECK(!stat(INDEX_FILE, &st) && st.st_size == sizeof(struct IndexHeader) + 3 * sizeof(struct IndexEntry));
+
+    // Changing a file keeps the directory mtime: an index served from disk
+    // still has the old time, a rescan would see the new one
+    create("00-20.jpg", T0 + 25);
+    touch(HOUR, T0 + 100);
+    index = reload();
+    CHECK_EQ(mtime_of(index, "00-20.jpg"), T0 + 20);
+
+    // A new file changes the directory: rescanned, known files are not stat()ed again
+    create("00-40.jpg", T0 + 40);
+    touch(HOUR, T0 + 200);
+    index = reload();
+    CHECK_EQ(index->count, 4);
+    CHECK_EQ(mtime_of(index, "00-20.jpg"), T0 + 20);
+    CHECK_EQ(mtime_of(index, "00-40.jpg"), T0 + 40);
+    index = reload();
+    CHECK_EQ(index->count, 4);
+
+    // Counts that don't match the file size, a bad magic and a torn file are
+    // rebuilt from the directory
+    uint32_t counts[] = {0xFFFFFFFF, 0x10000000, 5, 3};
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    {
+        patch(offsetof(struct IndexHeader, count), &counts[i], sizeof(counts[i]));
+        index = reload();
+        CHECK(index && index->count == 4 && mtime_of(index, "00-20.jpg") == T0 + 25);
+        create("00-20.jpg", T0 + 20);
+        touch(HOUR, T0 + 200);
+        index = reload();
+        CHECK(index && mtime_of(index, "00-20.jpg") == T0 + 25); // stored again
+        create("00-20.jpg", T0 + 25);
+        touch(HOUR, T0 + 200);
+    }
+    // A change within the same second still moves the nanoseconds
+    struct timespec mtime = {T0 + 200, 500000000};
+    create("00-50.jpg", T0 + 50);
+    touch_ns(HOUR, mtime);
+    CHECK_EQ(reload()->count, 5);
+    CHECK(!unlink(HOUR "/00-50.jpg"));
+    mtime.tv_nsec = 0;
+    touch_ns(HOUR, mtime);
+    CHECK_EQ(reload()->count, 4);
+
+    // An index built right after the directory changed is not trusted, a file
+    // added in the same mtime granule leaves the mtime where it was
+    clock_gettime(CLOCK_REALTIME, &mtime);
+    touch_ns(HOUR, mtime);
+    CHECK_EQ(reload()->count, 4);
+    create("00-50.jpg", T0 + 50);
+    touch_ns(HOUR, mtime);
+    CHECK_EQ(image_index_get(HOUR)->count, 5);
+    CHECK(!unlink(HOUR "/00-50.jpg"));
+    touch_ns(HOUR, mtime);
+    CHECK_EQ(reload()->count, 4);
+    touch(HOUR, T0 + 200);
+
+    uint32_t magic = 0;
+    patch(0, &magic, sizeof(magic));
+    CHECK(reload()->count == 4);
+    CHECK(!truncate(INDEX_FILE, sizeof(struct IndexHeader) + sizeof(struct IndexEntry) + 7));
+    CHECK(reload()->count == 4);
+    CHECK(!stat(INDEX_FILE, &st) && st.st_size == sizeof(struct IndexHeader) + 4 * sizeof(struct IndexEntry));
+
+    bench();
+
+    test_rmdir(INDEX_ROOT);
+    return test_done("image_index");
+}
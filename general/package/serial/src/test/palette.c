@@ -0,0 +1,80 @@
+// palette.c: ARGB1555 expansion, colour ramps and the ordered dither of I2/I4 packing
+#include "../palette.h"
+#include "test.h"
+
+static int index_at(const unsigned char *row, int x, int bits)
+{
+    int ppb = PALETTE_PPB(bits);
+    return row[x / ppb] >> (8 - bits - x % ppb * bits) & ((1 << bits) - 1);
+}
+
+int main(void)
+{
+    CHECK_EQ(argb1555_to_8888(0xFFFF), 0xFFFFFFFF);
+    CHECK_EQ(argb1555_to_8888(0x7C00), 0x00FF0000);
+    CHECK_EQ(argb1555_to_8888(0x8000 | 0x10 << 5), 0xFF008400);
+
+    // Ends are the background and the glyph colour, the outline sits at its level
+    uint32_t ramp[PALETTE_SIZE];
+    palette_ramp(ramp, 2, 0x8000, 0, 0xFFFF);
+    CHECK(ramp[0] == 0xFF000000 && ramp[3] == 0xFFFFFFFF && ramp[1] == 0xFF555555 && ramp[2] == 0xFFAAAAAA);
+    palette_ramp(ramp, 2, 0, 0xFC00, 0x83E0);
+    CHECK(ramp[0] == 0x00FF0000 && ramp[1] == 0xFFFF0000 && ramp[3] == 0xFF00FF00);
+    palette_ramp(ramp, 4, 0, 0, 0xFFFF);
+    for (int i = 0; i < 16; i++)
+        CHECK_EQ(ramp[i], (uint32_t)(i * 17) << 24 | 0xFFFFFF);
+
+    for (int bits = 2; bits <= 4; bits += 2)
+    {
+        int top = (1 << bits) - 1, stride = PALETTE_STRIDE(37, bits);
+        unsigned char levels[256][37];
+
+        // Every level over a row: 0 and 255 exact, the dither averages out to the
+        // level and never steps down as the level rises
+        for (int level = 0; level < 256; level++)
+            memset(levels[level], level, sizeof(levels[level]));
+        int worst = 0, monotonic = 1;
+        for (int level = 0; level < 256; level++)
+        {
+            int sum = 0;
+            for (int y = 0; y < 4; y++)
+            {
+                unsigned char row[16];
+                palette_pack(row, stride, levels[level], 0, 0, 16, y, 1, bits);
+                for (int x = 0; x < 16; x++)
+                    sum += index_at(row, x, bits);
+                if (level && y == 0)
+                {
+                    unsigned char lower[16];
+                    palette_pack(lower, stride, levels[level - 1], 0, 0, 16, 0, 1, bits);
+                    for (int x = 0; x < 16; x++)
+                        monotonic &= index_at(lower, x, bits) <= index_at(row, x, bits);
+                }
+            }
+            int mean = (sum * 255 + 32 * top) / (64 * top);
+            if (abs(mean - level) > worst)
+                worst = abs(mean - level);
+            if (level == 0 || level == 255)
+                CHECK_EQ(sum, level ? 64 * top : 0);
+        }
+        CHECK(monotonic);
+        CHECK(worst <= 255 / top / 16 + 1);
+
+        // Columns x0..x1 only, leftmost pixel in the high bits, the tail of the
+        // last byte left at index 0
+        unsigned char gradient[37], row[24];
+        for (int x = 0; x < 37; x++)
+            gradient[x] = x < 20 ? 0 : 255;
+        int ppb = PALETTE_PPB(bits);
+        memset(row, 0xA5, sizeof(row));
+        palette_pack(row, stride, gradient + ppb, 0, ppb, 37, 0, 1, bits);
+        CHECK_EQ(row[0], 0xA5);
+        CHECK_EQ(index_at(row, 19, bits), 0);
+        CHECK_EQ(index_at(row, 20, bits), top);
+        CHECK_EQ(index_at(row, 36, bits), top);
+        for (int x = 37; x < stride * ppb; x++)
+            CHECK_EQ(index_at(row, x, bits), 0);
+        CHECK_EQ(row[stride], 0xA5);
+    }
+    return test_done("palette");
+}
@@ -0,0 +1,105 @@
+// rgn_host.c: region bookkeeping, canvas stride and the composited PNG dump
+#include "../palette.h"
+#include "mi_rgn.h"
+#include "test.h"
+#include <stdint.h>
+#include <zlib.h>
+
+#define FRAME_W 32
+#define FRAME_H 8
+
+static void attach(MI_RGN_HANDLE handle, int x, int y)
+{
+    MI_RGN_ChnPort_t port = {.s32OutputPortId = 0};
+    MI_RGN_ChnPortParam_t param = {.bShow = 1, .stPoint = {x, y}};
+    param.unPara.stOsdChnPort.stOsdAlphaAttr.stAlphaPara.stArgb1555Alpha.u8FgAlpha = 0xFF;
+    CHECK_EQ(MI_RGN_AttachToChn(handle, &port, &param), MI_RGN_OK);
+    CHECK(MI_RGN_AttachToChn(handle, &port, &param) != MI_RGN_OK);
+}
+
+// Inflate the single IDAT of the dump into filter byte + RGB rows
+static int load_png(const char *path, unsigned char *rgb, uLongf size)
+{
+    unsigned char file[4096];
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return -1;
+    size_t length = fread(file, 1, sizeof(file), fp);
+    fclose(fp);
+    if (length < 8 || memcmp(file, "\x89PNG\r\n\x1A\n", 8))
+        return -1;
+    for (size_t pos = 8; pos + 12 <= length;)
+    {
+        uint32_t chunk = file[pos] << 24 | file[pos + 1] << 16 | file[pos + 2] << 8 | file[pos + 3];
+        if (!memcmp(file + pos + 4, "IDAT", 4))
+            return uncompress(rgb, &size, file + pos + 8, chunk) == Z_OK ? (int)size : -1;
+        pos += 12 + chunk;
+    }
+    return -1;
+}
+
+static const unsigned char *pixel(const unsigned char *rgb, int x, int y)
+{
+    return rgb + y * (1 + FRAME_W * 3) + 1 + x * 3;
+}
+
+int main(void)
+{
+    char *dir = test_tmpdir(), png[128];
+    snprintf(png, sizeof(png), "%s/osd.png", dir);
+    setenv("RGN_DUMP", png, 1);
+    setenv("RGN_FRAME", "32x8", 1);
+
+    MI_RGN_PaletteTable_t palette = {0};
+    palette.astElement[1] = (MI_RGN_PaletteElement_t){0xFF, 0x00, 0xFF, 0x00};
+    CHECK(MI_RGN_Create(0, &(MI_RGN_Attr_t){0}) != MI_RGN_OK); // before init
+    CHECK_EQ(MI_RGN_Init(&palette), MI_RGN_OK);
+
+    // ARGB1555 region, rows padded to the driver alignment
+    MI_RGN_Attr_t attr = {.eType = E_MI_RGN_TYPE_OSD,
+                          .stOsdInitParam = {E_MI_RGN_PIXEL_FORMAT_ARGB1555, {.u32Width = 5, .u32Height = 2}}};
+    CHECK_EQ(MI_RGN_Create(0, &attr), MI_RGN_OK);
+    CHECK_EQ(MI_RGN_Create(0, &attr), MI_ERR_RGN_EXIST);
+    CHECK(MI_RGN_Create((MI_RGN_HANDLE)-1, &attr) != MI_RGN_OK);
+    CHECK(MI_RGN_Destroy((MI_RGN_HANDLE)-1) != MI_RGN_OK);
+
+    MI_RGN_CanvasInfo_t canvas;
+    CHECK_EQ(MI_RGN_GetCanvasInfo(0, &canvas), MI_RGN_OK);
+    CHECK_EQ(canvas.u32Stride, 16);
+
+    uint16_t bits[2][5] = {{0xFC00, 0xFC00, 0x0000, 0x83E0, 0x83E0}, {0x801F, 0, 0, 0, 0x801F}};
+    MI_RGN_Bitmap_t bitmap = {E_MI_RGN_PIXEL_FORMAT_ARGB1555, {5, 2}, bits};
+    CHECK_EQ(MI_RGN_SetBitMap(0, &bitmap), MI_RGN_OK);
+    const uint16_t *row1 = (const uint16_t *)((uintptr_t)canvas.virtAddr + canvas.u32Stride);
+    CHECK_EQ(row1[0], 0x801F);
+    CHECK_EQ(row1[4], 0x801F);
+    bitmap.stSize.u32Width = 6;
+    CHECK_EQ(MI_RGN_SetBitMap(0, &bitmap), MI_ERR_RGN_ILLEGAL_PARAM);
+    attach(0, 4, 2);
+
+    // I4 region drawn through the palette
+    attr.stOsdInitParam = (MI_RGN_OsdInitParam_t){E_MI_RGN_PIXEL_FORMAT_I4, {.u32Width = 3, .u32Height = 1}};
+    CHECK_EQ(MI_RGN_Create(1, &attr), MI_RGN_OK);
+    unsigned char indices[PALETTE_STRIDE(3, 4)] = {0x01, 0x00};
+    bitmap = (MI_RGN_Bitmap_t){E_MI_RGN_PIXEL_FORMAT_I4, {3, 1}, indices};
+    CHECK_EQ(MI_RGN_SetBitMap(1, &bitmap), MI_RGN_OK);
+    attach(1, 20, 6);
+
+    attr.stOsdInitParam.ePixelFmt = E_MI_RGN_PIXEL_FORMAT_I8;
+    CHECK_EQ(MI_RGN_Create(2, &attr), MI_ERR_RGN_NOT_SUPPORT);
+
+    CHECK_EQ(MI_RGN_DeInit(), MI_RGN_OK);
+    unsigned char rgb[FRAME_H * (1 + FRAME_W * 3)];
+    CHECK_EQ(load_png(png, rgb, sizeof(rgb)), sizeof(rgb));
+    CHECK(!memcmp(pixel(rgb, 0, 0), "\x80\x80\x80", 3));
+    CHECK(!memcmp(pixel(rgb, 4, 2), "\xF8\x00\x00", 3));
+    CHECK(!memcmp(pixel(rgb, 6, 2), "\x80\x80\x80", 3)); // transparent
+    CHECK(!memcmp(pixel(rgb, 7, 2), "\x00\xF8\x00", 3));
+    CHECK(!memcmp(pixel(rgb, 8, 3), "\x00\x00\xF8", 3));
+    CHECK(!memcmp(pixel(rgb, 20, 6), "\x80\x80\x80", 3)); // palette index 0 is clear
+    CHECK(!memcmp(pixel(rgb, 21, 6), "\x00\xFF\x00", 3));
+    CHECK(!memcmp(pixel(rgb, 22, 6), "\x80\x80\x80", 3));
+
+    test_rmdir(dir);
+    return test_done("rgn_host");
+}
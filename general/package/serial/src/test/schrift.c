@@ -0,0 +1,137 @@
+// schrift.c: glyphs rendered against golden sheets made with the double precision
+// rasteriser. Run with -w to write the sheets again.
+#include "../schrift.h"
+#include "test.h"
+#include <math.h>
+
+#define FONT "../../majestic-fonts/files/UbuntuMono-Regular.ttf"
+#define GOLDEN "test/golden"
+// Float accumulation may round a pixel the other way now and then
+#define MAX_OFF_BY_ONE 16
+
+// UbuntuMono is cut down to ASCII, Cyrillic and a few signs
+static const SFT_UChar glyphs[] = {'A', 'g', '@', '&', '%', '8', 0x416, 0x44F, 0x2116};
+static const int sizes[] = {12, 32, 64};
+
+// Every glyph of the set side by side, top aligned, into one 8-bit sheet
+static unsigned char *render_sheet(SFT *sft, int *width, int *height)
+{
+    SFT_GMetrics metrics[sizeof(glyphs) / sizeof(glyphs[0])];
+    SFT_Glyph gid[sizeof(glyphs) / sizeof(glyphs[0])];
+    int count = sizeof(glyphs) / sizeof(glyphs[0]);
+
+    *width = *height = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (sft_lookup(sft, glyphs[i], &gid[i]) || !gid[i] || sft_gmetrics(sft, gid[i], &metrics[i]))
+            return NULL;
+        *width += metrics[i].minWidth + 1;
+        if (metrics[i].minHeight > *height)
+            *height = metrics[i].minHeight;
+    }
+    unsigned char *sheet = calloc(*width, *height), *glyph = malloc(*width * *height);
+    for (int i = 0, x = 0; sheet && glyph && i < count; x += metrics[i++].minWidth + 1)
+    {
+        SFT_Image image = {glyph, metrics[i].minWidth, metrics[i].minHeight};
+        if (sft_render(sft, gid[i], image))
+        {
+            free(sheet);
+            sheet = NULL;
+            break;
+        }
+        for (int y = 0; y < image.height; y++)
+            memcpy(sheet + y * *width + x, glyph + y * image.width, image.width);
+    }
+    free(glyph);
+    return sheet;
+}
+
+static unsigned char *read_pgm(const char *path, int *width, int *height)
+{
+    FILE *fp = fopen(path, "rb");
+    int max;
+    if (!fp || fscanf(fp, "P5 %d %d %d", width, height, &max) != 3 || max != 255 || fgetc(fp) != '\n')
+    {
+        if (fp)
+            fclose(fp);
+        return NULL;
+    }
+    unsigned char *pixels = malloc(*width * *height);
+    if (pixels && fread(pixels, 1, *width * *height, fp) != (size_t)(*width * *height))
+    {
+        free(pixels);
+        pixels = NULL;
+    }
+    fclose(fp);
+    return pixels;
+}
+
+static int write_pgm(const char *path, const unsigned char *pixels, int width, int height)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return -1;
+    fprintf(fp, "P5\n%d %d\n255\n", width, height);
+    fwrite(pixels, 1, width * height, fp);
+    return fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+    int write = argc > 1 && !strcmp(argv[1], "-w");
+    SFT sft = {.font = sft_loadfile(FONT), .flags = SFT_DOWNWARD_Y};
+    CHECK(sft.font != NULL);
+    if (!sft.font)
+        return test_done("schrift");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        char path[64];
+        int width, height, golden_width, golden_height;
+        snprintf(path, sizeof(path), GOLDEN "/schrift-%d.pgm", sizes[s]);
+        sft.xScale = sft.yScale = sizes[s];
+        unsigned char *sheet = render_sheet(&sft, &width, &height);
+        CHECK(sheet != NULL);
+        if (!sheet)
+            continue;
+        if (write)
+            CHECK(!write_pgm(path, sheet, width, height));
+
+        unsigned char *golden = read_pgm(path, &golden_width, &golden_height);
+        CHECK(golden && golden_width == width && golden_height == height);
+        if (golden && golden_width == width && golden_height == height)
+        {
+            int off_by_one = 0, worse = 0;
+            for (int i = 0; i < width * height; i++)
+            {
+                int diff = abs(sheet[i] - golden[i]);
+                off_by_one += diff == 1;
+                worse += diff > 1;
+            }
+            CHECK_EQ(worse, 0);
+            CHECK(off_by_one <= MAX_OFF_BY_ONE);
+        }
+        free(golden);
+        free(sheet);
+    }
+
+    // Repeated renders reuse the scratch arena and give the same pixels
+    SFT_Glyph gid;
+    SFT_GMetrics metrics;
+    sft.xScale = sft.yScale = 128;
+    CHECK(!sft_lookup(&sft, '@', &gid) && !sft_gmetrics(&sft, gid, &metrics));
+    unsigned char *first = malloc(metrics.minWidth * metrics.minHeight);
+    unsigned char *again = malloc(metrics.minWidth * metrics.minHeight);
+    CHECK(!sft_render(&sft, gid, (SFT_Image){first, metrics.minWidth, metrics.minHeight}));
+    sft.xScale = sft.yScale = 8;
+    unsigned char small[8 * 8];
+    CHECK(!sft_render(&sft, gid, (SFT_Image){small, 8, 8}));
+    sft.xScale = sft.yScale = 128;
+    CHECK(!sft_render(&sft, gid, (SFT_Image){again, metrics.minWidth, metrics.minHeight}));
+    CHECK(!memcmp(first, again, metrics.minWidth * metrics.minHeight));
+    free(first);
+    free(again);
+
+    sft_freefont(sft.font);
+    return test_done("schrift");
+}
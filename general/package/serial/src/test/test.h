@@ -0,0 +1,61 @@
+#ifndef TEST_H_
+#define TEST_H_
+// Checks for the host unit tests (make test). Every test/<name>.c is a program of
+// its own: failed checks print their location and test_done() turns them into
+// the exit status.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int test_checks, test_failures;
+
+#define CHECK(cond)                                                                                                    \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        test_checks++;                                                                                                 \
+        if (!(cond))                                                                                                   \
+        {                                                                                                              \
+            test_failures++;                                                                                           \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);                                   \
+        }                                                                                                              \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                                                                 \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        long long a_ = (long long)(a), b_ = (long long)(b);                                                            \
+        test_checks++;                                                                                                 \
+        if (a_ != b_)                                                                                                  \
+        {                                                                                                              \
+            test_failures++;                                                                                           \
+            fprintf(stderr, "%s:%d: %s == %s failed: %lld != %lld\n", __FILE__, __LINE__, #a, #b, a_, b_);           \
+        }                                                                                                              \
+    } while (0)
+
+// Scratch directory under /tmp, removed by the caller with test_rmdir()
+static inline char *test_tmpdir(void)
+{
+    static char path[64];
+    strcpy(path, "/tmp/serial-test-XXXXXX");
+    if (!mkdtemp(path))
+    {
+        perror("mkdtemp");
+        exit(2);
+    }
+    return path;
+}
+
+static inline void test_rmdir(const char *path)
+{
+    char command[128];
+    snprintf(command, sizeof(command), "rm -rf '%s'", path);
+    if (system(command))
+        fprintf(stderr, "can't remove %s\n", path);
+}
+
+static inline int test_done(const char *name)
+{
+    printf("%-12s %4d checks, %d failed\n", name, test_checks, test_failures);
+    return test_failures ? 1 : 0;
+}
+#endif
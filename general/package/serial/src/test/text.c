@@ -0,0 +1,127 @@
+// text.c: glyph and font caches give the pixels of a cold render, partial
+// updates those of a full one, and a timing of the cached timestamp render
+// text.c is included for the statics text.h leaves in every file that uses it
+#include "../text.c"
+#include "test.h"
+
+#define FONT "../../majestic-fonts/files/UbuntuMono-Regular.ttf"
+#define STAMP "2024-01-02 13:45:07 Ж№"
+#define BENCH_CALLS 2000
+
+// Every glyph of the font once, more than the glyph cache holds over two sizes
+static const char *everything = " !\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`"
+                                "abcdefghijklmnopqrstuvwxyz{|}~АБВГДЕЖЗИЙКЛМНОПРСТУФХЦЧШЩЪЫЬЭЮЯ"
+                                "абвгдежзийклмнопрстуфхцчшщъыьэюяѐё";
+
+static size_t bytes_of(BITMAP b)
+{
+    int bits = b.enPixelFormat == PIXEL_FORMAT_2BPP ? 2 : b.enPixelFormat == PIXEL_FORMAT_4BPP ? 4 : 16;
+    return (b.u32Width * bits + 7) / 8 * b.u32Height;
+}
+
+// Render and keep a copy, the bitmap itself lives in the pool
+static unsigned char *render(const char *font, double size, const char *text, const TEXTSTYLE *style, BITMAP *out)
+{
+    *out = raster_text(font, size, text, style);
+    unsigned char *copy = malloc(bytes_of(*out));
+    memcpy(copy, out->pData, bytes_of(*out));
+    pool_free(out->pData);
+    return copy;
+}
+
+static void check_same(const char *font, double size, const char *text, const TEXTSTYLE *style,
+                       const unsigned char *expected, BITMAP was)
+{
+    BITMAP now;
+    unsigned char *pixels = render(font, size, text, style, &now);
+    CHECK(now.u32Width == was.u32Width && now.u32Height == was.u32Height);
+    CHECK(now.u32Width == was.u32Width && !memcmp(pixels, expected, bytes_of(now)));
+    free(pixels);
+}
+
+// update_text() over a state that saw first against a fresh state, for the
+// text second
+static void check_update(const TEXTSTYLE *style, const char *first, const char *second, int expected)
+{
+    RECT area = {.width = 400, .height = 48};
+    int stride = style->bits ? PALETTE_STRIDE(area.width, style->bits) : area.width;
+    size_t size = style->bits ? (size_t)stride * area.height : (size_t)area.width * area.height * 2;
+    SFT_Image incremental = {calloc(size, 1), stride, area.height};
+    SFT_Image fresh = {calloc(size, 1), stride, area.height};
+    TEXTSTATE *state = calloc(1, sizeof(*state)), *other = calloc(1, sizeof(*other));
+
+    CHECK_EQ(update_text(FONT, 32, first, style, state, &incremental, area), TEXT_FULL);
+    CHECK_EQ(update_text(FONT, 32, second, style, state, &incremental, area), expected);
+    CHECK_EQ(update_text(FONT, 32, second, style, state, &incremental, area), TEXT_UNCHANGED);
+    CHECK_EQ(update_text(FONT, 32, second, style, other, &fresh, area), TEXT_FULL);
+    CHECK(!memcmp(incremental.pixels, fresh.pixels, size));
+    CHECK_EQ(update_text(FONT, 32, everything, style, state, &incremental, area), TEXT_TOO_SMALL);
+
+    free(incremental.pixels);
+    free(fresh.pixels);
+    free(state);
+    free(other);
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(void)
+{
+    char *dir = test_tmpdir(), fonts[5][64], command[512];
+    TEXTSTYLE boxed = {.color = 0xFC00, .background = 0x8000 | 0x1F, .outline = 0x8000, .padding = 2};
+    TEXTSTYLE palette = {.color = 0xFFFF, .outline = 0x8000, .bits = 2};
+    BITMAP cold, boxed_cold, palette_cold;
+
+    unsigned char *stamp = render(FONT, 32, STAMP, NULL, &cold);
+    RECT rect = measure_text(FONT, 32, STAMP, NULL);
+    CHECK(rect.width == (short)cold.u32Width && rect.height == (short)cold.u32Height && cold.u32Width > 0);
+    unsigned char *stamp_boxed = render(FONT, 32, STAMP, &boxed, &boxed_cold);
+    unsigned char *stamp_palette = render(FONT, 32, STAMP, &palette, &palette_cold);
+    CHECK_EQ(palette_cold.enPixelFormat, PIXEL_FORMAT_2BPP);
+
+    // Cached glyphs draw the same pixels, also after the cache went round
+    check_same(FONT, 32, STAMP, NULL, stamp, cold);
+    BITMAP ignored;
+    free(render(FONT, 20, everything, NULL, &ignored));
+    free(render(FONT, 24, everything, NULL, &ignored));
+    check_same(FONT, 32, STAMP, NULL, stamp, cold);
+    check_same(FONT, 32, STAMP, &boxed, stamp_boxed, boxed_cold);
+    check_same(FONT, 32, STAMP, &palette, stamp_palette, palette_cold);
+
+    // More fonts than are kept open, the least recently used one is reloaded
+    for (int i = 0; i < 5; i++)
+    {
+        snprintf(fonts[i], sizeof(fonts[i]), "%s/%d.ttf", dir, i);
+        snprintf(command, sizeof(command), "cp %s %s", FONT, fonts[i]);
+        CHECK(!system(command));
+        free(render(fonts[i], 32, STAMP, NULL, &ignored));
+    }
+    check_same(fonts[0], 32, STAMP, NULL, stamp, cold);
+    check_same(FONT, 32, STAMP, NULL, stamp, cold);
+
+    // Partial redraws end up where a full one does
+    check_update(&boxed, "13:45:07", "13:45:08", TEXT_PARTIAL);
+    check_update(&boxed, "13:45:07", "13:45:07 wider", TEXT_FULL);
+    check_update(&palette, "13:45:07", "13:45:18", TEXT_PARTIAL);
+    check_update(&palette, "13:45:07 Жя", "13:45:07", TEXT_PARTIAL);
+
+    // Not checked, cached glyphs and layout are the point
+    double start = now_us();
+    for (int i = 0; i < BENCH_CALLS; i++)
+    {
+        BITMAP b = raster_text(FONT, 32, i & 1 ? "13:45:07" : "13:45:08", NULL);
+        pool_free(b.pData);
+    }
+    printf("text         %.1f us per timestamp\n", (now_us() - start) / BENCH_CALLS);
+
+    free(stamp);
+    free(stamp_boxed);
+    free(stamp_palette);
+    test_rmdir(dir);
+    return test_done("text");
+}
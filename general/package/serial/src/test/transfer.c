@@ -0,0 +1,97 @@
+// transfer.c: packages served from the mapping and from the pread() window, sessions
+#include "../crc.h"
+#include "../transfer.h"
+#include "test.h"
+#include <sys/mman.h>
+
+#define FILE_SIZE 40000
+
+static unsigned char data[FILE_SIZE];
+
+static void write_file(const char *path, size_t size)
+{
+    FILE *fp = fopen(path, "wb");
+    CHECK(fp && fwrite(data, 1, size, fp) == size);
+    if (fp)
+        fclose(fp);
+}
+
+// Every package of the file at package_size, in order and then backwards
+static void check_packages(struct Transfer *transfer, int package_size)
+{
+    long packages = transfer_packages(transfer, package_size);
+    CHECK_EQ(packages, (FILE_SIZE + package_size - 1) / package_size);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (long i = 0; i < packages; i++)
+        {
+            long index = pass ? packages - 1 - i : i;
+            long offset = index * package_size;
+            int expected = FILE_SIZE - offset < package_size ? FILE_SIZE - offset : package_size;
+            const unsigned char *p = NULL;
+            int length = transfer_package(transfer, offset, package_size, &p);
+            CHECK_EQ(length, expected);
+            CHECK(p && !memcmp(p, data + offset, length));
+        }
+    }
+}
+
+int main(void)
+{
+    char *dir = test_tmpdir(), path[MAX_SESSIONS + 1][128];
+    const unsigned char *p;
+
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = i * 31 + (i >> 8);
+    for (int i = 0; i <= MAX_SESSIONS; i++)
+    {
+        snprintf(path[i], sizeof(path[i]), "%s/%d.jpg", dir, i);
+        write_file(path[i], FILE_SIZE);
+    }
+
+    struct Transfer *transfer = transfer_open(path[0]);
+    CHECK(transfer && transfer->map);
+    if (!transfer)
+        return test_done("transfer");
+    CHECK(transfer_current() == transfer);
+    CHECK_EQ(transfer_crc32(transfer), crc32_update(CRC32_INIT, data, FILE_SIZE));
+    check_packages(transfer, 1024);
+    check_packages(transfer, 2048);
+    CHECK_EQ(transfer_package(transfer, FILE_SIZE, 1024, &p), -1);
+    CHECK_EQ(transfer_package(transfer, -1, 1024, &p), -1);
+    CHECK_EQ(transfer_package(transfer, 0, MAX_PACKAGE_SIZE + 1, &p), -1);
+
+    // Same file, same session; a rewritten one gets a new session
+    int id = transfer->id;
+    CHECK(transfer_open(path[0]) == transfer && transfer->id == id);
+    write_file(path[0], FILE_SIZE - 1);
+    CHECK(transfer_open(path[0]) == transfer && transfer->id != id);
+    CHECK_EQ(transfer->size, FILE_SIZE - 1);
+    write_file(path[0], FILE_SIZE);
+    transfer_open(path[0]);
+
+    // pread() fallback through the read-ahead window
+    munmap(transfer->map, transfer->size);
+    transfer->map = NULL;
+    transfer->crc_valid = false;
+    CHECK_EQ(transfer_crc32(transfer), crc32_update(CRC32_INIT, data, FILE_SIZE));
+    check_packages(transfer, 1024);
+    check_packages(transfer, 256);
+
+    // One session per file, the least recently used one is evicted
+    int ids[MAX_SESSIONS + 1];
+    for (int i = 0; i <= MAX_SESSIONS; i++)
+    {
+        struct Transfer *t = transfer_open(path[i]);
+        ids[i] = t ? t->id : -1;
+    }
+    CHECK(transfer_session(ids[0]) == NULL);
+    for (int i = 1; i <= MAX_SESSIONS; i++)
+        CHECK(transfer_session(ids[i]) && !strcmp(transfer_session(ids[i])->path, path[i]));
+    transfer_close_all();
+    CHECK(transfer_current() == NULL);
+    CHECK(transfer_session(ids[1]) == NULL);
+
+    test_rmdir(dir);
+    return test_done("transfer");
+}
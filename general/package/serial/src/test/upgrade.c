@@ -0,0 +1,183 @@
+// upgrade.c: full and delta images packed by mkupgrade and signed with openssl are
+// installed, damaged or oversized ones are rejected and leave the binary alone
+#include "../upgrade.h"
+#include "../data_define.h"
+#include "../utils.h"
+#include "test.h"
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BINARY_SIZE (256 * 1024)
+
+static char dir[64];
+
+// upgrade.c's only calls into utils.c
+void restart_application(void)
+{
+}
+
+int mount_sdcard(void)
+{
+    return -1;
+}
+
+static void put(const char *path, const unsigned char *data, size_t size)
+{
+    FILE *fp = fopen(path, "wb");
+    if (!fp || fwrite(data, 1, size, fp) != size || fclose(fp))
+        exit(2);
+}
+
+static unsigned char *get(const char *path, size_t *size)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    rewind(fp);
+    unsigned char *data = malloc(*size + 1);
+    if (!data || fread(data, 1, *size, fp) != *size)
+        exit(2);
+    fclose(fp);
+    return data;
+}
+
+static bool same(const char *path, const unsigned char *data, size_t size)
+{
+    size_t length;
+    unsigned char *file = get(path, &length);
+    bool equal = file && length == size && !memcmp(file, data, size);
+    free(file);
+    return equal;
+}
+
+// Packed by mkupgrade (against base when given) and signed the way the readme says
+static unsigned char *pack(const char *name, const char *base, size_t *size)
+{
+    char path[128], command[1024];
+    snprintf(path, sizeof(path), "%s/%s.upg", dir, name);
+    snprintf(command, sizeof(command),
+             "./mkupgrade %s %s -o %s %s/target >/dev/null && "
+             "openssl dgst -sha256 -sign %s/key.pem -out %s.sig %s && cat %s.sig >> %s",
+             base ? "-b" : "", base ? base : "", path, dir, dir, path, path, path, path);
+    CHECK(!system(command));
+    unsigned char *image = get(path, size);
+    if (!image)
+        exit(2);
+    return image;
+}
+
+// Fed in UPGRADE_DATA sized chunks, the status of the first step that failed
+static int apply(const unsigned char *image, size_t size, uint32_t total)
+{
+    struct Upgrade upgrade = {.out = -1, .base = -1};
+    int status = upgrade_begin(&upgrade, total);
+    for (size_t at = 0; !status && at < size; at += UPGRADE_CHUNK)
+        status = upgrade_write(&upgrade, image + at, size - at < UPGRADE_CHUNK ? size - at : UPGRADE_CHUNK);
+    return status ? status : upgrade_finish(&upgrade);
+}
+
+// A rejected image leaves the running binary, and nothing staged next to it
+static void check_rejected(const unsigned char *image, size_t size, uint32_t total, int status,
+                           const unsigned char *base)
+{
+    CHECK_EQ(apply(image, size, total), status);
+    CHECK(same(APP_PATH, base, BINARY_SIZE));
+    CHECK(access(APP_PATH ".new", F_OK) && access(APP_PATH ".old", F_OK) && access(APP_PATH ".trial", F_OK));
+}
+
+static void check_installed(const unsigned char *image, size_t size, const unsigned char *base,
+                            const unsigned char *target, size_t target_size)
+{
+    CHECK_EQ(apply(image, size, size), UPGRADE_OK);
+    CHECK(upgrade_installed());
+    CHECK(same(APP_PATH, target, target_size));
+    CHECK(same(APP_PATH ".old", base, BINARY_SIZE));
+    CHECK(same(APP_PATH ".trial", (const unsigned char *)"0\n", 2));
+    CHECK(access(APP_PATH ".new", F_OK));
+
+    // back to the old binary for the next image
+    put(APP_PATH, base, BINARY_SIZE);
+    unlink(APP_PATH ".old");
+    unlink(APP_PATH ".trial");
+}
+
+int main(void)
+{
+    snprintf(dir, sizeof(dir), "%s", APP_PATH);
+    *strrchr(dir, '/') = '\0';
+    test_rmdir(dir);
+    CHECK(!mkdir(dir, 0755));
+
+    char command[512], target_path[128];
+    snprintf(command, sizeof(command),
+             "openssl ecparam -name prime256v1 -genkey -noout -out %s/key.pem && "
+             "openssl ec -in %s/key.pem -pubout -out %s 2>/dev/null",
+             dir, dir, UPGRADE_KEY_PATH);
+    CHECK(!system(command));
+
+    // The next build: a changed function, an inserted one and a longer tail
+    static unsigned char base[BINARY_SIZE], target[BINARY_SIZE + 8192];
+    uint32_t seed = 1;
+    for (int i = 0; i < BINARY_SIZE; i++)
+        base[i] = (seed = seed * 1103515245 + 12345) >> 16;
+    size_t target_size = 0;
+    memcpy(target, base, 100000);
+    for (int i = 60000; i < 64000; i++)
+        target[i] += i % 7 == 0;
+    target_size = 100000;
+    for (int i = 0; i < 1000; i++)
+        target[target_size++] = i * 31;
+    memcpy(target + target_size, base + 100000, BINARY_SIZE - 100000);
+    target_size += BINARY_SIZE - 100000;
+    for (int i = 0; i < 4000; i++)
+        target[target_size++] = (seed = seed * 1103515245 + 12345) >> 16;
+    snprintf(target_path, sizeof(target_path), "%s/target", dir);
+    put(target_path, target, target_size);
+    put(APP_PATH, base, BINARY_SIZE);
+
+    // Full image
+    size_t full_size, delta_size;
+    unsigned char *full = pack("full", NULL, &full_size);
+    struct UpgradeHeader header;
+    memcpy(&header, full, sizeof(header));
+    CHECK(header.type == UPGRADE_FULL && header.target_size == target_size);
+    check_installed(full, full_size, base, target, target_size);
+
+    // Delta against the running binary, a fraction of the full one
+    unsigned char *delta = pack("delta", APP_PATH, &delta_size);
+    memcpy(&header, delta, sizeof(header));
+    CHECK(header.type == UPGRADE_DELTA && delta_size * 10 < full_size);
+    check_installed(delta, delta_size, base, target, target_size);
+
+    // The delta on any other binary
+    base[BINARY_SIZE / 2] ^= 0x01;
+    put(APP_PATH, base, BINARY_SIZE);
+    check_rejected(delta, delta_size, delta_size, UPGRADE_ERR_BASE, base);
+    base[BINARY_SIZE / 2] ^= 0x01;
+    put(APP_PATH, base, BINARY_SIZE);
+
+    // One flipped bit of the signature
+    full[full_size - 8] ^= 0x01;
+    check_rejected(full, full_size, full_size, UPGRADE_ERR_SIGNATURE, base);
+    full[full_size - 8] ^= 0x01;
+
+    // Streams that end early, in the signature and in the payload
+    check_rejected(full, full_size - 16, full_size, UPGRADE_ERR_LENGTH, base);
+    check_rejected(delta, delta_size / 2, delta_size, UPGRADE_ERR_LENGTH, base);
+
+    // A target over the cap is refused from the header, before any payload is written
+    memcpy(&header, full, sizeof(header));
+    header.target_size = UPGRADE_MAX_TARGET + 1;
+    memcpy(full, &header, sizeof(header));
+    check_rejected(full, sizeof(header), full_size, UPGRADE_ERR_HEADER, base);
+    CHECK(!truncate(target_path, UPGRADE_MAX_TARGET + 1));
+    snprintf(command, sizeof(command), "./mkupgrade -o %s/big.upg %s 2>/dev/null", dir, target_path);
+    CHECK(system(command) != 0);
+
+    free(full);
+    free(delta);
+    test_rmdir(dir);
+    return test_done("upgrade");
+}
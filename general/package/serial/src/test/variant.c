@@ -0,0 +1,99 @@
+// variant.c: EXIF thumbnail extraction, including offsets that would wrap
+#include "../variant.h"
+#include "test.h"
+#include <limits.h>
+#include <stdint.h>
+
+#define THUMB "\xFF\xD8thumb\xFF\xD9"
+#define THUMB_AT 44 // after IFD0 without entries and IFD1 with two
+
+static void put16(unsigned char *p, uint16_t v)
+{
+    p[0] = v, p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    put16(p, v), put16(p + 2, v >> 16);
+}
+
+// Little endian JPEG with an APP1 Exif segment: IFD0 at ifd0, then IFD1 pointing
+// at offset/size for its JPEGInterchangeFormat tags
+static size_t make_jpeg(unsigned char *jpeg, uint32_t ifd0, uint16_t entries0, uint32_t offset, uint32_t size)
+{
+    unsigned char *tiff = jpeg + 12;
+    size_t tiff_size = THUMB_AT + sizeof(THUMB) - 1;
+
+    memset(jpeg, 0, 12 + tiff_size + 2);
+    memcpy(jpeg, "\xFF\xD8\xFF\xE1", 4);
+    jpeg[4] = (tiff_size + 8) >> 8, jpeg[5] = tiff_size + 8;
+    memcpy(jpeg + 6, "Exif\0\0II*\0", 10);
+    put32(tiff + 4, ifd0);
+    put16(tiff + 8, entries0);
+    put32(tiff + 10, 14);
+    put16(tiff + 14, 2);
+    put16(tiff + 16, 0x0201);
+    put32(tiff + 24, offset);
+    put16(tiff + 28, 0x0202);
+    put32(tiff + 36, size);
+    memcpy(tiff + THUMB_AT, THUMB, sizeof(THUMB) - 1);
+    memcpy(tiff + tiff_size, "\xFF\xD9", 2);
+    return 12 + tiff_size + 2;
+}
+
+// Write the JPEG and extract its thumbnail, returns the thumbnail size or -1
+static long thumbnail(const char *dir, const unsigned char *jpeg, size_t size, unsigned char *thumb)
+{
+    char path[PATH_MAX], out[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/00-00.jpg", dir);
+    FILE *fp = fopen(path, "wb");
+    if (!fp || fwrite(jpeg, 1, size, fp) != size || fclose(fp))
+        return -1;
+    snprintf(out, sizeof(out), "%s/%s/00-00.jpg.thumb.jpg", dir, VARIANT_DIR);
+    remove(out);
+    if (variant_prepare(path, VARIANT_THUMBNAIL, out, sizeof(out)))
+        return -1;
+    if (!(fp = fopen(out, "rb")))
+        return -1;
+    long length = fread(thumb, 1, 64, fp);
+    fclose(fp);
+    return length;
+}
+
+int main(void)
+{
+    char *dir = test_tmpdir();
+    unsigned char jpeg[128], thumb[64];
+
+    size_t size = make_jpeg(jpeg, 8, 0, THUMB_AT, sizeof(THUMB) - 1);
+    CHECK_EQ(thumbnail(dir, jpeg, size, thumb), sizeof(THUMB) - 1);
+    CHECK(!memcmp(thumb, THUMB, sizeof(THUMB) - 1));
+
+    // Thumbnail running past the segment, by a little and by wrapping around
+    size = make_jpeg(jpeg, 8, 0, THUMB_AT, sizeof(THUMB));
+    CHECK_EQ(thumbnail(dir, jpeg, size, thumb), -1);
+    size = make_jpeg(jpeg, 8, 0, 0xFFFFFFF0, 0x20);
+    CHECK_EQ(thumbnail(dir, jpeg, size, thumb), -1);
+    size = make_jpeg(jpeg, 8, 0, THUMB_AT, 0xFFFFFFFF);
+    CHECK_EQ(thumbnail(dir, jpeg, size, thumb), -1);
+
+    // IFD offsets and entry counts pointing outside the segment
+    size = make_jpeg(jpeg, 0xFFFFFFFF, 0, THUMB_AT, sizeof(THUMB) - 1);
+    CHECK_EQ(thumbnail(dir, jpeg, size, thumb), -1);
+    size = make_jpeg(jpeg, 0xFFFFFFFE, 0, THUMB_AT, sizeof(THUMB) - 1);
+    CHECK_EQ(thumbnail(dir, jpeg, size, thumb), -1);
+    size = make_jpeg(jpeg, 8, 0xFFFF, THUMB_AT, sizeof(THUMB) - 1);
+    CHECK_EQ(thumbnail(dir, jpeg, size, thumb), -1);
+    size = make_jpeg(jpeg, 8, 0, THUMB_AT, sizeof(THUMB) - 1);
+    put32(jpeg + 12 + 10, 0xFFFFFFFF);
+    CHECK_EQ(thumbnail(dir, jpeg, size, thumb), -1);
+    size = make_jpeg(jpeg, 8, 0, THUMB_AT, sizeof(THUMB) - 1);
+    put16(jpeg + 12 + 14, 0xFFFF); // IFD1 entries beyond the segment are not read
+    CHECK_EQ(thumbnail(dir, jpeg, size, thumb), sizeof(THUMB) - 1);
+
+    // No Exif at all
+    CHECK_EQ(thumbnail(dir, (const unsigned char *)"\xFF\xD8\xFF\xD9", 4, thumb), -1);
+
+    test_rmdir(dir);
+    return test_done("variant");
+}
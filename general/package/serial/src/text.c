@@ -1,171 +1,709 @@
 #include "text.h"
+#include "atlas.h"
+#include "palette.h"
+#include "pool.h"
+#include <limits.h>
+#include <stdbool.h>
 
-const double inv255 = 1.0 / 255.0;
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
-static void copyimage(SFT_Image *dest, const SFT_Image *source, int x0, int y0, int color)
+// Blend one row of alpha values onto ARGB1555 pixels in integer arithmetic:
+// channel = (dest * (255 - a) + color * a) / 255, rounded down exactly with
+// (x + (x >> 8) + 1) >> 8, which holds for every x up to 31 * 255. Against the
+// former double arithmetic it differs by one LSB in 270 of the 262144
+// (alpha, dest, color) combinations, where the double result fell just short of
+// an exact integer and was truncated below it. Opaque pixels (a background
+// box) stay opaque.
+static void blendrow(unsigned short *d, const unsigned char *s, int count, int color)
 {
     unsigned short maskr = (color & 0x7C00) >> 10;
     unsigned short maskg = (color & 0x3E0) >> 5;
     unsigned short maskb = color & 0x1F;
+    int x = 0;
+
+#ifdef __ARM_NEON
+    const uint16x8_t vr = vdupq_n_u16(maskr), vg = vdupq_n_u16(maskg), vb = vdupq_n_u16(maskb);
+    const uint16x8_t bits = vdupq_n_u16(0x1F), full = vdupq_n_u16(255), one = vdupq_n_u16(1);
+    const uint16x8_t opaque = vdupq_n_u16(0x8000);
+    for (; x + 8 <= count; x += 8)
+    {
+        uint16x8_t a = vmovl_u8(vld1_u8(s + x));
+        uint16x8_t ia = vsubq_u16(full, a);
+        uint16x8_t p = vld1q_u16(d + x);
+        uint16x8_t r = vmlaq_u16(vmulq_u16(vandq_u16(vshrq_n_u16(p, 10), bits), ia), vr, a);
+        uint16x8_t g = vmlaq_u16(vmulq_u16(vandq_u16(vshrq_n_u16(p, 5), bits), ia), vg, a);
+        uint16x8_t b = vmlaq_u16(vmulq_u16(vandq_u16(p, bits), ia), vb, a);
+        r = vshrq_n_u16(vaddq_u16(vsraq_n_u16(r, r, 8), one), 8);
+        g = vshrq_n_u16(vaddq_u16(vsraq_n_u16(g, g, 8), one), 8);
+        b = vshrq_n_u16(vaddq_u16(vsraq_n_u16(b, b, 8), one), 8);
+        p = vandq_u16(vorrq_u16(vtstq_u16(a, a), p), opaque);
+        p = vorrq_u16(p, vorrq_u16(vshlq_n_u16(r, 10), vshlq_n_u16(g, 5)));
+        vst1q_u16(d + x, vorrq_u16(p, b));
+    }
+#endif
+    for (; x < count; x++)
+    {
+        unsigned int a = s[x], ia = 255 - a;
+        unsigned int r = ((d[x] & 0x7C00) >> 10) * ia + maskr * a;
+        unsigned int g = ((d[x] & 0x3E0) >> 5) * ia + maskg * a;
+        unsigned int b = (d[x] & 0x1F) * ia + maskb * a;
+        r = (r + (r >> 8) + 1) >> 8;
+        g = (g + (g >> 8) + 1) >> 8;
+        b = (b + (b >> 8) + 1) >> 8;
+        d[x] = ((a > 0) << 15) | (d[x] & 0x8000) | (r << 10) | (g << 5) | b;
+    }
+}
 
+// Blend the alpha mask onto dest at (x0, y0), only columns xmin..xmax-1 of dest are touched
+static void copyimage(SFT_Image *dest, const SFT_Image *source, int x0, int y0, int color, int xmin, int xmax)
+{
     unsigned short *d = dest->pixels;
     unsigned char *s = source->pixels;
     d += x0 + y0 * dest->width;
+    int from = MAX(xmin - x0, 0);
+    int to = MIN(xmax - x0, source->width);
+    if (from >= to)
+        return;
+
+    for (int y = 0; y < source->height; y++)
+    {
+        blendrow(d + from, s + from, to - from, color);
+        d += dest->width;
+        s += source->width;
+    }
+}
+
+// Palette output counterpart of copyimage(), the mask pulls 8-bit levels
+// towards level
+static void copylevels(SFT_Image *dest, const SFT_Image *source, int x0, int y0, int level, int xmin, int xmax)
+{
+    unsigned char *d = dest->pixels;
+    unsigned char *s = source->pixels;
+    d += x0 + y0 * dest->width;
+    int from = MAX(xmin - x0, 0);
+    int to = MIN(xmax - x0, source->width);
+    if (from >= to)
+        return;
 
     for (int y = 0; y < source->height; y++)
     {
-        for (int x = 0; x < source->width; x++)
+        for (int x = from; x < to; x++)
         {
-            double t = s[x] * inv255;
-            unsigned short r = (1.0 - t) * ((d[x] & 0x7C00) >> 10) + t * maskr;
-            unsigned short g = (1.0 - t) * ((d[x] & 0x3E0) >> 5) + t * maskg;
-            unsigned short b = (1.0 - t) * (d[x] & 0x1F) + t * maskb;
-            d[x] = ((t > 0.0) << 15) | (r << 10) | (g << 5) | b;
+            int t = (level - d[x]) * s[x];
+            d[x] += (t + (t < 0 ? -127 : 127)) / 255;
         }
         d += dest->width;
         s += source->width;
     }
 }
 
-static void loadfont(SFT *sft, const char *path, double size, SFT_LMetrics *lmtx)
+// Scratch levels of palette output, shared by every text and only grown
+static unsigned char *levelbuffer(size_t size)
+{
+    static unsigned char *levels;
+    static size_t capacity;
+    if (size > capacity)
+    {
+        unsigned char *grown = realloc(levels, size);
+        if (!grown)
+            fatal("Out of memory for the text levels");
+        levels = grown;
+        capacity = size;
+    }
+    return levels;
+}
+
+// Fonts stay open by (path, size) and rendered glyphs are kept by codepoint, so
+// a ticking clock only blits cached alpha masks. A baked atlas (see atlas.h)
+// supplies the masks without touching the TTF, which is parsed only once a
+// glyph or kerning pair is missing from it.
+#define MAX_FONTS 4
+#define GLYPH_CACHE_SIZE 256 // more than any DATA_SIZE text, a pass never evicts its own glyphs
+#define GLYPH_BUCKETS 64
+
+struct FontEntry
+{
+    char path[PATH_MAX];
+    double size;
+    const struct AtlasSize *atlas;
+    SFT sft; // font is NULL until the atlas falls short
+    SFT_LMetrics lmtx;
+    unsigned long used;
+    unsigned long serial; // identifies this load in a TEXTSTATE
+};
+
+struct GlyphEntry
+{
+    const struct FontEntry *font;
+    SFT_UChar codepoint;
+    SFT_Glyph gid;
+    SFT_GMetrics mtx;
+    unsigned char *alpha;
+    bool mapped; // alpha points into the atlas
+    unsigned long used;
+    short next;
+};
+
+static SFT_Image canvas;
+static BITMAP bitmap;
+static struct FontEntry fonts[MAX_FONTS];
+static struct GlyphEntry glyphs[GLYPH_CACHE_SIZE];
+static short buckets[GLYPH_BUCKETS];
+static unsigned long tick;
+static unsigned long evictions; // invalidates the cached layout
+
+static unsigned int glyph_bucket(const struct FontEntry *font, SFT_UChar codepoint)
+{
+    return (codepoint * 2654435761u ^ (unsigned int)(font - fonts)) % GLYPH_BUCKETS;
+}
+
+static void unlink_glyph(short index)
+{
+    struct GlyphEntry *glyph = &glyphs[index];
+    short *link = &buckets[glyph_bucket(glyph->font, glyph->codepoint)];
+    while (*link != index + 1)
+        link = &glyphs[*link - 1].next;
+    *link = glyph->next;
+    evictions++;
+    if (!glyph->mapped)
+        free(glyph->alpha);
+    memset(glyph, 0, sizeof(*glyph));
+}
+
+static void unloadfont(struct FontEntry *font)
+{
+    for (short i = 0; i < GLYPH_CACHE_SIZE; i++)
+        if (glyphs[i].font == font)
+            unlink_glyph(i);
+    if (font->sft.font)
+        sft_freefont(font->sft.font);
+    memset(font, 0, sizeof(*font));
+}
+
+static void loadttf(struct FontEntry *font)
 {
-    SFT_Font *font = sft_loadfile(path);
-    if (font == NULL)
+    if (font->sft.font)
+        return;
+    SFT_Font *sft_font = sft_loadfile(font->path);
+    if (sft_font == NULL)
         fatal("sft_loadfile failed");
-    sft->font = font;
-    sft->xScale = size;
-    sft->yScale = size;
-    sft->xOffset = 0.0;
-    sft->yOffset = 0.0;
-    sft->flags = SFT_DOWNWARD_Y;
-    if (sft_lmetrics(sft, lmtx) < 0)
-        fatal("sft_lmetrics failed");
+    font->sft.font = sft_font;
+    font->sft.xScale = font->size;
+    font->sft.yScale = font->size;
+    font->sft.xOffset = 0.0;
+    font->sft.yOffset = 0.0;
+    font->sft.flags = SFT_DOWNWARD_Y;
 }
 
-static void loadglyph(const SFT *sft, SFT_UChar codepoint, SFT_Glyph *glyph, SFT_GMetrics *metrics)
+static struct FontEntry *loadfont(const char *path, double size)
 {
-    if (sft_lookup(sft, codepoint, glyph) < 0)
-        fatal("sft_lookup failed");
-    if (sft_gmetrics(sft, *glyph, metrics) < 0)
-        fatal("sft_gmetrics failed");
+    struct FontEntry *font = &fonts[0];
+    for (int i = 0; i < MAX_FONTS; i++)
+    {
+        if (fonts[i].path[0] && fonts[i].size == size && !strcmp(fonts[i].path, path))
+        {
+            fonts[i].used = ++tick;
+            return &fonts[i];
+        }
+        if (!fonts[i].path[0] || (font->path[0] && fonts[i].used < font->used))
+            font = &fonts[i];
+    }
+    if (font->path[0])
+        unloadfont(font);
+
+    strncpy(font->path, path, sizeof(font->path) - 1);
+    font->size = size;
+    font->atlas = atlas_find(path, size);
+    if (font->atlas)
+    {
+        font->lmtx.ascender = font->atlas->ascender;
+        font->lmtx.descender = font->atlas->descender;
+        font->lmtx.lineGap = font->atlas->lineGap;
+    }
+    else
+    {
+        loadttf(font);
+        if (sft_lmetrics(&font->sft, &font->lmtx) < 0)
+            fatal("sft_lmetrics failed");
+    }
+    font->used = font->serial = ++tick;
+    return font;
+}
+
+static const struct GlyphEntry *loadglyph(struct FontEntry *font, SFT_UChar codepoint)
+{
+    unsigned int bucket = glyph_bucket(font, codepoint);
+    for (short i = buckets[bucket]; i; i = glyphs[i - 1].next)
+    {
+        if (glyphs[i - 1].font == font && glyphs[i - 1].codepoint == codepoint)
+        {
+            glyphs[i - 1].used = ++tick;
+            return &glyphs[i - 1];
+        }
+    }
+
+    short victim = 0;
+    for (short i = 0; i < GLYPH_CACHE_SIZE; i++)
+    {
+        if (!glyphs[i].font)
+        {
+            victim = i;
+            break;
+        }
+        if (glyphs[i].used < glyphs[victim].used)
+            victim = i;
+    }
+    if (glyphs[victim].font)
+        unlink_glyph(victim);
+
+    struct GlyphEntry *glyph = &glyphs[victim];
+    const struct AtlasGlyph *baked = font->atlas ? atlas_glyph(font->atlas, codepoint) : NULL;
+    if (baked)
+    {
+        glyph->gid = baked->gid;
+        glyph->mtx.advanceWidth = baked->advanceWidth;
+        glyph->mtx.leftSideBearing = baked->leftSideBearing;
+        glyph->mtx.yOffset = baked->yOffset;
+        glyph->mtx.minWidth = baked->minWidth;
+        glyph->mtx.minHeight = baked->minHeight;
+        const unsigned char *bits = atlas_bitmap(font->atlas, baked);
+        if (atlas_bits(font->atlas) == 8)
+        {
+            glyph->alpha = (unsigned char *)bits;
+            glyph->mapped = true;
+        }
+        else if ((glyph->alpha = malloc(baked->minWidth * baked->minHeight)))
+        {
+            // I2 levels back to 0, 85, 170, 255
+            int stride = atlas_stride(font->atlas, baked);
+            for (int y = 0; y < baked->minHeight; y++)
+                for (int x = 0; x < baked->minWidth; x++)
+                    glyph->alpha[y * baked->minWidth + x] = (bits[y * stride + x / 4] >> (6 - 2 * (x % 4)) & 3) * 85;
+        }
+    }
+    else
+    {
+        loadttf(font);
+        if (sft_lookup(&font->sft, codepoint, &glyph->gid) < 0)
+            fatal("sft_lookup failed");
+        if (sft_gmetrics(&font->sft, glyph->gid, &glyph->mtx) < 0)
+            fatal("sft_gmetrics failed");
+        // Glyphs without an outline (space) are left blank by sft_render
+        glyph->alpha = calloc(glyph->mtx.minWidth * glyph->mtx.minHeight, 1);
+        SFT_Image image = {.pixels = glyph->alpha, .width = glyph->mtx.minWidth, .height = glyph->mtx.minHeight};
+        if (glyph->alpha && sft_render(&font->sft, glyph->gid, image) < 0)
+            fatal("sft_render failed");
+    }
+    glyph->font = font;
+    glyph->codepoint = codepoint;
+    glyph->used = ++tick;
+    glyph->next = buckets[bucket];
+    buckets[bucket] = victim + 1;
+    return glyph;
+}
+
+// Horizontal shift between two glyphs of a line, left is NULL at its start
+static double kerning(struct FontEntry *font, const struct GlyphEntry *left, const struct GlyphEntry *right)
+{
+    double shift;
+    if (!left)
+        return 0.0;
+    if (font->atlas && atlas_kerning(font->atlas, left->codepoint, right->codepoint, &shift) == 0)
+        return shift;
+    SFT_Kerning kerning;
+    loadttf(font);
+    if (sft_kerning(&font->sft, left->gid, right->gid, &kerning) < 0)
+        return 0.0;
+    return kerning.xShift;
 }
 
 static void newimage(SFT_Image *image, int width, int height, int color)
 {
     size_t size = (size_t)(width * height * 2);
-    void *pixels = malloc(size);
+    void *pixels = pool_alloc(size);
     image->pixels = pixels;
     image->width = width;
     image->height = height;
     if (color == 0)
         memset(pixels, 0, size);
-    else for (int i = 0; i < size / 2; i++)
+    else for (size_t i = 0; i < size / 2; i++)
         ((unsigned short*)pixels)[i] = color;
 }
 
-static inline void calcdim(double *margin, double *height, double *width, const char* text)
+static RECT rounddim(double height, double width)
 {
-    double lwidth = 0;
-    *margin = 0;
-    *height = lmtx.ascender - lmtx.descender + lmtx.lineGap;
-    *width = 0;
-
-#ifdef SUPP_UTF32
-    unsigned cps[strlen(text) + 1];
-    int n = utf8_to_utf32(text, cps, strlen(text) + 1);
-#else
-    #define cps text
-    #define n strlen(text)
-#endif
+	// Some platforms operate with a coarse pixel size of 2x2
+	// and rounding up is required for a sufficient canvas size
+    RECT rect = { .height = ceil(height), .width = ceil(width) };
+    rect.height += rect.height & 1;
+    rect.width += rect.width & 1;
+    return rect;
+}
 
-    for (int k = 0; k < n; k++)
+// Next codepoint of a UTF-8 string, malformed and overlong sequences read as
+// U+FFFD and consume a single byte
+static SFT_UChar decode_utf8(const unsigned char **text)
+{
+    const unsigned char *s = *text;
+    SFT_UChar cp;
+    int extra;
+    if (s[0] < 0x80)
+    {
+        *text = s + 1;
+        return s[0];
+    }
+    if ((s[0] & 0xE0) == 0xC0)
+        cp = s[0] & 0x1F, extra = 1;
+    else if ((s[0] & 0xF0) == 0xE0)
+        cp = s[0] & 0x0F, extra = 2;
+    else if ((s[0] & 0xF8) == 0xF0)
+        cp = s[0] & 0x07, extra = 3;
+    else
+        extra = 0;
+    for (int k = 1; k <= extra; k++)
     {
-        if (cps[k] == '\\' && cps[k + 1] == 'n')
+        if ((s[k] & 0xC0) != 0x80)
         {
-            k++;
-            *width = MAX(*width, lwidth);
-            *height += lmtx.ascender - lmtx.descender + lmtx.lineGap;
-            lwidth = 0;
-            continue;
+            extra = 0;
+            break;
         }
-        SFT_UChar cp = (SFT_UChar)cps[k];
-        SFT_Glyph gid;
-        SFT_GMetrics mtx;
-        loadglyph(&sft, cp, &gid, &mtx);
-        if (lwidth == 0 && mtx.leftSideBearing < 0 && *margin < -mtx.leftSideBearing)
-            *margin -= mtx.leftSideBearing;
-        lwidth += MAX(mtx.advanceWidth, mtx.minWidth);
+        cp = cp << 6 | (s[k] & 0x3F);
     }
-    *height += -lmtx.descender + lmtx.lineGap + 2 * *margin;
-    *width = MAX(*width, lwidth) + 2 * *margin;
+    static const SFT_UChar lowest[] = {0, 0x80, 0x800, 0x10000};
+    if (!extra || cp < lowest[extra] || cp > 0x10FFFF || (cp & 0xFFFFF800) == 0xD800)
+    {
+        *text = s + 1;
+        return 0xFFFD;
+    }
+    *text = s + extra + 1;
+    return cp;
 }
 
-RECT measure_text(const char *font, double size, const char *text)
+static const TEXTSTYLE plain = {.color = 0xFFFF};
+
+static bool samestyle(const TEXTSTYLE *a, const TEXTSTYLE *b)
 {
-    loadfont(&sft, font, size, &lmtx);
+    return a->color == b->color && a->background == b->background && a->outline == b->outline &&
+           a->align == b->align && a->width == b->width && a->padding == b->padding && a->bits == b->bits;
+}
 
-    double margin, height, width;
-    calcdim(&margin, &height, &width, text);
-	// Some platforms operate with a coarse pixel size of 2x2
-	// and rounding up is required for a sufficient canvas size
-    RECT rect = { .height = ceil(height), .width = ceil(width) };
-    rect.height += rect.height & 1;
-    rect.width += rect.width & 1;
+struct TextLine
+{
+    int first, end; // entries of the line, a space it was wrapped at is left out
+    double width;
+};
 
-    sft_freefont(sft.font);
-    return rect;
-}
+// A text laid out once into a single block that only ever grows. The last
+// result is kept, the measure and draw of one redraw share it.
+struct TextLayout
+{
+    size_t capacity; // entries, one per byte of text
+    const struct FontEntry *font;
+    unsigned long serial, evictions;
+    TEXTSTYLE style;
+    char *text;
+    int count, lines;
+    RECT rect;
+    struct TextLine *line;
+    double *pen;                      // of every glyph from the start of its line
+    const struct GlyphEntry **glyphs; // NULL at line breaks
+    TEXTCELL *cells;                  // where raster_text() draws every glyph
+};
 
-BITMAP raster_text(const char *font, double size, const char *text)
+static struct TextLayout *cached;
+
+static struct TextLayout *reserve(size_t capacity)
 {
-    loadfont(&sft, font, size, &lmtx);
+    if (!cached || cached->capacity < capacity)
+    {
+        capacity = MAX(capacity, cached ? cached->capacity * 2 : 64);
+        struct TextLayout *grown =
+            realloc(cached, sizeof(*cached) + capacity * (sizeof(struct TextLine) + sizeof(*cached->pen) +
+                                                          sizeof(*cached->glyphs) + sizeof(TEXTCELL) + 1));
+        if (!grown)
+            fatal("Out of memory for the text layout");
+        cached = grown;
+        cached->capacity = capacity;
+        cached->font = NULL;
+    }
+    cached->line = (struct TextLine *)(cached + 1);
+    cached->pen = (double *)(cached->line + cached->capacity);
+    cached->glyphs = (const struct GlyphEntry **)(cached->pen + cached->capacity);
+    cached->cells = (TEXTCELL *)(cached->glyphs + cached->capacity);
+    cached->text = (char *)(cached->cells + cached->capacity);
+    return cached;
+}
 
-    double margin, height, width;
-    calcdim(&margin, &height, &width, text);
-    newimage(&canvas, width, height, 0);
+// Wrap entries first..count-1 into lines no wider than avail (0 for no limit)
+// at the last space that fits, a word longer than a line is cut where it
+// overflows. Returns the widest line.
+static double breaklines(struct FontEntry *font, struct TextLayout *l, double avail)
+{
+    double widest = 0, x = 0, right = 0;
+    const struct GlyphEntry *previous = NULL;
+    int first = 0, space = -1;
+    l->lines = 0;
+    for (int k = 0; k <= l->count; k++)
+    {
+        const struct GlyphEntry *glyph = k < l->count ? l->glyphs[k] : NULL;
+        int end = k, next = k + 1;
+        if (glyph)
+        {
+            const SFT_GMetrics *mtx = &glyph->mtx;
+            double pen = x + kerning(font, previous, glyph);
+            double edge = pen + MAX(mtx->advanceWidth, mtx->leftSideBearing + mtx->minWidth);
+            if (!avail || edge <= avail || k == first || glyph->codepoint == ' ')
+            {
+                if (glyph->codepoint == ' ')
+                    space = k;
+                else
+                    right = MAX(right, edge);
+                l->pen[k] = pen;
+                x = pen + mtx->advanceWidth;
+                previous = glyph;
+                continue;
+            }
+            if (space > first)
+            {
+                // the space goes, the rest of the word starts the next line
+                end = space;
+                next = space + 1;
+                l->glyphs[space] = NULL;
+            }
+            else
+                next = k;
+        }
+        l->line[l->lines++] = (struct TextLine){.first = first, .end = end, .width = right};
+        widest = MAX(widest, right);
+        // entries from next on are measured again for the new line
+        k = next - 1;
+        first = next;
+        x = right = 0;
+        space = -1;
+        previous = NULL;
+    }
+    return widest;
+}
 
-#ifdef SUPP_UTF32
-    unsigned cps[strlen(text) + 1];
-    int n = utf8_to_utf32(text, cps, strlen(text) + 1);
-#else
-    #define cps text
-    #define n strlen(text)
-#endif
+// Decode, resolve glyphs, break lines and place every glyph of the text
+static const struct TextLayout *layout(struct FontEntry *font, const char *text, const TEXTSTYLE *style)
+{
+    size_t length = strlen(text);
+    if (cached && cached->font == font && cached->serial == font->serial && cached->evictions == evictions &&
+        samestyle(&cached->style, style) && !strcmp(cached->text, text))
+        return cached;
 
-    double x = margin;
-    double y = margin + lmtx.ascender + lmtx.lineGap;
-    SFT_Glyph ogid = 0;
-    for (int k = 0; k < n; k++)
+    struct TextLayout *l = reserve(length + 1);
+    l->font = NULL;
+    l->count = 0;
+    for (const unsigned char *s = (const unsigned char *)text; *s;)
     {
-        if (cps[k] == '\\' && cps[k + 1] == 'n')
+        SFT_UChar cp = decode_utf8(&s);
+        // a literal \n from templates and serial commands breaks lines as well
+        if (cp == '\n' || (cp == '\\' && *s == 'n'))
         {
-            k++;
-            x = margin;
-            y += lmtx.ascender - lmtx.descender + lmtx.lineGap;
-            ogid = 0;
+            s += cp == '\\';
+            l->glyphs[l->count++] = NULL;
             continue;
         }
-        SFT_Image image;
-        SFT_UChar cp = (SFT_UChar)cps[k];
-        SFT_Glyph gid;
-        SFT_GMetrics mtx;
-        SFT_Kerning kerning;
-        loadglyph(&sft, cp, &gid, &mtx);
-        newimage(&image, mtx.minWidth, mtx.minHeight, 0x7FFF);
-        sft_render(&sft, gid, image);
-        sft_kerning(&sft, ogid, gid, &kerning);
-        x += kerning.xShift;
-        copyimage(&canvas, &image, x + mtx.leftSideBearing, y + mtx.yOffset, 0xFFFF);
-        x += mtx.advanceWidth;
-        free(image.pixels);
-        ogid = gid;
+        l->glyphs[l->count++] = loadglyph(font, cp);
+    }
+
+    const SFT_LMetrics *lmtx = &font->lmtx;
+    double lineh = lmtx->ascender - lmtx->descender + lmtx->lineGap;
+    int frame = style->padding + (style->outline != 0);
+    double avail = style->width > 0 ? MAX(style->width - 2 * frame, 1) : 0;
+    double margin = 0;
+    // ink left of the pen on the first glyph of a line shifts everything right,
+    // the overhang is only known once lines are broken and is added to the width
+    double widest = breaklines(font, l, avail);
+    for (int n = 0; n < l->lines; n++)
+    {
+        const struct TextLine *line = &l->line[n];
+        if (line->first < line->end && l->glyphs[line->first] && l->glyphs[line->first]->mtx.leftSideBearing < 0)
+            margin = MAX(margin, -l->glyphs[line->first]->mtx.leftSideBearing);
+    }
+    double inset = margin + frame;
+
+    for (int k = 0; k < l->count; k++)
+        l->cells[k] = (TEXTCELL){.codepoint = '\n'};
+    for (int n = 0; n < l->lines; n++)
+    {
+        const struct TextLine *line = &l->line[n];
+        double shift = style->align == TEXT_CENTER ? 0.5 : style->align == TEXT_RIGHT ? 1.0 : 0.0;
+        double x0 = inset + (widest - line->width) * shift;
+        double y = inset + lmtx->ascender + lmtx->lineGap + n * lineh;
+        for (int k = line->first; k < line->end; k++)
+        {
+            const struct GlyphEntry *glyph = l->glyphs[k];
+            TEXTCELL *cell = &l->cells[k];
+            double x = x0 + l->pen[k];
+            cell->codepoint = glyph->codepoint;
+            cell->x = x + glyph->mtx.leftSideBearing;
+            cell->y = y + glyph->mtx.yOffset;
+            cell->left = MIN(floor(x), cell->x) - (style->outline != 0);
+            cell->right = MAX(ceil(x + glyph->mtx.advanceWidth), cell->x + glyph->mtx.minWidth) + (style->outline != 0);
+        }
+    }
+    l->rect = rounddim(l->lines * lineh - lmtx->descender + lmtx->lineGap + 2 * inset, widest + 2 * inset);
+
+    memcpy(l->text, text, length + 1);
+    l->style = *style;
+    l->serial = font->serial;
+    l->evictions = evictions;
+    l->font = font;
+    return l;
+}
+
+// Outlines of every glyph go first so none covers a neighbouring glyph, dest
+// holds levels for palette output
+static void drawglyphs(SFT_Image *dest, const struct TextLayout *l, const TEXTSTYLE *style, int xmin, int xmax)
+{
+    for (int pass = style->outline ? 0 : 1; pass < 2; pass++)
+    {
+        for (int k = 0; k < l->count; k++)
+        {
+            const struct GlyphEntry *glyph = l->glyphs[k];
+            const TEXTCELL *cell = &l->cells[k];
+            if (!glyph || !glyph->alpha || cell->right <= xmin || cell->left >= xmax)
+                continue;
+            SFT_Image image = {.pixels = glyph->alpha, .width = glyph->mtx.minWidth, .height = glyph->mtx.minHeight};
+            if (pass == 1)
+            {
+                if (style->bits)
+                    copylevels(dest, &image, cell->x, cell->y, 255, xmin, xmax);
+                else
+                    copyimage(dest, &image, cell->x, cell->y, style->color, xmin, xmax);
+                continue;
+            }
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dx = -1; dx <= 1; dx++)
+                    if ((dx || dy) && style->bits)
+                        copylevels(dest, &image, cell->x + dx, cell->y + dy, PALETTE_OUTLINE, xmin, xmax);
+                    else if (dx || dy)
+                        copyimage(dest, &image, cell->x + dx, cell->y + dy, style->outline, xmin, xmax);
+        }
+    }
+}
+
+RECT measure_text(const char *font, double size, const char *text, const TEXTSTYLE *style)
+{
+    return layout(loadfont(font, size), text, style ? style : &plain)->rect;
+}
+
+// Measures and renders in one pass, the bitmap has the size measure_text() reports
+BITMAP raster_text(const char *font, double size, const char *text, const TEXTSTYLE *style)
+{
+    if (!style)
+        style = &plain;
+    const struct TextLayout *l = layout(loadfont(font, size), text, style);
+    if (style->bits)
+    {
+        // levels first, then dithered to indices, the background is index 0
+        int width = l->rect.width, height = l->rect.height, stride = PALETTE_STRIDE(width, style->bits);
+        SFT_Image levels = {.pixels = levelbuffer(width * height), .width = width, .height = height};
+        memset(levels.pixels, 0, width * height);
+        drawglyphs(&levels, l, style, 0, width);
+        canvas.pixels = pool_alloc(stride * height);
+        canvas.width = width;
+        canvas.height = height;
+        palette_pack(canvas.pixels, stride, levels.pixels, width, 0, width, 0, height, style->bits);
+    }
+    else
+    {
+        newimage(&canvas, l->rect.width, l->rect.height, style->background);
+        drawglyphs(&canvas, l, style, 0, canvas.width);
     }
 
     bitmap.u32Width = canvas.width;
     bitmap.u32Height = canvas.height;
     bitmap.pData = canvas.pixels;
-    bitmap.enPixelFormat = PIXEL_FORMAT_1555;
+    bitmap.enPixelFormat = style->bits == 2   ? PIXEL_FORMAT_2BPP
+                           : style->bits == 4 ? PIXEL_FORMAT_4BPP
+                                              : PIXEL_FORMAT_1555;
 
-    sft_freefont(sft.font);
     return bitmap;
 }
+
+// Redraw text into a persistent canvas of area size, only the columns covered
+// by glyphs that differ from the previous call on this state are cleared and
+// blended again. Returns TEXT_TOO_SMALL when the text needs a larger canvas.
+// For palette output dest->width is the row stride in bytes, columns are
+// redrawn in whole bytes.
+int update_text(const char *font, double size, const char *text, const TEXTSTYLE *style, TEXTSTATE *state,
+                SFT_Image *dest, RECT area)
+{
+    if (!style)
+        style = &plain;
+    struct FontEntry *entry = loadfont(font, size);
+    const struct TextLayout *l = layout(entry, text, style);
+    RECT rect = l->rect;
+    if (rect.width > area.width || rect.height > area.height)
+        return TEXT_TOO_SMALL;
+
+    // the background box follows the text size, resizing it repaints it all
+    int full = state->serial != entry->serial || state->count < 0 || !samestyle(&state->style, style) ||
+               (style->background && (state->rect.width != rect.width || state->rect.height != rect.height));
+    int x0 = area.width, x1 = 0;
+    for (int k = 0; !full && k < MAX(l->count, state->count); k++)
+    {
+        const TEXTCELL *old = k < state->count ? &state->cells[k] : NULL;
+        const TEXTCELL *cell = k < l->count ? &l->cells[k] : NULL;
+        if (old && cell && old->codepoint == cell->codepoint && old->x == cell->x && old->y == cell->y)
+            continue;
+        if (old)
+        {
+            x0 = MIN(x0, old->left);
+            x1 = MAX(x1, old->right);
+        }
+        if (cell)
+        {
+            x0 = MIN(x0, cell->left);
+            x1 = MAX(x1, cell->right);
+        }
+    }
+    if (full)
+    {
+        x0 = 0;
+        x1 = area.width;
+    }
+    x0 = MAX(x0, 0);
+    x1 = MIN(x1, area.width);
+
+    state->serial = entry->serial;
+    state->style = *style;
+    state->rect = rect;
+    state->count = l->count <= MAX_CELLS ? l->count : -1;
+    if (state->count > 0)
+        memcpy(state->cells, l->cells, l->count * sizeof(TEXTCELL));
+    if (x0 >= x1)
+        return TEXT_UNCHANGED;
+
+    if (style->bits)
+    {
+        int ppb = PALETTE_PPB(style->bits);
+        x0 -= x0 % ppb;
+        x1 += (ppb - x1 % ppb) % ppb;
+        SFT_Image levels = {.width = x1, .height = area.height};
+        levels.pixels = levelbuffer(levels.width * levels.height);
+        for (int y = 0; y < area.height; y++)
+            memset((unsigned char *)levels.pixels + y * levels.width + x0, 0, x1 - x0);
+        drawglyphs(&levels, l, style, x0, x1);
+        palette_pack(dest->pixels, dest->width, (unsigned char *)levels.pixels + x0, levels.width, x0, x1, 0,
+                     area.height, style->bits);
+        return full ? TEXT_FULL : TEXT_PARTIAL;
+    }
+
+    unsigned short *row = dest->pixels;
+    for (int y = 0; y < area.height; y++, row += dest->width)
+    {
+        int box = y < rect.height && style->background ? MIN(MAX(rect.width, x0), x1) : x0;
+        for (int x = x0; x < box; x++)
+            row[x] = style->background;
+        memset(row + box, 0, (x1 - box) * sizeof(*row));
+    }
+    drawglyphs(dest, l, style, x0, x1);
+    return full ? TEXT_FULL : TEXT_PARTIAL;
+}
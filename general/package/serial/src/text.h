@@ -12,13 +12,56 @@ extern "C"
 
 #include "common.h"
 
-    static SFT sft;
-    static SFT_Image canvas;
-    static SFT_LMetrics lmtx;
-    static BITMAP bitmap;
+#define MAX_CELLS 256
 
-    RECT measure_text(const char *font, double size, const char *text);
-    BITMAP raster_text(const char *font, double size, const char *text);
+    enum TextUpdate
+    {
+        TEXT_TOO_SMALL = -1,
+        TEXT_UNCHANGED,
+        TEXT_PARTIAL,
+        TEXT_FULL,
+    };
+
+    enum TextAlign
+    {
+        TEXT_LEFT,
+        TEXT_CENTER,
+        TEXT_RIGHT,
+    };
+
+    typedef struct textstyle
+    {
+        int color;      // ARGB1555 of the glyphs
+        int background; // ARGB1555 box behind the text, 0 keeps it transparent
+        int outline;    // ARGB1555 one pixel outline around the glyphs, 0 for none
+        short align;    // enum TextAlign, lines against the widest one
+        short width;    // wrap at spaces to fit this many pixels, 0 never wraps
+        short padding;  // between the text and the edge of its box
+        short bits;     // palette index depth (2, 4) of the output, 0 draws ARGB1555
+    } TEXTSTYLE;
+
+    typedef struct textcell
+    {
+        unsigned int codepoint;
+        short x, y;        // ink origin
+        short left, right; // columns covered by advance and ink
+    } TEXTCELL;
+
+    // Last text drawn into a canvas, zero it to force a full redraw
+    typedef struct textstate
+    {
+        unsigned long serial;
+        TEXTSTYLE style;
+        RECT rect;
+        int count;
+        TEXTCELL cells[MAX_CELLS];
+    } TEXTSTATE;
+
+    // A NULL style draws white text on a transparent canvas
+    RECT measure_text(const char *font, double size, const char *text, const TEXTSTYLE *style);
+    BITMAP raster_text(const char *font, double size, const char *text, const TEXTSTYLE *style);
+    int update_text(const char *font, double size, const char *text, const TEXTSTYLE *style, TEXTSTATE *state,
+                    SFT_Image *dest, RECT area);
 
 #ifdef __cplusplus
 #if __cplusplus
@@ -0,0 +1,225 @@
+#include "transfer.h"
+#include "crc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static struct Transfer sessions[MAX_SESSIONS] = {[0 ... MAX_SESSIONS - 1] = {.fd = -1}};
+static struct Transfer *current;
+static unsigned long clock_tick;
+static int next_id;
+
+static void touch(struct Transfer *transfer)
+{
+    transfer->used = ++clock_tick;
+}
+
+static int allocate_id(void)
+{
+    for (;;)
+    {
+        next_id = next_id % 0xFF + 1;
+        int i;
+        for (i = 0; i < MAX_SESSIONS && sessions[i].id != next_id; i++)
+            ;
+        if (i == MAX_SESSIONS)
+            return next_id;
+    }
+}
+
+// Keep the selected images open across requests and hosts, packages are then
+// served straight from the mapping (or pread() when mmap is not possible)
+struct Transfer *transfer_open(const char *path)
+{
+    struct Transfer *transfer = NULL;
+    struct stat st;
+
+    if (stat(path, &st) != 0)
+    {
+        perror("Failed to get file stats");
+        return NULL;
+    }
+    for (int i = 0; i < MAX_SESSIONS; i++)
+    {
+        if (sessions[i].fd >= 0 && !strcmp(sessions[i].path, path))
+        {
+            transfer = &sessions[i];
+            break;
+        }
+    }
+    // Same file untouched since it was opened, keep its session
+    if (transfer && transfer->inode == st.st_ino && transfer->mtime == st.st_mtime && transfer->size == st.st_size)
+    {
+        touch(transfer);
+        return current = transfer;
+    }
+    if (!transfer)
+    {
+        transfer = &sessions[0];
+        for (int i = 1; i < MAX_SESSIONS; i++)
+            if (sessions[i].fd < 0 || (transfer->fd >= 0 && sessions[i].used < transfer->used))
+                transfer = &sessions[i];
+    }
+    transfer_close(transfer);
+
+    transfer->fd = open(path, O_RDONLY);
+    if (transfer->fd < 0)
+    {
+        perror("Error opening file");
+        return NULL;
+    }
+    if (fstat(transfer->fd, &st) != 0)
+    {
+        perror("Failed to get file stats");
+        transfer_close(transfer);
+        return NULL;
+    }
+    transfer->id = allocate_id();
+    transfer->inode = st.st_ino;
+    transfer->mtime = st.st_mtime;
+    transfer->size = st.st_size;
+    strncpy(transfer->path, path, sizeof(transfer->path) - 1);
+
+    if (transfer->size > 0)
+    {
+        transfer->map = mmap(NULL, transfer->size, PROT_READ, MAP_PRIVATE, transfer->fd, 0);
+        if (transfer->map == MAP_FAILED)
+            transfer->map = NULL;
+        else
+            madvise(transfer->map, transfer->size, MADV_SEQUENTIAL);
+    }
+    touch(transfer);
+    return current = transfer;
+}
+
+struct Transfer *transfer_session(int id)
+{
+    for (int i = 0; i < MAX_SESSIONS; i++)
+    {
+        if (sessions[i].fd >= 0 && sessions[i].id == id)
+        {
+            touch(&sessions[i]);
+            return &sessions[i];
+        }
+    }
+    return NULL;
+}
+
+// Session of the last NEXT_FILE, used by the legacy package commands
+struct Transfer *transfer_current(void)
+{
+    return current && current->fd >= 0 ? current : NULL;
+}
+
+void transfer_close(struct Transfer *transfer)
+{
+    if (transfer->map)
+        munmap(transfer->map, transfer->size);
+    if (transfer->fd >= 0)
+        close(transfer->fd);
+    transfer->id = 0;
+    transfer->map = NULL;
+    transfer->fd = -1;
+    transfer->size = 0;
+    transfer->crc_valid = false;
+    transfer->next_offset = 0;
+    transfer->window_length = 0;
+    transfer->path[0] = '\0';
+}
+
+void transfer_close_all(void)
+{
+    for (int i = 0; i < MAX_SESSIONS; i++)
+        transfer_close(&sessions[i]);
+    current = NULL;
+}
+
+long transfer_packages(const struct Transfer *transfer, int package_size)
+{
+    if (!transfer || transfer->fd < 0 || package_size <= 0)
+        return 0;
+    return (transfer->size + package_size - 1) / package_size;
+}
+
+unsigned int transfer_crc32(struct Transfer *transfer)
+{
+    if (transfer->fd < 0 || transfer->crc_valid)
+        return transfer->crc;
+
+    uint32_t crc = CRC32_INIT;
+    if (transfer->map)
+        crc = crc32_update(crc, transfer->map, transfer->size);
+    else
+    {
+        ssize_t n;
+        // the read-ahead window doubles as scratch space
+        transfer->window_length = 0;
+        for (off_t offset = 0; offset < transfer->size; offset += n)
+        {
+            n = pread(transfer->fd, transfer->window, sizeof(transfer->window), offset);
+            if (n <= 0)
+            {
+                perror("Error reading file");
+                return 0;
+            }
+            crc = crc32_update(crc, transfer->window, n);
+        }
+    }
+    transfer->crc = crc;
+    transfer->crc_valid = true;
+    return crc;
+}
+
+// Returns the number of valid bytes at offset (at most length), the caller
+// pads the remainder of the package
+int transfer_package(struct Transfer *transfer, long offset, int length, const unsigned char **data)
+{
+    if (!transfer || transfer->fd < 0 || length > MAX_PACKAGE_SIZE)
+        return -1;
+    if (offset < 0 || offset >= transfer->size)
+    {
+        fprintf(stderr, "Error: Requested bytes exceed file size\n");
+        return -1;
+    }
+    if (length > transfer->size - offset)
+        length = transfer->size - offset;
+
+    if (transfer->map)
+    {
+        // A jump (resume or retransmit) defeats the sequential read-ahead, prefetch explicitly
+        if (offset != transfer->next_offset)
+        {
+            long page = sysconf(_SC_PAGESIZE);
+            off_t start = offset & ~(page - 1);
+            off_t ahead = transfer->size - start < READ_AHEAD_SIZE ? transfer->size - start : READ_AHEAD_SIZE;
+            madvise(transfer->map + start, ahead, MADV_WILLNEED);
+        }
+        transfer->next_offset = offset + length;
+        *data = transfer->map + offset;
+        return length;
+    }
+
+    if (offset < transfer->window_offset || offset + length > transfer->window_offset + transfer->window_length)
+    {
+        ssize_t n;
+        do
+            n = pread(transfer->fd, transfer->window, sizeof(transfer->window), offset);
+        while (n < 0 && errno == EINTR);
+        if (n < 0)
+        {
+            perror("Error reading file");
+            transfer->window_length = 0;
+            return -1;
+        }
+        transfer->window_offset = offset;
+        transfer->window_length = n;
+    }
+    *data = transfer->window + (offset - transfer->window_offset);
+    if (length > transfer->window_offset + transfer->window_length - offset)
+        length = transfer->window_offset + transfer->window_length - offset;
+    return length;
+}
@@ -0,0 +1,41 @@
+#ifndef TRANSFER_H_
+#define TRANSFER_H_
+#include <limits.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define MAX_PACKAGE_SIZE 2048
+// Files kept open at once, the least recently used session is evicted
+#define MAX_SESSIONS 4
+// pread() fallback reads this much ahead of the requested package
+#define READ_AHEAD_SIZE (16 * 1024)
+
+struct Transfer
+{
+    int id; // session id handed to the host, 1..255
+    int fd;
+    char path[PATH_MAX];
+    ino_t inode;
+    time_t mtime;
+    off_t size;
+    unsigned char *map;
+    unsigned int crc;
+    bool crc_valid;
+    bool crc_mode;
+    int package_size;
+    unsigned long used;
+    off_t next_offset;
+    off_t window_offset;
+    ssize_t window_length;
+    unsigned char window[READ_AHEAD_SIZE];
+};
+
+struct Transfer *transfer_open(const char *path);
+struct Transfer *transfer_session(int id);
+struct Transfer *transfer_current(void);
+void transfer_close(struct Transfer *transfer);
+void transfer_close_all(void);
+long transfer_packages(const struct Transfer *transfer, int package_size);
+unsigned int transfer_crc32(struct Transfer *transfer);
+int transfer_package(struct Transfer *transfer, long offset, int length, const unsigned char **data);
+#endif
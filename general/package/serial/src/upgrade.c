@@ -0,0 +1,508 @@
+#include "upgrade.h"
+#include "stats.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <mbedtls/pk.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The new binary is staged next to the running one so the swap is a rename
+#define NEW_PATH APP_PATH ".new"
+#define OLD_PATH APP_PATH ".old"
+#define TRIAL_PATH APP_PATH ".trial"
+#define CHUNK 4096
+#define MAX_SEEK (1LL << 32)
+
+enum Stage
+{
+    STAGE_IDLE,
+    STAGE_HEADER,
+    STAGE_PAYLOAD,
+    STAGE_SIGNATURE,
+};
+
+static bool installed;
+static bool on_trial;
+static struct timespec trial_started;
+
+const char *upgrade_error(int status)
+{
+    static const char *errors[] = {
+        "ok",           "no upgrade in progress", "chunk CRC mismatch", "bad header",          "delta for another binary",
+        "bad payload",  "wrong image length",     "bad signature",      "output hash mismatch", "I/O error",
+    };
+    return status >= 0 && status <= UPGRADE_ERR_IO ? errors[status] : "unknown";
+}
+
+bool upgrade_installed(void)
+{
+    return installed;
+}
+
+static int write_all_fd(int fd, const unsigned char *data, size_t length)
+{
+    while (length)
+    {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int sha256_fd(int fd, unsigned char *hash)
+{
+    unsigned char buffer[CHUNK];
+    mbedtls_sha256_context sha256;
+    off_t offset = 0;
+    ssize_t n;
+
+    mbedtls_sha256_init(&sha256);
+    mbedtls_sha256_starts_ret(&sha256, 0);
+    while ((n = pread(fd, buffer, sizeof(buffer), offset)) > 0)
+    {
+        mbedtls_sha256_update_ret(&sha256, buffer, n);
+        offset += n;
+    }
+    mbedtls_sha256_finish_ret(&sha256, hash);
+    mbedtls_sha256_free(&sha256);
+    return n < 0 ? -1 : 0;
+}
+
+static void sync_dir(void)
+{
+    char dir[] = APP_PATH;
+    *strrchr(dir, '/') = '\0';
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static int write_trial(int trials)
+{
+    char text[16];
+    int fd = open(TRIAL_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    int length = snprintf(text, sizeof(text), "%d\n", trials);
+    int ret = write_all_fd(fd, (unsigned char *)text, length) || fsync(fd) ? -1 : 0;
+    close(fd);
+    return ret;
+}
+
+static int fail(struct Upgrade *upgrade, int status)
+{
+    upgrade_abort(upgrade);
+    upgrade->status = status;
+    return status;
+}
+
+void upgrade_abort(struct Upgrade *upgrade)
+{
+    if (upgrade->out >= 0)
+    {
+        close(upgrade->out);
+        unlink(NEW_PATH);
+    }
+    if (upgrade->base >= 0)
+        close(upgrade->base);
+    if (upgrade->stage != STAGE_IDLE)
+    {
+        mbedtls_sha256_free(&upgrade->image);
+        mbedtls_sha256_free(&upgrade->target);
+    }
+    if (upgrade->inflating)
+        inflateEnd(&upgrade->zlib);
+    upgrade->inflating = false;
+    upgrade->out = upgrade->base = -1;
+    upgrade->stage = STAGE_IDLE;
+    upgrade->status = UPGRADE_ERR_STATE;
+}
+
+// total is the size of the whole image, signature included
+int upgrade_begin(struct Upgrade *upgrade, uint32_t total)
+{
+    if (upgrade->stage != STAGE_IDLE)
+        upgrade_abort(upgrade);
+    memset(upgrade, 0, sizeof(*upgrade));
+    upgrade->out = upgrade->base = -1;
+    upgrade->total = total;
+    if (total <= sizeof(struct UpgradeHeader))
+        return fail(upgrade, UPGRADE_ERR_LENGTH);
+
+    upgrade->out = open(NEW_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0700);
+    if (upgrade->out < 0)
+    {
+        perror("Failed to create " NEW_PATH);
+        return fail(upgrade, UPGRADE_ERR_IO);
+    }
+    mbedtls_sha256_init(&upgrade->image);
+    mbedtls_sha256_init(&upgrade->target);
+    mbedtls_sha256_starts_ret(&upgrade->image, 0);
+    mbedtls_sha256_starts_ret(&upgrade->target, 0);
+    upgrade->stage = STAGE_HEADER;
+    printf("Upgrade started, %u bytes\n", total);
+    return UPGRADE_OK;
+}
+
+static int check_header(struct Upgrade *upgrade)
+{
+    const struct UpgradeHeader *header = &upgrade->header;
+    uint32_t signature = upgrade->total - sizeof(*header) - header->payload;
+
+    if (memcmp(header->magic, UPGRADE_MAGIC, 4) || header->version != UPGRADE_VERSION ||
+        (header->type != UPGRADE_FULL && header->type != UPGRADE_DELTA) || !header->target_size ||
+        header->target_size > UPGRADE_MAX_TARGET)
+        return UPGRADE_ERR_HEADER;
+    if (header->payload >= upgrade->total - sizeof(*header) || signature > UPGRADE_MAX_SIGNATURE)
+        return UPGRADE_ERR_LENGTH;
+    if (header->type == UPGRADE_FULL && !(header->flags & UPGRADE_DEFLATE) && header->payload != header->target_size)
+        return UPGRADE_ERR_HEADER;
+    if (header->flags & UPGRADE_DEFLATE)
+    {
+        if (inflateInit(&upgrade->zlib) != Z_OK)
+            return UPGRADE_ERR_IO;
+        upgrade->inflating = true;
+    }
+    if (header->type == UPGRADE_FULL)
+        return UPGRADE_OK;
+
+    // A delta only makes sense against the exact binary it was made from
+    unsigned char hash[32];
+    struct stat st;
+    upgrade->base = open(APP_PATH, O_RDONLY);
+    if (upgrade->base < 0 || fstat(upgrade->base, &st) || sha256_fd(upgrade->base, hash))
+        return UPGRADE_ERR_IO;
+    upgrade->base_size = st.st_size;
+    return memcmp(hash, header->base_sha256, sizeof(hash)) ? UPGRADE_ERR_BASE : UPGRADE_OK;
+}
+
+static int emit(struct Upgrade *upgrade, const unsigned char *data, size_t length)
+{
+    if (length > upgrade->header.target_size - upgrade->written)
+        return UPGRADE_ERR_PATCH;
+    if (write_all_fd(upgrade->out, data, length))
+    {
+        perror("Failed to write " NEW_PATH);
+        return UPGRADE_ERR_IO;
+    }
+    mbedtls_sha256_update_ret(&upgrade->target, data, length);
+    upgrade->written += length;
+    return UPGRADE_OK;
+}
+
+// bsdiff stores offsets as sign and magnitude, little-endian
+static int64_t offset_in(const unsigned char *p)
+{
+    int64_t value = p[7] & 0x7F;
+    for (int i = 6; i >= 0; i--)
+        value = value << 8 | p[i];
+    return p[7] & 0x80 ? -value : value;
+}
+
+// Diff bytes are added to the base bytes at base_pos, those outside the base count as 0
+static int apply_diff(struct Upgrade *upgrade, const unsigned char *data, size_t length)
+{
+    unsigned char old[CHUNK];
+    int64_t from = upgrade->base_pos < 0 ? 0 : upgrade->base_pos;
+    int64_t to = upgrade->base_pos + (int64_t)length;
+
+    memset(old, 0, length);
+    if (to > upgrade->base_size)
+        to = upgrade->base_size;
+    if (from < to && pread(upgrade->base, old + (from - upgrade->base_pos), to - from, from) != to - from)
+        return UPGRADE_ERR_IO;
+    for (size_t i = 0; i < length; i++)
+        old[i] += data[i];
+    upgrade->base_pos += length;
+    return emit(upgrade, old, length);
+}
+
+static int patch(struct Upgrade *upgrade, const unsigned char *data, size_t length)
+{
+    while (length)
+    {
+        size_t n;
+        int status = UPGRADE_OK;
+
+        if (upgrade->control_length < (int)sizeof(upgrade->control))
+        {
+            n = sizeof(upgrade->control) - upgrade->control_length;
+            n = n < length ? n : length;
+            memcpy(upgrade->control + upgrade->control_length, data, n);
+            upgrade->control_length += n;
+            if (upgrade->control_length == sizeof(upgrade->control))
+            {
+                upgrade->diff = offset_in(upgrade->control);
+                upgrade->extra = offset_in(upgrade->control + 8);
+                upgrade->seek = offset_in(upgrade->control + 16);
+                int64_t left = upgrade->header.target_size - upgrade->written;
+                if (upgrade->diff < 0 || upgrade->extra < 0 || upgrade->diff > left ||
+                    upgrade->extra > left - upgrade->diff)
+                    return UPGRADE_ERR_PATCH;
+            }
+        }
+        else if (upgrade->diff)
+        {
+            n = upgrade->diff < CHUNK ? upgrade->diff : CHUNK;
+            n = n < length ? n : length;
+            status = apply_diff(upgrade, data, n);
+            upgrade->diff -= n;
+        }
+        else
+        {
+            n = upgrade->extra < (int64_t)length ? (size_t)upgrade->extra : length;
+            status = emit(upgrade, data, n);
+            upgrade->extra -= n;
+        }
+        if (status)
+            return status;
+        if (upgrade->control_length == sizeof(upgrade->control) && !upgrade->diff && !upgrade->extra)
+        {
+            // the image is not verified yet, keep a hostile seek from overflowing
+            if (upgrade->seek > MAX_SEEK || upgrade->seek < -MAX_SEEK)
+                return UPGRADE_ERR_PATCH;
+            upgrade->base_pos += upgrade->seek;
+            if (upgrade->base_pos > MAX_SEEK || upgrade->base_pos < -MAX_SEEK)
+                return UPGRADE_ERR_PATCH;
+            upgrade->control_length = 0;
+        }
+        data += n;
+        length -= n;
+    }
+    return UPGRADE_OK;
+}
+
+static int apply(struct Upgrade *upgrade, const unsigned char *data, size_t length)
+{
+    return upgrade->header.type == UPGRADE_FULL ? emit(upgrade, data, length) : patch(upgrade, data, length);
+}
+
+static int unpack(struct Upgrade *upgrade, const unsigned char *data, size_t length)
+{
+    unsigned char buffer[CHUNK];
+    z_stream *zlib = &upgrade->zlib;
+
+    zlib->next_in = (unsigned char *)data;
+    zlib->avail_in = length;
+    do
+    {
+        zlib->next_out = buffer;
+        zlib->avail_out = sizeof(buffer);
+        int ret = inflate(zlib, Z_NO_FLUSH);
+        if ((ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) || (upgrade->inflated && length))
+            return UPGRADE_ERR_PATCH;
+        int status = apply(upgrade, buffer, sizeof(buffer) - zlib->avail_out);
+        if (status)
+            return status;
+        upgrade->inflated = ret == Z_STREAM_END;
+    } while (!zlib->avail_out && !upgrade->inflated);
+    return upgrade->inflated && zlib->avail_in ? UPGRADE_ERR_PATCH : UPGRADE_OK;
+}
+
+int upgrade_write(struct Upgrade *upgrade, const unsigned char *data, size_t length)
+{
+    if (upgrade->stage == STAGE_IDLE)
+        return upgrade->status ? upgrade->status : UPGRADE_ERR_STATE;
+    if (length > upgrade->total - upgrade->received)
+        return fail(upgrade, UPGRADE_ERR_LENGTH);
+
+    while (length)
+    {
+        size_t n, end;
+        int status = UPGRADE_OK;
+
+        switch (upgrade->stage)
+        {
+        case STAGE_HEADER:
+            n = sizeof(upgrade->header) - upgrade->received;
+            n = n < length ? n : length;
+            memcpy((unsigned char *)&upgrade->header + upgrade->received, data, n);
+            mbedtls_sha256_update_ret(&upgrade->image, data, n);
+            if (upgrade->received + n == sizeof(upgrade->header))
+            {
+                status = check_header(upgrade);
+                upgrade->stage = STAGE_PAYLOAD;
+            }
+            break;
+        case STAGE_PAYLOAD:
+            end = sizeof(upgrade->header) + upgrade->header.payload;
+            n = end - upgrade->received;
+            n = n < length ? n : length;
+            mbedtls_sha256_update_ret(&upgrade->image, data, n);
+            status = upgrade->inflating ? unpack(upgrade, data, n) : apply(upgrade, data, n);
+            if (upgrade->received + n == end)
+                upgrade->stage = STAGE_SIGNATURE;
+            break;
+        default:
+            // check_header bounded the signature by UPGRADE_MAX_SIGNATURE
+            n = length;
+            memcpy(upgrade->signature + upgrade->signature_length, data, n);
+            upgrade->signature_length += n;
+            break;
+        }
+        if (status)
+            return fail(upgrade, status);
+        upgrade->received += n;
+        data += n;
+        length -= n;
+    }
+    return UPGRADE_OK;
+}
+
+static int verify_signature(struct Upgrade *upgrade)
+{
+    unsigned char hash[32];
+    mbedtls_pk_context key;
+    int ret;
+
+    mbedtls_sha256_finish_ret(&upgrade->image, hash);
+    mbedtls_pk_init(&key);
+    if ((ret = mbedtls_pk_parse_public_keyfile(&key, UPGRADE_KEY_PATH)))
+        fprintf(stderr, "Can't load upgrade key %s: -0x%04X\n", UPGRADE_KEY_PATH, -ret);
+    else if ((ret = mbedtls_pk_verify(&key, MBEDTLS_MD_SHA256, hash, sizeof(hash), upgrade->signature,
+                                      upgrade->signature_length)))
+        fprintf(stderr, "Upgrade signature rejected: -0x%04X\n", -ret);
+    mbedtls_pk_free(&key);
+    return ret ? UPGRADE_ERR_SIGNATURE : UPGRADE_OK;
+}
+
+// Keep the running binary as OLD_PATH and move the new one over it, the trial marker
+// makes upgrade_boot() put OLD_PATH back when the new binary keeps failing
+static int install(void)
+{
+    unlink(OLD_PATH);
+    if (link(APP_PATH, OLD_PATH) && errno != ENOENT)
+    {
+        perror("Failed to keep " APP_PATH);
+        return UPGRADE_ERR_IO;
+    }
+    if (write_trial(0) || rename(NEW_PATH, APP_PATH))
+    {
+        perror("Failed to install " NEW_PATH);
+        unlink(TRIAL_PATH);
+        unlink(NEW_PATH);
+        return UPGRADE_ERR_IO;
+    }
+    sync_dir();
+    installed = true;
+    return UPGRADE_OK;
+}
+
+int upgrade_finish(struct Upgrade *upgrade)
+{
+    unsigned char hash[32];
+    int status;
+
+    if (upgrade->stage == STAGE_IDLE)
+        return upgrade->status ? upgrade->status : UPGRADE_ERR_STATE;
+    if (upgrade->stage != STAGE_SIGNATURE || upgrade->received != upgrade->total || !upgrade->signature_length)
+        return fail(upgrade, UPGRADE_ERR_LENGTH);
+    if (upgrade->control_length || upgrade->written != upgrade->header.target_size ||
+        upgrade->inflating != upgrade->inflated)
+        return fail(upgrade, UPGRADE_ERR_PATCH);
+    if ((status = verify_signature(upgrade)))
+        return fail(upgrade, status);
+    mbedtls_sha256_finish_ret(&upgrade->target, hash);
+    if (memcmp(hash, upgrade->header.target_sha256, sizeof(hash)))
+        return fail(upgrade, UPGRADE_ERR_HASH);
+    if (fsync(upgrade->out) || fchmod(upgrade->out, 0755))
+        return fail(upgrade, UPGRADE_ERR_IO);
+
+    close(upgrade->out);
+    upgrade->out = -1;
+    if ((status = install()))
+        return fail(upgrade, status);
+    printf("Upgrade installed, %u bytes %s\n", upgrade->written,
+           upgrade->header.type == UPGRADE_DELTA ? "patched" : "written");
+    upgrade_abort(upgrade);
+    upgrade->status = UPGRADE_OK;
+    return UPGRADE_OK;
+}
+
+// First thing at startup: count the starts of a freshly installed binary and roll
+// back once it used up its trials without reaching upgrade_health()
+void upgrade_boot(void)
+{
+    int trials = 0;
+    FILE *file = fopen(TRIAL_PATH, "r");
+    if (!file)
+        return;
+    if (fscanf(file, "%d", &trials) != 1)
+        trials = UPGRADE_TRIALS;
+    fclose(file);
+
+    if (trials < UPGRADE_TRIALS && !write_trial(trials + 1))
+    {
+        printf("Upgrade on trial, start %d of %d\n", trials + 1, UPGRADE_TRIALS);
+        on_trial = true;
+        clock_gettime(CLOCK_MONOTONIC, &trial_started);
+        return;
+    }
+
+    fprintf(stderr, "Upgrade failed its health check, rolling back\n");
+    if (rename(OLD_PATH, APP_PATH))
+    {
+        perror("Failed to restore " OLD_PATH);
+        unlink(TRIAL_PATH);
+        return;
+    }
+    unlink(TRIAL_PATH);
+    sync_dir();
+    restart_application();
+}
+
+// Called every second from the main loop, confirms the upgrade once it ran long enough
+void upgrade_health(void)
+{
+    if (!on_trial || stats_since_us(&trial_started) < UPGRADE_HEALTHY_S * 1000000ULL)
+        return;
+    on_trial = false;
+    unlink(OLD_PATH);
+    unlink(TRIAL_PATH);
+    sync_dir();
+    printf("Upgrade confirmed\n");
+}
+
+// An image left on the SD card goes through the same pipeline as one sent over the
+// UART, it is renamed afterwards so it's only tried once
+void upgrade_application_from_sdcard(void)
+{
+    static struct Upgrade upgrade = {.out = -1, .base = -1};
+    unsigned char buffer[CHUNK];
+    struct stat st;
+    ssize_t n;
+
+    if (mount_sdcard() != 0)
+        return;
+    int fd = open(UPGRADE_FILE_PATH, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    int status = fstat(fd, &st) ? UPGRADE_ERR_IO : upgrade_begin(&upgrade, st.st_size);
+    while (!status && (n = read(fd, buffer, sizeof(buffer))) > 0)
+        status = upgrade_write(&upgrade, buffer, n);
+    close(fd);
+    if (!status)
+        status = upgrade_finish(&upgrade);
+    else
+        upgrade_abort(&upgrade);
+
+    rename(UPGRADE_FILE_PATH, status ? UPGRADE_FILE_PATH ".rejected" : UPGRADE_FILE_PATH ".done");
+    if (status)
+    {
+        fprintf(stderr, "SD card upgrade rejected: %s\n", upgrade_error(status));
+        return;
+    }
+    restart_application();
+}
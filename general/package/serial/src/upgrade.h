@@ -0,0 +1,93 @@
+#ifndef UPGRADE_H_
+#define UPGRADE_H_
+#include <mbedtls/sha256.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+// Signed upgrade image: struct UpgradeHeader, payload, signature. The signature is
+// ECDSA or RSA (whatever the key in UPGRADE_KEY_PATH is) over the SHA-256 of header
+// and payload, DER encoded as `openssl dgst -sha256 -sign` writes it. See mkupgrade.c.
+#define UPGRADE_MAGIC "SUPG"
+#define UPGRADE_VERSION 1
+#ifndef UPGRADE_KEY_PATH
+#define UPGRADE_KEY_PATH "/etc/serial.pub"
+#endif
+#define UPGRADE_MAX_SIGNATURE 512
+#define UPGRADE_MAX_TARGET (4 << 20) // bytes, what the overlay has room to stage next to the binary
+// Header flags
+#define UPGRADE_DEFLATE 0x01 // payload is a zlib stream, the delta diff bytes are mostly zeros
+// Starts of an installed image that may end without a health check before rollback
+#define UPGRADE_TRIALS 2
+#define UPGRADE_HEALTHY_S 30
+
+enum UpgradeType
+{
+    UPGRADE_FULL,  // payload is the new binary
+    UPGRADE_DELTA, // payload is a bsdiff style patch against the running binary
+};
+
+// Outcome of an upgrade step, also the status byte of the UART acks
+enum UpgradeStatus
+{
+    UPGRADE_OK,
+    UPGRADE_ERR_STATE,     // no upgrade in progress or already failed
+    UPGRADE_ERR_CRC,       // chunk damaged on the line, resend it
+    UPGRADE_ERR_HEADER,    // not an image, unknown version or sizes
+    UPGRADE_ERR_BASE,      // delta made for another binary
+    UPGRADE_ERR_PATCH,     // malformed delta or zlib stream
+    UPGRADE_ERR_LENGTH,    // image shorter or longer than announced
+    UPGRADE_ERR_SIGNATURE, // missing key or bad signature
+    UPGRADE_ERR_HASH,      // output differs from the signed target
+    UPGRADE_ERR_IO,
+};
+
+// Little-endian, 80 bytes
+struct UpgradeHeader
+{
+    char magic[4];
+    uint8_t version;
+    uint8_t type;  // enum UpgradeType
+    uint8_t flags; // UPGRADE_DEFLATE
+    uint8_t reserved;
+    uint32_t payload;     // payload bytes following the header, compressed or not
+    uint32_t target_size; // bytes of the binary once installed
+    uint8_t target_sha256[32];
+    uint8_t base_sha256[32]; // binary a delta applies to, zero for full images
+};
+
+// Streaming state: the image is hashed, patched and written as it arrives, nothing
+// but the current chunk is held in memory
+struct Upgrade
+{
+    int stage;
+    int status; // first error, the upgrade is dead once set
+    uint32_t total, received;
+    struct UpgradeHeader header;
+    mbedtls_sha256_context image, target;
+    z_stream zlib;
+    bool inflating, inflated;
+    int out, base;
+    off_t base_size;
+    uint32_t written;
+    // delta control record: diff bytes, extra bytes, then seek in the base
+    unsigned char control[24];
+    int control_length;
+    int64_t diff, extra, seek, base_pos;
+    unsigned char signature[UPGRADE_MAX_SIGNATURE];
+    size_t signature_length;
+};
+
+int upgrade_begin(struct Upgrade *upgrade, uint32_t total);
+int upgrade_write(struct Upgrade *upgrade, const unsigned char *data, size_t length);
+int upgrade_finish(struct Upgrade *upgrade);
+void upgrade_abort(struct Upgrade *upgrade);
+const char *upgrade_error(int status);
+bool upgrade_installed(void);
+
+void upgrade_boot(void);
+void upgrade_health(void);
+void upgrade_application_from_sdcard(void);
+#endif
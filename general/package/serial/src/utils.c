@@ -1,10 +1,11 @@
 // Function to URL-encode a string
 #include "utils.h"
+#include "image_index.h"
 #include "region.h"
 #include <curl/curl.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
-#include <mbedtls/sha256.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,15 +13,27 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-static inline void sha256_file(const char *filename, unsigned char *hash);
-static inline int copy_upgrade_file(const char *src, const char *dst);
-static inline int validate_upgrade_file(const char *file_path);
+bool sdcard_mounted(void)
+{
+    char line[256];
+    bool mounted = false;
+    FILE *mounts = fopen("/proc/mounts", "r");
+    if (!mounts)
+        return false;
+    while (!mounted && fgets(line, sizeof(line), mounts))
+    {
+        char device[128], dir[128];
+        if (sscanf(line, "%127s %127s", device, dir) == 2 && equals(dir, SD_CARD_PATH))
+            mounted = true;
+    }
+    fclose(mounts);
+    return mounted;
+}
 
 int mount_sdcard(void)
 {
     // check if sd card is mounted
-    struct stat st;
-    if (stat(SD_CARD_PATH, &st) == 0)
+    if (sdcard_mounted())
     {
         fprintf(stderr, "SD card is already mounted\n");
         return 0;
@@ -32,65 +45,6 @@ int mount_sdcard(void)
     }
     return 0;
 }
-// Function to calculate the SHA-256 hash of a file
-static inline void sha256_file(const char *filename, unsigned char *hash)
-{
-    FILE *file = fopen(filename, "rb");
-    if (!file)
-    {
-        perror("File opening failed");
-        return;
-    }
-
-    mbedtls_sha256_context sha256_ctx;
-    mbedtls_sha256_init(&sha256_ctx);
-    mbedtls_sha256_starts_ret(&sha256_ctx, 0); // 0 means not in "SHA-224" mode (using SHA-256 mode)
-
-    unsigned char buffer[BUF_SIZE];
-    size_t bytesRead = 0;
-
-    while ((bytesRead = fread(buffer, 1, BUF_SIZE, file)) > 0)
-    {
-        mbedtls_sha256_update_ret(&sha256_ctx, buffer, bytesRead);
-    }
-
-    mbedtls_sha256_finish_ret(&sha256_ctx, hash);
-
-    fclose(file);
-    mbedtls_sha256_free(&sha256_ctx);
-}
-
-static inline int copy_upgrade_file(const char *src, const char *dst)
-{
-    int result = system("mv /mnt/mmcblk0p1/serial /usr/bin/serial");
-    if (result != 0)
-    {
-        perror("Failed to copy upgrade file");
-        return -1;
-    }
-}
-
-static inline int validate_upgrade_file(const char *file_path)
-{
-    struct stat st;
-    if (stat(file_path, &st) != 0 || st.st_size == 0)
-    {
-        fprintf(stderr, "Invalid upgrade file\n");
-        return -1;
-    }
-    unsigned char old[32]; // 32 bytes for SHA-256
-    unsigned char new[32]; // 32 bytes for SHA-256
-
-    sha256_file(APP_PATH, old);
-    sha256_file(UPGRADE_FILE_PATH, new);
-    if (memcmp(old, new, 32) == 0)
-    {
-        fprintf(stderr, "Upgrade file is the same as the current application\n");
-        return -1;
-    }
-    return 0;
-}
-
 char *textEncode(const char *str)
 {
     char *encoded = malloc(URL_BUFFER_SIZE);
@@ -143,63 +97,24 @@ void sendGetRequest(const char *text)
     curl_global_cleanup();
 }
 
-// Function to traverse directories and find the nearest file
+// Function to find the nearest file not older than the requested time
 bool findNearestFile(struct tm *time_info, char *path)
 {
-    DIR *dir;
-    struct dirent *entry;
-    struct stat file_stat;
-    char filepath[PATH_MAX];
-    double min_diff = -1;
-    struct tm parsed_time;
-    time_t file_time;
-    struct stat nearest_file_stat;
-    char nearest_file_path[PATH_MAX] = "";
     // get directory path from target time
-    char directory[PATH_MAX];
+    char directory[64];
     time_t target_time = mktime(time_info);
     strftime(directory, sizeof(directory), "/mnt/mmcblk0p1/%Y-%m-%d/image/%H", localtime(&target_time));
 
-    if ((dir = opendir(directory)) != NULL)
-    {
-        while ((entry = readdir(dir)) != NULL)
-        {
-            if (entry->d_type == DT_REG)
-            { // Only regular files
-                snprintf(filepath, sizeof(filepath), "%s/%s", directory, entry->d_name);
-                if (stat(filepath, &file_stat) == 0)
-                {
-                    if (difftime(file_stat.st_mtime, target_time) >= 0)
-                    {
-                        double diff = difftime(file_stat.st_mtime, target_time);
-                        if (min_diff == -1 || diff < min_diff)
-                        {
-                            min_diff = diff;
-                            strncpy(nearest_file_path, filepath, sizeof(nearest_file_path) - 1);
-                            nearest_file_path[sizeof(nearest_file_path) - 1] = '\0';
-                        }
-                    }
-                }
-                else
-                {
-                    perror("Failed to get file stats");
-                    return false;
-                }
-            }
-        }
-        closedir(dir);
-    }
-    else
-    {
-        perror("Failed to open directory");
+    const struct ImageIndex *index = image_index_get(directory);
+    if (!index)
         return false;
-    }
 
-    if (min_diff != -1)
+    const struct IndexEntry *nearest = image_index_find(index, target_time);
+    if (nearest)
     {
-        printf("Nearest file: %s\n", nearest_file_path);
-        // copy nearest_file_path to path
-        strncpy(path, nearest_file_path, PATH_MAX - 1);
+        // copy nearest file path to path
+        snprintf(path, PATH_MAX, "%s/%s", directory, nearest->name);
+        printf("Nearest file: %s\n", path);
         return true;
     }
     else
@@ -275,13 +190,7 @@ char *readBytesFromFile(const char *filename, int max_size, long start_index)
     // Read num_bytes bytes into buffer
     size_t bytesRead = fread(buffer, 1, max_size, fp);
 
-    // Output the read bytes (example: print as hexadecimal)
-    printf("Read %d bytes starting from index %ld:\n", max_size, start_index);
-    for (long i = 0; i < max_size; i++)
-    {
-        printf("%02X ", (unsigned char)buffer[i]);
-    }
-    printf("\n");
+    printf("Read %zu bytes starting from index %ld\n", bytesRead, start_index);
     // copy buffer to data
     fclose(fp);
     return buffer;
@@ -335,59 +244,49 @@ int listFile(struct tm *tm_info)
     memset(path, 0, PATH_MAX);
     snprintf(path, sizeof(path), "/mnt/mmcblk0p1/%04d-%02d-%02d/image/%02d", tm_info->tm_year + 1900,
              tm_info->tm_mon + 1, tm_info->tm_mday, tm_info->tm_hour);
-    DIR *d;
-    int count = 0;
-    struct dirent *dir;
-    d = opendir(path);
-    if (d)
-    {
-        while ((dir = readdir(d)) != NULL)
-        {
-            if (dir->d_type == DT_REG)
-            {
-                count++;
-                printf("%s\n", dir->d_name);
-            }
-        }
-        closedir(d);
-    }
-    return count;
+    const struct ImageIndex *index = image_index_get(path);
+    return index ? index->count : 0;
 }
+// Drive the status LED through sysfs directly instead of forking "gpio toggle"
 void toggleLed(void)
 {
-    int result = system("gpio toggle 0");
+    static int led_fd = -1;
+    static char led_state = '0';
 
-    if (result == -1)
+    if (led_fd < 0)
     {
-        // system() returned an error
-        printf("Failed to execute command.\n");
+        char path[64];
+        int fd = open("/sys/class/gpio/export", O_WRONLY);
+        if (fd >= 0)
+        {
+            write(fd, LED_GPIO, strlen(LED_GPIO)); // EBUSY when already exported
+            close(fd);
+        }
+        snprintf(path, sizeof(path), "/sys/class/gpio/gpio%s/direction", LED_GPIO);
+        if ((fd = open(path, O_WRONLY)) >= 0)
+        {
+            write(fd, "out", 3);
+            close(fd);
+        }
+        snprintf(path, sizeof(path), "/sys/class/gpio/gpio%s/value", LED_GPIO);
+        if ((led_fd = open(path, O_RDWR)) < 0)
+        {
+            printf("Failed to open %s\n", path);
+            return;
+        }
+        pread(led_fd, &led_state, 1, 0);
     }
+
+    led_state = led_state == '0' ? '1' : '0';
+    if (pwrite(led_fd, &led_state, 1, 0) != 1)
+        printf("Failed to toggle led\n");
 }
 
 void restart_application(void)
 {
     graceful = 1;
     printf("Restarting application\n");
+    fflush(NULL);
     execl(APP_PATH, APP_PATH, (char *)NULL);
     perror("Failed to restart application");
 }
-
-void upgrade_application_from_sdcard(void)
-{
-    if (mount_sdcard() != 0)
-    {
-        return;
-    }
-
-    if (validate_upgrade_file(UPGRADE_FILE_PATH) != 0)
-    {
-        return;
-    }
-
-    if (copy_upgrade_file(UPGRADE_FILE_PATH, APP_PATH) != 0)
-    {
-        return;
-    }
-
-    restart_application();
-}
@@ -5,10 +5,11 @@
 #define UART_BUFFER_SIZE 1024
 
 #define SD_CARD_PATH "/mnt/mmcblk0p1"
+#ifndef APP_PATH
 #define APP_PATH "/usr/bin/serial"
-#define TEMP_UPGRADE_PATH "/tmp/serial"
-#define UPGRADE_FILE_PATH "/mnt/mmcblk0p1/serial"
-#define BUF_SIZE 32768 // Buffer size for reading the file
+#endif
+#define UPGRADE_FILE_PATH "/mnt/mmcblk0p1/serial.upg" // signed image, see upgrade.h
+#define LED_GPIO "0"
 
 extern char graceful;
 
@@ -21,5 +22,5 @@ bool parseDatetimeFromFile(char *filepath, struct tm *parsed_time);
 int listFile(struct tm *tm_info);
 void toggleLed(void);
 void restart_application(void);
-void upgrade_application_from_sdcard(void);
 int mount_sdcard(void);
+bool sdcard_mounted(void);
@@ -0,0 +1,222 @@
+#include "variant.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LZ4_HASH_LOG 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint16_t tiff16(const unsigned char *p, int le)
+{
+    return le ? p[0] | p[1] << 8 : p[0] << 8 | p[1];
+}
+
+static inline uint32_t tiff32(const unsigned char *p, int le)
+{
+    return le ? p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24
+              : (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static unsigned char *put_length(unsigned char *op, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *op++ = 255;
+    *op++ = length;
+    return op;
+}
+
+// Greedy LZ4 block compressor, dst must hold at least LZ4 bound of len bytes
+static size_t lz4_compress_block(const unsigned char *src, size_t len, unsigned char *dst)
+{
+    static uint32_t table[1 << LZ4_HASH_LOG];
+    const unsigned char *ip = src, *anchor = src;
+    const unsigned char *end = src + len;
+    const unsigned char *match_limit = end - LZ4_MF_LIMIT;
+    unsigned char *op = dst;
+
+    memset(table, 0, sizeof(table));
+    if (len > LZ4_MF_LIMIT)
+    {
+        for (ip = src + 1; ip < match_limit;)
+        {
+            uint32_t sequence = read32(ip);
+            uint32_t h = (sequence * 2654435761U) >> (32 - LZ4_HASH_LOG);
+            const unsigned char *ref = src + table[h];
+            table[h] = ip - src;
+            if (ref >= ip || ip - ref > 0xFFFF || read32(ref) != sequence)
+            {
+                ip++;
+                continue;
+            }
+
+            const unsigned char *mp = ip + LZ4_MIN_MATCH, *rp = ref + LZ4_MIN_MATCH;
+            while (mp < end - LZ4_LAST_LITERALS && *mp == *rp)
+                mp++, rp++;
+            size_t literals = ip - anchor, match = mp - ip - LZ4_MIN_MATCH;
+
+            unsigned char *token = op++;
+            *token = (literals < 15 ? literals : 15) << 4 | (match < 15 ? match : 15);
+            if (literals >= 15)
+                op = put_length(op, literals - 15);
+            memcpy(op, anchor, literals);
+            op += literals;
+            *op++ = (ip - ref) & 0xFF;
+            *op++ = (ip - ref) >> 8;
+            if (match >= 15)
+                op = put_length(op, match - 15);
+            anchor = ip = mp;
+        }
+    }
+
+    size_t literals = end - anchor;
+    *op++ = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15)
+        op = put_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    return op + literals - dst;
+}
+
+static int write_lz4(const unsigned char *data, size_t size, FILE *out)
+{
+    unsigned char header[4] = {LZ4_LEGACY_MAGIC & 0xFF, LZ4_LEGACY_MAGIC >> 8 & 0xFF, LZ4_LEGACY_MAGIC >> 16 & 0xFF,
+                               LZ4_LEGACY_MAGIC >> 24};
+    size_t chunk = size < LZ4_LEGACY_BLOCK ? size : LZ4_LEGACY_BLOCK;
+    unsigned char *block = malloc(chunk + chunk / 255 + 16);
+    int ret = block && fwrite(header, sizeof(header), 1, out) == 1 ? 0 : -1;
+
+    for (size_t offset = 0; !ret && offset < size; offset += chunk)
+    {
+        size_t n = size - offset < chunk ? size - offset : chunk;
+        uint32_t length = lz4_compress_block(data + offset, n, block);
+        unsigned char prefix[4] = {length & 0xFF, length >> 8 & 0xFF, length >> 16 & 0xFF, length >> 24};
+        if (fwrite(prefix, sizeof(prefix), 1, out) != 1 || fwrite(block, 1, length, out) != length)
+            ret = -1;
+    }
+    free(block);
+    return ret;
+}
+
+// Locate the IFD1 JPEG thumbnail inside the APP1 Exif segment
+static int write_thumbnail(const unsigned char *data, size_t size, FILE *out)
+{
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+        return -1;
+
+    for (size_t pos = 2; pos + 4 <= size && data[pos] == 0xFF;)
+    {
+        unsigned char marker = data[pos + 1];
+        size_t length = data[pos + 2] << 8 | data[pos + 3];
+        if (marker == 0xDA || marker == 0xD9)
+            break;
+        if (marker == 0xE1 && length >= 16 && pos + 2 + length <= size && !memcmp(data + pos + 4, "Exif\0\0", 6))
+        {
+            const unsigned char *tiff = data + pos + 10;
+            size_t tiff_size = length - 8;
+            int le = tiff[0] == 'I';
+            uint32_t ifd = tiff32(tiff + 4, le);
+            // Offsets come from the file, compare them against what is left of
+            // tiff_size instead of adding them up, the sums could wrap
+            if (ifd > tiff_size - 2)
+                return -1;
+            // skip IFD0 to reach IFD1
+            uint16_t entries = tiff16(tiff + ifd, le);
+            if ((size_t)entries * 12 + 4 > tiff_size - ifd - 2)
+                return -1;
+            ifd = tiff32(tiff + ifd + 2 + entries * 12, le);
+            if (!ifd || ifd > tiff_size - 2)
+                return -1;
+
+            uint32_t offset = 0, thumb_size = 0;
+            entries = tiff16(tiff + ifd, le);
+            for (size_t i = 0; i < entries && (i + 1) * 12 <= tiff_size - ifd - 2; i++)
+            {
+                const unsigned char *entry = tiff + ifd + 2 + i * 12;
+                if (tiff16(entry, le) == 0x0201)
+                    offset = tiff32(entry + 8, le);
+                else if (tiff16(entry, le) == 0x0202)
+                    thumb_size = tiff32(entry + 8, le);
+            }
+            if (!offset || !thumb_size || offset > tiff_size || thumb_size > tiff_size - offset)
+                return -1;
+            return fwrite(tiff + offset, 1, thumb_size, out) == thumb_size ? 0 : -1;
+        }
+        pos += 2 + length;
+    }
+    return -1;
+}
+
+// Resolve the file to transfer for a variant, generating and caching it in
+// a hidden directory next to the original on first request
+int variant_prepare(const char *path, int variant, char *out, size_t size)
+{
+    struct stat original, cached;
+    char directory[PATH_MAX], name[PATH_MAX], tmp[PATH_MAX + 4];
+
+    if (variant == VARIANT_RAW)
+    {
+        snprintf(out, size, "%s", path);
+        return 0;
+    }
+    if (variant != VARIANT_THUMBNAIL && variant != VARIANT_LZ4)
+        return -1;
+
+    snprintf(directory, sizeof(directory), "%s", path);
+    snprintf(name, sizeof(name), "%s", path);
+    snprintf(out, size, "%s/%s/%s.%s", dirname(directory), VARIANT_DIR, basename(name),
+             variant == VARIANT_THUMBNAIL ? "thumb.jpg" : "lz4");
+
+    if (stat(path, &original) != 0)
+        return -1;
+    if (stat(out, &cached) == 0 && cached.st_mtime >= original.st_mtime)
+        return 0;
+
+    snprintf(directory, sizeof(directory), "%s", out);
+    if (mkdir(dirname(directory), 0755) && errno != EEXIST)
+        return -1;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    unsigned char *data = original.st_size ? mmap(NULL, original.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+    FILE *file = fopen(tmp, "wb");
+    int ret = -1;
+    if (file)
+    {
+        ret = variant == VARIANT_THUMBNAIL ? write_thumbnail(data, original.st_size, file)
+                                           : write_lz4(data, original.st_size, file);
+        if (fclose(file))
+            ret = -1;
+        if (ret || rename(tmp, out))
+        {
+            remove(tmp);
+            ret = -1;
+        }
+    }
+    if (data)
+        munmap(data, original.st_size);
+    if (ret)
+        fprintf(stderr, "Can't prepare variant %d of %s\n", variant, path);
+    return ret;
+}
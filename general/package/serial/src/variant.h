@@ -0,0 +1,18 @@
+#ifndef VARIANT_H_
+#define VARIANT_H_
+#include <stddef.h>
+
+#define VARIANT_DIR ".cache"
+#define LZ4_LEGACY_MAGIC 0x184C2102
+#define LZ4_LEGACY_BLOCK (8 << 20)
+
+// Server-side representation of a file selected by NEXT_FILE
+enum TransferVariant
+{
+    VARIANT_RAW = 0,
+    VARIANT_THUMBNAIL = 1, // EXIF thumbnail embedded in the JPEG
+    VARIANT_LZ4 = 2,       // LZ4 legacy frame, meant for logs and other non-JPEG files
+};
+
+int variant_prepare(const char *path, int variant, char *out, size_t size);
+#endif
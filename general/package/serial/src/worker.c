@@ -0,0 +1,96 @@
+#include "worker.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+// Blocking operations (shell-outs, mounts) run here so the serial thread can
+// keep reading the UART, results are reported through the done callback
+static struct Job queue[MAX_JOBS];
+static int head, count;
+static bool stopping;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t workers[WORKER_THREADS];
+static int started;
+static void (*on_done)(struct Job *job);
+
+static void *worker_thread(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&lock);
+        while (!count && !stopping)
+            pthread_cond_wait(&wake, &lock);
+        if (!count)
+        {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        struct Job job = queue[head];
+        head = (head + 1) % MAX_JOBS;
+        count--;
+        pthread_mutex_unlock(&lock);
+
+        job.result = job.run(&job);
+        if (on_done)
+            on_done(&job);
+    }
+    return NULL;
+}
+
+int worker_start(int threads, void (*done)(struct Job *job))
+{
+    on_done = done;
+    stopping = false;
+    for (started = 0; started < threads && started < WORKER_THREADS; started++)
+    {
+        if (pthread_create(&workers[started], NULL, worker_thread, NULL))
+        {
+            fprintf(stderr, "[worker] Can't start worker %d\n", started);
+            break;
+        }
+    }
+    return started ? 0 : -1;
+}
+
+// Pending jobs are still run before the workers exit
+void worker_stop(void)
+{
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    started = 0;
+}
+
+int worker_submit(job_fn run, char command, char camera_id)
+{
+    pthread_mutex_lock(&lock);
+    const char *error = NULL;
+    if (stopping)
+        error = "workers are stopping";
+    else if (!started)
+        error = "no workers running";
+    else if (count == MAX_JOBS)
+        error = "job queue is full";
+    if (error)
+    {
+        pthread_mutex_unlock(&lock);
+        fprintf(stderr, "[worker] Can't queue job 0x%02X, %s\n", (unsigned char)command, error);
+        return -1;
+    }
+    struct Job *job = &queue[(head + count) % MAX_JOBS];
+    memset(job, 0, sizeof(*job));
+    job->run = run;
+    job->command = command;
+    job->camera_id = camera_id;
+    clock_gettime(CLOCK_MONOTONIC, &job->queued);
+    count++;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
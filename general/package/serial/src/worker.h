@@ -0,0 +1,23 @@
+#ifndef WORKER_H_
+#define WORKER_H_
+#include <time.h>
+
+#define MAX_JOBS 16
+#define WORKER_THREADS 2
+
+struct Job;
+typedef int (*job_fn)(struct Job *job);
+
+struct Job
+{
+    job_fn run;
+    char command;
+    char camera_id;
+    int result;
+    struct timespec queued;
+};
+
+int worker_start(int threads, void (*done)(struct Job *job));
+void worker_stop(void);
+int worker_submit(job_fn run, char command, char camera_id);
+#endif